@@ -0,0 +1,384 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiApplicationEntryPoint.h>
+#include <Library/MauUtilsLib.h>
+#include <Protocol/EmuTraceProtocol.h>
+#include <Protocol/EmuBbTraceProtocol.h>
+#include <Protocol/EmuCallRecordProtocol.h>
+
+#define DEFAULT_PRINT_COUNT  32
+
+STATIC EFI_GUID  mEmuTraceProtocolGuid      = EMU_TRACE_PROTOCOL_GUID;
+STATIC EFI_GUID  mEmuBbTraceProtocolGuid    = EMU_BB_TRACE_PROTOCOL_GUID;
+STATIC EFI_GUID  mEmuCallRecordProtocolGuid = EMU_CALL_RECORD_PROTOCOL_GUID;
+
+STATIC CONST CHAR16  *mEventNames[EmuTraceMax] = {
+  [EmuTraceNone]            = L"none",
+  [EmuTraceEnterEmulation]  = L"enter",
+  [EmuTraceExitEmulation]   = L"exit",
+  [EmuTraceNativeCall]      = L"native",
+  [EmuTraceWrapperCall]     = L"wrapper",
+  [EmuTraceNativeReturn]    = L"ret",
+  [EmuTraceContextAlloc]    = L"ctx-alloc",
+  [EmuTraceContextFree]     = L"ctx-free",
+  [EmuTraceSliceExpiry]     = L"slice",
+  [EmuTraceImageRegister]   = L"img-reg",
+  [EmuTraceImageUnregister] = L"img-unreg",
+};
+
+STATIC
+EFI_STATUS
+Usage (
+  IN CHAR16  *Name
+  )
+{
+  Print (L"Usage: %s [-d | -e] [-r] [-n count] [-o file]\n", Name);
+  Print (L"       %s -b [-r]\n", Name);
+  Print (L"       %s -c file\n", Name);
+  return EFI_INVALID_PARAMETER;
+}
+
+STATIC
+EFI_STATUS
+SaveBlockTraces (
+  IN  BOOLEAN  Reset
+  )
+{
+  EFI_STATUS             Status;
+  EMU_BB_TRACE_PROTOCOL  *BbTrace;
+
+  Status = gBS->LocateProtocol (&mEmuBbTraceProtocolGuid, NULL, (VOID **)&BbTrace);
+  if (EFI_ERROR (Status)) {
+    Print (L"No EmulatorDxe block traces (not built with MAU_BB_TRACE=YES?)\n");
+    return Status;
+  }
+
+  Status = BbTrace->Save ();
+  if (EFI_ERROR (Status)) {
+    Print (L"Couldn't save block traces: %r\n", Status);
+  } else {
+    Print (L"Block traces saved\n");
+  }
+
+  if (Reset) {
+    BbTrace->Reset ();
+  }
+
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+SaveCallRecording (
+  IN  CHAR16  *OutFile
+  )
+{
+  EFI_STATUS                Status;
+  BOOLEAN                   WasEnabled;
+  EMU_CALL_RECORD_HEADER    *Header;
+  EMU_CALL_RECORD_PROTOCOL  *Record;
+
+  Status = gBS->LocateProtocol (&mEmuCallRecordProtocolGuid, NULL, (VOID **)&Record);
+  if (EFI_ERROR (Status)) {
+    Print (L"No EmulatorDxe call recording (not built with MAU_CALL_RECORD=YES?)\n");
+    return Status;
+  }
+
+  Header = Record->Header;
+  if ((Header->Signature != EMU_CALL_RECORD_SIGNATURE) ||
+      (Header->Version != EMU_CALL_RECORD_VERSION))
+  {
+    Print (L"Unsupported call recording version\n");
+    return EFI_INCOMPATIBLE_VERSION;
+  }
+
+  /*
+   * Writing the file runs emulated code (e.g. an emulated
+   * file system driver), which must not end up being
+   * recorded half-way through.
+   */
+  WasEnabled = Record->SetEnabled (FALSE);
+
+  Print (
+    L"0x%lx of 0x%lx bytes used%s%s\n",
+    Header->Used,
+    Header->BufferSize - Header->HeaderSize,
+    (Header->Flags & EMU_CALL_RECORD_FLAG_OVERFLOW) != 0 ? L", overflowed" : L"",
+    (Header->Flags & EMU_CALL_RECORD_FLAG_INCOMPLETE) != 0 ? L", incomplete" : L""
+    );
+
+  Status = WriteShellFile (OutFile, Header, Header->HeaderSize + Header->Used);
+  if (EFI_ERROR (Status)) {
+    Print (L"Couldn't write '%s': %r\n", OutFile, Status);
+  } else {
+    Print (L"Saved to '%s'\n", OutFile);
+  }
+
+  Record->SetEnabled (WasEnabled);
+  return Status;
+}
+
+STATIC
+CONST CHAR16 *
+MachineName (
+  IN  UINT16  MachineType
+  )
+{
+  switch (MachineType) {
+    case EFI_IMAGE_MACHINE_X64:
+      return L"X64";
+    case EFI_IMAGE_MACHINE_AARCH64:
+      return L"AArch64";
+    case EFI_IMAGE_MACHINE_RISCV64:
+      return L"RISCV64";
+    case EFI_IMAGE_MACHINE_LOONGARCH64:
+      return L"LoongArch64";
+    default:
+      return L"???";
+  }
+}
+
+STATIC
+UINT64
+TicksToNs (
+  IN  EMU_TRACE_HEADER  *Header,
+  IN  UINT64            Begin,
+  IN  UINT64            End
+  )
+{
+  UINT64  Ticks;
+  UINT64  Seconds;
+  UINT64  Remainder;
+
+  if (Header->CounterStart > Header->CounterEnd) {
+    Ticks = Begin - End;
+  } else {
+    Ticks = End - Begin;
+  }
+
+  if (Header->Frequency == 0) {
+    return 0;
+  }
+
+  Seconds = DivU64x64Remainder (Ticks, Header->Frequency, &Remainder);
+  return MultU64x64 (Seconds, 1000000000UL) +
+         DivU64x64Remainder (MultU64x64 (Remainder, 1000000000UL), Header->Frequency, NULL);
+}
+
+STATIC
+VOID
+PrintEntries (
+  IN  EMU_TRACE_HEADER  *Header,
+  IN  UINT64            Count
+  )
+{
+  UINT64           Index;
+  UINT64           First;
+  UINT64           FirstTimestamp;
+  EMU_TRACE_ENTRY  *Entries;
+  EMU_TRACE_ENTRY  *Entry;
+
+  Entries = (VOID *)((UINT8 *)Header + Header->HeaderSize);
+  Count   = MIN (Count, MIN (Header->Head, Header->EntryCount));
+  if (Count == 0) {
+    Print (L"No entries\n");
+    return;
+  }
+
+  First          = Header->Head - Count;
+  FirstTimestamp = Entries[First % Header->EntryCount].Timestamp;
+
+  for (Index = First; Index < Header->Head; Index++) {
+    Entry = &Entries[Index % Header->EntryCount];
+    Print (
+      L"%8lu %10lu ns %-8s %-9s %016lx %016lx %016lx %016lx\n",
+      Index,
+      TicksToNs (Header, FirstTimestamp, Entry->Timestamp),
+      MachineName (Entry->MachineType),
+      Entry->Event < EmuTraceMax ? mEventNames[Entry->Event] : L"???",
+      Entry->Args[0],
+      Entry->Args[1],
+      Entry->Args[2],
+      Entry->Args[3]
+      );
+  }
+}
+
+EFI_STATUS
+EFIAPI
+EntryPoint (
+  IN  EFI_HANDLE        ImageHandle,
+  IN  EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  UINTN               Argc;
+  CHAR16              **Argv;
+  EFI_STATUS          Status;
+  GET_OPT_CONTEXT     GetOptContext;
+  EMU_TRACE_PROTOCOL  *Trace;
+  EMU_TRACE_HEADER    *Header;
+  BOOLEAN             WasEnabled;
+  BOOLEAN             Reset;
+  BOOLEAN             Enable;
+  BOOLEAN             Disable;
+  BOOLEAN             Blocks;
+  UINT64              PrintCount;
+  CHAR16              *OutFile;
+  CHAR16              *RecordFile;
+
+  Status = GetShellArgcArgv (ImageHandle, &Argc, &Argv);
+  if (Status != EFI_SUCCESS) {
+    Print (
+      L"This program requires Microsoft Windows.\n"
+      "Just kidding...only the UEFI Shell!\n"
+      );
+    return EFI_ABORTED;
+  }
+
+  Reset      = FALSE;
+  Enable     = FALSE;
+  Disable    = FALSE;
+  Blocks     = FALSE;
+  PrintCount = (UINT64)-1;
+  OutFile    = NULL;
+  RecordFile = NULL;
+
+  INIT_GET_OPT_CONTEXT (&GetOptContext);
+  while ((Status = GetOpt (
+                     Argc,
+                     Argv,
+                     L"noc",
+                     &GetOptContext
+                     )) == EFI_SUCCESS)
+  {
+    switch (GetOptContext.Opt) {
+      case L'b':
+        Blocks = TRUE;
+        break;
+      case L'd':
+        Disable = TRUE;
+        break;
+      case L'e':
+        Enable = TRUE;
+        break;
+      case L'r':
+        Reset = TRUE;
+        break;
+      case L'n':
+        if (GetOptContext.OptArg == NULL) {
+          Print (L"Missing count\n");
+          return Usage (Argv[0]);
+        }
+
+        PrintCount = StrDecimalToUint64 (GetOptContext.OptArg);
+        break;
+      case L'o':
+        if (GetOptContext.OptArg == NULL) {
+          Print (L"Missing file name\n");
+          return Usage (Argv[0]);
+        }
+
+        OutFile = GetOptContext.OptArg;
+        break;
+      case L'c':
+        if (GetOptContext.OptArg == NULL) {
+          Print (L"Missing file name\n");
+          return Usage (Argv[0]);
+        }
+
+        RecordFile = GetOptContext.OptArg;
+        break;
+      default:
+        Print (L"Unknown option '%c'\n", GetOptContext.Opt);
+        return Usage (Argv[0]);
+    }
+  }
+
+  if ((Enable && Disable) || (GetOptContext.OptIndex != Argc)) {
+    return Usage (Argv[0]);
+  }
+
+  if (Blocks) {
+    if (Enable || Disable || (PrintCount != (UINT64)-1) || (OutFile != NULL) ||
+        (RecordFile != NULL))
+    {
+      return Usage (Argv[0]);
+    }
+
+    return SaveBlockTraces (Reset);
+  }
+
+  if (RecordFile != NULL) {
+    if (Enable || Disable || Reset || (PrintCount != (UINT64)-1) || (OutFile != NULL)) {
+      return Usage (Argv[0]);
+    }
+
+    return SaveCallRecording (RecordFile);
+  }
+
+  Status = gBS->LocateProtocol (&mEmuTraceProtocolGuid, NULL, (VOID **)&Trace);
+  if (EFI_ERROR (Status)) {
+    Print (L"No EmulatorDxe trace buffer (not built with MAU_TRACE=YES?)\n");
+    return Status;
+  }
+
+  Header = Trace->Header;
+  if ((Header->Signature != EMU_TRACE_SIGNATURE) ||
+      (Header->Version != EMU_TRACE_VERSION))
+  {
+    Print (L"Unsupported trace buffer version\n");
+    return EFI_INCOMPATIBLE_VERSION;
+  }
+
+  if (PrintCount == (UINT64)-1) {
+    PrintCount = (OutFile == NULL && !Reset && !Enable && !Disable) ?
+                 DEFAULT_PRINT_COUNT : 0;
+  }
+
+  /*
+   * Don't let the ring move under us while it is being
+   * copied out or printed.
+   */
+  WasEnabled = Trace->SetEnabled (FALSE);
+
+  Print (
+    L"%lu events logged, %u entry ring, %s\n",
+    Header->Head,
+    Header->EntryCount,
+    WasEnabled ? L"enabled" : L"disabled"
+    );
+
+  if (OutFile != NULL) {
+    Status = WriteShellFile (OutFile, Header, Trace->BufferSize);
+    if (EFI_ERROR (Status)) {
+      Print (L"Couldn't write '%s': %r\n", OutFile, Status);
+    } else {
+      Print (L"Saved to '%s'\n", OutFile);
+    }
+  }
+
+  PrintEntries (Header, PrintCount);
+
+  if (Reset) {
+    Trace->Reset ();
+  }
+
+  if (Enable) {
+    WasEnabled = TRUE;
+  } else if (Disable) {
+    WasEnabled = FALSE;
+  }
+
+  Trace->SetEnabled (WasEnabled);
+  return Status;
+}
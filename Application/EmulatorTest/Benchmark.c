@@ -0,0 +1,824 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/PrintLib.h>
+#include <Library/MauUtilsLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include "Benchmark.h"
+
+#define BENCH_LINE_SIZE    256
+#define BENCH_MAX_COLUMNS  16
+
+typedef struct {
+  CONST CHAR8    *Name;
+  UINT64         Count;
+  /*
+   * All times are in picoseconds per operation.
+   */
+  UINT64         MinPs;
+  UINT64         MedianPs;
+  UINT64         P90Ps;
+  UINT64         P99Ps;
+  UINT64         MaxPs;
+  UINT64         MeanPs;
+  /*
+   * Mean absolute difference between consecutive samples.
+   */
+  UINT64         JitterPs;
+  /*
+   * Median from the baseline file, 0 if not there.
+   */
+  UINT64         BaselinePs;
+  BOOLEAN        Regressed;
+  /*
+   * Median from the native results file, 0 if not there.
+   */
+  UINT64         NativePs;
+} BENCH_RESULT;
+
+typedef struct {
+  CHAR8    *Buffer;
+  UINTN    Size;
+  UINTN    Used;
+  /*
+   * Straight to the console instead of the buffer.
+   */
+  BOOLEAN  Console;
+} BENCH_OUTPUT;
+
+STATIC volatile UINT64  mBenchSink;
+STATIC UINT64           mBenchFrequency;
+STATIC BOOLEAN          mBenchCountsDown;
+
+STATIC
+CONST CHAR8 *
+BenchMachineName (
+  IN  UINT16  MachineType
+  )
+{
+  switch (MachineType) {
+    case EFI_IMAGE_MACHINE_AARCH64:
+      return "AArch64";
+    case EFI_IMAGE_MACHINE_RISCV64:
+      return "RiscV64";
+    case EFI_IMAGE_MACHINE_LOONGARCH64:
+      return "LoongArch64";
+    case EFI_IMAGE_MACHINE_X64:
+      return "X64";
+    default:
+      return "unknown";
+  }
+}
+
+STATIC
+VOID
+BenchOut (
+  IN  BENCH_OUTPUT  *Out,
+  IN  CONST CHAR8   *Format,
+  ...
+  )
+{
+  VA_LIST  Marker;
+  CHAR8    Line[BENCH_LINE_SIZE];
+  UINTN    Length;
+  CHAR8    *Buffer;
+
+  VA_START (Marker, Format);
+  Length = AsciiVSPrint (Line, sizeof (Line), Format, Marker);
+  VA_END (Marker);
+
+  if (Out->Console) {
+    AsciiPrint ("%a", Line);
+    return;
+  }
+
+  if (Out->Used + Length > Out->Size) {
+    Buffer = ReallocatePool (Out->Size, Out->Size * 2 + Length, Out->Buffer);
+    if (Buffer == NULL) {
+      return;
+    }
+
+    Out->Buffer = Buffer;
+    Out->Size   = Out->Size * 2 + Length;
+  }
+
+  CopyMem (Out->Buffer + Out->Used, Line, Length);
+  Out->Used += Length;
+}
+
+STATIC
+UINT64
+BenchSample (
+  IN  BENCH_CONFIG      *Config,
+  IN  CONST BENCH_CASE  *Case,
+  IN  UINT64            Count
+  )
+{
+  UINT64  Start;
+  UINT64  End;
+
+  Start       = Config->Test->GetPerformanceCounter ();
+  mBenchSink += Case->Fn (Case->Context, Count);
+  End         = Config->Test->GetPerformanceCounter ();
+
+  return BenchTicksBetween (Start, End);
+}
+
+UINT64
+BenchTicksBetween (
+  IN  UINT64  Start,
+  IN  UINT64  End
+  )
+{
+  return mBenchCountsDown ? Start - End : End - Start;
+}
+
+UINT64
+BenchTicksToPs (
+  IN  UINT64  Ticks,
+  IN  UINT64  Count
+  )
+{
+  UINT64  Ns;
+
+  Ns = DivU64x64Remainder (MultU64x64 (Ticks, 1000000000ULL), mBenchFrequency, NULL);
+  return DivU64x64Remainder (MultU64x64 (Ns, 1000), Count, NULL);
+}
+
+/*
+ * Finds an operation count that makes one sample last about
+ * Config->SampleMs, doubling it until the sample is long enough
+ * to be measured with some precision, and then scaling it.
+ */
+STATIC
+UINT64
+BenchCalibrate (
+  IN  BENCH_CONFIG      *Config,
+  IN  CONST BENCH_CASE  *Case
+  )
+{
+  UINT64  Count;
+  UINT64  Ticks;
+  UINT64  Target;
+
+  Target = DivU64x32 (MultU64x64 (mBenchFrequency, Config->SampleMs), 1000);
+  Count  = 1;
+  for ( ; ;) {
+    Ticks = BenchSample (Config, Case, Count);
+    if ((Ticks >= Target / 16) || (Count >= BIT48)) {
+      break;
+    }
+
+    Count *= 2;
+  }
+
+  Count = DivU64x64Remainder (MultU64x64 (Count, Target), MAX (Ticks, 1), NULL);
+  return MAX (Count, 1);
+}
+
+STATIC
+VOID
+BenchSort (
+  IN  OUT UINT64  *Values,
+  IN      UINTN   Count
+  )
+{
+  UINTN   Index;
+  UINTN   Pos;
+  UINT64  Value;
+
+  for (Index = 1; Index < Count; Index++) {
+    Value = Values[Index];
+    for (Pos = Index; Pos > 0 && Values[Pos - 1] > Value; Pos--) {
+      Values[Pos] = Values[Pos - 1];
+    }
+
+    Values[Pos] = Value;
+  }
+}
+
+/*
+ * Nearest-rank percentile of sorted values.
+ */
+STATIC
+UINT64
+BenchPercentile (
+  IN  CONST UINT64  *Sorted,
+  IN  UINTN         Count,
+  IN  UINTN         Percent
+  )
+{
+  UINTN  Rank;
+
+  Rank = (Percent * Count + 99) / 100;
+  return Sorted[MAX (Rank, 1) - 1];
+}
+
+STATIC
+EFI_STATUS
+BenchMeasure (
+  IN  BENCH_CONFIG      *Config,
+  IN  CONST BENCH_CASE  *Case,
+  IN  UINT64            *Samples,
+  OUT BENCH_RESULT      *Result
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+  UINT64      Sum;
+  UINT64      Jitter;
+
+  Result->Name = Case->Name;
+
+  if (Case->SampleFn != NULL) {
+    Result->Count = 1;
+    Status        = Case->SampleFn (Case->Context, Config->Test, Samples, Config->Iterations);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "Benchmark %a failed: %r\n", Case->Name, Status));
+      return Status;
+    }
+  } else {
+    Result->Count = BenchCalibrate (Config, Case);
+
+    for (Index = 0; Index < Config->WarmUp; Index++) {
+      BenchSample (Config, Case, Result->Count);
+    }
+
+    for (Index = 0; Index < Config->Iterations; Index++) {
+      Samples[Index] = BenchTicksToPs (
+                         BenchSample (Config, Case, Result->Count),
+                         Result->Count
+                         );
+    }
+  }
+
+  Sum    = 0;
+  Jitter = 0;
+  for (Index = 0; Index < Config->Iterations; Index++) {
+    Sum += Samples[Index];
+    if (Index != 0) {
+      Jitter += Samples[Index] > Samples[Index - 1] ?
+                Samples[Index] - Samples[Index - 1] :
+                Samples[Index - 1] - Samples[Index];
+    }
+  }
+
+  BenchSort (Samples, Config->Iterations);
+  Result->MinPs    = Samples[0];
+  Result->MedianPs = BenchPercentile (Samples, Config->Iterations, 50);
+  Result->P90Ps    = BenchPercentile (Samples, Config->Iterations, 90);
+  Result->P99Ps    = BenchPercentile (Samples, Config->Iterations, 99);
+  Result->MaxPs    = Samples[Config->Iterations - 1];
+  Result->MeanPs   = DivU64x64Remainder (Sum, Config->Iterations, NULL);
+  if (Config->Iterations > 1) {
+    Result->JitterPs = DivU64x64Remainder (Jitter, Config->Iterations - 1, NULL);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Parses a non-negative decimal number of nanoseconds
+ * with up to 3 fractional digits into picoseconds.
+ */
+STATIC
+UINT64
+BenchParsePs (
+  IN  CONST CHAR8  *String
+  )
+{
+  UINT64  Value;
+  UINTN   Digits;
+
+  Value = 0;
+  while (*String >= '0' && *String <= '9') {
+    Value = Value * 10 + (*String++ - '0');
+  }
+
+  Value *= 1000;
+  if (*String == '.') {
+    String++;
+    for (Digits = 100; Digits != 0 && *String >= '0' && *String <= '9'; Digits /= 10) {
+      Value += (*String++ - '0') * Digits;
+    }
+  }
+
+  return Value;
+}
+
+/*
+ * Splits a line in place into comma-separated fields, returning
+ * the number of fields and the start of the next line.
+ */
+STATIC
+UINTN
+BenchSplitLine (
+  IN  OUT CHAR8  **Line,
+  OUT     CHAR8  **Fields
+  )
+{
+  CHAR8  *Pos;
+  UINTN  Count;
+
+  Pos       = *Line;
+  Count     = 1;
+  Fields[0] = Pos;
+  for ( ; *Pos != '\0' && *Pos != '\n'; Pos++) {
+    if (*Pos == '\r') {
+      *Pos = '\0';
+    } else if ((*Pos == ',') && (Count < BENCH_MAX_COLUMNS)) {
+      *Pos            = '\0';
+      Fields[Count++] = Pos + 1;
+    }
+  }
+
+  if (*Pos == '\n') {
+    *Pos++ = '\0';
+  }
+
+  *Line = Pos;
+  return Count;
+}
+
+/*
+ * Fills in BaselinePs (or NativePs) from the medians in a
+ * CSV result file, matching cases by name.
+ */
+STATIC
+EFI_STATUS
+BenchLoadMedians (
+  IN  BENCH_CONFIG  *Config,
+  IN  CHAR16        *File,
+  IN  BOOLEAN       Native,
+  IN  BENCH_RESULT  *Results,
+  IN  UINTN         ResultCount
+  )
+{
+  EFI_STATUS  Status;
+  CHAR8       *Data;
+  CHAR8       *Line;
+  UINTN       Size;
+  UINTN       Count;
+  UINTN       Index;
+  UINTN       NameColumn;
+  UINTN       MedianColumn;
+  CHAR8       *Fields[BENCH_MAX_COLUMNS];
+
+  Status = ReadShellFile (File, (VOID **)&Data, &Size);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Couldn't read '%s': %r\n", File, Status));
+    return Status;
+  }
+
+  Line         = Data;
+  NameColumn   = MAX_UINTN;
+  MedianColumn = MAX_UINTN;
+  Count        = BenchSplitLine (&Line, Fields);
+  for (Index = 0; Index < Count; Index++) {
+    if (AsciiStrCmp (Fields[Index], "name") == 0) {
+      NameColumn = Index;
+    } else if (AsciiStrCmp (Fields[Index], "median_ns") == 0) {
+      MedianColumn = Index;
+    }
+  }
+
+  if ((NameColumn == MAX_UINTN) || (MedianColumn == MAX_UINTN)) {
+    DEBUG ((DEBUG_ERROR, "'%s' is not a CSV benchmark result\n", File));
+    FreePool (Data);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  while (*Line != '\0') {
+    Count = BenchSplitLine (&Line, Fields);
+    if ((Count <= NameColumn) || (Count <= MedianColumn)) {
+      continue;
+    }
+
+    for (Index = 0; Index < ResultCount; Index++) {
+      if (AsciiStrCmp (Results[Index].Name, Fields[NameColumn]) != 0) {
+        continue;
+      }
+
+      if (Native) {
+        Results[Index].NativePs = BenchParsePs (Fields[MedianColumn]);
+      } else {
+        Results[Index].BaselinePs = BenchParsePs (Fields[MedianColumn]);
+        Results[Index].Regressed  = Results[Index].BaselinePs != 0 &&
+                                    MultU64x32 (Results[Index].MedianPs, 100) >
+                                    MultU64x32 (Results[Index].BaselinePs, 100 + (UINT32)Config->Threshold);
+      }
+    }
+  }
+
+  FreePool (Data);
+  return EFI_SUCCESS;
+}
+
+#define PS_ARGS(Ps)  ((Ps) / 1000), ((Ps) % 1000)
+
+/*
+ * Median relative to the native median, in hundredths.
+ */
+STATIC
+UINT64
+BenchSlowdown (
+  IN  CONST BENCH_RESULT  *Result
+  )
+{
+  if (Result->NativePs == 0) {
+    return 0;
+  }
+
+  return DivU64x64Remainder (
+           MultU64x32 (Result->MedianPs, 100),
+           Result->NativePs,
+           NULL
+           );
+}
+
+STATIC
+VOID
+BenchOutputChange (
+  IN  BENCH_OUTPUT        *Out,
+  IN  CONST BENCH_RESULT  *Result
+  )
+{
+  UINT64  Permille;
+
+  if (Result->MedianPs >= Result->BaselinePs) {
+    Permille = DivU64x64Remainder (
+                 MultU64x32 (Result->MedianPs - Result->BaselinePs, 1000),
+                 Result->BaselinePs,
+                 NULL
+                 );
+    BenchOut (Out, "+%lu.%lu%%", DivU64x32 (Permille, 10), Permille % 10);
+  } else {
+    Permille = DivU64x64Remainder (
+                 MultU64x32 (Result->BaselinePs - Result->MedianPs, 1000),
+                 Result->BaselinePs,
+                 NULL
+                 );
+    BenchOut (Out, "-%lu.%lu%%", DivU64x32 (Permille, 10), Permille % 10);
+  }
+}
+
+STATIC
+VOID
+BenchOutputHeader (
+  IN  BENCH_CONFIG  *Config,
+  IN  BENCH_OUTPUT  *Out
+  )
+{
+  switch (Config->Format) {
+    case BenchFormatCsv:
+      BenchOut (Out, "name,count,iterations,min_ns,median_ns,p90_ns,p99_ns,max_ns,mean_ns,jitter_ns");
+      if (Config->BaselineFile != NULL) {
+        BenchOut (Out, ",baseline_ns,regressed");
+      }
+
+      if (Config->NativeFile != NULL) {
+        BenchOut (Out, ",native_ns,slowdown");
+      }
+
+      BenchOut (Out, "\n");
+      break;
+    case BenchFormatJson:
+      BenchOut (
+        Out,
+        "{\n  \"host\": \"%a\",\n  \"caller\": \"%a\",\n",
+        BenchMachineName (Config->HostMachineType),
+        BenchMachineName (Config->CallerMachineType)
+        );
+      BenchOut (
+        Out,
+        "  \"iterations\": %lu,\n  \"warm_up\": %lu,\n  \"sample_ms\": %lu,\n  \"results\": [\n",
+        (UINT64)Config->Iterations,
+        (UINT64)Config->WarmUp,
+        (UINT64)Config->SampleMs
+        );
+      break;
+    default:
+      BenchOut (
+        Out,
+        "%a on %a, %lu iterations, %lu warm-up, %lu ms samples, ns per operation:\n",
+        BenchMachineName (Config->CallerMachineType),
+        BenchMachineName (Config->HostMachineType),
+        (UINT64)Config->Iterations,
+        (UINT64)Config->WarmUp,
+        (UINT64)Config->SampleMs
+        );
+      BenchOut (
+        Out,
+        "%-28a %12a %12a %12a %12a %12a %12a %12a %12a",
+        "name",
+        "count",
+        "min",
+        "median",
+        "p90",
+        "p99",
+        "max",
+        "mean",
+        "jitter"
+        );
+      if (Config->BaselineFile != NULL) {
+        BenchOut (Out, " %12a %8a", "baseline", "change");
+      }
+
+      if (Config->NativeFile != NULL) {
+        BenchOut (Out, " %12a %10a", "native", "slowdown");
+      }
+
+      BenchOut (Out, "\n");
+      break;
+  }
+}
+
+STATIC
+VOID
+BenchOutputResult (
+  IN  BENCH_CONFIG        *Config,
+  IN  BENCH_OUTPUT        *Out,
+  IN  CONST BENCH_RESULT  *Result,
+  IN  BOOLEAN             First
+  )
+{
+  switch (Config->Format) {
+    case BenchFormatCsv:
+      BenchOut (
+        Out,
+        "%a,%lu,%lu,%lu.%03lu,%lu.%03lu,%lu.%03lu,%lu.%03lu,%lu.%03lu,%lu.%03lu,%lu.%03lu",
+        Result->Name,
+        Result->Count,
+        (UINT64)Config->Iterations,
+        PS_ARGS (Result->MinPs),
+        PS_ARGS (Result->MedianPs),
+        PS_ARGS (Result->P90Ps),
+        PS_ARGS (Result->P99Ps),
+        PS_ARGS (Result->MaxPs),
+        PS_ARGS (Result->MeanPs),
+        PS_ARGS (Result->JitterPs)
+        );
+      if (Config->BaselineFile != NULL) {
+        BenchOut (
+          Out,
+          ",%lu.%03lu,%u",
+          PS_ARGS (Result->BaselinePs),
+          Result->Regressed
+          );
+      }
+
+      if (Config->NativeFile != NULL) {
+        BenchOut (
+          Out,
+          ",%lu.%03lu,%lu.%02lu",
+          PS_ARGS (Result->NativePs),
+          BenchSlowdown (Result) / 100,
+          BenchSlowdown (Result) % 100
+          );
+      }
+
+      BenchOut (Out, "\n");
+      break;
+    case BenchFormatJson:
+      BenchOut (
+        Out,
+        "%a    { \"name\": \"%a\", \"count\": %lu, ",
+        First ? "" : ",\n",
+        Result->Name,
+        Result->Count
+        );
+      BenchOut (
+        Out,
+        "\"min_ns\": %lu.%03lu, \"median_ns\": %lu.%03lu, \"p90_ns\": %lu.%03lu, ",
+        PS_ARGS (Result->MinPs),
+        PS_ARGS (Result->MedianPs),
+        PS_ARGS (Result->P90Ps)
+        );
+      BenchOut (
+        Out,
+        "\"p99_ns\": %lu.%03lu, \"max_ns\": %lu.%03lu, \"mean_ns\": %lu.%03lu, ",
+        PS_ARGS (Result->P99Ps),
+        PS_ARGS (Result->MaxPs),
+        PS_ARGS (Result->MeanPs)
+        );
+      BenchOut (Out, "\"jitter_ns\": %lu.%03lu", PS_ARGS (Result->JitterPs));
+      if ((Config->BaselineFile != NULL) && (Result->BaselinePs != 0)) {
+        BenchOut (
+          Out,
+          ", \"baseline_ns\": %lu.%03lu, \"regressed\": %a",
+          PS_ARGS (Result->BaselinePs),
+          Result->Regressed ? "true" : "false"
+          );
+      }
+
+      if ((Config->NativeFile != NULL) && (Result->NativePs != 0)) {
+        BenchOut (
+          Out,
+          ", \"native_ns\": %lu.%03lu, \"slowdown\": %lu.%02lu",
+          PS_ARGS (Result->NativePs),
+          BenchSlowdown (Result) / 100,
+          BenchSlowdown (Result) % 100
+          );
+      }
+
+      BenchOut (Out, " }");
+      break;
+    default:
+      BenchOut (
+        Out,
+        "%-28a %12lu %8lu.%03lu %8lu.%03lu %8lu.%03lu %8lu.%03lu %8lu.%03lu %8lu.%03lu %8lu.%03lu",
+        Result->Name,
+        Result->Count,
+        PS_ARGS (Result->MinPs),
+        PS_ARGS (Result->MedianPs),
+        PS_ARGS (Result->P90Ps),
+        PS_ARGS (Result->P99Ps),
+        PS_ARGS (Result->MaxPs),
+        PS_ARGS (Result->MeanPs),
+        PS_ARGS (Result->JitterPs)
+        );
+      if ((Config->BaselineFile != NULL) && (Result->BaselinePs != 0)) {
+        BenchOut (Out, " %8lu.%03lu ", PS_ARGS (Result->BaselinePs));
+        BenchOutputChange (Out, Result);
+        if (Result->Regressed) {
+          BenchOut (Out, " REGRESSED");
+        }
+      }
+
+      if ((Config->NativeFile != NULL) && (Result->NativePs != 0)) {
+        BenchOut (
+          Out,
+          " %8lu.%03lu %7lu.%02lux",
+          PS_ARGS (Result->NativePs),
+          BenchSlowdown (Result) / 100,
+          BenchSlowdown (Result) % 100
+          );
+      }
+
+      BenchOut (Out, "\n");
+      break;
+  }
+}
+
+STATIC
+VOID
+BenchOutputFooter (
+  IN  BENCH_CONFIG  *Config,
+  IN  BENCH_OUTPUT  *Out
+  )
+{
+  if (Config->Format == BenchFormatJson) {
+    BenchOut (Out, "\n  ]\n}\n");
+  }
+}
+
+VOID
+BenchInitConfig (
+  OUT BENCH_CONFIG  *Config
+  )
+{
+  ZeroMem (Config, sizeof (*Config));
+  Config->Iterations = BENCH_DEFAULT_ITERATIONS;
+  Config->WarmUp     = BENCH_DEFAULT_WARM_UP;
+  Config->SampleMs   = BENCH_DEFAULT_SAMPLE_MS;
+  Config->Format     = BenchFormatText;
+  Config->Threshold  = BENCH_DEFAULT_THRESHOLD;
+}
+
+EFI_STATUS
+BenchRun (
+  IN  BENCH_CONFIG      *Config,
+  IN  CONST BENCH_CASE  *Cases,
+  IN  UINTN             CaseCount
+  )
+{
+  EFI_STATUS    Status;
+  UINT64        Start;
+  UINT64        End;
+  UINTN         Index;
+  UINTN         Ran;
+  UINTN         Regressions;
+  UINTN         Failures;
+  UINT64        *Samples;
+  BENCH_RESULT  *Results;
+  BENCH_OUTPUT  Out;
+
+  if (Config->Test == NULL) {
+    DEBUG ((DEBUG_ERROR, "Benchmarks need EMU_TEST_PROTOCOL for timing\n"));
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((Config->Iterations == 0) || (Config->SampleMs == 0) ||
+      (Config->SampleMs > BENCH_MAX_SAMPLE_MS))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  mBenchFrequency  = Config->Test->GetPerformanceCounterProperties (&Start, &End);
+  mBenchCountsDown = Start > End;
+
+  Samples = AllocatePool (Config->Iterations * sizeof (*Samples));
+  Results = AllocateZeroPool (CaseCount * sizeof (*Results));
+  if ((Samples == NULL) || (Results == NULL)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Ran      = 0;
+  Failures = 0;
+  for (Index = 0; Index < CaseCount; Index++) {
+    if ((Config->Filter != NULL) &&
+        (AsciiStrnCmp (Cases[Index].Name, Config->Filter, AsciiStrLen (Config->Filter)) != 0))
+    {
+      continue;
+    }
+
+    DEBUG ((DEBUG_VERBOSE, "Benchmarking %a\n", Cases[Index].Name));
+    if (EFI_ERROR (BenchMeasure (Config, &Cases[Index], Samples, &Results[Ran]))) {
+      Failures++;
+      continue;
+    }
+
+    Ran++;
+  }
+
+  Regressions = 0;
+  if (Config->BaselineFile != NULL) {
+    Status = BenchLoadMedians (Config, Config->BaselineFile, FALSE, Results, Ran);
+    if (EFI_ERROR (Status)) {
+      goto out;
+    }
+  }
+
+  if (Config->NativeFile != NULL) {
+    Status = BenchLoadMedians (Config, Config->NativeFile, TRUE, Results, Ran);
+    if (EFI_ERROR (Status)) {
+      goto out;
+    }
+  }
+
+  ZeroMem (&Out, sizeof (Out));
+  Out.Console = Config->OutFile == NULL;
+
+  BenchOutputHeader (Config, &Out);
+  for (Index = 0; Index < Ran; Index++) {
+    BenchOutputResult (Config, &Out, &Results[Index], Index == 0);
+    if (Results[Index].Regressed) {
+      Regressions++;
+    }
+  }
+
+  BenchOutputFooter (Config, &Out);
+
+  Status = EFI_SUCCESS;
+  if (Config->OutFile != NULL) {
+    Status = WriteShellFile (Config->OutFile, Out.Buffer, Out.Used);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "Couldn't write '%s': %r\n", Config->OutFile, Status));
+    }
+
+    if (Out.Buffer != NULL) {
+      FreePool (Out.Buffer);
+    }
+  }
+
+  if (Regressions != 0) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%lu of %lu benchmarks regressed by more than %lu%%\n",
+      (UINT64)Regressions,
+      (UINT64)Ran,
+      (UINT64)Config->Threshold
+      ));
+    if (!EFI_ERROR (Status)) {
+      Status = EFI_ABORTED;
+    }
+  }
+
+  if ((Failures != 0) && !EFI_ERROR (Status)) {
+    Status = EFI_DEVICE_ERROR;
+  }
+
+out:
+  if (Samples != NULL) {
+    FreePool (Samples);
+  }
+
+  if (Results != NULL) {
+    FreePool (Results);
+  }
+
+  return Status;
+}
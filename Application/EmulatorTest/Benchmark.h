@@ -0,0 +1,132 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#include <Uefi.h>
+#include <Protocol/EmuTestProtocol.h>
+
+/*
+ * Performs Count operations of whatever is being measured.
+ * The return value is consumed, so the work isn't optimized out.
+ */
+typedef
+UINT64
+(*BENCH_FN)(
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  );
+
+/*
+ * Used instead of BENCH_FN for measurements that can't be batched
+ * (e.g. event latency), filling in Count samples in picoseconds.
+ */
+typedef
+EFI_STATUS
+(*BENCH_SAMPLE_FN)(
+  IN  VOID               *Context,
+  IN  EMU_TEST_PROTOCOL  *Test,
+  OUT UINT64             *SamplesPs,
+  IN  UINTN              Count
+  );
+
+typedef struct {
+  CONST CHAR8        *Name;
+  BENCH_FN           Fn;
+  VOID               *Context;
+  BENCH_SAMPLE_FN    SampleFn;
+} BENCH_CASE;
+
+typedef enum {
+  BenchFormatText,
+  BenchFormatCsv,
+  BenchFormatJson,
+} BENCH_FORMAT;
+
+typedef struct {
+  /*
+   * Timed samples per case.
+   */
+  UINTN                Iterations;
+  /*
+   * Untimed samples per case, run after calibration.
+   */
+  UINTN                WarmUp;
+  /*
+   * Each sample performs enough operations to take about this long.
+   */
+  UINTN                SampleMs;
+  BENCH_FORMAT         Format;
+  /*
+   * Results go to the console if NULL.
+   */
+  CHAR16               *OutFile;
+  /*
+   * CSV results of an earlier run to compare medians against.
+   */
+  CHAR16               *BaselineFile;
+  /*
+   * A case regresses if its median is this many percent
+   * worse than the baseline.
+   */
+  UINTN                Threshold;
+  /*
+   * CSV results of a native build's run, to report the slowdown
+   * of each case against.
+   */
+  CHAR16               *NativeFile;
+  /*
+   * Only cases with names starting with this are run, if not NULL.
+   */
+  CHAR8                *Filter;
+  EMU_TEST_PROTOCOL    *Test;
+  UINT16               HostMachineType;
+  UINT16               CallerMachineType;
+} BENCH_CONFIG;
+
+#define BENCH_DEFAULT_ITERATIONS  31
+#define BENCH_DEFAULT_WARM_UP     3
+#define BENCH_DEFAULT_SAMPLE_MS   10
+#define BENCH_MAX_SAMPLE_MS       1000
+#define BENCH_DEFAULT_THRESHOLD   10
+
+VOID
+BenchInitConfig (
+  OUT BENCH_CONFIG  *Config
+  );
+
+/*
+ * For BENCH_SAMPLE_FN, only valid while BenchRun is running.
+ * Returns the number of ticks from Start to End, for
+ * counters counting both up and down.
+ */
+UINT64
+BenchTicksBetween (
+  IN  UINT64  Start,
+  IN  UINT64  End
+  );
+
+UINT64
+BenchTicksToPs (
+  IN  UINT64  Ticks,
+  IN  UINT64  Count
+  );
+
+/*
+ * Returns EFI_SUCCESS if all cases ran and none regressed
+ * against the baseline.
+ */
+EFI_STATUS
+BenchRun (
+  IN  BENCH_CONFIG      *Config,
+  IN  CONST BENCH_CASE  *Cases,
+  IN  UINTN             CaseCount
+  );
@@ -0,0 +1,271 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include "Compress.h"
+
+/*
+ * This isn't a real compressor: the data is made up of tokens
+ * picked while generating it, and the Huffman trees are fixed
+ * instead of being built from symbol frequencies. That's good
+ * enough to exercise all of the decoder.
+ *
+ * The char&length set has NC symbols: 256 literals followed by
+ * match lengths 3 to 256. The last two get 8-bit codes and the
+ * rest 9-bit codes, which makes for a complete tree. The position
+ * set has a single symbol, COMPRESS_POS_SYMBOL, encoded with zero
+ * bits and followed by COMPRESS_POS_SYMBOL - 1 bits of position.
+ */
+#define COMPRESS_NC          510
+#define COMPRESS_CBIT        9
+#define COMPRESS_TBIT        5
+#define COMPRESS_PBIT        4
+#define COMPRESS_THRESHOLD   3
+#define COMPRESS_MAX_MATCH   256
+#define COMPRESS_POS_SYMBOL  12
+#define COMPRESS_POS_MIN     (1U << (COMPRESS_POS_SYMBOL - 1))
+#define COMPRESS_POS_MAX     ((1U << COMPRESS_POS_SYMBOL) - 1)
+#define COMPRESS_MAX_TOKENS  MAX_UINT16
+
+typedef struct {
+  UINT8     *Buffer;
+  UINTN     Size;
+  UINTN     Used;
+  UINT32    Bits;
+  UINTN     BitCount;
+} COMPRESS_WRITER;
+
+typedef struct {
+  /*
+   * Literal byte or match length.
+   */
+  UINT16    Symbol;
+  UINT16    Pos;
+} COMPRESS_TOKEN;
+
+STATIC CONST CHAR8  mCompressWords[][9] = {
+  "EFI", "Pci", "Io", "Protocol", "Handle", "Status", "Buffer", "Size",
+  "the", "of", "to", "and", "Device", "Path", "Image", "Memory",
+};
+
+/*
+ * Bits go out MSB first, matching the decoder's FillBuf.
+ */
+STATIC
+VOID
+CompressPutBits (
+  IN  COMPRESS_WRITER  *Writer,
+  IN  UINT32           Value,
+  IN  UINTN            Count
+  )
+{
+  while (Count-- != 0) {
+    Writer->Bits = (Writer->Bits << 1) | ((Value >> Count) & 1);
+    if (++Writer->BitCount == 8) {
+      if (Writer->Used < Writer->Size) {
+        Writer->Buffer[Writer->Used] = (UINT8)Writer->Bits;
+      }
+
+      Writer->Used++;
+      Writer->Bits     = 0;
+      Writer->BitCount = 0;
+    }
+  }
+}
+
+STATIC
+UINT32
+CompressRandom (
+  IN  OUT UINT32  *Seed
+  )
+{
+  *Seed = *Seed * 1103515245 + 12345;
+  return *Seed >> 16;
+}
+
+STATIC
+UINTN
+CompressGenerateTokens (
+  OUT UINT8           *Data,
+  IN  UINTN           Size,
+  OUT COMPRESS_TOKEN  *Tokens
+  )
+{
+  UINT32       Seed;
+  UINTN        Out;
+  UINTN        TokenCount;
+  UINTN        Length;
+  UINTN        Pos;
+  CONST CHAR8  *Word;
+
+  Seed       = 1;
+  Out        = 0;
+  TokenCount = 0;
+  while (Out < Size && TokenCount < COMPRESS_MAX_TOKENS) {
+    Length = COMPRESS_THRESHOLD + CompressRandom (&Seed) % 61;
+    Pos    = COMPRESS_POS_MIN + CompressRandom (&Seed) % (COMPRESS_POS_MIN);
+    Length = MIN (Length, Size - Out);
+    if ((Out > Pos) && (Length >= COMPRESS_THRESHOLD) &&
+        ((CompressRandom (&Seed) % 4) != 0))
+    {
+      Tokens[TokenCount].Symbol = (UINT16)(Length + 0xFF + 1 - COMPRESS_THRESHOLD);
+      Tokens[TokenCount++].Pos  = (UINT16)Pos;
+      for ( ; Length != 0; Length--, Out++) {
+        Data[Out] = Data[Out - Pos - 1];
+      }
+
+      continue;
+    }
+
+    /*
+     * A word and a separator as literals.
+     */
+    for (Word = mCompressWords[CompressRandom (&Seed) % ARRAY_SIZE (mCompressWords)];
+         Out < Size && TokenCount < COMPRESS_MAX_TOKENS; Word++)
+    {
+      Data[Out]                   = *Word != '\0' ? *Word : " ,.\n"[CompressRandom (&Seed) % 4];
+      Tokens[TokenCount++].Symbol = Data[Out++];
+      if (*Word == '\0') {
+        break;
+      }
+    }
+  }
+
+  return TokenCount;
+}
+
+STATIC
+VOID
+CompressPutBlock (
+  IN  COMPRESS_WRITER       *Writer,
+  IN  CONST COMPRESS_TOKEN  *Tokens,
+  IN  UINTN                 TokenCount
+  )
+{
+  UINTN  Index;
+
+  CompressPutBits (Writer, (UINT32)TokenCount, 16);
+
+  /*
+   * Tree for the char&length code lengths: symbols 10 and 11
+   * (lengths 8 and 9) with 1-bit codes. Lengths are 3 bits each,
+   * with a 2-bit zero run count after the third one.
+   */
+  CompressPutBits (Writer, 12, COMPRESS_TBIT);
+  for (Index = 0; Index < 12; Index++) {
+    if (Index == 3) {
+      CompressPutBits (Writer, 3, 2);
+      Index += 3;
+    }
+
+    CompressPutBits (Writer, Index >= 10 ? 1 : 0, 3);
+  }
+
+  /*
+   * Char&length code lengths.
+   */
+  CompressPutBits (Writer, COMPRESS_NC, COMPRESS_CBIT);
+  for (Index = 0; Index < COMPRESS_NC; Index++) {
+    CompressPutBits (Writer, Index < COMPRESS_NC - 2 ? 1 : 0, 1);
+  }
+
+  /*
+   * Single-symbol position tree.
+   */
+  CompressPutBits (Writer, 0, COMPRESS_PBIT);
+  CompressPutBits (Writer, COMPRESS_POS_SYMBOL, COMPRESS_PBIT);
+
+  for (Index = 0; Index < TokenCount; Index++) {
+    if (Tokens[Index].Symbol >= COMPRESS_NC - 2) {
+      CompressPutBits (Writer, Tokens[Index].Symbol - (COMPRESS_NC - 2), 8);
+    } else {
+      CompressPutBits (Writer, 4 + Tokens[Index].Symbol, 9);
+    }
+
+    if (Tokens[Index].Symbol > MAX_UINT8) {
+      CompressPutBits (
+        Writer,
+        Tokens[Index].Pos - COMPRESS_POS_MIN,
+        COMPRESS_POS_SYMBOL - 1
+        );
+    }
+  }
+}
+
+EFI_STATUS
+TestCompressGenerate (
+  IN  UINTN  Size,
+  OUT VOID   **Original,
+  OUT VOID   **Compressed,
+  OUT UINTN  *CompressedSize
+  )
+{
+  EFI_STATUS       Status;
+  UINT8            *Data;
+  COMPRESS_TOKEN   *Tokens;
+  UINTN            TokenCount;
+  COMPRESS_WRITER  Writer;
+
+  ZeroMem (&Writer, sizeof (Writer));
+  Data   = AllocatePool (Size);
+  Tokens = AllocatePool (COMPRESS_MAX_TOKENS * sizeof (*Tokens));
+  if ((Data == NULL) || (Tokens == NULL)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  TokenCount = CompressGenerateTokens (Data, Size, Tokens);
+  if ((TokenCount == COMPRESS_MAX_TOKENS) || (Size > MAX_UINT32)) {
+    Status = EFI_BAD_BUFFER_SIZE;
+    goto out;
+  }
+
+  /*
+   * Worst case is all 9-bit literals, plus the block header.
+   */
+  Writer.Size   = sizeof (UINT32) * 2 + Size * 9 / 8 + COMPRESS_NC;
+  Writer.Buffer = AllocatePool (Writer.Size);
+  if (Writer.Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Writer.Used = sizeof (UINT32) * 2;
+  CompressPutBlock (&Writer, Tokens, TokenCount);
+  if (Writer.BitCount != 0) {
+    CompressPutBits (&Writer, 0, 8 - Writer.BitCount);
+  }
+
+  ASSERT (Writer.Used <= Writer.Size);
+
+  WriteUnaligned32 ((UINT32 *)Writer.Buffer, (UINT32)(Writer.Used - sizeof (UINT32) * 2));
+  WriteUnaligned32 ((UINT32 *)Writer.Buffer + 1, (UINT32)Size);
+
+  *Original       = Data;
+  *Compressed     = Writer.Buffer;
+  *CompressedSize = Writer.Used;
+  Data            = NULL;
+  Status          = EFI_SUCCESS;
+
+out:
+  if (Data != NULL) {
+    FreePool (Data);
+  }
+
+  if (Tokens != NULL) {
+    FreePool (Tokens);
+  }
+
+  return Status;
+}
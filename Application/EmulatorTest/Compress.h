@@ -0,0 +1,28 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#include <Uefi.h>
+
+/*
+ * Generates Size bytes of text-like data with plenty of repeats
+ * and compresses it in the EFI (UefiDecompressLib version 1)
+ * format, to have something to benchmark decompression with
+ * without shipping a binary blob. Both buffers are pool-allocated.
+ */
+EFI_STATUS
+TestCompressGenerate (
+  IN  UINTN  Size,
+  OUT VOID   **Original,
+  OUT VOID   **Compressed,
+  OUT UINTN  *CompressedSize
+  );
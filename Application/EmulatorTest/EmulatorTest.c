@@ -12,20 +12,198 @@
 #include <Library/CpuLib.h>
 #include <Library/UefiLib.h>
 #include <Library/BaseLib.h>
+#include <Library/PrintLib.h>
 #include <Library/DebugLib.h>
+#include <Library/MauUtilsLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiDecompressLib.h>
 #include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
 #include <Library/UefiApplicationEntryPoint.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/PciRootBridgeIo.h>
+#include <Protocol/MpService.h>
+#include <Protocol/DriverBinding.h>
+#include <Protocol/SimpleNetwork.h>
+#include <Protocol/GraphicsOutput.h>
+#include <IndustryStandard/PeImage.h>
 #include <Protocol/EmuTestProtocol.h>
+#include <Protocol/SyntheticOpRomProtocol.h>
+#include "Benchmark.h"
+#include "Compress.h"
 
 #define NO_INLINE  __attribute__((noinline))
+
+#ifdef MDE_CPU_AARCH64
+#define TEST_MACHINE_TYPE  EFI_IMAGE_MACHINE_AARCH64
+#elif defined (MDE_CPU_RISCV64)
+#define TEST_MACHINE_TYPE  EFI_IMAGE_MACHINE_RISCV64
+#elif defined (MDE_CPU_LOONGARCH64)
+#define TEST_MACHINE_TYPE  EFI_IMAGE_MACHINE_LOONGARCH64
+#elif defined (MDE_CPU_X64)
+#define TEST_MACHINE_TYPE  EFI_IMAGE_MACHINE_X64
+#else
+  #error
+#endif
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
-STATIC EFI_GUID              mEmuTestProtocolGuid = EMU_TEST_PROTOCOL_GUID;
+/*
+ * Uncompressed size of the Decompress benchmark input.
+ */
+#define TEST_DECOMPRESS_SIZE  SIZE_16KB
+
+/*
+ * Transfers done by TestSyntheticOpRom.
+ */
+#define TEST_OPROM_TRANSFERS  16
+
+/*
+ * Framebuffer and BltBuffer geometry used by TestGopBlt, in pixels.
+ */
+#define TEST_GOP_WIDTH   40
+#define TEST_GOP_HEIGHT  24
+#define TEST_GOP_STRIDE  48
+#define TEST_GOP_BUFFER  16
+
+/*
+ * How many idle Receive polls TestSnpThrottle does to get SNP throttling
+ * to back off, and how long it then waits for a packet, in 100us steps
+ * (well over the 2ms maximum backoff).
+ */
+#define TEST_SNP_IDLE_POLLS  1000
+#define TEST_SNP_WAIT_STEPS  100
+
+/*
+ * Port 0x80 writes done by TestPioDelay. Port 0x61 is read up to
+ * 100 times as often, 1us apart, to see the 15us refresh toggle.
+ */
+#define TEST_PIO_DELAYS  16
+
+/*
+ * PIT channel 2 one-shot done by TestPioDelay: 10ms at 1.193182MHz.
+ */
+#define TEST_PIT_COUNT  11932
+#define TEST_PIT_US     10000
+
+/*
+ * Size of the buffer above 4GiB that TestLowMem has mapped.
+ */
+#define TEST_LOW_MEM_PAGES  4
+
+/*
+ * With -x, a build of EmulatorTest for another ISA is loaded as a
+ * peer. The peer is passed TEST_PEER_LOAD_OPTIONS as its load options
+ * and calls back into Run with its callees, allowing cross-ISA calls to
+ * be measured while the peer is still running (StartImage unloads it on
+ * return).
+ */
+#define TEST_PEER_SIGNATURE  SIGNATURE_64 ('M', 'A', 'U', 'T', 'P', 'E', 'E', 'R')
+
+typedef struct {
+  UINT16    MachineType;
+  /*
+   * Taking 0, 4, 8 and 16 arguments.
+   */
+  VOID      *Callees[4];
+} TEST_PEER_CALLEES;
+
+typedef struct {
+  UINT64    Signature;
+  VOID EFIAPI (*Run)(TEST_PEER_CALLEES *Callees);
+} TEST_PEER_LOAD_OPTIONS;
+
+/*
+ * Tests needing an EmulatorDxe variable to be set when EmulatorTest
+ * is loaded get run by another instance of EmulatorTest, loaded by
+ * TestReload with the variable set. The instance is passed
+ * TEST_RELOAD_OPTIONS as its load options, and logs its results
+ * via LogResult of the instance that loaded it.
+ */
+#define TEST_RELOAD_SIGNATURE  SIGNATURE_64 ('M', 'A', 'U', 'T', 'R', 'L', 'D', 'D')
+
+#define TEST_RELOAD_LOW_MEM  0
+#define TEST_RELOAD_HLE      1
+
+typedef struct {
+  UINT64    Signature;
+  UINTN     Test;
+  VOID EFIAPI (*LogResult)(CONST CHAR8 *String, BOOLEAN Result);
+  /*
+   * For TEST_RELOAD_LOW_MEM: a buffer above 4GiB, or NULL.
+   */
+  VOID      *HighBuffer;
+  UINTN     HighSize;
+} TEST_RELOAD_OPTIONS;
+
+/*
+ * A Blt done by TestGopBlt.
+ */
+typedef struct {
+  EFI_GRAPHICS_OUTPUT_BLT_OPERATION    Operation;
+  UINTN                                SourceX;
+  UINTN                                SourceY;
+  UINTN                                DestinationX;
+  UINTN                                DestinationY;
+  UINTN                                Width;
+  UINTN                                Height;
+} TEST_GOP_BLT;
+
+/*
+ * A library routine EmulatorDxe has a native implementation of.
+ */
+typedef struct {
+  CONST CHAR8    *Name;
+  VOID           *Function;
+} TEST_HLE_ROUTINE;
+
+/*
+ * Passed to TestMpProcedure.
+ */
+typedef struct {
+  EFI_MP_SERVICES_PROTOCOL    *MpServices;
+  CONST UINT64                *Buffer;
+  UINTN                       Count;
+  volatile UINT64             Sum;
+  volatile UINTN              Done;
+  UINTN                       Index;
+  /*
+   * As returned by WhoAmI.
+   */
+  volatile UINTN              Cpu;
+  /*
+   * As returned by StartupThisAP called from the procedure.
+   */
+  volatile EFI_STATUS         Nested;
+} TEST_MP_ARG;
+
+STATIC EFI_GUID              mEmuTestProtocolGuid        = EMU_TEST_PROTOCOL_GUID;
+STATIC EFI_GUID              mSyntheticOpRomProtocolGuid = SYNTHETIC_OPROM_PROTOCOL_GUID;
+STATIC EFI_GUID              mEmuVariableGuid            = EMU_VARIABLE_GUID;
 STATIC UINT64                TestArray[EFI_PAGE_SIZE / sizeof (UINT64)];
+STATIC UINT64                TestCopyArray[EFI_PAGE_SIZE / sizeof (UINT64)];
 STATIC EMU_TEST_DEBUG_STATE  mBeginDebugState;
 STATIC EMU_TEST_PROTOCOL     *mTest = NULL;
+STATIC BENCH_CONFIG          mBenchConfig;
+STATIC CHAR8                 mBenchFilter[64];
+STATIC CHAR16                *mPeerFile = NULL;
+STATIC TEST_PEER_CALLEES     *mPeerCallees;
+STATIC EFI_STATUS            mPeerStatus;
+
+/*
+ * Installed on a scratch controller by TestSupportedCache.
+ */
+STATIC EFI_GUID  mTestScratchProtocolGuids[2] = {
+  { 0xe2a61d93, 0xcbba, 0x43e6, { 0x97, 0x98, 0xa3, 0xe8, 0xb9, 0x06, 0x30, 0x10 }
+  },
+  { 0xbdcb7ac8, 0xa0ba, 0x4f99, { 0xb3, 0x63, 0xa0, 0x98, 0x31, 0x57, 0x6f, 0xd5 }
+  },
+};
 
 STATIC VOID
+EFIAPI
 LogResult (
   IN  CONST CHAR8    *String,
   IN        BOOLEAN  Result
@@ -299,365 +477,3000 @@ TestNullDeref (
 }
 
 STATIC
-NO_INLINE
 VOID
-TestCpuSleep (
-  VOID
+EFIAPI
+TestMpIdleProcedure (
+  IN  VOID  *Buffer
   )
 {
-  CpuSleep ();
-  LogResult ("CpuSleep", TRUE);
 }
 
 STATIC
-EFIAPI
 VOID
-TestTimerHandler (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
+EFIAPI
+TestMpProcedure (
+  IN  VOID  *Buffer
   )
 {
-  BOOLEAN  *IsDone = Context;
+  TEST_MP_ARG  *Arg = Buffer;
+  UINT64       Sum;
+  UINTN        Index;
+  UINTN        Cpu;
+
+  if (Arg->MpServices != NULL) {
+    if (!EFI_ERROR (Arg->MpServices->WhoAmI (Arg->MpServices, &Cpu))) {
+      Arg->Cpu = Cpu;
+    }
 
-  *IsDone = TRUE;
+    /*
+     * Only the BSP may start APs.
+     */
+    Arg->Nested = Arg->MpServices->StartupThisAP (
+                                     Arg->MpServices,
+                                     TestMpIdleProcedure,
+                                     Arg->Index,
+                                     NULL,
+                                     0,
+                                     NULL,
+                                     NULL
+                                     );
+  }
+
+  Sum = 0;
+  for (Index = 0; Index < Arg->Count; Index++) {
+    Sum = (Sum << 7 | Sum >> 57) ^ Arg->Buffer[Index];
+  }
+
+  Arg->Sum  = Sum;
+  Arg->Done = Arg->Index + 1;
 }
 
 STATIC
-NO_INLINE
-UINT64
-TestPerfMyCall1 (
+VOID
+TestMpServices (
   VOID
   )
 {
-  return 1;
-}
+  EFI_STATUS                 Status;
+  EFI_MP_SERVICES_PROTOCOL   *MpServices;
+  EFI_PROCESSOR_INFORMATION  Info;
+  TEST_MP_ARG                Expected;
+  TEST_MP_ARG                *Args;
+  UINTN                      Count;
+  UINTN                      EnabledCount;
+  UINTN                      Index;
+  UINTN                      EventIndex;
+  EFI_EVENT                  WaitEvent;
+  BOOLEAN                    Result;
+
+  Status = gBS->LocateProtocol (
+                  &gEfiMpServiceProtocolGuid,
+                  NULL,
+                  (VOID **)&MpServices
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "No MP services, skipping MP tests\n"));
+    return;
+  }
 
-STATIC
-NO_INLINE
-UINT64
-TestPerfEmpty (
-  IN  volatile BOOLEAN  *IsDone
-  )
-{
-  UINT64  Result;
+  Status = MpServices->GetNumberOfProcessors (MpServices, &Count, &EnabledCount);
+  if (EFI_ERROR (Status) || (EnabledCount < 2)) {
+    DEBUG ((DEBUG_INFO, "No APs, skipping MP tests\n"));
+    return;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (TestArray); Index++) {
+    TestArray[Index] = LShiftU64 (Index, 56) | Index;
+  }
+
+  ZeroMem (&Expected, sizeof (Expected));
+  Expected.Buffer = TestArray;
+  Expected.Count  = ARRAY_SIZE (TestArray);
+  TestMpProcedure (&Expected);
+
+  Args = AllocateZeroPool (Count * sizeof (*Args));
+  if (Args == NULL) {
+    LogResult ("MP services", FALSE);
+    return;
+  }
 
   /*
-   * Test empty loops.
+   * All APs write the same result.
    */
+  Args[0].Buffer = TestArray;
+  Args[0].Count  = ARRAY_SIZE (TestArray);
+  Status         = MpServices->StartupAllAPs (
+                                 MpServices,
+                                 TestMpProcedure,
+                                 FALSE,
+                                 NULL,
+                                 0,
+                                 &Args[0],
+                                 NULL
+                                 );
+  LogResult (
+    "MP StartupAllAPs",
+    !EFI_ERROR (Status) && (Args[0].Sum == Expected.Sum) && (Args[0].Done == 1)
+    );
+
+  Result = TRUE;
+  for (Index = 0; Index < Count; Index++) {
+    Status = MpServices->GetProcessorInfo (MpServices, Index, &Info);
+    if (EFI_ERROR (Status) ||
+        ((Info.StatusFlag & PROCESSOR_AS_BSP_BIT) != 0) ||
+        ((Info.StatusFlag & PROCESSOR_ENABLED_BIT) == 0))
+    {
+      continue;
+    }
 
-  Result = 0;
-  while (!*IsDone) {
-    Result += 1;
+    ZeroMem (&Args[Index], sizeof (Args[Index]));
+    Args[Index].MpServices = MpServices;
+    Args[Index].Buffer     = TestArray;
+    Args[Index].Count      = ARRAY_SIZE (TestArray);
+    Args[Index].Index      = Index;
+    Args[Index].Cpu        = MAX_UINTN;
+    Status                 = MpServices->StartupThisAP (
+                                       MpServices,
+                                       TestMpProcedure,
+                                       Index,
+                                       NULL,
+                                       0,
+                                       &Args[Index],
+                                       NULL
+                                       );
+    if (EFI_ERROR (Status) ||
+        (Args[Index].Sum != Expected.Sum) ||
+        (Args[Index].Done != (Index + 1)) ||
+        (Args[Index].Cpu != Index) ||
+        (Args[Index].Nested != EFI_DEVICE_ERROR))
+    {
+      DEBUG ((DEBUG_ERROR, "StartupThisAP %u: %r\n", Index, Status));
+      Result = FALSE;
+    }
   }
 
-  return Result;
-}
+  LogResult ("MP StartupThisAP", Result);
 
-STATIC
-NO_INLINE
-UINT64
-TestPerfMyCall (
-  IN  volatile BOOLEAN  *IsDone
-  )
-{
-  UINT64  Result;
+  /*
+   * Emulated procedures are run on the BSP, which can
+   * neither time out nor return before they are done.
+   */
+  if ((mTest != NULL) &&
+      (mBeginDebugState.HostMachineType != mBeginDebugState.CallerMachineType) &&
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_MP_SERVICES) != 0))
+  {
+    Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &WaitEvent);
+    if (!EFI_ERROR (Status)) {
+      Result = MpServices->StartupAllAPs (
+                             MpServices,
+                             TestMpProcedure,
+                             FALSE,
+                             WaitEvent,
+                             0,
+                             &Args[0],
+                             NULL
+                             ) == EFI_UNSUPPORTED;
+      Result &= MpServices->StartupAllAPs (
+                              MpServices,
+                              TestMpProcedure,
+                              FALSE,
+                              NULL,
+                              1000000,
+                              &Args[0],
+                              NULL
+                              ) == EFI_UNSUPPORTED;
+      gBS->CloseEvent (WaitEvent);
+    } else {
+      Result = FALSE;
+    }
+
+    LogResult ("MP non-blocking and timeout refused", Result);
+    FreePool (Args);
+    return;
+  }
 
   /*
-   * Test emulated function call loops.
+   * Non-blocking, then blocking again, which must not
+   * find APs still busy with the first call.
    */
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &WaitEvent);
+  if (!EFI_ERROR (Status)) {
+    ZeroMem (&Args[0], sizeof (Args[0]));
+    Args[0].Buffer = TestArray;
+    Args[0].Count  = ARRAY_SIZE (TestArray);
+    Status         = MpServices->StartupAllAPs (
+                                   MpServices,
+                                   TestMpProcedure,
+                                   FALSE,
+                                   WaitEvent,
+                                   0,
+                                   &Args[0],
+                                   NULL
+                                   );
+    if (!EFI_ERROR (Status)) {
+      Status = gBS->WaitForEvent (1, &WaitEvent, &EventIndex);
+    }
 
-  Result = 0;
-  while (!*IsDone) {
-    Result += TestPerfMyCall1 ();
+    Result = !EFI_ERROR (Status) && (Args[0].Sum == Expected.Sum);
+
+    Args[0].Sum = 0;
+    Status      = MpServices->StartupAllAPs (
+                                MpServices,
+                                TestMpProcedure,
+                                FALSE,
+                                NULL,
+                                0,
+                                &Args[0],
+                                NULL
+                                );
+    Result = Result && !EFI_ERROR (Status) && (Args[0].Sum == Expected.Sum);
+    gBS->CloseEvent (WaitEvent);
+  } else {
+    Result = FALSE;
   }
 
-  return Result;
+  LogResult ("MP StartupAllAPs non-blocking", Result);
+  FreePool (Args);
 }
 
+#ifdef MDE_CPU_X64
+
 STATIC
-NO_INLINE
-UINT64
-TestPerfNativeCall (
-  IN  volatile BOOLEAN  *IsDone
+VOID
+TestRepStrings (
+  VOID
   )
 {
-  UINT64  Result;
+  UINT64   *Buffer;
+  UINT64   *Copy;
+  UINT8    *Dest;
+  UINT8    *Source;
+  UINTN    Count;
+  UINTN    Index;
+  UINT64   Value;
+  BOOLEAN  Result;
 
   /*
-   * Test emulated function call loops.
+   * What BaseMemoryLibRepStr does, and what the emulator may
+   * accelerate. Pool buffers, as writes into images (including
+   * TestArray) are never accelerated. Checked element by element.
    */
+  Buffer = AllocatePool (EFI_PAGE_SIZE * 2);
+  if (Buffer == NULL) {
+    LogResult ("rep strings", FALSE);
+    return;
+  }
 
-  Result = 0;
-  while (!*IsDone) {
-    gBS->GetNextMonotonicCount (NULL);
-    Result++;
+  Copy  = Buffer + EFI_PAGE_SIZE / sizeof (UINT64);
+  Count = EFI_PAGE_SIZE / sizeof (UINT64);
+  for (Index = 0; Index < Count; Index++) {
+    Buffer[Index] = LShiftU64 (Index, 32) | Index;
   }
 
-  return Result;
-}
+  Dest   = (UINT8 *)Copy;
+  Source = (UINT8 *)Buffer;
+  Count  = EFI_PAGE_SIZE;
+  asm volatile ("rep movsb" : "+D" (Dest), "+S" (Source), "+c" (Count) : : "memory");
+  Result = (Count == 0) && (Dest == (UINT8 *)Copy + EFI_PAGE_SIZE);
+  for (Index = 0; Index < EFI_PAGE_SIZE / sizeof (UINT64); Index++) {
+    Result &= Copy[Index] == Buffer[Index];
+  }
+
+  LogResult ("rep movsb", Result);
 
-#define GEN_TEST_PERF_LOAD(x)                               \
-  STATIC                                                    \
-  NO_INLINE                                                 \
-  UINT64                                                    \
-  TestPerfLoad##x (                                         \
-    IN  UINT64   *TestArray,                                \
-    IN  UINTN    ArrayLen,                                  \
-    IN  volatile BOOLEAN *IsDone                            \
-    )                                                       \
-  {                                                         \
-    UINT64 Result;                                          \
-                                                            \
-    Result = 0;                                             \
-    while (!*IsDone) {                                      \
-      Result += *(UINT##x *) &TestArray[Result % ArrayLen]; \
-    }                                                       \
-                                                            \
-    return Result;                                          \
+  Dest  = (UINT8 *)Copy;
+  Count = EFI_PAGE_SIZE / sizeof (UINT64);
+  Value = ARG_VAL (5);
+  asm volatile ("rep stosq" : "+D" (Dest), "+c" (Count) : "a" (Value) : "memory");
+  Result = (Count == 0);
+  for (Index = 0; Index < EFI_PAGE_SIZE / sizeof (UINT64); Index++) {
+    Result &= Copy[Index] == ARG_VAL (5);
   }
-GEN_TEST_PERF_LOAD (64)
-GEN_TEST_PERF_LOAD (32)
-GEN_TEST_PERF_LOAD (16)
-GEN_TEST_PERF_LOAD (8)
-#undef GEN_TEST_PERF_LOAD
 
-#define GEN_TEST_PERF_STORE(x)                        \
-  STATIC                                              \
-  NO_INLINE                                           \
-  UINT##x                                             \
-  TestPerfStore##x (                                  \
-    IN  UINT64   *TestArray,                          \
-    IN  UINTN    ArrayLen,                            \
-    IN  volatile BOOLEAN *IsDone                      \
-    )                                                 \
-  {                                                   \
-    UINT64 Result;                                    \
-                                                      \
-    Result = 0;                                       \
-    while (!*IsDone) {                                \
-      *(UINT##x *) &TestArray[Result % ArrayLen] = 1; \
-      Result++;                                       \
-    }                                                 \
-                                                      \
-    return Result;                                    \
+  LogResult ("rep stosq", Result);
+
+  /*
+   * Overlapping forward copy, replicating the first byte.
+   */
+  Dest    = (UINT8 *)Copy + 1;
+  Source  = (UINT8 *)Copy;
+  Count   = EFI_PAGE_SIZE - 1;
+  *Source = 0xA5;
+  asm volatile ("rep movsb" : "+D" (Dest), "+S" (Source), "+c" (Count) : : "memory");
+  Result = TRUE;
+  for (Index = 0; Index < EFI_PAGE_SIZE; Index++) {
+    Result &= ((UINT8 *)Copy)[Index] == 0xA5;
   }
-GEN_TEST_PERF_STORE (64)
-GEN_TEST_PERF_STORE (32)
-GEN_TEST_PERF_STORE (16)
-GEN_TEST_PERF_STORE (8)
-#undef GEN_TEST_PERF_STORE
 
+  LogResult ("rep movsb overlapping", Result);
+  FreePool (Buffer);
+}
+
+/*
+ * When emulated, checks that writes to port 0x80 are done as
+ * native delays, that port 0x61 reads see the refresh toggle flip,
+ * and that a PIT channel 2 one-shot takes as long as programmed.
+ */
 STATIC
-NO_INLINE
 VOID
-TestPerf (
+TestPioDelay (
   VOID
   )
 {
-  UINT64            Result;
-  EFI_STATUS        Status;
-  EFI_EVENT         OneShotTimer;
-  volatile BOOLEAN  IsDone;
-  UINTN             Index;
+  EFI_STATUS            Status;
+  UINTN                 Size;
+  UINTN                 Index;
+  UINT8                 First;
+  UINT8                 Value;
+  EMU_TEST_DEBUG_STATE  Before;
+  EMU_TEST_DEBUG_STATE  After;
+  BOOLEAN               Result;
+
+  if ((mTest == NULL) ||
+      (mBeginDebugState.HostMachineType == mBeginDebugState.CallerMachineType) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_PIO_DELAY) == 0))
+  {
+    return;
+  }
 
-  DEBUG ((DEBUG_INFO, "Doing perf tests...\n"));
+  /*
+   * PioRazWi may make the timing ports RAZ/WI.
+   */
+  Size   = 0;
+  Status = gRT->GetVariable (L"PioRazWi", &mEmuVariableGuid, NULL, &Size, NULL);
+  if (Status != EFI_NOT_FOUND) {
+    DEBUG ((DEBUG_INFO, "PioRazWi set, skipping port I/O delay tests\n"));
+    return;
+  }
 
-  Status = gBS->CreateEventEx (
-                  EVT_TIMER | EVT_NOTIFY_SIGNAL, // Type
-                  TPL_CALLBACK,                  // NotifyTpl
-                  TestTimerHandler,              // NotifyFunction
-                  (VOID *)&IsDone,               // NotifyContext
-                  NULL,                          // No group
-                  &OneShotTimer                  // Event
-                  );
-  ASSERT_EFI_ERROR (Status);
+  mTest->TestGetDebugState (&Before);
+  for (Index = 0; Index < TEST_PIO_DELAYS; Index++) {
+    asm volatile ("outb %0, $0x80" : : "a" ((UINT8)Index));
+  }
 
-  #define PREP()  do {                          \
-    IsDone = 0;                                 \
-    Status = gBS->SetTimer (                    \
-      OneShotTimer,                             \
-      TimerRelative,                            \
-      EFI_TIMER_PERIOD_SECONDS (1)              \
-      );                                        \
-    ASSERT_EFI_ERROR (Status);                  \
-  } while (0)
-
-  #define PTEST(x)  do {                        \
-    PREP();                                     \
-    DEBUG ((DEBUG_INFO, #x " loops %u\n",       \
-            TestPerf##x (&IsDone)));            \
-  } while (0)
-
-  PTEST (Empty);
-  PTEST (MyCall);
-  PTEST (NativeCall);
+  mTest->TestGetDebugState (&After);
+  LogResult (
+    "port 0x80 writes done as delays",
+    (After.PioDelayOps == Before.PioDelayOps + TEST_PIO_DELAYS) &&
+    (After.PioRazWiOps == Before.PioRazWiOps)
+    );
+
+  asm volatile ("inb $0x61, %0" : "=a" (First));
+  Value = First;
+  for (Index = 0; Index < TEST_PIO_DELAYS * 100; Index++) {
+    asm volatile ("inb $0x61, %0" : "=a" (Value));
+    if (((Value ^ First) & BIT4) != 0) {
+      break;
+    }
 
-  for (Index = 0; Index < ARRAY_SIZE (TestArray); Index++) {
-    TestArray[Index] = 1;
+    gBS->Stall (1);
   }
 
-  #undef PTEST
-  #define PTEST(x)  do {                                                \
-    PREP();                                                             \
-    DEBUG ((DEBUG_INFO, #x " loops %u\n",                               \
-            TestPerf##x (TestArray, ARRAY_SIZE (TestArray), &IsDone))); \
-  } while (0)
+  LogResult ("port 0x61 refresh toggle", ((Value ^ First) & BIT4) != 0);
 
-  PTEST (Load64);
-  PTEST (Load32);
-  PTEST (Load16);
-  PTEST (Load8);
-
-  PTEST (Store64);
-  PTEST (Store32);
-  PTEST (Store16);
-  PTEST (Store8);
+  /*
+   * Gate on, speaker off, channel 2 mode 0 with an LSB/MSB count.
+   * The output stays low for the count, then goes high.
+   */
+  asm volatile ("outb %0, $0x61" : : "a" ((UINT8)((First & ~BIT1) | BIT0)));
+  asm volatile ("outb %0, $0x43" : : "a" ((UINT8)0xB0));
+  asm volatile ("outb %0, $0x42" : : "a" ((UINT8)TEST_PIT_COUNT));
+  asm volatile ("outb %0, $0x42" : : "a" ((UINT8)(TEST_PIT_COUNT >> 8)));
+  asm volatile ("inb $0x61, %0" : "=a" (Value));
+  Result = (Value & BIT5) == 0;
+  gBS->Stall (TEST_PIT_US / 2);
+  asm volatile ("inb $0x61, %0" : "=a" (Value));
+  Result &= (Value & BIT5) == 0;
+  for (Index = 0; Index < TEST_PIT_US / 100 * 10; Index++) {
+    asm volatile ("inb $0x61, %0" : "=a" (Value));
+    if ((Value & BIT5) != 0) {
+      break;
+    }
 
-  #undef PTEST
+    gBS->Stall (100);
+  }
 
-  LogResult ("TestPerf", TRUE);
-  gBS->CloseEvent (OneShotTimer);
+  Result &= (Value & BIT5) != 0;
+  asm volatile ("outb %0, $0x61" : : "a" (First));
+  LogResult ("PIT channel 2 one-shot", Result);
 }
 
+#endif /* MDE_CPU_X64 */
+
+/*
+ * Needs MockPciDevice loaded and SyntheticOpRom
+ * started on it (see Docs/Running.md).
+ */
 STATIC
-NO_INLINE
 VOID
-TestTimer (
-  BOOLEAN  WithCpuSleep
+TestSyntheticOpRom (
+  VOID
   )
 {
-  EFI_STATUS        Status;
-  EFI_EVENT         OneShotTimer;
-  volatile BOOLEAN  IsDone = FALSE;
-
-  Status = gBS->CreateEvent (
-                  EVT_TIMER | EVT_NOTIFY_SIGNAL, // Type
-                  TPL_CALLBACK,                  // NotifyTpl
-                  TestTimerHandler,              // NotifyFunction
-                  (VOID *)&IsDone,               // NotifyContext
-                  &OneShotTimer                  // Event
-                  );
-  ASSERT_EFI_ERROR (Status);
-
-  Status = gBS->SetTimer (
-                  OneShotTimer,
-                  TimerRelative,
-                  EFI_TIMER_PERIOD_SECONDS (1)
+  EFI_STATUS                Status;
+  SYNTHETIC_OPROM_PROTOCOL  *OpRom;
+  EMU_TEST_DEBUG_STATE      Before;
+  EMU_TEST_DEBUG_STATE      After;
+
+  Status = gBS->LocateProtocol (
+                  &mSyntheticOpRomProtocolGuid,
+                  NULL,
+                  (VOID **)&OpRom
                   );
-  ASSERT_EFI_ERROR (Status);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "No SyntheticOpRom, skipping PCI driver tests\n"));
+    return;
+  }
 
-  while (!IsDone) {
-    if (WithCpuSleep) {
-      CpuSleep ();
-    }
+  if (mTest != NULL) {
+    mTest->TestGetDebugState (&Before);
   }
 
-  if (WithCpuSleep) {
-    LogResult ("CpuSleep loop + timer", TRUE);
-  } else {
-    LogResult ("Tight loop + timer", TRUE);
+  Status = OpRom->Transfer (OpRom, TEST_OPROM_TRANSFERS);
+  LogResult ("SyntheticOpRom transfers", !EFI_ERROR (Status));
+  if (mTest == NULL) {
+    return;
   }
 
-  gBS->CloseEvent (OneShotTimer);
+  /*
+   * MockPciDevice register accesses have side effects (e.g. starting
+   * DMA), so must go to its PciIo rather than to CpuIo2.
+   */
+  mTest->TestGetDebugState (&After);
+  LogResult (
+    "PciIo fast path skips MockPciDevice",
+    After.PciIoShadowCalls == Before.PciIoShadowCalls
+    );
 }
 
-#ifdef MDE_CPU_X64
+/*
+ * Returns TRUE if the image isn't for the host machine type.
+ */
 STATIC
-NO_INLINE
-UINT64
-EFIAPI
-SelfModCodeFn (
-  IN  UINTN  Input
+BOOLEAN
+TestIsEmulatedImage (
+  IN  EFI_HANDLE  ImageHandle
   )
 {
-  static UINTN  Value = 0;
+  EFI_STATUS                 Status;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  EFI_IMAGE_DOS_HEADER       *DosHdr;
+  EFI_IMAGE_NT_HEADERS64     *Hdr;
+
+  Status = gBS->HandleProtocol (
+                  ImageHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
 
-  return Value++;
-}
+  DosHdr = LoadedImage->ImageBase;
+  Hdr    = LoadedImage->ImageBase;
+  if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE) {
+    Hdr = (VOID *)((UINT8 *)DosHdr + DosHdr->e_lfanew);
+  }
 
-#endif /* MDE_CPU_X64 */
+  return (Hdr->Signature == EFI_IMAGE_NT_SIGNATURE) &&
+         (Hdr->FileHeader.Machine != mBeginDebugState.HostMachineType);
+}
 
+/*
+ * Calls the DriverBinding Supported of an emulated SyntheticOpRom
+ * for a scratch controller without PciIo, which must be emulated
+ * once, then answered from the cache until the controller changes.
+ */
 STATIC
-NO_INLINE
 VOID
-TestSelfModCode (
+TestSupportedCache (
   VOID
   )
 {
- #ifdef MDE_CPU_X64
-  UINTN  Index;
+  EFI_STATUS                           Status;
+  EFI_HANDLE                           *Handles;
+  UINTN                                HandleCount;
+  EFI_OPEN_PROTOCOL_INFORMATION_ENTRY  *Info;
+  UINTN                                InfoCount;
+  UINTN                                Index;
+  EFI_HANDLE                           Agent;
+  EFI_HANDLE                           Controller;
+  EFI_DRIVER_BINDING_PROTOCOL          *Binding;
+  EMU_TEST_DEBUG_STATE                 Before;
+  EMU_TEST_DEBUG_STATE                 After;
+  BOOLEAN                              Result;
+
+  if ((mTest == NULL) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_SUPPORTED_CACHE) == 0))
+  {
+    return;
+  }
 
-  /*
-   *  mov    rax,rcx; ret
-   */
-  static UINT8  Patch1[] = { 0x48, 0x89, 0xC8, 0xC3 };
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &mSyntheticOpRomProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status)) {
+    return;
+  }
 
-  /*
-   *  mov    rax,0xfeed; ret
-   */
-  static UINT8  Patch2[] = { 0x48, 0xC7, 0xC0, 0xED, 0xFE, 0x00, 0x00, 0xC3 };
+  Agent  = NULL;
+  Status = gBS->OpenProtocolInformation (
+                  Handles[0],
+                  &gEfiPciIoProtocolGuid,
+                  &Info,
+                  &InfoCount
+                  );
+  FreePool (Handles);
+  if (!EFI_ERROR (Status)) {
+    for (Index = 0; Index < InfoCount; Index++) {
+      if ((Info[Index].Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) != 0) {
+        Agent = Info[Index].AgentHandle;
+      }
+    }
 
-  LogResult ("Self-modifying code test before", SelfModCodeFn (0x1337) == 0);
+    FreePool (Info);
+  }
 
-  for (Index = 0; Index < sizeof (Patch1); Index++) {
-    ((UINT8 *)SelfModCodeFn)[Index] = Patch1[Index];
-    asm volatile ("" : : : "memory");
+  if ((Agent == NULL) || !TestIsEmulatedImage (Agent)) {
+    DEBUG ((DEBUG_INFO, "SyntheticOpRom not emulated, skipping Supported cache tests\n"));
+    return;
   }
 
-  LogResult ("Self-modifying code test after 1", SelfModCodeFn (0xf00d) == 0xf00d);
+  Status = gBS->HandleProtocol (
+                  Agent,
+                  &gEfiDriverBindingProtocolGuid,
+                  (VOID **)&Binding
+                  );
+  if (EFI_ERROR (Status)) {
+    LogResult ("SyntheticOpRom DriverBinding", FALSE);
+    return;
+  }
 
-  for (Index = 0; Index < sizeof (Patch2); Index++) {
-    ((UINT8 *)SelfModCodeFn)[Index] = Patch2[Index];
-    asm volatile ("" : : : "memory");
+  Controller = NULL;
+  Status     = gBS->InstallProtocolInterface (
+                      &Controller,
+                      &mTestScratchProtocolGuids[0],
+                      EFI_NATIVE_INTERFACE,
+                      NULL
+                      );
+  if (EFI_ERROR (Status)) {
+    LogResult ("Supported cache scratch controller", FALSE);
+    return;
   }
 
-  LogResult ("Self-modifying code test after 2", SelfModCodeFn (0xf00d) == 0xfeed);
+  mTest->TestGetDebugState (&Before);
+  Result  = Binding->Supported (Binding, Controller, NULL) == EFI_UNSUPPORTED;
+  Result &= Binding->Supported (Binding, Controller, NULL) == EFI_UNSUPPORTED;
+  mTest->TestGetDebugState (&After);
+  Result &= (After.SupportedEmulated == Before.SupportedEmulated + 1) &&
+            (After.SupportedCacheHits == Before.SupportedCacheHits + 1);
+  LogResult ("Supported EFI_UNSUPPORTED cached", Result);
+
+  Before = After;
+  Status = gBS->InstallProtocolInterface (
+                  &Controller,
+                  &mTestScratchProtocolGuids[1],
+                  EFI_NATIVE_INTERFACE,
+                  NULL
+                  );
+  Result = !EFI_ERROR (Status) &&
+           (Binding->Supported (Binding, Controller, NULL) == EFI_UNSUPPORTED);
+  mTest->TestGetDebugState (&After);
+  Result &= (After.SupportedEmulated == Before.SupportedEmulated + 1) &&
+            (After.SupportedCacheHits == Before.SupportedCacheHits);
+  LogResult ("Supported cache invalidated by protocol install", Result);
+
+  if (!EFI_ERROR (Status)) {
+    gBS->UninstallProtocolInterface (Controller, &mTestScratchProtocolGuids[1], NULL);
+  }
 
-  /*
-   * TODO:
-   * - test binary patching at a page boundary.
-   * - test binary patching using gBS->CopyMem.
-   * - test running code from a BootServiceCode pool alloc.
-   * - add AArch64 and RISC-V variants.
-   */
- #endif /* MDE_CPU_X64 */
+  gBS->UninstallProtocolInterface (Controller, &mTestScratchProtocolGuids[0], NULL);
 }
 
+STATIC EFI_GRAPHICS_OUTPUT_MODE_INFORMATION  mTestGopInfo;
+STATIC EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE     mTestGopMode;
+STATIC EFI_GRAPHICS_OUTPUT_PROTOCOL          mTestGop;
+
+/*
+ * Including overlapping video to video copies in every direction.
+ */
+STATIC CONST TEST_GOP_BLT  mTestGopBlts[] = {
+  { EfiBltVideoFill,        0,  0,  3,  2,  10, 5  },
+  { EfiBltBufferToVideo,    1,  1,  20, 10, 8,  6  },
+  { EfiBltVideoToBltBuffer, 5,  5,  2,  3,  6,  4  },
+  { EfiBltVideoToVideo,     0,  0,  2,  3,  20, 10 },
+  { EfiBltVideoToVideo,     4,  6,  3,  2,  20, 10 },
+  { EfiBltVideoToVideo,     0,  8,  5,  8,  25, 3  },
+  { EfiBltVideoToVideo,     10, 12, 7,  12, 25, 3  },
+  { EfiBltVideoToVideo,     1,  1,  39, 23, 1,  1  },
+};
+
+STATIC
 EFI_STATUS
 EFIAPI
-EmulatorTestEntryPoint (
-  IN  EFI_HANDLE        ImageHandle,
-  IN  EFI_SYSTEM_TABLE  *SystemTable
+TestGopQueryMode (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL          *This,
+  IN  UINT32                                ModeNumber,
+  OUT UINTN                                 *SizeOfInfo,
+  OUT EFI_GRAPHICS_OUTPUT_MODE_INFORMATION  **Info
   )
 {
-  gBS->LocateProtocol (&mEmuTestProtocolGuid, NULL, (VOID **)&mTest);
-  if (mTest == NULL) {
-    DEBUG ((DEBUG_ERROR, "EMU_TEST_PROTOCOL is missing\n"));
-  } else {
-    mTest->TestGetDebugState (&mBeginDebugState);
-    DEBUG ((DEBUG_INFO, "Initial %lu contexts\n", mBeginDebugState.ContextCount));
-    DoTestProtocolTests (mTest);
+  return EFI_UNSUPPORTED;
+}
 
-    if (mBeginDebugState.HostMachineType !=
-        mBeginDebugState.CallerMachineType)
-    {
-      /*
-       * Only run these tests if we know we are being emulated.
-       */
-      TestNullCall ();
-      TestNullCall2 ();
-      TestNullDeref ();
-    }
+STATIC
+EFI_STATUS
+EFIAPI
+TestGopSetMode (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL  *This,
+  IN  UINT32                        ModeNumber
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+/*
+ * Reference Blt, pixel by pixel. Requests are assumed valid.
+ */
+STATIC
+EFI_STATUS
+EFIAPI
+TestGopBltEmulated (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL       *This,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_PIXEL      *BltBuffer OPTIONAL,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_OPERATION  BltOperation,
+  IN  UINTN                              SourceX,
+  IN  UINTN                              SourceY,
+  IN  UINTN                              DestinationX,
+  IN  UINTN                              DestinationY,
+  IN  UINTN                              Width,
+  IN  UINTN                              Height,
+  IN  UINTN                              Delta OPTIONAL
+  )
+{
+  UINT32  *FrameBuffer;
+  UINT32  *Buffer;
+  UINT32  *Copy;
+  UINTN   Stride;
+  UINTN   X;
+  UINTN   Y;
+
+  FrameBuffer = (UINT32 *)(UINTN)This->Mode->FrameBufferBase;
+  Stride      = This->Mode->Info->PixelsPerScanLine;
+  Buffer      = (UINT32 *)BltBuffer;
+  if (Delta == 0) {
+    Delta = Width * sizeof (UINT32);
   }
 
-  TestSelfModCode ();
-  TestCpuSleep ();
-  TestTimer (FALSE);
-  TestTimer (TRUE);
-  TestPerf ();
-  DEBUG ((DEBUG_INFO, "Tests completed!\n"));
+  Delta /= sizeof (UINT32);
 
-  if (mTest != NULL) {
+  switch (BltOperation) {
+    case EfiBltVideoFill:
+      for (Y = 0; Y < Height; Y++) {
+        for (X = 0; X < Width; X++) {
+          FrameBuffer[(DestinationY + Y) * Stride + DestinationX + X] = Buffer[0];
+        }
+      }
+
+      break;
+    case EfiBltVideoToBltBuffer:
+      for (Y = 0; Y < Height; Y++) {
+        for (X = 0; X < Width; X++) {
+          Buffer[(DestinationY + Y) * Delta + DestinationX + X] =
+            FrameBuffer[(SourceY + Y) * Stride + SourceX + X];
+        }
+      }
+
+      break;
+    case EfiBltBufferToVideo:
+      for (Y = 0; Y < Height; Y++) {
+        for (X = 0; X < Width; X++) {
+          FrameBuffer[(DestinationY + Y) * Stride + DestinationX + X] =
+            Buffer[(SourceY + Y) * Delta + SourceX + X];
+        }
+      }
+
+      break;
+    case EfiBltVideoToVideo:
+      Copy = AllocatePool (Width * Height * sizeof (UINT32));
+      if (Copy == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+      }
+
+      for (Y = 0; Y < Height; Y++) {
+        for (X = 0; X < Width; X++) {
+          Copy[Y * Width + X] = FrameBuffer[(SourceY + Y) * Stride + SourceX + X];
+        }
+      }
+
+      for (Y = 0; Y < Height; Y++) {
+        for (X = 0; X < Width; X++) {
+          FrameBuffer[(DestinationY + Y) * Stride + DestinationX + X] = Copy[Y * Width + X];
+        }
+      }
+
+      FreePool (Copy);
+      break;
+    default:
+      return EFI_INVALID_PARAMETER;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Does mTestGopBlts on a freshly patterned FrameBuffer and BltBuffer,
+ * via mTestGop.Blt or directly via TestGopBltEmulated.
+ */
+STATIC
+BOOLEAN
+TestGopBltRun (
+  IN  BOOLEAN  ViaProtocol,
+  IN  UINT32   *FrameBuffer,
+  IN  UINT32   *BltBuffer
+  )
+{
+  EFI_STATUS          Status;
+  UINTN               Index;
+  CONST TEST_GOP_BLT  *Blt;
+
+  for (Index = 0; Index < TEST_GOP_STRIDE * TEST_GOP_HEIGHT; Index++) {
+    FrameBuffer[Index] = (UINT32)Index * 0x00010203;
+  }
+
+  for (Index = 0; Index < TEST_GOP_BUFFER * TEST_GOP_BUFFER; Index++) {
+    BltBuffer[Index] = ~((UINT32)Index * 0x00030201);
+  }
+
+  mTestGopMode.FrameBufferBase = (UINTN)FrameBuffer;
+  for (Index = 0; Index < ARRAY_SIZE (mTestGopBlts); Index++) {
+    Blt = &mTestGopBlts[Index];
+    if (ViaProtocol) {
+      Status = mTestGop.Blt (
+                          &mTestGop,
+                          (VOID *)BltBuffer,
+                          Blt->Operation,
+                          Blt->SourceX,
+                          Blt->SourceY,
+                          Blt->DestinationX,
+                          Blt->DestinationY,
+                          Blt->Width,
+                          Blt->Height,
+                          TEST_GOP_BUFFER * sizeof (UINT32)
+                          );
+    } else {
+      Status = TestGopBltEmulated (
+                 &mTestGop,
+                 (VOID *)BltBuffer,
+                 Blt->Operation,
+                 Blt->SourceX,
+                 Blt->SourceY,
+                 Blt->DestinationX,
+                 Blt->DestinationY,
+                 Blt->Width,
+                 Blt->Height,
+                 TEST_GOP_BUFFER * sizeof (UINT32)
+                 );
+    }
+
+    if (EFI_ERROR (Status)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/*
+ * When emulated, installs a GOP with a 32bpp BGRX framebuffer,
+ * getting its Blt replaced with a native one. Both must leave
+ * the framebuffer and BltBuffer the same.
+ */
+STATIC
+VOID
+TestGopBlt (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  EFI_HANDLE            Handle;
+  UINT32                *Buffers;
+  UINT32                *FrameBuffers[2];
+  UINT32                *BltBuffers[2];
+  UINTN                 FrameBufferSize;
+  UINTN                 BltBufferSize;
+  EMU_TEST_DEBUG_STATE  Before;
+  EMU_TEST_DEBUG_STATE  After;
+  BOOLEAN               Result;
+
+  if ((mTest == NULL) ||
+      (mBeginDebugState.HostMachineType == mBeginDebugState.CallerMachineType) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_GOP_BLT) == 0))
+  {
+    return;
+  }
+
+  FrameBufferSize = TEST_GOP_STRIDE * TEST_GOP_HEIGHT * sizeof (UINT32);
+  BltBufferSize   = TEST_GOP_BUFFER * TEST_GOP_BUFFER * sizeof (UINT32);
+  Buffers         = AllocatePool ((FrameBufferSize + BltBufferSize) * 2);
+  if (Buffers == NULL) {
+    LogResult ("GOP Blt buffers", FALSE);
+    return;
+  }
+
+  FrameBuffers[0] = Buffers;
+  FrameBuffers[1] = (UINT32 *)((UINT8 *)FrameBuffers[0] + FrameBufferSize);
+  BltBuffers[0]   = (UINT32 *)((UINT8 *)FrameBuffers[1] + FrameBufferSize);
+  BltBuffers[1]   = (UINT32 *)((UINT8 *)BltBuffers[0] + BltBufferSize);
+
+  mTestGopInfo.Version              = 0;
+  mTestGopInfo.HorizontalResolution = TEST_GOP_WIDTH;
+  mTestGopInfo.VerticalResolution   = TEST_GOP_HEIGHT;
+  mTestGopInfo.PixelFormat          = PixelBlueGreenRedReserved8BitPerColor;
+  mTestGopInfo.PixelsPerScanLine    = TEST_GOP_STRIDE;
+  mTestGopMode.MaxMode              = 1;
+  mTestGopMode.Mode                 = 0;
+  mTestGopMode.Info                 = &mTestGopInfo;
+  mTestGopMode.SizeOfInfo           = sizeof (mTestGopInfo);
+  mTestGopMode.FrameBufferBase      = (UINTN)FrameBuffers[0];
+  mTestGopMode.FrameBufferSize      = FrameBufferSize;
+  mTestGop.QueryMode                = TestGopQueryMode;
+  mTestGop.SetMode                  = TestGopSetMode;
+  mTestGop.Blt                      = TestGopBltEmulated;
+  mTestGop.Mode                     = &mTestGopMode;
+
+  /*
+   * No device path, so no console driver will start on it.
+   */
+  Handle = NULL;
+  Status = gBS->InstallProtocolInterface (
+                  &Handle,
+                  &gEfiGraphicsOutputProtocolGuid,
+                  EFI_NATIVE_INTERFACE,
+                  &mTestGop
+                  );
+  if (EFI_ERROR (Status)) {
+    LogResult ("GOP Blt install", FALSE);
+    FreePool (Buffers);
+    return;
+  }
+
+  mTest->TestGetDebugState (&Before);
+  Result = TestGopBltRun (TRUE, FrameBuffers[0], BltBuffers[0]);
+  mTest->TestGetDebugState (&After);
+  Result &= TestGopBltRun (FALSE, FrameBuffers[1], BltBuffers[1]);
+  Result &= (After.GopBltNative == Before.GopBltNative + ARRAY_SIZE (mTestGopBlts)) &&
+            (After.GopBltEmulated == Before.GopBltEmulated);
+  Result &= CompareMem (FrameBuffers[0], FrameBuffers[1], FrameBufferSize) == 0;
+  Result &= CompareMem (BltBuffers[0], BltBuffers[1], BltBufferSize) == 0;
+  LogResult ("GOP Blt native matches emulated", Result);
+
+  gBS->UninstallProtocolInterface (Handle, &gEfiGraphicsOutputProtocolGuid, &mTestGop);
+  FreePool (Buffers);
+}
+
+STATIC EFI_SIMPLE_NETWORK_MODE      mTestSnpMode;
+STATIC EFI_SIMPLE_NETWORK_PROTOCOL  mTestSnp;
+STATIC CONST CHAR8                  mTestSnpPacket[] = "MAU SNP test packet";
+STATIC volatile BOOLEAN             mTestSnpRxPending;
+STATIC VOID                         *mTestSnpTxBuffer;
+
+STATIC
+EFI_STATUS
+EFIAPI
+TestSnpReceive (
+  IN     EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT    UINTN                        *HeaderSize OPTIONAL,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  OUT    EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  OUT    UINT16                       *Protocol OPTIONAL
+  )
+{
+  if (!mTestSnpRxPending) {
+    return EFI_NOT_READY;
+  }
+
+  if (*BufferSize < sizeof (mTestSnpPacket)) {
+    *BufferSize = sizeof (mTestSnpPacket);
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  CopyMem (Buffer, mTestSnpPacket, sizeof (mTestSnpPacket));
+  *BufferSize       = sizeof (mTestSnpPacket);
+  mTestSnpRxPending = FALSE;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+TestSnpTransmit (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  IN  UINTN                        HeaderSize,
+  IN  UINTN                        BufferSize,
+  IN  VOID                         *Buffer,
+  IN  EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  IN  EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  IN  UINT16                       *Protocol OPTIONAL
+  )
+{
+  mTestSnpTxBuffer = Buffer;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+TestSnpGetStatus (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT UINT32                       *InterruptStatus OPTIONAL,
+  OUT VOID                         **TxBuf OPTIONAL
+  )
+{
+  if (InterruptStatus != NULL) {
+    *InterruptStatus = 0;
+  }
+
+  if (TxBuf != NULL) {
+    *TxBuf           = mTestSnpTxBuffer;
+    mTestSnpTxBuffer = NULL;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * When emulated, installs an SNP getting Receive, Transmit and
+ * GetStatus replaced with native ones. Idle polling must make
+ * Receive back off, yet a packet arriving meanwhile must still
+ * be received, and transmit buffers must still be recycled.
+ */
+STATIC
+VOID
+TestSnpThrottle (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  EFI_HANDLE            Handle;
+  UINTN                 Index;
+  UINTN                 BufferSize;
+  CHAR8                 Buffer[sizeof (mTestSnpPacket)];
+  VOID                  *TxBuf;
+  EMU_TEST_DEBUG_STATE  Before;
+  EMU_TEST_DEBUG_STATE  After;
+  BOOLEAN               Result;
+
+  if ((mTest == NULL) ||
+      (mBeginDebugState.HostMachineType == mBeginDebugState.CallerMachineType) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_SNP_THROTTLE) == 0))
+  {
+    return;
+  }
+
+  mTestSnp.Revision  = EFI_SIMPLE_NETWORK_PROTOCOL_REVISION;
+  mTestSnp.Receive   = TestSnpReceive;
+  mTestSnp.Transmit  = TestSnpTransmit;
+  mTestSnp.GetStatus = TestSnpGetStatus;
+  mTestSnp.Mode      = &mTestSnpMode;
+  mTestSnpRxPending  = FALSE;
+  mTestSnpTxBuffer   = NULL;
+
+  /*
+   * No device path, so no network stack will start on it.
+   */
+  Handle = NULL;
+  Status = gBS->InstallProtocolInterface (
+                  &Handle,
+                  &gEfiSimpleNetworkProtocolGuid,
+                  EFI_NATIVE_INTERFACE,
+                  &mTestSnp
+                  );
+  if (EFI_ERROR (Status)) {
+    LogResult ("SNP install", FALSE);
+    return;
+  }
+
+  mTest->TestGetDebugState (&Before);
+  for (Index = 0; Index < TEST_SNP_IDLE_POLLS; Index++) {
+    BufferSize = sizeof (Buffer);
+    Status     = mTestSnp.Receive (&mTestSnp, NULL, &BufferSize, Buffer, NULL, NULL, NULL);
+    mTest->TestGetDebugState (&After);
+    if ((Status != EFI_NOT_READY) ||
+        (After.SnpPollsSkipped != Before.SnpPollsSkipped))
+    {
+      break;
+    }
+  }
+
+  Result = (Status == EFI_NOT_READY) &&
+           (After.SnpPollsSkipped != Before.SnpPollsSkipped);
+  LogResult ("SNP idle Receive backs off", Result);
+
+  mTestSnpRxPending = TRUE;
+  for (Index = 0; Index < TEST_SNP_WAIT_STEPS; Index++) {
+    BufferSize = sizeof (Buffer);
+    Status     = mTestSnp.Receive (&mTestSnp, NULL, &BufferSize, Buffer, NULL, NULL, NULL);
+    if (Status != EFI_NOT_READY) {
+      break;
+    }
+
+    gBS->Stall (100);
+  }
+
+  Result = !EFI_ERROR (Status) && (BufferSize == sizeof (mTestSnpPacket)) &&
+           (CompareMem (Buffer, mTestSnpPacket, sizeof (mTestSnpPacket)) == 0);
+  LogResult ("SNP packet received during backoff", Result);
+
+  mTest->TestGetDebugState (&Before);
+  TxBuf  = Buffer;
+  Status = mTestSnp.GetStatus (&mTestSnp, NULL, &TxBuf);
+  mTest->TestGetDebugState (&After);
+  Result = !EFI_ERROR (Status) && (TxBuf == NULL) &&
+           (After.SnpStatusSkipped == Before.SnpStatusSkipped + 1);
+  Status  = mTestSnp.Transmit (&mTestSnp, 0, sizeof (Buffer), Buffer, NULL, NULL, NULL);
+  Result &= !EFI_ERROR (Status);
+  TxBuf   = NULL;
+  Status  = mTestSnp.GetStatus (&mTestSnp, NULL, &TxBuf);
+  Result &= !EFI_ERROR (Status) && (TxBuf == Buffer);
+  LogResult ("SNP transmit buffer recycled", Result);
+
+  gBS->UninstallProtocolInterface (Handle, &gEfiSimpleNetworkProtocolGuid, &mTestSnp);
+}
+
+/*
+ * Loads another instance of EmulatorTest with the EmulatorDxe
+ * variable VariableName set to Value, and runs Options->Test in it.
+ * Returns EFI_ALREADY_STARTED if the variable is already set, as
+ * that's the user's configuration.
+ */
+STATIC
+EFI_STATUS
+TestReload (
+  IN  CONST CHAR16         *VariableName,
+  IN  CONST CHAR8          *Value,
+  IN  TEST_RELOAD_OPTIONS  *Options
+  )
+{
+  EFI_STATUS                 Status;
+  UINTN                      Size;
+  EFI_DEVICE_PATH_PROTOCOL   *DevicePath;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  EFI_HANDLE                 Handle;
+
+  Size   = 0;
+  Status = gRT->GetVariable (
+                  (CHAR16 *)VariableName,
+                  &mEmuVariableGuid,
+                  NULL,
+                  &Size,
+                  NULL
+                  );
+  if (Status != EFI_NOT_FOUND) {
+    DEBUG ((DEBUG_INFO, "%s already set, skipping tests setting it\n", VariableName));
+    return EFI_ALREADY_STARTED;
+  }
+
+  Status = gBS->HandleProtocol (
+                  gImageHandle,
+                  &gEfiLoadedImageDevicePathProtocolGuid,
+                  (VOID **)&DevicePath
+                  );
+  if (EFI_ERROR (Status) || (DevicePath == NULL)) {
+    DEBUG ((DEBUG_INFO, "Not loaded from a device path, skipping tests setting %s\n", VariableName));
+    return EFI_ALREADY_STARTED;
+  }
+
+  Status = gRT->SetVariable (
+                  (CHAR16 *)VariableName,
+                  &mEmuVariableGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                  AsciiStrLen (Value),
+                  (VOID *)Value
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  /*
+   * The variable is read when LoadImage registers the image.
+   */
+  Handle = NULL;
+  Status = gBS->LoadImage (FALSE, gImageHandle, DevicePath, NULL, 0, &Handle);
+  gRT->SetVariable ((CHAR16 *)VariableName, &mEmuVariableGuid, 0, 0, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->HandleProtocol (
+                  Handle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->UnloadImage (Handle);
+    return Status;
+  }
+
+  Options->Signature           = TEST_RELOAD_SIGNATURE;
+  Options->LogResult           = LogResult;
+  LoadedImage->LoadOptions     = Options;
+  LoadedImage->LoadOptionsSize = sizeof (*Options);
+  return gBS->StartImage (Handle, NULL, NULL);
+}
+
+/*
+ * Run by an instance of EmulatorTest listed in LowMemImages.
+ */
+STATIC
+VOID
+TestLowMemReloaded (
+  IN  TEST_RELOAD_OPTIONS  *Options
+  )
+{
+  EFI_STATUS                Status;
+  VOID                      *Small;
+  VOID                      *Large;
+  EFI_PHYSICAL_ADDRESS      Pages;
+  EFI_HANDLE                *Handles;
+  UINTN                     HandleCount;
+  UINTN                     Index;
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  EFI_HANDLE                RootBridge;
+  EFI_PCI_IO_PROTOCOL       *PciIo;
+  UINT8                     *High;
+  UINTN                     Bytes;
+  EFI_PHYSICAL_ADDRESS      DeviceAddress;
+  VOID                      *Mapping;
+  EMU_TEST_DEBUG_STATE      Before;
+  EMU_TEST_DEBUG_STATE      After;
+  BOOLEAN                   Result;
+
+  mTest->TestGetDebugState (&Before);
+  Small  = AllocatePool (64);
+  Large  = AllocatePool (SIZE_64KB);
+  Status = gBS->AllocatePages (AllocateAnyPages, EfiBootServicesData, 4, &Pages);
+  mTest->TestGetDebugState (&After);
+  Result = (Small != NULL) && ((UINTN)Small + 64 <= BASE_4GB) &&
+           (Large != NULL) && ((UINTN)Large + SIZE_64KB <= BASE_4GB) &&
+           !EFI_ERROR (Status) && (Pages + EFI_PAGES_TO_SIZE (4) <= BASE_4GB) &&
+           (After.LowMemAllocations >= Before.LowMemAllocations + 2);
+  Options->LogResult ("LowMem allocations below 4GiB", Result);
+
+  if (Small != NULL) {
+    FreePool (Small);
+  }
+
+  if (Large != NULL) {
+    FreePool (Large);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    gBS->FreePages (Pages, 4);
+  }
+
+  if (Options->HighBuffer == NULL) {
+    DEBUG ((DEBUG_INFO, "No memory above 4GiB, skipping LowMem bounce tests\n"));
+    return;
+  }
+
+  /*
+   * Only PciIo produced by PciBusDxe, under a root bridge, is bounced.
+   */
+  PciIo  = NULL;
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiPciIoProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (!EFI_ERROR (Status)) {
+    for (Index = 0; Index < HandleCount; Index++) {
+      Status = gBS->HandleProtocol (
+                      Handles[Index],
+                      &gEfiDevicePathProtocolGuid,
+                      (VOID **)&DevicePath
+                      );
+      if (EFI_ERROR (Status) ||
+          EFI_ERROR (gBS->LocateDevicePath (&gEfiPciRootBridgeIoProtocolGuid, &DevicePath, &RootBridge)))
+      {
+        continue;
+      }
+
+      gBS->HandleProtocol (Handles[Index], &gEfiPciIoProtocolGuid, (VOID **)&PciIo);
+      break;
+    }
+
+    FreePool (Handles);
+  }
+
+  if (PciIo == NULL) {
+    DEBUG ((DEBUG_INFO, "No PCI devices, skipping LowMem bounce tests\n"));
+    return;
+  }
+
+  High = Options->HighBuffer;
+  for (Index = 0; Index < Options->HighSize; Index++) {
+    High[Index] = (UINT8)(Index * 7 + 1);
+  }
+
+  mTest->TestGetDebugState (&Before);
+  Bytes  = Options->HighSize;
+  Status = PciIo->Map (
+                    PciIo,
+                    EfiPciIoOperationBusMasterRead,
+                    High,
+                    &Bytes,
+                    &DeviceAddress,
+                    &Mapping
+                    );
+  Result = !EFI_ERROR (Status) && (Bytes == Options->HighSize) &&
+           (DeviceAddress + Bytes <= BASE_4GB);
+  if (!EFI_ERROR (Status)) {
+    PciIo->Unmap (PciIo, Mapping);
+  }
+
+  /*
+   * The bounce buffer, still holding what was copied in for
+   * the bus master read, is reused for the bus master write,
+   * and must be copied back on Unmap.
+   */
+  ZeroMem (High, Options->HighSize);
+  Bytes  = Options->HighSize;
+  Status = PciIo->Map (
+                    PciIo,
+                    EfiPciIoOperationBusMasterWrite,
+                    High,
+                    &Bytes,
+                    &DeviceAddress,
+                    &Mapping
+                    );
+  Result &= !EFI_ERROR (Status) && (Bytes == Options->HighSize) &&
+            (DeviceAddress + Bytes <= BASE_4GB);
+  if (!EFI_ERROR (Status)) {
+    PciIo->Unmap (PciIo, Mapping);
+  }
+
+  mTest->TestGetDebugState (&After);
+  for (Index = 0; Index < Options->HighSize; Index++) {
+    Result &= High[Index] == (UINT8)(Index * 7 + 1);
+  }
+
+  Result &= After.LowMemBounceReused > Before.LowMemBounceReused;
+  Options->LogResult ("LowMem bounce Map/Unmap keeps data", Result);
+}
+
+/*
+ * Run by an instance of EmulatorTest loaded with its own CopyMem
+ * and CompareMem in HleSignatures, so these are native.
+ */
+STATIC
+VOID
+TestHleReloaded (
+  IN  TEST_RELOAD_OPTIONS  *Options
+  )
+{
+  UINT8    Source[256];
+  UINT8    Buffer[256];
+  UINTN    Index;
+  BOOLEAN  Result;
+
+  for (Index = 0; Index < sizeof (Source); Index++) {
+    Source[Index] = (UINT8)Index;
+  }
+
+  /*
+   * Overlapping copies in both directions.
+   */
+  CopyMem (Buffer, Source, sizeof (Buffer));
+  CopyMem (Buffer + 1, Buffer, 128);
+  Result = Buffer[0] == 0;
+  for (Index = 1; Index < sizeof (Buffer); Index++) {
+    Result &= Buffer[Index] == (UINT8)(Index <= 128 ? Index - 1 : Index);
+  }
+
+  CopyMem (Buffer, Buffer + 1, 128);
+  for (Index = 0; Index < sizeof (Buffer); Index++) {
+    Result &= Buffer[Index] == (UINT8)(Index == 128 ? 127 : Index);
+  }
+
+  Result &= CompareMem (Buffer, Source, 128) == 0;
+  Result &= CompareMem (Buffer, Source, sizeof (Buffer)) < 0;
+  Result &= CompareMem (Source, Buffer, sizeof (Buffer)) > 0;
+  Options->LogResult ("HLE CopyMem and CompareMem results", Result);
+}
+
+/*
+ * Returns TRUE if loaded by TestReload, after having run the test.
+ */
+STATIC
+BOOLEAN
+TestReloadEntry (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  TEST_RELOAD_OPTIONS        *Options;
+
+  Status = gBS->HandleProtocol (
+                  ImageHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status) ||
+      (LoadedImage->LoadOptionsSize != sizeof (TEST_RELOAD_OPTIONS)))
+  {
+    return FALSE;
+  }
+
+  Options = LoadedImage->LoadOptions;
+  if (Options->Signature != TEST_RELOAD_SIGNATURE) {
+    return FALSE;
+  }
+
+  gBS->LocateProtocol (&mEmuTestProtocolGuid, NULL, (VOID **)&mTest);
+  if (mTest == NULL) {
+    Options->LogResult ("EMU_TEST_PROTOCOL in reloaded EmulatorTest", FALSE);
+    return TRUE;
+  }
+
+  mTest->TestGetDebugState (&mBeginDebugState);
+  switch (Options->Test) {
+    case TEST_RELOAD_LOW_MEM:
+      TestLowMemReloaded (Options);
+      break;
+    case TEST_RELOAD_HLE:
+      TestHleReloaded (Options);
+      break;
+    default:
+      Options->LogResult ("Reloaded EmulatorTest test", FALSE);
+      break;
+  }
+
+  return TRUE;
+}
+
+/*
+ * When emulated, checks that an EmulatorTest listed in LowMemImages
+ * gets memory below 4GiB, and that DMA to a buffer above 4GiB is
+ * bounced without losing data.
+ */
+STATIC
+VOID
+TestLowMem (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  EFI_PHYSICAL_ADDRESS  High;
+  TEST_RELOAD_OPTIONS   Options;
+
+  if ((mTest == NULL) ||
+      (mBeginDebugState.HostMachineType == mBeginDebugState.CallerMachineType) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_LOW_MEM) == 0))
+  {
+    return;
+  }
+
+  ZeroMem (&Options, sizeof (Options));
+  Options.Test = TEST_RELOAD_LOW_MEM;
+
+  /*
+   * Memory is mostly allocated top-down, so this lands
+   * above 4GiB if there is any memory there.
+   */
+  Status = gBS->AllocatePages (
+                  AllocateAnyPages,
+                  EfiBootServicesData,
+                  TEST_LOW_MEM_PAGES,
+                  &High
+                  );
+  if (!EFI_ERROR (Status)) {
+    if (High >= BASE_4GB) {
+      Options.HighBuffer = (VOID *)(UINTN)High;
+      Options.HighSize   = EFI_PAGES_TO_SIZE (TEST_LOW_MEM_PAGES);
+    } else {
+      gBS->FreePages (High, TEST_LOW_MEM_PAGES);
+    }
+  }
+
+  Status = TestReload (L"LowMemImages", "EmulatorTest", &Options);
+  if (Status != EFI_ALREADY_STARTED) {
+    LogResult ("LowMem reloaded EmulatorTest", !EFI_ERROR (Status));
+  }
+
+  if (Options.HighBuffer != NULL) {
+    gBS->FreePages (High, TEST_LOW_MEM_PAGES);
+  }
+}
+
+/*
+ * Same as mHleNatives in EmulatorDxe. Besides being fingerprinted by
+ * TestHle, this makes every routine get linked, so the built-in HLE
+ * signatures can be generated from the map file of this image.
+ */
+STATIC CONST TEST_HLE_ROUTINE  mTestHleRoutines[] = {
+  { "CopyMem",        (VOID *)CopyMem        },
+  { "SetMem",         (VOID *)SetMem         },
+  { "SetMem16",       (VOID *)SetMem16       },
+  { "SetMem32",       (VOID *)SetMem32       },
+  { "SetMem64",       (VOID *)SetMem64       },
+  { "SetMemN",        (VOID *)SetMemN        },
+  { "ZeroMem",        (VOID *)ZeroMem        },
+  { "CompareMem",     (VOID *)CompareMem     },
+  { "ScanMem8",       (VOID *)ScanMem8       },
+  { "ScanMem16",      (VOID *)ScanMem16      },
+  { "ScanMem32",      (VOID *)ScanMem32      },
+  { "ScanMem64",      (VOID *)ScanMem64      },
+  { "StrLen",         (VOID *)StrLen         },
+  { "StrSize",        (VOID *)StrSize        },
+  { "StrCmp",         (VOID *)StrCmp         },
+  { "StrnCmp",        (VOID *)StrnCmp        },
+  { "AsciiStrLen",    (VOID *)AsciiStrLen    },
+  { "AsciiStrSize",   (VOID *)AsciiStrSize   },
+  { "AsciiStrCmp",    (VOID *)AsciiStrCmp    },
+  { "AsciiStrnCmp",   (VOID *)AsciiStrnCmp   },
+  { "CalculateCrc32", (VOID *)CalculateCrc32 },
+};
+
+/*
+ * Appends the HleSignatures item for Function, named Name, to
+ * Signatures, sizing it from .pdata like EmulatorDxe does.
+ * Returns FALSE if the function isn't in .pdata (e.g. for GCC
+ * builds) or has base relocations, and so can't be matched.
+ */
+STATIC
+BOOLEAN
+TestHleSignature (
+  IN     CONST CHAR8  *Name,
+  IN     VOID         *Function,
+  IN OUT CHAR8        *Signatures,
+  IN     UINTN        SignaturesSize
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  UINT8                      *ImageBase;
+  EFI_IMAGE_DOS_HEADER       *DosHdr;
+  EFI_IMAGE_NT_HEADERS64     *Hdr;
+  EFI_IMAGE_DATA_DIRECTORY   *Dir;
+  EFI_IMAGE_BASE_RELOCATION  *Block;
+  UINT32                     *Entry;
+  UINT16                     *Reloc;
+  UINT32                     Rva;
+  UINT32                     Size;
+  UINT32                     Field;
+  UINTN                      Offset;
+  UINTN                      Index;
+  UINTN                      Count;
+  UINTN                      Length;
+
+  Status = gBS->HandleProtocol (
+                  gImageHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+
+  ImageBase = LoadedImage->ImageBase;
+  DosHdr    = LoadedImage->ImageBase;
+  Hdr       = LoadedImage->ImageBase;
+  if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE) {
+    Hdr = (VOID *)(ImageBase + DosHdr->e_lfanew);
+  }
+
+  if (Hdr->OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC) {
+    return FALSE;
+  }
+
+  Rva  = (UINT32)((UINT8 *)Function - ImageBase);
+  Size = 0;
+  Dir  = &Hdr->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+  if (TEST_MACHINE_TYPE == EFI_IMAGE_MACHINE_X64) {
+    Count = Dir->Size / (3 * sizeof (UINT32));
+    for (Index = 0; Index < Count; Index++) {
+      Entry = (UINT32 *)(ImageBase + Dir->VirtualAddress) + Index * 3;
+      if (Entry[0] == Rva) {
+        Size = Entry[1] - Entry[0];
+        break;
+      }
+    }
+  } else {
+    Count = Dir->Size / (2 * sizeof (UINT32));
+    for (Index = 0; Index < Count; Index++) {
+      Entry = (UINT32 *)(ImageBase + Dir->VirtualAddress) + Index * 2;
+      if (Entry[0] == Rva) {
+        if ((Entry[1] & 3) != 0) {
+          Size = ((Entry[1] >> 2) & 0x7FF) * 4;
+        } else {
+          Size = (*(UINT32 *)(ImageBase + Entry[1]) & 0x3FFFF) * 4;
+        }
+
+        break;
+      }
+    }
+  }
+
+  if (Size == 0) {
+    return FALSE;
+  }
+
+  /*
+   * Relocated fields are at most 8 bytes.
+   */
+  Dir = &Hdr->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+  for (Offset = 0; Offset + sizeof (*Block) <= Dir->Size; Offset += Block->SizeOfBlock) {
+    Block = (VOID *)(ImageBase + Dir->VirtualAddress + Offset);
+    if (Block->SizeOfBlock < sizeof (*Block)) {
+      break;
+    }
+
+    Reloc = (UINT16 *)(Block + 1);
+    Count = (Block->SizeOfBlock - sizeof (*Block)) / sizeof (UINT16);
+    for (Index = 0; Index < Count; Index++) {
+      if ((Reloc[Index] >> 12) == EFI_IMAGE_REL_BASED_ABSOLUTE) {
+        continue;
+      }
+
+      Field = Block->VirtualAddress + (Reloc[Index] & 0xFFF);
+      if ((Field < Rva + Size) && (Field + sizeof (UINT64) > Rva)) {
+        return FALSE;
+      }
+    }
+  }
+
+  Length = AsciiStrLen (Signatures);
+  AsciiSPrint (
+    Signatures + Length,
+    SignaturesSize - Length,
+    "%a:%x:%x:%08x ",
+    Name,
+    TEST_MACHINE_TYPE,
+    Size,
+    CalculateCrc32 (ImageBase + Rva, Size)
+    );
+  return TRUE;
+}
+
+/*
+ * When emulated, fingerprints the library routines of this image
+ * EmulatorDxe has native implementations of, and checks that
+ * another instance of EmulatorTest, loaded with these in
+ * HleSignatures, gets them redirected to native code and still
+ * gets correct results for CopyMem and CompareMem.
+ */
+STATIC
+VOID
+TestHle (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  CHAR8                 Signatures[1024];
+  UINTN                 Index;
+  UINTN                 Count;
+  UINTN                 Size;
+  TEST_RELOAD_OPTIONS   Options;
+  EMU_TEST_DEBUG_STATE  Before;
+  EMU_TEST_DEBUG_STATE  After;
+
+  if ((mTest == NULL) ||
+      (mBeginDebugState.HostMachineType == mBeginDebugState.CallerMachineType) ||
+      ((mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_HLE) == 0))
+  {
+    return;
+  }
+
+  Size   = 0;
+  Status = gRT->GetVariable (L"HleDisable", &mEmuVariableGuid, NULL, &Size, NULL);
+  if (Status != EFI_NOT_FOUND) {
+    DEBUG ((DEBUG_INFO, "HleDisable set, skipping HLE tests\n"));
+    return;
+  }
+
+  Signatures[0] = '\0';
+  Count         = 0;
+  for (Index = 0; Index < ARRAY_SIZE (mTestHleRoutines); Index++) {
+    if (TestHleSignature (
+          mTestHleRoutines[Index].Name,
+          mTestHleRoutines[Index].Function,
+          Signatures,
+          sizeof (Signatures)
+          ))
+    {
+      Count++;
+    }
+  }
+
+  if (Count == 0) {
+    DEBUG ((DEBUG_INFO, "No routine can be fingerprinted, skipping HLE tests\n"));
+    return;
+  }
+
+  ZeroMem (&Options, sizeof (Options));
+  Options.Test = TEST_RELOAD_HLE;
+  mTest->TestGetDebugState (&Before);
+  Status = TestReload (L"HleSignatures", Signatures, &Options);
+  if (Status == EFI_ALREADY_STARTED) {
+    return;
+  }
+
+  mTest->TestGetDebugState (&After);
+  LogResult (
+    "HLE redirects fingerprinted routines",
+    !EFI_ERROR (Status) && (After.HleFunctions >= Before.HleFunctions + Count)
+    );
+}
+
+STATIC
+VOID
+EFIAPI
+TestTplNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  UINTN  *Count = Context;
+
+  (*Count)++;
+}
+
+STATIC
+VOID
+TestTpl (
+  VOID
+  )
+{
+  EFI_STATUS     Status;
+  EFI_EVENT      Event;
+  EFI_TPL        OldTpl;
+  EFI_TPL        NestedTpl;
+  volatile UINTN Count;
+  BOOLEAN        Result;
+
+  /*
+   * A signaled event must only be dispatched once the TPL goes
+   * below the event's TPL, no matter how the TPL is tracked
+   * for emulated code.
+   */
+  Count  = 0;
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  TestTplNotify,
+                  (VOID *)&Count,
+                  &Event
+                  );
+  if (EFI_ERROR (Status)) {
+    LogResult ("TPL", FALSE);
+    return;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  gBS->SignalEvent (Event);
+  Result = Count == 0;
+
+  NestedTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Result   &= NestedTpl == TPL_CALLBACK;
+  gBS->RestoreTPL (NestedTpl);
+  Result &= Count == 0;
+
+  NestedTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  Result   &= NestedTpl == TPL_CALLBACK;
+  gBS->RestoreTPL (NestedTpl);
+  Result &= Count == 0;
+
+  gBS->RestoreTPL (OldTpl);
+  Result &= Count == 1;
+
+  gBS->CloseEvent (Event);
+  LogResult ("TPL", Result);
+}
+
+STATIC
+NO_INLINE
+VOID
+TestCpuSleep (
+  VOID
+  )
+{
+  CpuSleep ();
+  LogResult ("CpuSleep", TRUE);
+}
+
+STATIC
+EFIAPI
+VOID
+TestTimerHandler (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  BOOLEAN  *IsDone = Context;
+
+  *IsDone = TRUE;
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfMyCall1 (
+  VOID
+  )
+{
+  return 1;
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfEmpty (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64  Result;
+
+  /*
+   * Test empty loops.
+   */
+
+  for (Result = 0; Result < Count; Result++) {
+    asm volatile ("" : "+r" (Result));
+  }
+
+  return Result;
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfMyCall (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64  Index;
+  UINT64  Result;
+
+  /*
+   * Test emulated function call loops.
+   */
+
+  Result = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Result += TestPerfMyCall1 ();
+  }
+
+  return Result;
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfNativeCall (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64  Index;
+
+  /*
+   * Test native function call loops.
+   */
+
+  for (Index = 0; Index < Count; Index++) {
+    gBS->GetNextMonotonicCount (NULL);
+  }
+
+  return Index;
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfRaiseTpl (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64   Index;
+  EFI_TPL  OldTpl;
+
+  /*
+   * Test RaiseTPL/RestoreTPL pairs, as done by EfiAcquireLock
+   * and EfiReleaseLock.
+   */
+
+  for (Index = 0; Index < Count; Index++) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    gBS->RestoreTPL (OldTpl);
+  }
+
+  return Index;
+}
+
+typedef struct {
+  UINT64    *Array;
+  UINTN     Length;
+} TEST_PERF_ARRAY;
+
+#define GEN_TEST_PERF_LOAD(x)                                                  \
+  STATIC                                                                       \
+  NO_INLINE                                                                    \
+  UINT64                                                                       \
+  TestPerfLoad##x (                                                            \
+    IN  VOID    *Context,                                                      \
+    IN  UINT64  Count                                                          \
+    )                                                                          \
+  {                                                                            \
+    UINT64          Index;                                                     \
+    UINT64          Result;                                                    \
+    TEST_PERF_ARRAY *Array = Context;                                          \
+                                                                               \
+    Result = 0;                                                                \
+    for (Index = 0; Index < Count; Index++) {                                  \
+      Result += *(UINT##x *) &Array->Array[Result % Array->Length];            \
+    }                                                                          \
+                                                                               \
+    return Result;                                                             \
+  }
+GEN_TEST_PERF_LOAD (64)
+GEN_TEST_PERF_LOAD (32)
+GEN_TEST_PERF_LOAD (16)
+GEN_TEST_PERF_LOAD (8)
+#undef GEN_TEST_PERF_LOAD
+
+#define GEN_TEST_PERF_STORE(x)                                                 \
+  STATIC                                                                       \
+  NO_INLINE                                                                    \
+  UINT64                                                                       \
+  TestPerfStore##x (                                                           \
+    IN  VOID    *Context,                                                      \
+    IN  UINT64  Count                                                          \
+    )                                                                          \
+  {                                                                            \
+    UINT64          Index;                                                     \
+    TEST_PERF_ARRAY *Array = Context;                                          \
+                                                                               \
+    for (Index = 0; Index < Count; Index++) {                                  \
+      *(volatile UINT##x *) &Array->Array[Index % Array->Length] = 1;          \
+    }                                                                          \
+                                                                               \
+    return Index;                                                              \
+  }
+GEN_TEST_PERF_STORE (64)
+GEN_TEST_PERF_STORE (32)
+GEN_TEST_PERF_STORE (16)
+GEN_TEST_PERF_STORE (8)
+#undef GEN_TEST_PERF_STORE
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfCopyMem (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64           Index;
+  TEST_PERF_ARRAY  *Array = Context;
+
+  for (Index = 0; Index < Count; Index++) {
+    CopyMem (TestCopyArray, Array->Array, Array->Length * sizeof (UINT64));
+  }
+
+  return Index + TestCopyArray[Count % Array->Length];
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfCrc32 (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64           Index;
+  UINT64           Result;
+  TEST_PERF_ARRAY  *Array = Context;
+
+  Result = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Result += CalculateCrc32 (Array->Array, Array->Length * sizeof (UINT64));
+  }
+
+  return Result;
+}
+
+typedef struct {
+  VOID     *Source;
+  UINT8    *Destination;
+  UINT32   DestinationSize;
+  VOID     *Scratch;
+} TEST_PERF_DECOMPRESS;
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfDecompress (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64                Index;
+  UINT64                Result;
+  TEST_PERF_DECOMPRESS  *Decompress = Context;
+
+  Result = 0;
+  for (Index = 0; Index < Count; Index++) {
+    UefiDecompress (Decompress->Source, Decompress->Destination, Decompress->Scratch);
+    Result += Decompress->Destination[Index % Decompress->DestinationSize];
+  }
+
+  return Result;
+}
+
+STATIC
+NO_INLINE
+UINT64
+EFIAPI
+TestCallee0 (
+  VOID
+  )
+{
+  return 1;
+}
+
+STATIC
+NO_INLINE
+UINT64
+EFIAPI
+TestCallee4 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4
+  )
+{
+  return Arg4 != 0;
+}
+
+STATIC
+NO_INLINE
+UINT64
+EFIAPI
+TestCallee8 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4,
+  IN  UINT64  Arg5,
+  IN  UINT64  Arg6,
+  IN  UINT64  Arg7,
+  IN  UINT64  Arg8
+  )
+{
+  return Arg8 != 0;
+}
+
+STATIC
+NO_INLINE
+UINT64
+EFIAPI
+TestCallee16 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4,
+  IN  UINT64  Arg5,
+  IN  UINT64  Arg6,
+  IN  UINT64  Arg7,
+  IN  UINT64  Arg8,
+  IN  UINT64  Arg9,
+  IN  UINT64  Arg10,
+  IN  UINT64  Arg11,
+  IN  UINT64  Arg12,
+  IN  UINT64  Arg13,
+  IN  UINT64  Arg14,
+  IN  UINT64  Arg15,
+  IN  UINT64  Arg16
+  )
+{
+  return Arg16 != 0;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestNestCb (
+  IN  UINT64  Depth
+  )
+{
+  if (Depth <= 1) {
+    return 1;
+  }
+
+  return 1 + mTest->TestNest (TestNestCb, Depth - 1);
+}
+
+/*
+ * The thunk transition matrix: the per-call cost of every kind of
+ * transition between emulated and native code, with 0, 4, 8
+ * and 16 arguments.
+ */
+typedef enum {
+  /*
+   * Emulated loop calling native code.
+   */
+  ThunkEmuToNative,
+  /*
+   * Native loop calling emulated code, via the exception path.
+   */
+  ThunkNativeToEmu,
+  /*
+   * Native loop calling emulated code, via CpuRunFunc directly
+   * as with wrapped callbacks and entry points.
+   */
+  ThunkNativeToEmuWrapped,
+  /*
+   * Emulated loop calling emulated code, for reference.
+   */
+  ThunkEmuToEmu,
+  /*
+   * Emulated loop calling code in the peer image.
+   */
+  ThunkCrossIsa,
+  /*
+   * Native loop calling emulated code that calls native code...,
+   * nested ArgCount deep.
+   */
+  ThunkNested,
+} TEST_THUNK_KIND;
+
+typedef struct {
+  TEST_THUNK_KIND    Kind;
+  UINTN              ArgCount;
+} TEST_THUNK;
+
+STATIC
+VOID *
+TestThunkCallee (
+  IN  CONST TEST_THUNK  *Thunk
+  )
+{
+  UINTN  Index;
+
+  Index = Thunk->ArgCount / 4;
+  if (Index > 2) {
+    Index = 3;
+  }
+
+  switch (Thunk->Kind) {
+    case ThunkEmuToNative:
+      return ((VOID *[]) {
+        mTest->TestNop0, mTest->TestNop4, mTest->TestNop8, mTest->TestNop16
+      })[Index];
+    case ThunkCrossIsa:
+      return mPeerCallees->Callees[Index];
+    default:
+      return ((VOID *[]) {
+        TestCallee0, TestCallee4, TestCallee8, TestCallee16
+      })[Index];
+  }
+}
+
+STATIC
+NO_INLINE
+UINT64
+TestPerfThunk (
+  IN  VOID    *Context,
+  IN  UINT64  Count
+  )
+{
+  UINT64      Index;
+  UINT64      Result;
+  TEST_THUNK  *Thunk;
+  VOID        *Callee;
+
+  Thunk  = Context;
+  Callee = TestThunkCallee (Thunk);
+
+  switch (Thunk->Kind) {
+    case ThunkNativeToEmu:
+      return mTest->TestLoopCb (Callee, Thunk->ArgCount, FALSE, Count);
+    case ThunkNativeToEmuWrapped:
+      return mTest->TestLoopCb (Callee, Thunk->ArgCount, TRUE, Count);
+    case ThunkNested:
+      return mTest->TestLoopNest (TestNestCb, Thunk->ArgCount, Count);
+    default:
+      break;
+  }
+
+  /*
+   * Calls via a volatile pointer, so emulated->emulated
+   * calls can't be inlined or turned into jumps.
+   */
+  Result = 0;
+  asm volatile ("" : "+r" (Callee));
+  switch (Thunk->ArgCount) {
+    case 0:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(VOID))Callee)();
+      }
+
+      break;
+    case 4:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(UINT64, UINT64, UINT64, UINT64))Callee)(
+                                                                               1,
+                                                                               2,
+                                                                               3,
+                                                                               4
+                                                                               );
+      }
+
+      break;
+    case 8:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(UINT64, UINT64, UINT64, UINT64,
+                                      UINT64, UINT64, UINT64, UINT64))Callee)(
+                                                                              1,
+                                                                              2,
+                                                                              3,
+                                                                              4,
+                                                                              5,
+                                                                              6,
+                                                                              7,
+                                                                              8
+                                                                              );
+      }
+
+      break;
+    default:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(UINT64, UINT64, UINT64, UINT64,
+                                      UINT64, UINT64, UINT64, UINT64,
+                                      UINT64, UINT64, UINT64, UINT64,
+                                      UINT64, UINT64, UINT64, UINT64))Callee)(
+                                                                              1,
+                                                                              2,
+                                                                              3,
+                                                                              4,
+                                                                              5,
+                                                                              6,
+                                                                              7,
+                                                                              8,
+                                                                              9,
+                                                                              10,
+                                                                              11,
+                                                                              12,
+                                                                              13,
+                                                                              14,
+                                                                              15,
+                                                                              16
+                                                                              );
+      }
+
+      break;
+  }
+
+  return Result;
+}
+
+#define TEST_THUNK_CASE(Kind, Name, ArgCount) \
+  { Name "/" #ArgCount, TestPerfThunk, &(TEST_THUNK) { Kind, ArgCount } }
+
+#define TEST_THUNK_CASES(Kind, Name)  \
+  TEST_THUNK_CASE (Kind, Name, 0),    \
+  TEST_THUNK_CASE (Kind, Name, 4),    \
+  TEST_THUNK_CASE (Kind, Name, 8),    \
+  TEST_THUNK_CASE (Kind, Name, 16)
+
+/*
+ * Timer event notification latency, i.e. how much later than
+ * scheduled notification functions run, while emulated code
+ * is doing different things.
+ */
+#define TEST_EVENT_PERIOD_MS  10
+
+typedef enum {
+  /*
+   * Emulated tight loop.
+   */
+  EventLoadBusy,
+  /*
+   * Emulated CpuSleep loop.
+   */
+  EventLoadIdle,
+  /*
+   * Emulated loop calling native code.
+   */
+  EventLoadNative,
+} TEST_EVENT_LOAD;
+
+typedef struct {
+  BOOLEAN            Periodic;
+  EFI_TPL            Tpl;
+  TEST_EVENT_LOAD    Load;
+} TEST_EVENT;
+
+typedef struct {
+  EMU_TEST_PROTOCOL    *Test;
+  UINT64               *Stamps;
+  UINTN                Count;
+  volatile UINTN       Fired;
+} TEST_EVENT_STATE;
+
+STATIC
+VOID
+EFIAPI
+TestEventNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  TEST_EVENT_STATE  *State = Context;
+
+  if (State->Fired < State->Count) {
+    State->Stamps[State->Fired] = State->Test->GetPerformanceCounter ();
+    State->Fired++;
+  }
+}
+
+STATIC
+VOID
+TestEventWait (
+  IN  CONST TEST_EVENT  *TestEvent,
+  IN  TEST_EVENT_STATE  *State,
+  IN  UINTN             Fired
+  )
+{
+  while (State->Fired < Fired) {
+    switch (TestEvent->Load) {
+      case EventLoadIdle:
+        CpuSleep ();
+        break;
+      case EventLoadNative:
+        State->Test->TestNop0 ();
+        break;
+      default:
+        asm volatile ("" : : : "memory");
+        break;
+    }
+  }
+}
+
+STATIC
+EFI_STATUS
+TestPerfEvent (
+  IN  VOID               *Context,
+  IN  EMU_TEST_PROTOCOL  *Test,
+  OUT UINT64             *SamplesPs,
+  IN  UINTN              Count
+  )
+{
+  EFI_STATUS        Status;
+  EFI_EVENT         Event;
+  TEST_EVENT        *TestEvent;
+  TEST_EVENT_STATE  State;
+  UINTN             Index;
+  UINT64            Start;
+  UINT64            ElapsedPs;
+  UINT64            ExpectedPs;
+
+  TestEvent    = Context;
+  State.Test   = Test;
+  State.Count  = Count;
+  State.Fired  = 0;
+  State.Stamps = AllocatePool (Count * sizeof (*State.Stamps));
+  if (State.Stamps == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TestEvent->Tpl,
+                  TestEventNotify,
+                  &State,
+                  &Event
+                  );
+  if (EFI_ERROR (Status)) {
+    FreePool (State.Stamps);
+    return Status;
+  }
+
+  /*
+   * Latency is measured against the ideal schedule, so for periodic
+   * timers a late notification makes the following ones late too,
+   * unless the firmware catches up.
+   */
+  if (TestEvent->Periodic) {
+    Start  = Test->GetPerformanceCounter ();
+    Status = gBS->SetTimer (
+                    Event,
+                    TimerPeriodic,
+                    EFI_TIMER_PERIOD_MILLISECONDS (TEST_EVENT_PERIOD_MS)
+                    );
+    if (!EFI_ERROR (Status)) {
+      TestEventWait (TestEvent, &State, Count);
+      gBS->SetTimer (Event, TimerCancel, 0);
+
+      for (Index = 0; Index < Count; Index++) {
+        ElapsedPs        = BenchTicksToPs (BenchTicksBetween (Start, State.Stamps[Index]), 1);
+        ExpectedPs       = MultU64x64 (Index + 1, TEST_EVENT_PERIOD_MS * 1000000000ULL);
+        SamplesPs[Index] = ElapsedPs > ExpectedPs ? ElapsedPs - ExpectedPs : 0;
+      }
+    }
+  } else {
+    for (Index = 0; Index < Count; Index++) {
+      Start  = Test->GetPerformanceCounter ();
+      Status = gBS->SetTimer (
+                      Event,
+                      TimerRelative,
+                      EFI_TIMER_PERIOD_MILLISECONDS (TEST_EVENT_PERIOD_MS)
+                      );
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+
+      TestEventWait (TestEvent, &State, Index + 1);
+
+      ElapsedPs        = BenchTicksToPs (BenchTicksBetween (Start, State.Stamps[Index]), 1);
+      ExpectedPs       = TEST_EVENT_PERIOD_MS * 1000000000ULL;
+      SamplesPs[Index] = ElapsedPs > ExpectedPs ? ElapsedPs - ExpectedPs : 0;
+    }
+  }
+
+  gBS->CloseEvent (Event);
+  FreePool (State.Stamps);
+  return Status;
+}
+
+#define TEST_EVENT_CASE(Periodic, Tpl, Load, Name) \
+  { "Timer/" Name, NULL, &(TEST_EVENT) { Periodic, Tpl, Load }, TestPerfEvent }
+
+#define TEST_EVENT_CASES(Periodic, Tpl, Name)                       \
+  TEST_EVENT_CASE (Periodic, Tpl, EventLoadBusy, Name "/Busy"),     \
+  TEST_EVENT_CASE (Periodic, Tpl, EventLoadIdle, Name "/Idle"),     \
+  TEST_EVENT_CASE (Periodic, Tpl, EventLoadNative, Name "/Native")
+
+STATIC TEST_PERF_ARRAY       mTestPerfArray = { TestArray, ARRAY_SIZE (TestArray) };
+STATIC TEST_PERF_DECOMPRESS  mTestPerfDecompress;
+
+STATIC CONST BENCH_CASE  mTestPerfCases[] = {
+  { "Empty",      TestPerfEmpty,      NULL            },
+  { "MyCall",     TestPerfMyCall,     NULL            },
+  { "NativeCall", TestPerfNativeCall, NULL            },
+  { "RaiseTpl",   TestPerfRaiseTpl,   NULL            },
+  { "Load64",     TestPerfLoad64,     &mTestPerfArray },
+  { "Load32",     TestPerfLoad32,     &mTestPerfArray },
+  { "Load16",     TestPerfLoad16,     &mTestPerfArray },
+  { "Load8",      TestPerfLoad8,      &mTestPerfArray },
+  { "Store64",    TestPerfStore64,    &mTestPerfArray },
+  { "Store32",    TestPerfStore32,    &mTestPerfArray },
+  { "Store16",    TestPerfStore16,    &mTestPerfArray },
+  { "Store8",     TestPerfStore8,     &mTestPerfArray },
+  { "CopyMem",    TestPerfCopyMem,    &mTestPerfArray },
+  { "Crc32",      TestPerfCrc32,      &mTestPerfArray },
+  { "Decompress", TestPerfDecompress, &mTestPerfDecompress },
+  TEST_THUNK_CASES (ThunkEmuToNative,        "EmuToNative"),
+  TEST_THUNK_CASES (ThunkNativeToEmu,        "NativeToEmu"),
+  TEST_THUNK_CASES (ThunkNativeToEmuWrapped, "NativeToEmuWrapped"),
+  TEST_THUNK_CASES (ThunkEmuToEmu,           "EmuToEmu"),
+  TEST_THUNK_CASE (ThunkNested,              "Nested",             1),
+  TEST_THUNK_CASE (ThunkNested,              "Nested",             2),
+  TEST_THUNK_CASE (ThunkNested,              "Nested",             4),
+  TEST_THUNK_CASE (ThunkNested,              "Nested",             8),
+  TEST_THUNK_CASE (ThunkNested,              "Nested",             16),
+  TEST_EVENT_CASES (FALSE,                   TPL_CALLBACK,         "OneShot/Callback"),
+  TEST_EVENT_CASES (FALSE,                   TPL_NOTIFY,           "OneShot/Notify"),
+  TEST_EVENT_CASES (TRUE,                    TPL_CALLBACK,         "Periodic/Callback"),
+  TEST_EVENT_CASES (TRUE,                    TPL_NOTIFY,           "Periodic/Notify"),
+};
+
+STATIC CONST BENCH_CASE  mTestPerfPeerCases[] = {
+  TEST_THUNK_CASES (ThunkCrossIsa, "CrossIsa"),
+};
+
+STATIC
+VOID
+EFIAPI
+TestPerfPeerRun (
+  IN  TEST_PEER_CALLEES  *Callees
+  )
+{
+  BENCH_CASE  Cases[ARRAY_SIZE (mTestPerfCases) + ARRAY_SIZE (mTestPerfPeerCases)];
+
+  DEBUG ((
+    DEBUG_INFO,
+    "Peer machine type 0x%x, caller machine type 0x%x\n",
+    Callees->MachineType,
+    mBeginDebugState.CallerMachineType
+    ));
+
+  CopyMem (Cases, mTestPerfCases, sizeof (mTestPerfCases));
+  CopyMem (&Cases[ARRAY_SIZE (mTestPerfCases)], mTestPerfPeerCases, sizeof (mTestPerfPeerCases));
+
+  mPeerCallees = Callees;
+  mPeerStatus  = BenchRun (&mBenchConfig, Cases, ARRAY_SIZE (Cases));
+  mPeerCallees = NULL;
+}
+
+STATIC
+EFI_STATUS
+TestPerfWithPeer (
+  VOID
+  )
+{
+  EFI_STATUS                 Status;
+  VOID                       *Buffer;
+  UINTN                      BufferSize;
+  EFI_HANDLE                 PeerHandle;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  TEST_PEER_LOAD_OPTIONS     Options;
+
+  Status = ReadShellFile (mPeerFile, &Buffer, &BufferSize);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Couldn't read '%s': %r\n", mPeerFile, Status));
+    return Status;
+  }
+
+  PeerHandle = NULL;
+  Status     = gBS->LoadImage (
+                      FALSE,
+                      gImageHandle,
+                      NULL,
+                      Buffer,
+                      BufferSize,
+                      &PeerHandle
+                      );
+  FreePool (Buffer);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Couldn't load '%s': %r\n", mPeerFile, Status));
+    return Status;
+  }
+
+  Status = gBS->HandleProtocol (
+                  PeerHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->UnloadImage (PeerHandle);
+    return Status;
+  }
+
+  Options.Signature             = TEST_PEER_SIGNATURE;
+  Options.Run                   = TestPerfPeerRun;
+  LoadedImage->LoadOptions      = &Options;
+  LoadedImage->LoadOptionsSize  = sizeof (Options);
+
+  mPeerStatus = EFI_NOT_STARTED;
+  Status      = gBS->StartImage (PeerHandle, NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Peer '%s' failed: %r\n", mPeerFile, Status));
+    return Status;
+  }
+
+  return mPeerStatus;
+}
+
+/*
+ * Returns TRUE if loaded by TestPerfWithPeer, after having run
+ * the cross-ISA benchmarks against this image's callees.
+ */
+STATIC
+BOOLEAN
+TestPeerEntry (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
+  TEST_PEER_LOAD_OPTIONS     *Options;
+  TEST_PEER_CALLEES          Callees = {
+    TEST_MACHINE_TYPE,
+    { TestCallee0, TestCallee4, TestCallee8, TestCallee16 }
+  };
+
+  Status = gBS->HandleProtocol (
+                  ImageHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  if (EFI_ERROR (Status) ||
+      (LoadedImage->LoadOptionsSize != sizeof (TEST_PEER_LOAD_OPTIONS)))
+  {
+    return FALSE;
+  }
+
+  Options = LoadedImage->LoadOptions;
+  if (Options->Signature != TEST_PEER_SIGNATURE) {
+    return FALSE;
+  }
+
+  Options->Run (&Callees);
+  return TRUE;
+}
+
+/*
+ * Sets up mTestPerfDecompress, checking that the
+ * generated input decompresses to what it should.
+ */
+STATIC
+EFI_STATUS
+TestPerfDecompressInit (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  VOID        *Original;
+  UINTN       SourceSize;
+  UINT32      ScratchSize;
+
+  Status = TestCompressGenerate (
+             TEST_DECOMPRESS_SIZE,
+             &Original,
+             &mTestPerfDecompress.Source,
+             &SourceSize
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = UefiDecompressGetInfo (
+             mTestPerfDecompress.Source,
+             (UINT32)SourceSize,
+             &mTestPerfDecompress.DestinationSize,
+             &ScratchSize
+             );
+  if (EFI_ERROR (Status)) {
+    goto out;
+  }
+
+  mTestPerfDecompress.Destination = AllocatePool (mTestPerfDecompress.DestinationSize);
+  mTestPerfDecompress.Scratch     = AllocatePool (ScratchSize);
+  if ((mTestPerfDecompress.Destination == NULL) ||
+      (mTestPerfDecompress.Scratch == NULL))
+  {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Status = UefiDecompress (
+             mTestPerfDecompress.Source,
+             mTestPerfDecompress.Destination,
+             mTestPerfDecompress.Scratch
+             );
+  if (!EFI_ERROR (Status) &&
+      ((mTestPerfDecompress.DestinationSize != TEST_DECOMPRESS_SIZE) ||
+       (CompareMem (Original, mTestPerfDecompress.Destination, TEST_DECOMPRESS_SIZE) != 0)))
+  {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "Decompress input %lu bytes, output %lu bytes: %r\n",
+    (UINT64)SourceSize,
+    (UINT64)mTestPerfDecompress.DestinationSize,
+    Status
+    ));
+
+out:
+  FreePool (Original);
+  return Status;
+}
+
+STATIC
+VOID
+TestPerfDecompressFree (
+  VOID
+  )
+{
+  if (mTestPerfDecompress.Source != NULL) {
+    FreePool (mTestPerfDecompress.Source);
+  }
+
+  if (mTestPerfDecompress.Destination != NULL) {
+    FreePool (mTestPerfDecompress.Destination);
+  }
+
+  if (mTestPerfDecompress.Scratch != NULL) {
+    FreePool (mTestPerfDecompress.Scratch);
+  }
+
+  ZeroMem (&mTestPerfDecompress, sizeof (mTestPerfDecompress));
+}
+
+STATIC
+NO_INLINE
+VOID
+TestPerf (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+
+  if (mTest == NULL) {
+    DEBUG ((DEBUG_INFO, "Skipping perf tests, EMU_TEST_PROTOCOL is missing\n"));
+    return;
+  }
+
+  DEBUG ((DEBUG_INFO, "Doing perf tests...\n"));
+
+  for (Index = 0; Index < ARRAY_SIZE (TestArray); Index++) {
+    TestArray[Index] = 1;
+  }
+
+  Status = TestPerfDecompressInit ();
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Couldn't set up Decompress benchmark: %r\n", Status));
+    TestPerfDecompressFree ();
+    LogResult ("TestPerf", FALSE);
+    return;
+  }
+
+  mBenchConfig.Test              = mTest;
+  mBenchConfig.HostMachineType   = mBeginDebugState.HostMachineType;
+  mBenchConfig.CallerMachineType = mBeginDebugState.CallerMachineType;
+
+  DEBUG ((
+    DEBUG_INFO,
+    "Event notifications are %a\n",
+    (mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_WRAPPED_EVENTS) != 0 ?
+    "wrapped" : "called via the exception path"
+    ));
+  DEBUG ((
+    DEBUG_INFO,
+    "Emulated protocols are %a\n",
+    (mBeginDebugState.Flags & EMU_TEST_DEBUG_FLAG_PROTOCOL_TRAMPOLINES) != 0 ?
+    "entered via trampolines" : "entered via the exception path"
+    ));
+
+  if (mPeerFile != NULL) {
+    Status = TestPerfWithPeer ();
+  } else {
+    Status = BenchRun (&mBenchConfig, mTestPerfCases, ARRAY_SIZE (mTestPerfCases));
+  }
+
+  TestPerfDecompressFree ();
+  LogResult ("TestPerf", !EFI_ERROR (Status));
+}
+
+STATIC
+NO_INLINE
+VOID
+TestTimer (
+  BOOLEAN  WithCpuSleep
+  )
+{
+  EFI_STATUS        Status;
+  EFI_EVENT         OneShotTimer;
+  volatile BOOLEAN  IsDone = FALSE;
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL, // Type
+                  TPL_CALLBACK,                  // NotifyTpl
+                  TestTimerHandler,              // NotifyFunction
+                  (VOID *)&IsDone,               // NotifyContext
+                  &OneShotTimer                  // Event
+                  );
+  ASSERT_EFI_ERROR (Status);
+
+  Status = gBS->SetTimer (
+                  OneShotTimer,
+                  TimerRelative,
+                  EFI_TIMER_PERIOD_SECONDS (1)
+                  );
+  ASSERT_EFI_ERROR (Status);
+
+  while (!IsDone) {
+    if (WithCpuSleep) {
+      CpuSleep ();
+    }
+  }
+
+  if (WithCpuSleep) {
+    LogResult ("CpuSleep loop + timer", TRUE);
+  } else {
+    LogResult ("Tight loop + timer", TRUE);
+  }
+
+  gBS->CloseEvent (OneShotTimer);
+}
+
+#ifdef MDE_CPU_X64
+STATIC
+NO_INLINE
+UINT64
+EFIAPI
+SelfModCodeFn (
+  IN  UINTN  Input
+  )
+{
+  static UINTN  Value = 0;
+
+  return Value++;
+}
+
+/*
+ *  mov    rax,rcx; ret
+ */
+STATIC UINT8  mSelfModPatch1[] = { 0x48, 0x89, 0xC8, 0xC3 };
+
+/*
+ *  mov    rax,0xfeed; ret
+ */
+STATIC UINT8  mSelfModPatch2[] = { 0x48, 0xC7, 0xC0, 0xED, 0xFE, 0x00, 0x00, 0xC3 };
+
+STATIC
+VOID
+SelfModPatch (
+  IN  UINT8  *Patch,
+  IN  UINTN  Size
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < Size; Index++) {
+    ((UINT8 *)SelfModCodeFn)[Index] = Patch[Index];
+    asm volatile ("" : : : "memory");
+  }
+}
+
+/*
+ * Entered from native code while TestSelfModCode runs, so that with
+ * MAU_ENGINE_POOL it runs on a different engine. Phase 1 expects
+ * Patch1 and applies Patch2, phase 2 expects Patch1 again.
+ */
+STATIC
+UINT64
+EFIAPI
+SelfModNestCb (
+  IN  UINT64  Phase
+  )
+{
+  BOOLEAN  Result;
+
+  Result = SelfModCodeFn (0xf00d) == 0xf00d;
+  if (Phase == 1) {
+    SelfModPatch (mSelfModPatch2, sizeof (mSelfModPatch2));
+    Result &= SelfModCodeFn (0xf00d) == 0xfeed;
+  }
+
+  return Result;
+}
+
+#endif /* MDE_CPU_X64 */
+
+STATIC
+NO_INLINE
+VOID
+TestSelfModCode (
+  VOID
+  )
+{
+ #ifdef MDE_CPU_X64
+  LogResult ("Self-modifying code test before", SelfModCodeFn (0x1337) == 0);
+
+  SelfModPatch (mSelfModPatch1, sizeof (mSelfModPatch1));
+  LogResult ("Self-modifying code test after 1", SelfModCodeFn (0xf00d) == 0xf00d);
+
+  /*
+   * Patches done by a nested entry must be seen by the outer one,
+   * and the other way around, even when each has already translated
+   * the old code.
+   */
+  if (mTest != NULL) {
+    LogResult ("Self-modifying code test nested", mTest->TestNest (SelfModNestCb, 1) == TRUE);
+  } else {
+    SelfModPatch (mSelfModPatch2, sizeof (mSelfModPatch2));
+  }
+
+  LogResult ("Self-modifying code test after 2", SelfModCodeFn (0xf00d) == 0xfeed);
+
+  if (mTest != NULL) {
+    SelfModPatch (mSelfModPatch1, sizeof (mSelfModPatch1));
+    LogResult ("Self-modifying code test nested after 2", mTest->TestNest (SelfModNestCb, 2) == TRUE);
+  }
+
+  /*
+   * TODO:
+   * - test binary patching at a page boundary.
+   * - test binary patching using gBS->CopyMem.
+   * - test running code from a BootServiceCode pool alloc.
+   * - add AArch64 and RISC-V variants.
+   */
+ #endif /* MDE_CPU_X64 */
+}
+
+STATIC
+EFI_STATUS
+Usage (
+  IN CHAR16  *Name
+  )
+{
+  Print (L"Usage: %s [-p] [-n iterations] [-w warm-up] [-t sample ms]\n", Name);
+  Print (L"       [-f text | csv | json] [-o file] [-c baseline.csv] [-r percent] [-s prefix]\n");
+  Print (L"       [-d native.csv] [-x peer.efi]\n");
+  return EFI_INVALID_PARAMETER;
+}
+
+/*
+ * Not being run from the shell is fine, everything
+ * then just runs with the defaults.
+ */
+STATIC
+EFI_STATUS
+ParseArgs (
+  IN  EFI_HANDLE  ImageHandle,
+  OUT BOOLEAN     *PerfOnly
+  )
+{
+  UINTN            Argc;
+  CHAR16           **Argv;
+  EFI_STATUS       Status;
+  GET_OPT_CONTEXT  GetOptContext;
+
+  BenchInitConfig (&mBenchConfig);
+  *PerfOnly = FALSE;
+
+  Status = GetShellArgcArgv (ImageHandle, &Argc, &Argv);
+  if (Status != EFI_SUCCESS) {
+    return EFI_SUCCESS;
+  }
+
+  INIT_GET_OPT_CONTEXT (&GetOptContext);
+  while ((Status = GetOpt (
+                     Argc,
+                     Argv,
+                     L"nwtfocrsdx",
+                     &GetOptContext
+                     )) == EFI_SUCCESS)
+  {
+    if ((GetOptContext.Opt != L'p') && (GetOptContext.OptArg == NULL)) {
+      Print (L"Missing argument to '%c'\n", GetOptContext.Opt);
+      return Usage (Argv[0]);
+    }
+
+    switch (GetOptContext.Opt) {
+      case L'p':
+        *PerfOnly = TRUE;
+        break;
+      case L'n':
+        mBenchConfig.Iterations = StrDecimalToUintn (GetOptContext.OptArg);
+        break;
+      case L'w':
+        mBenchConfig.WarmUp = StrDecimalToUintn (GetOptContext.OptArg);
+        break;
+      case L't':
+        mBenchConfig.SampleMs = StrDecimalToUintn (GetOptContext.OptArg);
+        break;
+      case L'f':
+        if (StrCmp (GetOptContext.OptArg, L"text") == 0) {
+          mBenchConfig.Format = BenchFormatText;
+        } else if (StrCmp (GetOptContext.OptArg, L"csv") == 0) {
+          mBenchConfig.Format = BenchFormatCsv;
+        } else if (StrCmp (GetOptContext.OptArg, L"json") == 0) {
+          mBenchConfig.Format = BenchFormatJson;
+        } else {
+          Print (L"Unknown format '%s'\n", GetOptContext.OptArg);
+          return Usage (Argv[0]);
+        }
+
+        break;
+      case L'o':
+        mBenchConfig.OutFile = GetOptContext.OptArg;
+        break;
+      case L'c':
+        mBenchConfig.BaselineFile = GetOptContext.OptArg;
+        break;
+      case L'r':
+        mBenchConfig.Threshold = StrDecimalToUintn (GetOptContext.OptArg);
+        break;
+      case L's':
+        UnicodeStrToAsciiStrS (GetOptContext.OptArg, mBenchFilter, sizeof (mBenchFilter));
+        mBenchConfig.Filter = mBenchFilter;
+        break;
+      case L'd':
+        mBenchConfig.NativeFile = GetOptContext.OptArg;
+        break;
+      case L'x':
+        mPeerFile = GetOptContext.OptArg;
+        break;
+      default:
+        Print (L"Unknown option '%c'\n", GetOptContext.Opt);
+        return Usage (Argv[0]);
+    }
+  }
+
+  if ((GetOptContext.OptIndex != Argc) || (mBenchConfig.Iterations == 0) ||
+      (mBenchConfig.SampleMs == 0) || (mBenchConfig.SampleMs > BENCH_MAX_SAMPLE_MS))
+  {
+    return Usage (Argv[0]);
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+EmulatorTestEntryPoint (
+  IN  EFI_HANDLE        ImageHandle,
+  IN  EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  EFI_STATUS  Status;
+  BOOLEAN     PerfOnly;
+
+  if (TestPeerEntry (ImageHandle) || TestReloadEntry (ImageHandle)) {
+    return EFI_SUCCESS;
+  }
+
+  Status = ParseArgs (ImageHandle, &PerfOnly);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  gBS->LocateProtocol (&mEmuTestProtocolGuid, NULL, (VOID **)&mTest);
+  if (mTest == NULL) {
+    DEBUG ((DEBUG_ERROR, "EMU_TEST_PROTOCOL is missing\n"));
+  } else {
+    mTest->TestGetDebugState (&mBeginDebugState);
+    DEBUG ((DEBUG_INFO, "Initial %lu contexts\n", mBeginDebugState.ContextCount));
+  }
+
+  if (!PerfOnly) {
+    if (mTest != NULL) {
+      DoTestProtocolTests (mTest);
+
+      if (mBeginDebugState.HostMachineType !=
+          mBeginDebugState.CallerMachineType)
+      {
+        /*
+         * Only run these tests if we know we are being emulated.
+         */
+        TestNullCall ();
+        TestNullCall2 ();
+        TestNullDeref ();
+      }
+    }
+
+    TestSelfModCode ();
+    TestMpServices ();
+    TestSyntheticOpRom ();
+    TestSupportedCache ();
+    TestGopBlt ();
+    TestSnpThrottle ();
+    TestLowMem ();
+    TestHle ();
+    TestTpl ();
+ #ifdef MDE_CPU_X64
+    TestRepStrings ();
+    TestPioDelay ();
+ #endif /* MDE_CPU_X64 */
+    TestCpuSleep ();
+    TestTimer (FALSE);
+    TestTimer (TRUE);
+  }
+
+  TestPerf ();
+  DEBUG ((DEBUG_INFO, "Tests completed!\n"));
+
+  if (mTest != NULL) {
     EMU_TEST_DEBUG_STATE  DebugState;
     mTest->TestGetDebugState (&DebugState);
 
@@ -689,6 +3502,79 @@ EmulatorTestEntryPoint (
       DebugState.AArch64ExitPeriodTicks,
       DebugState.AArch64ExitPeriodTbs
       ));
+    DEBUG ((
+      DEBUG_INFO,
+      "Engine pool %lu per ISA, max depth %lu, %lu fallbacks\n",
+      DebugState.EnginePoolSize,
+      DebugState.EngineDepthMax,
+      DebugState.EngineFallbacks
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu TPL calls done on the shadow TPL\n",
+      DebugState.TplShadowCalls
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu x64 rep string ops done natively\n",
+      DebugState.X64RepStringOps
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu x64 rep ins/outs done as a single port access\n",
+      DebugState.X64RepIoOps
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu port I/O accesses done as native delays\n",
+      DebugState.PioDelayOps
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu allocations below 4GiB, %lu bounce buffers reused\n",
+      DebugState.LowMemAllocations,
+      DebugState.LowMemBounceReused
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu event notifications delivered in %lu emulation entries\n",
+      DebugState.EventNotifies,
+      DebugState.EventEntries
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu DriverBinding Supported calls cached, %lu emulated\n",
+      DebugState.SupportedCacheHits,
+      DebugState.SupportedEmulated
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu idle SNP Receive polls and %lu GetStatus calls skipped\n",
+      DebugState.SnpPollsSkipped,
+      DebugState.SnpStatusSkipped
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu library functions redirected to native code\n",
+      DebugState.HleFunctions
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu GOP Blt calls done natively, %lu emulated\n",
+      DebugState.GopBltNative,
+      DebugState.GopBltEmulated
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu PciIo calls done without leaving the engine\n",
+      DebugState.PciIoShadowCalls
+      ));
+    DEBUG ((
+      DEBUG_INFO,
+      "%lu port I/O accesses ignored, %lu done directly\n",
+      DebugState.PioRazWiOps,
+      DebugState.PioDirectOps
+      ));
 
     mTest->TestCbArgs ((VOID *)TestExit);
     return EFI_ABORTED;
@@ -8,6 +8,7 @@
 **/
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
 #include <Library/UefiLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -16,6 +17,8 @@
 #include <Library/MauUtilsLib.h>
 #include <Protocol/PciIo.h>
 #include <Protocol/Decompress.h>
+#include <Protocol/EmuTestProtocol.h>
+#include <Protocol/SyntheticOpRomProtocol.h>
 #include <IndustryStandard/Pci.h>
 
 #ifdef MDE_CPU_AARCH64
@@ -30,9 +33,21 @@
   #error
 #endif
 
-STATIC EFI_HANDLE  mImageHandle;
-STATIC BOOLEAN     mOnlyList;
-STATIC BOOLEAN     mNoConnect;
+/*
+ * How long to run SYNTHETIC_OPROM_PROTOCOL transfers for with -t.
+ */
+#define THROUGHPUT_MS  1000
+
+STATIC EFI_HANDLE         mImageHandle;
+STATIC BOOLEAN            mOnlyList;
+STATIC BOOLEAN            mNoConnect;
+STATIC BOOLEAN            mTiming;
+STATIC CHAR16             *mImageFile;
+STATIC EFI_GUID           mEmuTestProtocolGuid        = EMU_TEST_PROTOCOL_GUID;
+STATIC EFI_GUID           mSyntheticOpRomProtocolGuid = SYNTHETIC_OPROM_PROTOCOL_GUID;
+STATIC EMU_TEST_PROTOCOL  *mTest;
+STATIC UINT64             mFrequency;
+STATIC BOOLEAN            mCountsDown;
 
 STATIC
 EFI_STATUS
@@ -40,10 +55,174 @@ Usage (
   IN CHAR16  *Name
   )
 {
-  Print (L"Usage: %s [-l] [-n] [seg bus dev func]\n", Name);
+  Print (L"Usage: %s [-l] [-n] [-t] [seg bus dev func]\n", Name);
+  Print (L"       %s [-n] [-t] -f driver.efi seg bus dev func\n", Name);
   return EFI_INVALID_PARAMETER;
 }
 
+STATIC
+UINT64
+GetCounter (
+  VOID
+  )
+{
+  return mTest != NULL ? mTest->GetPerformanceCounter () : 0;
+}
+
+STATIC
+UINT64
+GetElapsedUs (
+  IN  UINT64  Start,
+  IN  UINT64  End
+  )
+{
+  if (mFrequency == 0) {
+    return 0;
+  }
+
+  return DivU64x64Remainder (
+           MultU64x32 (mCountsDown ? Start - End : End - Start, 1000000),
+           mFrequency,
+           NULL
+           );
+}
+
+/*
+ * Steady-state throughput of a driver built from Drivers/SyntheticOpRom.
+ */
+STATIC
+VOID
+MeasureThroughput (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  EFI_STATUS                Status;
+  SYNTHETIC_OPROM_PROTOCOL  *SyntheticOpRom;
+  UINTN                     Count;
+  UINT64                    Start;
+  UINT64                    Us;
+  UINT64                    TimerTicks;
+
+  Status = gBS->HandleProtocol (
+                  ControllerHandle,
+                  &mSyntheticOpRomProtocolGuid,
+                  (VOID **)&SyntheticOpRom
+                  );
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  /*
+   * Find a transfer count taking about a tenth
+   * of the run, then scale it up.
+   */
+  for (Count = 1; ; Count *= 2) {
+    Start  = GetCounter ();
+    Status = SyntheticOpRom->Transfer (SyntheticOpRom, Count);
+    Us     = GetElapsedUs (Start, GetCounter ());
+    if (EFI_ERROR (Status)) {
+      Print (L"Transfer failed: %r\n", Status);
+      return;
+    }
+
+    if ((Us >= THROUGHPUT_MS * 100) || (Count >= SIZE_1GB)) {
+      break;
+    }
+  }
+
+  Count      = (UINTN)DivU64x64Remainder (MultU64x32 (Count, THROUGHPUT_MS * 1000), MAX (Us, 1), NULL);
+  Count      = MAX (Count, 1);
+  TimerTicks = SyntheticOpRom->TimerTicks;
+  Start      = GetCounter ();
+  Status     = SyntheticOpRom->Transfer (SyntheticOpRom, Count);
+  Us         = MAX (GetElapsedUs (Start, GetCounter ()), 1);
+  TimerTicks = SyntheticOpRom->TimerTicks - TimerTicks;
+  if (EFI_ERROR (Status)) {
+    Print (L"Transfer failed: %r\n", Status);
+    return;
+  }
+
+  Print (
+    L"Throughput: %lu transfers in %lu us, %lu transfers/s, %lu KiB/s, %lu timer ticks\n",
+    (UINT64)Count,
+    Us,
+    DivU64x64Remainder (MultU64x32 (Count, 1000000), Us, NULL),
+    DivU64x64Remainder (MultU64x32 (Count, SYNTHETIC_OPROM_TRANSFER_SIZE / SIZE_1KB * 1000000), Us, NULL),
+    TimerTicks
+    );
+}
+
+STATIC
+VOID
+StartDriver (
+  IN EFI_HANDLE                ControllerHandle,
+  IN EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  IN VOID                      *Image,
+  IN UINTN                     ImageSize
+  )
+{
+  EFI_STATUS  Status;
+  EFI_HANDLE  ImageHandle;
+  UINT64      Start;
+  UINT64      Loaded;
+  UINT64      Started;
+  UINT64      Connected;
+
+  Start       = GetCounter ();
+  ImageHandle = NULL;
+  Status      = gBS->LoadImage (
+                       TRUE,
+                       mImageHandle,
+                       DevicePath,
+                       Image,
+                       ImageSize,
+                       &ImageHandle
+                       );
+  if (EFI_ERROR (Status)) {
+    Print (L"LoadImage failed: %r\n", Status);
+    if (Status == EFI_SECURITY_VIOLATION) {
+      gBS->UnloadImage (ImageHandle);
+    }
+
+    return;
+  }
+
+  Loaded  = GetCounter ();
+  Status  = gBS->StartImage (ImageHandle, NULL, NULL);
+  Started = GetCounter ();
+  if (EFI_ERROR (Status)) {
+    Print (L"StartImage failed: %r\n", Status);
+    gBS->UnloadImage (ImageHandle);
+    return;
+  }
+
+  if (mNoConnect) {
+    Print (L"Skipping connect as requested...\n");
+    Connected = Started;
+  } else {
+    EFI_HANDLE  Drivers[2] = { ImageHandle, NULL };
+    Print (L"Recursive connect...\n");
+    Status    = gBS->ConnectController (ControllerHandle, Drivers, NULL, TRUE);
+    Connected = GetCounter ();
+    if (EFI_ERROR (Status)) {
+      Print (L"ConnectController: %r\n", Status);
+    }
+  }
+
+  if (mTiming) {
+    Print (
+      L"Load %lu us, start %lu us, connect %lu us, total %lu us\n",
+      GetElapsedUs (Start, Loaded),
+      GetElapsedUs (Loaded, Started),
+      GetElapsedUs (Started, Connected),
+      GetElapsedUs (Start, Connected)
+      );
+    if (!EFI_ERROR (Status) && !mNoConnect) {
+      MeasureThroughput (ControllerHandle);
+    }
+  }
+}
+
 STATIC
 VOID
 LoadImage (
@@ -55,7 +234,6 @@ LoadImage (
   VOID                                     *Image;
   UINTN                                    ImageSize;
   EFI_STATUS                               Status;
-  EFI_HANDLE                               ImageHandle;
   UINTN                                    InitializationSize;
   EFI_PCI_EXPANSION_ROM_HEADER             *EfiRomHeader;
   MEDIA_RELATIVE_OFFSET_RANGE_DEVICE_PATH  DeviceNode;
@@ -143,40 +321,7 @@ LoadImage (
     goto done;
   }
 
-  ImageHandle = NULL;
-  Status      = gBS->LoadImage (
-                       TRUE,
-                       mImageHandle,
-                       DevicePath,
-                       Image,
-                       ImageSize,
-                       &ImageHandle
-                       );
-  if (EFI_ERROR (Status)) {
-    Print (L"LoadImage failed: %r\n", Status);
-    if (Status == EFI_SECURITY_VIOLATION) {
-      gBS->UnloadImage (ImageHandle);
-    }
-
-    goto done;
-  }
-
-  Status = gBS->StartImage (ImageHandle, NULL, NULL);
-  if (EFI_ERROR (Status)) {
-    Print (L"StartImage failed: %r\n", Status);
-    gBS->UnloadImage (ImageHandle);
-  } else {
-    if (mNoConnect) {
-      Print (L"Skipping connect as requested...\n");
-    } else {
-      EFI_HANDLE  Drivers[2] = { ImageHandle, NULL };
-      Print (L"Recursive connect...\n");
-      Status = gBS->ConnectController (ControllerHandle, Drivers, NULL, TRUE);
-      if (EFI_ERROR (Status)) {
-        Print (L"ConnectController: %r\n", Status);
-      }
-    }
-  }
+  StartDriver (ControllerHandle, DevicePath, Image, ImageSize);
 
 done:
   if (EfiRomHeader->CompressionType != 0) {
@@ -374,6 +519,31 @@ AnalyzeROM (
   return EFI_SUCCESS;
 }
 
+/*
+ * For trying out drivers not in the OpRom, or devices without one
+ * (e.g. SyntheticOpRom with MockPciDevice).
+ */
+STATIC
+EFI_STATUS
+LoadImageFile (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  EFI_STATUS  Status;
+  VOID        *Image;
+  UINTN       ImageSize;
+
+  Status = ReadShellFile (mImageFile, &Image, &ImageSize);
+  if (EFI_ERROR (Status)) {
+    Print (L"Couldn't read '%s': %r\n", mImageFile, Status);
+    return Status;
+  }
+
+  StartDriver (ControllerHandle, NULL, Image, ImageSize);
+  FreePool (Image);
+  return EFI_SUCCESS;
+}
+
 EFI_STATUS
 EFIAPI
 EntryPoint (
@@ -410,7 +580,7 @@ EntryPoint (
   while ((Status = GetOpt (
                      Argc,
                      Argv,
-                     L"",
+                     L"f",
                      &GetOptContext
                      )) == EFI_SUCCESS)
   {
@@ -421,6 +591,16 @@ EntryPoint (
       case L'n':
         mNoConnect = TRUE;
         break;
+      case L't':
+        mTiming = TRUE;
+        break;
+      case L'f':
+        if (GetOptContext.OptArg == NULL) {
+          return Usage (Argv[0]);
+        }
+
+        mImageFile = GetOptContext.OptArg;
+        break;
       default:
         Print (L"Unknown option '%c'\n", GetOptContext.Opt);
         return Usage (Argv[0]);
@@ -445,6 +625,24 @@ EntryPoint (
       return Usage (Argv[0]);
   }
 
+  if ((mImageFile != NULL) && (AllDevs || mOnlyList)) {
+    return Usage (Argv[0]);
+  }
+
+  if (mTiming) {
+    UINT64  StartValue;
+    UINT64  EndValue;
+
+    Status = gBS->LocateProtocol (&mEmuTestProtocolGuid, NULL, (VOID **)&mTest);
+    if (EFI_ERROR (Status)) {
+      Print (L"-t needs EMU_TEST_PROTOCOL, provided by DEBUG EmulatorDxe builds\n");
+      return Status;
+    }
+
+    mFrequency  = mTest->GetPerformanceCounterProperties (&StartValue, &EndValue);
+    mCountsDown = StartValue > EndValue;
+  }
+
   PciCount   = 0;
   PciHandles = NULL;
   Status     = gBS->LocateHandleBuffer (
@@ -502,6 +700,11 @@ EntryPoint (
       }
     }
 
+    if (mImageFile != NULL) {
+      Status = LoadImageFile (PciHandles[PciIndex]);
+      break;
+    }
+
     Status = AnalyzeROM (
                Seg,
                Bus,
@@ -0,0 +1,583 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <unicorn.h>
+#include "Emulator.h"
+#include <Library/PrintLib.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#ifdef MAU_BB_TRACE
+
+/*
+ * Block table is sized by image size (assuming ~16 bytes per TB),
+ * within these bounds, and is never grown. Tables are at most
+ * 3/4 full to keep probe sequences short.
+ */
+#define BB_TRACE_BLOCK_BITS_MIN  10
+#define BB_TRACE_BLOCK_BITS_MAX  18
+#define BB_TRACE_CALL_BITS       10
+#define BB_TRACE_LIMIT(Bits)  ((1U << (Bits)) / 4 * 3)
+#define BB_TRACE_HASH(Key, Bits)  ((UINT32)((Key) * 0x9E3779B97F4A7C15ULL >> (64 - (Bits))))
+
+struct BbTraceImage {
+  LIST_ENTRY            Link;
+  ImageRecord           *Record;
+  /*
+   * One per engine of the ISA (see CPU_NEXT_ENGINE).
+   */
+  uc_hook               Hooks[1 + CPU_ENGINE_POOL_SIZE];
+  CHAR8                 Name[64];
+  UINT32                BlockBits;
+  UINT32                BlockCount;
+  UINT64                BlocksDropped;
+  EMU_BB_TRACE_BLOCK    *Blocks;
+  UINT32                CallCount;
+  UINT64                CallsDropped;
+  EMU_BB_TRACE_CALL     *Calls;
+};
+
+STATIC LIST_ENTRY  mBbTraceList = INITIALIZE_LIST_HEAD_VARIABLE (mBbTraceList);
+STATIC EFI_GUID    mEmuBbTraceProtocolGuid = EMU_BB_TRACE_PROTOCOL_GUID;
+
+/*
+ * Only called from within uc_emu_start, so always with
+ * interrupts disabled.
+ */
+STATIC
+VOID
+BbTraceBlockCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Address,
+  IN  UINT32     Size,
+  IN  VOID       *UserData
+  )
+{
+  UINT32              Index;
+  UINT32              Offset;
+  EMU_BB_TRACE_BLOCK  *Block;
+  BbTraceImage        *Trace = UserData;
+
+  Offset = (UINT32)(Address - Trace->Record->ImageBase);
+  Index  = BB_TRACE_HASH (Offset, Trace->BlockBits);
+
+  for ( ; ;) {
+    Block = &Trace->Blocks[Index];
+    if (Block->Count == 0) {
+      if (Trace->BlockCount == BB_TRACE_LIMIT (Trace->BlockBits)) {
+        Trace->BlocksDropped++;
+        return;
+      }
+
+      Trace->BlockCount++;
+      Block->Offset = Offset;
+      Block->Size   = Size;
+      Block->Count  = 1;
+      return;
+    }
+
+    if (Block->Offset == Offset) {
+      /*
+       * The same address can start TBs of different length,
+       * e.g. after a TB got split by uc_emu_stop.
+       */
+      Block->Size = MAX (Block->Size, Size);
+      Block->Count++;
+      return;
+    }
+
+    Index = (Index + 1) & ((1U << Trace->BlockBits) - 1);
+  }
+}
+
+VOID
+BbTraceNativeCall (
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  Target
+  )
+{
+  UINT32             Index;
+  UINT32             Offset;
+  BOOLEAN            InterruptState;
+  ImageRecord        *Record;
+  BbTraceImage       *Trace;
+  EMU_BB_TRACE_CALL  *Call;
+
+  Record = ImageFindByAddress (ReturnAddress);
+  if ((Record == NULL) || (Record->BbTrace == NULL)) {
+    return;
+  }
+
+  Trace  = Record->BbTrace;
+  Offset = (UINT32)(ReturnAddress - Record->ImageBase);
+  Index  = BB_TRACE_HASH (Offset ^ Target, BB_TRACE_CALL_BITS);
+
+  /*
+   * Unlike BbTraceBlockCb, this can be interrupted by
+   * events running emulated code from the same image.
+   */
+  InterruptState = SaveAndDisableInterrupts ();
+  for ( ; ;) {
+    Call = &Trace->Calls[Index];
+    if (Call->Count == 0) {
+      if (Trace->CallCount == BB_TRACE_LIMIT (BB_TRACE_CALL_BITS)) {
+        Trace->CallsDropped++;
+        break;
+      }
+
+      Trace->CallCount++;
+      Call->ReturnOffset = Offset;
+      Call->Target       = Target;
+      Call->Count        = 1;
+      break;
+    }
+
+    if ((Call->ReturnOffset == Offset) && (Call->Target == Target)) {
+      Call->Count++;
+      break;
+    }
+
+    Index = (Index + 1) & ((1U << BB_TRACE_CALL_BITS) - 1);
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+STATIC
+VOID
+BbTraceSetName (
+  IN  BbTraceImage  *Trace
+  )
+{
+  CHAR8  *Pdb;
+  CHAR8  *Base;
+  UINTN  Index;
+
+  /*
+   * Turns e.g. "c:\build\X64\Foo\DEBUG\FooDxe.pdb" into "FooDxe",
+   * which is then used as part of the file name.
+   */
+  Pdb = PeCoffLoaderGetPdbPointer ((VOID *)(UINTN)Trace->Record->ImageBase);
+  if (Pdb == NULL) {
+    AsciiStrCpyS (Trace->Name, sizeof (Trace->Name), "Image");
+    return;
+  }
+
+  for (Base = Pdb; *Pdb != '\0'; Pdb++) {
+    if ((*Pdb == '\\') || (*Pdb == '/')) {
+      Base = Pdb + 1;
+    }
+  }
+
+  for (Index = 0; Index < sizeof (Trace->Name) - 1; Index++) {
+    if ((Base[Index] == '\0') || (Base[Index] == '.')) {
+      break;
+    }
+
+    if (((Base[Index] >= 'a') && (Base[Index] <= 'z')) ||
+        ((Base[Index] >= 'A') && (Base[Index] <= 'Z')) ||
+        ((Base[Index] >= '0') && (Base[Index] <= '9')))
+    {
+      Trace->Name[Index] = Base[Index];
+    } else {
+      Trace->Name[Index] = '_';
+    }
+  }
+
+  Trace->Name[Index] = '\0';
+}
+
+STATIC
+EFI_STATUS
+BbTraceOpenRoot (
+  OUT EFI_FILE_PROTOCOL  **Root
+  )
+{
+  EFI_STATUS                       Status;
+  UINTN                            HandleCount;
+  EFI_HANDLE                       *Handles;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *Fs;
+
+  /*
+   * Prefer the volume EmulatorDxe was loaded from. For
+   * directly-included builds, fall back to the first file
+   * system around, which is usually the ESP.
+   */
+  Status = gBS->HandleProtocol (
+                  gDriverImage->DeviceHandle,
+                  &gEfiSimpleFileSystemProtocolGuid,
+                  (VOID **)&Fs
+                  );
+  if (EFI_ERROR (Status)) {
+    Status = gBS->LocateHandleBuffer (
+                    ByProtocol,
+                    &gEfiSimpleFileSystemProtocolGuid,
+                    NULL,
+                    &HandleCount,
+                    &Handles
+                    );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Status = gBS->HandleProtocol (
+                    Handles[0],
+                    &gEfiSimpleFileSystemProtocolGuid,
+                    (VOID **)&Fs
+                    );
+    FreePool (Handles);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  return Fs->OpenVolume (Fs, Root);
+}
+
+STATIC
+EFI_STATUS
+BbTraceSaveImage (
+  IN  BbTraceImage       *Trace,
+  IN  EFI_FILE_PROTOCOL  *Root
+  )
+{
+  EFI_STATUS                Status;
+  UINTN                     Index;
+  UINTN                     BufferSize;
+  UINTN                     WriteSize;
+  UINT32                    MaxBlocks;
+  UINT32                    MaxCalls;
+  BOOLEAN                   InterruptState;
+  EMU_BB_TRACE_FILE_HEADER  *Header;
+  EMU_BB_TRACE_BLOCK        *Blocks;
+  EMU_BB_TRACE_CALL         *Calls;
+  EFI_FILE_PROTOCOL         *File;
+  CHAR16                    FileName[128];
+
+  /*
+   * The tables can keep growing while the buffer is allocated,
+   * so anything past the counts seen here is not saved.
+   */
+  MaxBlocks  = Trace->BlockCount;
+  MaxCalls   = Trace->CallCount;
+  BufferSize = sizeof (*Header) + MaxBlocks * sizeof (*Blocks) +
+               MaxCalls * sizeof (*Calls);
+  Header = AllocateZeroPool (BufferSize);
+  if (Header == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Blocks = (VOID *)(Header + 1);
+  Calls  = (VOID *)(Blocks + MaxBlocks);
+
+  Header->Signature   = EMU_BB_TRACE_SIGNATURE;
+  Header->Version     = EMU_BB_TRACE_VERSION;
+  Header->MachineType = Trace->Record->Cpu->EmuMachineType;
+  Header->ImageBase   = Trace->Record->ImageBase;
+  Header->ImageSize   = Trace->Record->ImageSize;
+  Header->ImageEntry  = Trace->Record->ImageEntry;
+  CopyMem (Header->Name, Trace->Name, sizeof (Header->Name));
+
+  InterruptState = SaveAndDisableInterrupts ();
+  for (Index = 0; Index < (1U << Trace->BlockBits) &&
+       Header->BlockCount < MaxBlocks; Index++)
+  {
+    if (Trace->Blocks[Index].Count != 0) {
+      Blocks[Header->BlockCount++] = Trace->Blocks[Index];
+    }
+  }
+
+  for (Index = 0; Index < (1U << BB_TRACE_CALL_BITS) &&
+       Header->CallCount < MaxCalls; Index++)
+  {
+    if (Trace->Calls[Index].Count != 0) {
+      Calls[Header->CallCount++] = Trace->Calls[Index];
+    }
+  }
+
+  Header->BlocksDropped = Trace->BlocksDropped;
+  Header->CallsDropped  = Trace->CallsDropped;
+  SetInterruptState (InterruptState);
+
+  UnicodeSPrint (
+    FileName,
+    sizeof (FileName),
+    L"\\MauBb-%a-%lx.bin",
+    Trace->Name,
+    Trace->Record->ImageBase
+    );
+
+  /*
+   * Get rid of any older (and possibly larger) file first.
+   */
+  Status = Root->Open (Root, &File, FileName, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+  if (!EFI_ERROR (Status)) {
+    File->Delete (File);
+  }
+
+  Status = Root->Open (
+                   Root,
+                   &File,
+                   FileName,
+                   EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                   0
+                   );
+  if (!EFI_ERROR (Status)) {
+    WriteSize = BufferSize;
+    Status    = File->Write (File, &WriteSize, Header);
+    File->Close (File);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Couldn't save '%s': %r\n", FileName, Status));
+  } else {
+    DEBUG ((DEBUG_INFO, "Saved %u blocks to '%s'\n", Header->BlockCount, FileName));
+  }
+
+  FreePool (Header);
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+BbTraceSave (
+  VOID
+  )
+{
+  EFI_STATUS         Status;
+  EFI_STATUS         SaveStatus;
+  LIST_ENTRY         *Entry;
+  EFI_FILE_PROTOCOL  *Root;
+
+  Status = BbTraceOpenRoot (&Root);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "No volume to save block traces to: %r\n", Status));
+    return Status;
+  }
+
+  for (Entry = GetFirstNode (&mBbTraceList);
+       !IsNull (&mBbTraceList, Entry);
+       Entry = GetNextNode (&mBbTraceList, Entry))
+  {
+    SaveStatus = BbTraceSaveImage (BASE_CR (Entry, BbTraceImage, Link), Root);
+    if (EFI_ERROR (SaveStatus)) {
+      Status = SaveStatus;
+    }
+  }
+
+  Root->Close (Root);
+  return Status;
+}
+
+STATIC
+VOID
+EFIAPI
+BbTraceReset (
+  VOID
+  )
+{
+  BOOLEAN       InterruptState;
+  LIST_ENTRY    *Entry;
+  BbTraceImage  *Trace;
+
+  InterruptState = SaveAndDisableInterrupts ();
+  for (Entry = GetFirstNode (&mBbTraceList);
+       !IsNull (&mBbTraceList, Entry);
+       Entry = GetNextNode (&mBbTraceList, Entry))
+  {
+    Trace = BASE_CR (Entry, BbTraceImage, Link);
+    ZeroMem (Trace->Blocks, sizeof (*Trace->Blocks) << Trace->BlockBits);
+    ZeroMem (Trace->Calls, sizeof (*Trace->Calls) << BB_TRACE_CALL_BITS);
+    Trace->BlockCount    = 0;
+    Trace->CallCount     = 0;
+    Trace->BlocksDropped = 0;
+    Trace->CallsDropped  = 0;
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+STATIC EMU_BB_TRACE_PROTOCOL  mEmuBbTraceProtocol = {
+  EMU_BB_TRACE_VERSION,
+  BbTraceSave,
+  BbTraceReset
+};
+
+STATIC
+VOID
+BbTraceFree (
+  IN  BbTraceImage  *Trace
+  )
+{
+  if (Trace->Blocks != NULL) {
+    FreePool (Trace->Blocks);
+  }
+
+  if (Trace->Calls != NULL) {
+    FreePool (Trace->Calls);
+  }
+
+  FreePool (Trace);
+}
+
+/*
+ * Removes the hooks of the first Count engines. Not safe
+ * to call while we are in JIT (uc_emu_start).
+ */
+STATIC
+VOID
+BbTraceHooksDel (
+  IN  BbTraceImage  *Trace,
+  IN  UINTN         Count
+  )
+{
+  UINTN       Index;
+  CpuContext  *Engine;
+
+  for (Engine = Trace->Record->Cpu, Index = 0;
+       Engine != NULL && Index < Count;
+       Engine = CPU_NEXT_ENGINE (Engine), Index++)
+  {
+    uc_hook_del (Engine->UE, Trace->Hooks[Index]);
+  }
+}
+
+VOID
+BbTraceImageRegister (
+  IN  ImageRecord  *Record
+  )
+{
+  uc_err        UcErr;
+  UINTN         Index;
+  CpuContext    *Engine;
+  BbTraceImage  *Trace;
+
+  Record->BbTrace = NULL;
+
+  Trace = AllocateZeroPool (sizeof (*Trace));
+  if (Trace == NULL) {
+    return;
+  }
+
+  Trace->Record    = Record;
+  Trace->BlockBits = (UINT32)HighBitSet64 (MAX (Record->ImageSize / 16, 1));
+  Trace->BlockBits = MIN (MAX (Trace->BlockBits, BB_TRACE_BLOCK_BITS_MIN), BB_TRACE_BLOCK_BITS_MAX);
+  Trace->Blocks    = AllocateZeroPool (sizeof (*Trace->Blocks) << Trace->BlockBits);
+  Trace->Calls     = AllocateZeroPool (sizeof (*Trace->Calls) << BB_TRACE_CALL_BITS);
+  if ((Trace->Blocks == NULL) || (Trace->Calls == NULL)) {
+    DEBUG ((DEBUG_ERROR, "No memory to trace image 0x%lx\n", Record->ImageBase));
+    BbTraceFree (Trace);
+    return;
+  }
+
+  BbTraceSetName (Trace);
+
+  /*
+   * uc_hook_add is not safe to call while we are in JIT (uc_emu_start).
+   * Every engine of the ISA can run the image, so all of them are hooked.
+   */
+  CriticalBegin ();
+  for (Engine = Record->Cpu, Index = 0;
+       Engine != NULL;
+       Engine = CPU_NEXT_ENGINE (Engine), Index++)
+  {
+    ASSERT (Index < ARRAY_SIZE (Trace->Hooks));
+    UcErr = uc_hook_add (
+              Engine->UE,
+              &Trace->Hooks[Index],
+              UC_HOOK_BLOCK,
+              BbTraceBlockCb,
+              Trace,
+              Record->ImageBase,
+              Record->ImageBase + Record->ImageSize - 1
+              );
+    if (UcErr != UC_ERR_OK) {
+      break;
+    }
+  }
+
+  if (UcErr != UC_ERR_OK) {
+    BbTraceHooksDel (Trace, Index);
+  }
+
+  CriticalEnd ();
+  if (UcErr != UC_ERR_OK) {
+    DEBUG ((DEBUG_ERROR, "Block trace hook failed: %a\n", uc_strerror (UcErr)));
+    BbTraceFree (Trace);
+    return;
+  }
+
+  InsertTailList (&mBbTraceList, &Trace->Link);
+  Record->BbTrace = Trace;
+}
+
+VOID
+BbTraceImageUnregister (
+  IN  ImageRecord  *Record
+  )
+{
+  EFI_STATUS         Status;
+  EFI_FILE_PROTOCOL  *Root;
+  BbTraceImage       *Trace;
+
+  Trace = Record->BbTrace;
+  if (Trace == NULL) {
+    return;
+  }
+
+  CriticalBegin ();
+  BbTraceHooksDel (Trace, ARRAY_SIZE (Trace->Hooks));
+  CriticalEnd ();
+
+  Status = BbTraceOpenRoot (&Root);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "No volume to save block trace to: %r\n", Status));
+  } else {
+    BbTraceSaveImage (Trace, Root);
+    Root->Close (Root);
+  }
+
+  RemoveEntryList (&Trace->Link);
+  BbTraceFree (Trace);
+  Record->BbTrace = NULL;
+}
+
+VOID
+BbTraceInit (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = gBS->InstallProtocolInterface (
+                  &ImageHandle,
+                  &mEmuBbTraceProtocolGuid,
+                  EFI_NATIVE_INTERFACE,
+                  &mEmuBbTraceProtocol
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "InstallProtocolInterface failed: %r\n", Status));
+  }
+}
+
+VOID
+BbTraceCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  gBS->UninstallProtocolInterface (
+         ImageHandle,
+         &mEmuBbTraceProtocolGuid,
+         &mEmuBbTraceProtocol
+         );
+}
+
+#endif /* MAU_BB_TRACE */
@@ -62,7 +62,9 @@ CpuIsNativeCb (
   IN  VOID       *UserData
   )
 {
-  if ((Address == RETURN_TO_NATIVE_MAGIC) || EmulatorIsNativeCall (Address)) {
+  CpuContext  *Cpu = UserData;
+
+  if ((Address == RETURN_TO_NATIVE_MAGIC) || EmulatorIsNativeCall (Cpu, Address)) {
     return TRUE;
   }
 
@@ -108,27 +110,12 @@ CpuIoReadCb (
   IN  VOID       *UserData
   )
 {
-  UINT32  Result = 0;
-
-  if (gCpuIo2 != NULL) {
-    switch (Size) {
-      case 1:
-        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint8, Port, 1, &Result);
-        break;
-      case 2:
-        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint16, Port, 1, &Result);
-        break;
-      default:
-        ASSERT (Size == 4);
-        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint32, Port, 1, &Result);
-        break;
-    }
-  }
+  UINT32  Result;
 
+  Result = PioRead (Port, Size);
   DEBUG ((
     DEBUG_VERBOSE,
-    "%aPCI I/O read%u from 0x%x = 0x%x\n",
-    gCpuIo2 == NULL ? "Ignored " : "",
+    "PCI I/O read%u from 0x%x = 0x%x\n",
     Size,
     Port,
     Result
@@ -148,27 +135,13 @@ CpuIoWriteCb (
 {
   DEBUG ((
     DEBUG_VERBOSE,
-    "%aPCI I/O write%u to 0x%x = 0x%x\n",
-    gCpuIo2 == NULL ? "Ignoring " : "",
+    "PCI I/O write%u to 0x%x = 0x%x\n",
     Size,
     Port,
     Value
     ));
 
-  if (gCpuIo2 != NULL) {
-    switch (Size) {
-      case 1:
-        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint8, Port, 1, &Value);
-        break;
-      case 2:
-        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint16, Port, 1, &Value);
-        break;
-      default:
-        ASSERT (Size == 4);
-        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint32, Port, 1, &Value);
-        break;
-    }
-  }
+  PioWrite (Port, Size, Value);
 }
 
 STATIC
@@ -242,15 +215,40 @@ CpuCleanupEx (
    */
 }
 
+#ifdef MAU_ENGINE_POOL
+STATIC
+VOID
+CpuCleanupPool (
+  IN  CpuContext  *Cpu
+  )
+{
+  CpuContext  *Engine;
+
+  while (Cpu->NextEngine != NULL) {
+    Engine          = Cpu->NextEngine;
+    Cpu->NextEngine = Engine->NextEngine;
+    CpuCleanupEx (Engine);
+    FreePool (Engine);
+  }
+}
+
+#endif /* MAU_ENGINE_POOL */
+
 VOID
 CpuCleanup (
   VOID
   )
 {
  #ifdef MAU_SUPPORTS_X64_BINS
+ #ifdef MAU_ENGINE_POOL
+  CpuCleanupPool (&CpuX64);
+ #endif /* MAU_ENGINE_POOL */
   CpuCleanupEx (&CpuX64);
  #endif /* MAU_SUPPORTS_X64_BINS */
  #ifdef MAU_SUPPORTS_AARCH64_BINS
+ #ifdef MAU_ENGINE_POOL
+  CpuCleanupPool (&CpuAArch64);
+ #endif /* MAU_ENGINE_POOL */
   CpuCleanupEx (&CpuAArch64);
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
 }
@@ -355,6 +353,93 @@ CpuStackPush64 (
   *(UINT64 *)Rsp = Val;
 }
 
+#if defined (MAU_SHADOW_TPL) || defined (MAU_FAST_PCI_IO)
+
+/*
+ * For completing a call to native code without leaving the
+ * engine: fetches the first Count (up to 8) EFIAPI arguments
+ * of the call.
+ */
+VOID
+CpuGetCallArgs (
+  IN  CpuContext  *Cpu,
+  OUT UINT64      *Args,
+  IN  UINTN       Count
+  )
+{
+  UINTN   Index;
+  UINT64  *StackArgs;
+
+  STATIC CONST INT32  X64Regs[] = {
+    UC_X86_REG_RCX, UC_X86_REG_RDX, UC_X86_REG_R8, UC_X86_REG_R9
+  };
+
+  ASSERT (Count <= 8);
+
+  if (Cpu->EmuMachineType == EFI_IMAGE_MACHINE_X64) {
+    /*
+     * Return address, then the home space for the
+     * register arguments.
+     */
+    StackArgs = (UINT64 *)REG_READ (Cpu, UC_X86_REG_RSP) + 1;
+    for (Index = 0; Index < Count; Index++) {
+      Args[Index] = Index < ARRAY_SIZE (X64Regs) ?
+                    REG_READ (Cpu, X64Regs[Index]) : StackArgs[Index];
+    }
+  } else {
+    for (Index = 0; Index < Count; Index++) {
+      Args[Index] = REG_READ (Cpu, UC_ARM64_REG_X0 + Index);
+    }
+  }
+}
+
+/*
+ * Completes the call with the return value Ret, returning
+ * the address to continue emulation at.
+ */
+UINT64
+CpuCallReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  )
+{
+  if (Cpu->EmuMachineType == EFI_IMAGE_MACHINE_X64) {
+    REG_WRITE (Cpu, UC_X86_REG_RAX, Ret);
+    return CpuStackPop64 (Cpu);
+  }
+
+  REG_WRITE (Cpu, UC_ARM64_REG_X0, Ret);
+  return REG_READ (Cpu, UC_ARM64_REG_LR);
+}
+
+/*
+ * Called with UC_ERR_FIND_TB, i.e. on a call to native code.
+ * Returns the address to continue emulation at if the call
+ * was completed without leaving the engine, or 0.
+ */
+STATIC
+UINT64
+CpuShadowCall (
+  IN  CpuRunContext  *Context
+  )
+{
+  UINT64  ProgramCounter;
+
+  ProgramCounter = 0;
+ #ifdef MAU_SHADOW_TPL
+  ProgramCounter = TplShadowCall (Context);
+ #endif /* MAU_SHADOW_TPL */
+ #ifdef MAU_FAST_PCI_IO
+  if (ProgramCounter == 0) {
+    ProgramCounter = PciIoShadowCall (Context);
+  }
+
+ #endif /* MAU_FAST_PCI_IO */
+  return ProgramCounter;
+}
+
+#endif /* MAU_SHADOW_TPL || MAU_FAST_PCI_IO */
+
 #ifdef MAU_SUPPORTS_AARCH64_BINS
 STATIC
 VOID
@@ -732,6 +817,8 @@ CpuInitEx (
     return Status;
   }
 
+  Cpu->Primary = Cpu;
+
   /*
    * Prefer to put the emulated stack below 4GiB to deal
    * with x64 code that may work incorrectly with 64-bit
@@ -756,9 +843,11 @@ CpuInitEx (
     return EFI_UNSUPPORTED;
   }
 
+  AllocConfig.Name            = "CpuRunContext";
   AllocConfig.ObjectSize      = sizeof (CpuRunContext);
   AllocConfig.ObjectAlignment = sizeof (VOID *);
   AllocConfig.ObjectCount     = MAX_CPU_RUN_CONTEXTS;
+  AllocConfig.Growable        = FALSE;
   AllocConfig.CbContext       = Cpu;
   AllocConfig.Signature       = Cpu->EmuMachineType;
 
@@ -817,7 +906,7 @@ CpuInitEx (
             &IsNativeHook,
             UC_HOOK_TB_FIND_FAILURE,
             CpuIsNativeCb,
-            NULL,
+            Cpu,
             1,
             0
             );
@@ -894,6 +983,14 @@ CpuInitEx (
     return EFI_UNSUPPORTED;
   }
 
+ #ifdef MAU_CALL_RECORD
+  Status = RecordCpuInit (Cpu);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+ #endif /* MAU_CALL_RECORD */
+
   /*
    * Don't want to set an exit, to avoid the useless tb flush on every
    * uc_emu_start return. uc_ctl_exits_enable also disables the 'until'
@@ -926,8 +1023,6 @@ CpuInitEx (
   UcErr = uc_context_save (Cpu->UE, Cpu->InitialState);
   ASSERT (UcErr == UC_ERR_OK);
 
-  mTopContext = NULL;
-
  #ifndef MAU_EMU_TIMEOUT_NONE
   Cpu->TbCount         = 0;
   Cpu->ExitPeriodTbs   = UC_EMU_EXIT_PERIOD_TB_INITIAL;
@@ -943,6 +1038,48 @@ CpuInitEx (
   return EFI_SUCCESS;
 }
 
+#ifdef MAU_ENGINE_POOL
+
+/*
+ * Every engine has its own emulated stack and code buffer, but maps
+ * the same memory, so any of them can run any image of the ISA.
+ * Code ranges are kept in sync by CpuRegisterCodeRange.
+ */
+STATIC
+EFI_STATUS
+CpuInitPool (
+  IN  uc_arch     Arch,
+  IN  CpuContext  *Cpu
+  )
+{
+  EFI_STATUS  Status;
+  CpuContext  *Engine;
+  CpuContext  *Last;
+  UINTN       Index;
+
+  Last = Cpu;
+  for (Index = 0; Index < CPU_ENGINE_POOL_SIZE; Index++) {
+    Engine = AllocateZeroPool (sizeof (*Engine));
+    if (Engine == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = CpuInitEx (Arch, Engine);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a engine %u: %r\n", Cpu->Name, Index + 1, Status));
+      return Status;
+    }
+
+    Engine->Primary  = Cpu;
+    Last->NextEngine = Engine;
+    Last             = Engine;
+  }
+
+  return EFI_SUCCESS;
+}
+
+#endif /* MAU_ENGINE_POOL */
+
 EFI_STATUS
 CpuInit (
   VOID
@@ -955,12 +1092,21 @@ CpuInit (
     return Status;
   }
 
+  mTopContext = NULL;
+
  #ifdef MAU_SUPPORTS_X64_BINS
   Status = CpuInitEx (UC_ARCH_X86, &CpuX64);
   if (EFI_ERROR (Status)) {
     return Status;
   }
 
+ #ifdef MAU_ENGINE_POOL
+  Status = CpuInitPool (UC_ARCH_X86, &CpuX64);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+ #endif /* MAU_ENGINE_POOL */
  #endif /* MAU_SUPPORTS_X64_BINS*/
 
  #ifdef MAU_SUPPORTS_AARCH64_BINS
@@ -969,6 +1115,13 @@ CpuInit (
     return Status;
   }
 
+ #ifdef MAU_ENGINE_POOL
+  Status = CpuInitPool (UC_ARCH_ARM64, &CpuAArch64);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+ #endif /* MAU_ENGINE_POOL */
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
 
   return EFI_SUCCESS;
@@ -1049,26 +1202,28 @@ CpuRunCtxInternal (
   )
 {
   uc_err         UcErr;
+  UINT64         Ret;
   CpuExitReason  ExitReason;
   UINT64         *Args          = Context->Args;
   UINT64         ProgramCounter = Context->ProgramCounter;
   CpuContext     *Cpu           = Context->Cpu;
 
-  DEBUG ((
-    DEBUG_VERBOSE,
-    "%a fn %lx(%lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx)\n",
-    Cpu->Name,
+  TRACE_EVENT (
+    EmuTraceEnterEmulation,
+    Cpu->EmuMachineType,
     ProgramCounter,
     Args[0],
     Args[1],
-    Args[2],
-    Args[3],
-    Args[4],
-    Args[5],
-    Args[6],
-    Args[7],
-    Args[8]
-    ));
+    Cpu->Contexts
+    );
+
+  /*
+   * Before EmuThunkPre, to capture the stack pointer before
+   * any arguments are pushed.
+   */
+ #ifdef MAU_CALL_RECORD
+  RecordEmuCall (Cpu, ProgramCounter, Args, RETURN_TO_NATIVE_MAGIC);
+ #endif /* MAU_CALL_RECORD */
 
   ASSERT (Cpu->EmuThunkPre != NULL);
   Cpu->EmuThunkPre (Cpu, Args);
@@ -1093,6 +1248,20 @@ CpuRunCtxInternal (
  #endif /* MAU_EMU_TIMEOUT_NONE */
 
       UcErr = uc_emu_start (Cpu->UE, ProgramCounter, 0, 0, 0);
+ #if defined (MAU_SHADOW_TPL) || defined (MAU_FAST_PCI_IO)
+      while (UcErr == UC_ERR_FIND_TB) {
+        ProgramCounter = CpuShadowCall (Context);
+        if (ProgramCounter == 0) {
+          break;
+        }
+
+        UcErr = uc_emu_start (Cpu->UE, ProgramCounter, 0, 0, 0);
+      }
+
+ #endif /* MAU_SHADOW_TPL || MAU_FAST_PCI_IO */
+ #ifdef MAU_SHADOW_TPL
+      TplSync (Context);
+ #endif /* MAU_SHADOW_TPL */
       ASSERT (!GetInterruptState ());
 
  #ifndef MAU_EMU_TIMEOUT_NONE
@@ -1100,6 +1269,15 @@ CpuRunCtxInternal (
         Cpu->StoppedOnTimeout = FALSE;
         UINT64  Ticks = GetPerformanceCounter ();
 
+        TRACE_EVENT (
+          EmuTraceSliceExpiry,
+          Cpu->EmuMachineType,
+          REG_READ (Cpu, Cpu->ProgramCounterReg),
+          Cpu->ExitPeriodTbs,
+          Ticks - TimeoutAbsTicks,
+          0
+          );
+
         if (Ticks > TimeoutAbsTicks) {
           if (Cpu->ExitPeriodTbs > UC_EMU_EXIT_PERIOD_TB_MIN) {
             Cpu->ExitPeriodTbs = Cpu->ExitPeriodTbs >> 1;
@@ -1157,11 +1335,24 @@ CpuRunCtxInternal (
   if (ExitReason != CPU_REASON_FAILED_EMU) {
     ASSERT (Cpu->EmuThunkPost != NULL);
     Cpu->EmuThunkPost (Cpu, Args);
+    Ret = REG_READ (Cpu, Cpu->ReturnValueReg);
   } else {
-    return EFI_UNSUPPORTED;
+    Ret = EFI_UNSUPPORTED;
   }
 
-  return REG_READ (Cpu, Cpu->ReturnValueReg);
+ #ifdef MAU_CALL_RECORD
+  RecordEmuReturn (Cpu, Ret);
+ #endif /* MAU_CALL_RECORD */
+
+  TRACE_EVENT (
+    EmuTraceExitEmulation,
+    Cpu->EmuMachineType,
+    Context->ProgramCounter,
+    Ret,
+    ExitReason,
+    0
+    );
+  return Ret;
 }
 
 VOID
@@ -1171,22 +1362,26 @@ CpuUnregisterCodeRange (
   IN  UINT64                ImageSize
   )
 {
-  uc_err  UcErr;
+  uc_err      UcErr;
+  CpuContext  *Engine;
 
   /*
    * uc_mem_protect is not safe to call while we are in JIT (uc_emu_start).
    */
   CriticalBegin ();
-  UcErr = uc_mem_protect (Cpu->UE, ImageBase, ImageSize, UC_PROT_READ | UC_PROT_WRITE);
-  if (UcErr != UC_ERR_OK) {
-    DEBUG ((DEBUG_ERROR, "uc_mem_protect failed: %a\n", uc_strerror (UcErr)));
+  for (Engine = Cpu; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    UcErr = uc_mem_protect (Engine->UE, ImageBase, ImageSize, UC_PROT_READ | UC_PROT_WRITE);
+    if (UcErr != UC_ERR_OK) {
+      DEBUG ((DEBUG_ERROR, "uc_mem_protect failed: %a\n", uc_strerror (UcErr)));
+    }
+
+    /*
+     * Because images can be loaded into a previously used range,
+     * stale TBs can lead to "strange" crashes.
+     */
+    uc_ctl_remove_cache (Engine->UE, ImageBase, ImageBase + ImageSize);
   }
 
-  /*
-   * Because images can be loaded into a previously used range,
-   * stale TBs can lead to "strange" crashes.
-   */
-  uc_ctl_remove_cache (Cpu->UE, ImageBase, ImageBase + ImageSize);
   CriticalEnd ();
 }
 
@@ -1197,18 +1392,185 @@ CpuRegisterCodeRange (
   IN  UINT64                ImageSize
   )
 {
-  uc_err  UcErr;
+  uc_err      UcErr;
+  CpuContext  *Engine;
 
   /*
    * uc_mem_protect is not safe to call while we are in JIT (uc_emu_start).
    */
   CriticalBegin ();
-  UcErr = uc_mem_protect (Cpu->UE, ImageBase, ImageSize, UC_PROT_ALL);
+  for (Engine = Cpu; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    UcErr = uc_mem_protect (Engine->UE, ImageBase, ImageSize, UC_PROT_ALL);
+    if (UcErr != UC_ERR_OK) {
+      DEBUG ((DEBUG_ERROR, "uc_mem_protect failed: %a\n", uc_strerror (UcErr)));
+    }
+  }
+
+  CriticalEnd ();
+}
+
+#ifdef MAU_ENGINE_POOL
+
+struct CpuPoolImage {
+  /*
+   * One per engine of the ISA (see CPU_NEXT_ENGINE).
+   */
+  uc_hook    CodeWriteHooks[1 + CPU_ENGINE_POOL_SIZE];
+};
+
+/*
+ * Unicorn invalidates stale TBs on a store to translated code, but
+ * only in the translation cache of the engine doing the store. The
+ * other engines of the ISA map the same memory, so flush the range
+ * from their caches too.
+ */
+STATIC
+VOID
+CpuCodeWriteCb (
+  IN  uc_engine    *UE,
+  IN  uc_mem_type  Type,
+  IN  UINT64       Address,
+  IN  INT32        Size,
+  IN  INT64        Value,
+  IN  VOID         *UserData
+  )
+{
+  CpuContext  *Cpu = UserData;
+  CpuContext  *Engine;
+
+  for (Engine = CPU_PRIMARY (Cpu); Engine != NULL; Engine = Engine->NextEngine) {
+    if (Engine != Cpu) {
+      uc_ctl_remove_cache (Engine->UE, Address, Address + Size);
+    }
+  }
+}
+
+STATIC
+VOID
+CpuCodeWriteHooksDel (
+  IN  ImageRecord  *Record,
+  IN  UINTN        Count
+  )
+{
+  UINTN       Index;
+  CpuContext  *Engine;
+
+  for (Engine = Record->Cpu, Index = 0;
+       Engine != NULL && Index < Count;
+       Engine = Engine->NextEngine, Index++)
+  {
+    uc_hook_del (Engine->UE, Record->Pool->CodeWriteHooks[Index]);
+  }
+}
+
+VOID
+CpuPoolImageRegister (
+  IN  ImageRecord  *Record
+  )
+{
+  uc_err        UcErr;
+  UINTN         Index;
+  CpuContext    *Engine;
+  CpuPoolImage  *Pool;
+
+  Pool = AllocateZeroPool (sizeof (*Pool));
+  if (Pool == NULL) {
+    Record->Pool = NULL;
+    return;
+  }
+
+  Record->Pool = Pool;
+
+  /*
+   * uc_hook_add is not safe to call while we are in JIT (uc_emu_start).
+   */
+  UcErr = UC_ERR_OK;
+  CriticalBegin ();
+  for (Engine = Record->Cpu, Index = 0;
+       Engine != NULL;
+       Engine = Engine->NextEngine, Index++)
+  {
+    ASSERT (Index < ARRAY_SIZE (Pool->CodeWriteHooks));
+    UcErr = uc_hook_add (
+              Engine->UE,
+              &Pool->CodeWriteHooks[Index],
+              UC_HOOK_MEM_WRITE,
+              CpuCodeWriteCb,
+              Engine,
+              Record->ImageBase,
+              Record->ImageBase + Record->ImageSize - 1
+              );
+    if (UcErr != UC_ERR_OK) {
+      break;
+    }
+  }
+
   if (UcErr != UC_ERR_OK) {
-    DEBUG ((DEBUG_ERROR, "uc_mem_protect failed: %a\n", uc_strerror (UcErr)));
+    CpuCodeWriteHooksDel (Record, Index);
+  }
+
+  CriticalEnd ();
+  if (UcErr != UC_ERR_OK) {
+    DEBUG ((DEBUG_ERROR, "code write hook failed: %a\n", uc_strerror (UcErr)));
+    FreePool (Pool);
+    Record->Pool = NULL;
+  }
+}
+
+VOID
+CpuPoolImageUnregister (
+  IN  ImageRecord  *Record
+  )
+{
+  if (Record->Pool == NULL) {
+    return;
+  }
+
+  CriticalBegin ();
+  CpuCodeWriteHooksDel (Record, ARRAY_SIZE (Record->Pool->CodeWriteHooks));
+  CriticalEnd ();
+
+  FreePool (Record->Pool);
+  Record->Pool = NULL;
+}
+
+#endif /* MAU_ENGINE_POOL */
+
+/*
+ * Returns the engine to use for a new entry into emulated code.
+ * Nested entries use a free pool engine, if there is one. Otherwise
+ * they share the primary engine, whose state is saved and restored
+ * around the nested entry by CpuRunCtxOnPrivateStack.
+ */
+STATIC
+CpuContext *
+CpuPickEngine (
+  IN  CpuContext  *Cpu
+  )
+{
+ #ifdef MAU_ENGINE_POOL
+  CpuContext  *Engine;
+  UINTN       Depth;
+
+  Cpu   = CPU_PRIMARY (Cpu);
+  Depth = 1;
+
+  CriticalBegin ();
+  for (Engine = Cpu; Engine != NULL; Engine = Engine->NextEngine) {
+    if (Engine->Contexts == 0) {
+      Cpu->EngineDepthMax = MAX (Cpu->EngineDepthMax, Depth);
+      CriticalEnd ();
+      return Engine;
+    }
+
+    Depth++;
   }
 
+  Cpu->EngineFallbacks++;
   CriticalEnd ();
+ #endif /* MAU_ENGINE_POOL */
+
+  return Cpu;
 }
 
 STATIC
@@ -1226,6 +1588,14 @@ CpuAllocContext (
   }
 
   ASSERT (Object != NULL);
+  TRACE_EVENT (
+    EmuTraceContextAlloc,
+    Cpu->EmuMachineType,
+    Object,
+    Cpu->Contexts,
+    0,
+    0
+    );
   return (VOID *)Object;
 }
 
@@ -1244,6 +1614,14 @@ CpuFreeContext (
    */
   ASSERT (Context->Flags == 0);
 
+  TRACE_EVENT (
+    EmuTraceContextFree,
+    Context->Cpu->EmuMachineType,
+    Context,
+    Context->Cpu->Contexts,
+    0,
+    0
+    );
   ObjectFree (Context->Cpu->RunContextAlloc, (VOID *)Context);
 }
 
@@ -1408,6 +1786,16 @@ CpuRunCtxOnPrivateStack (
   }
 
   Context->Ret = CpuRunCtxInternal (Context);
+ #ifdef MAU_WRAPPED_ENTRY_POINTS
+  while ((Context->Next != NULL) && Context->Next (Context, Context->NextContext)) {
+    /*
+     * The emulated stack is back to where it was before the
+     * last call, so the next one goes on the same UC context.
+     */
+    Context->Ret = CpuRunCtxInternal (Context);
+  }
+
+ #endif /* MAU_WRAPPED_ENTRY_POINTS */
 
   if ((Context->Flags & CRC_HAVE_SAVED_UC_CONTEXT) != 0) {
     UcErr = uc_context_restore (Cpu->UE, Context->PrevUcContext);
@@ -1422,7 +1810,13 @@ CpuRunCtxOnPrivateStack (
   CpuLeaveCritical (Context);
 
  #ifdef MAU_ON_PRIVATE_STACK
-  if ((Context->Flags & CRC_HAVE_SAVED_UC_CONTEXT) == 0) {
+
+  /*
+   * Only the outermost context switched stacks in CpuRunCtx.
+   * Nested contexts don't necessarily have a saved UC context
+   * (e.g. when running on another engine or another ISA).
+   */
+  if (Context->PrevContext == NULL) {
     LongJump (&mOriginalStack, -1);
   }
 
@@ -1475,7 +1869,47 @@ CpuRunFunc (
 
   ASSERT (Cpu != NULL);
 
-  Context = CpuAllocContext (Cpu);
+  Context = CpuAllocContext (CpuPickEngine (Cpu));
+  if (Context == NULL) {
+    DEBUG ((DEBUG_ERROR, "Could not allocate CpuRunContext\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Context->ProgramCounter = ProgramCounter;
+  Context->Args           = Args;
+
+  Ret = CpuRunCtx (Context);
+
+  CpuFreeContext (Context);
+  return Ret;
+}
+
+#ifdef MAU_WRAPPED_ENTRY_POINTS
+
+/*
+ * Like CpuRunFunc, but once the function returns, Next gets to set
+ * the ProgramCounter and Args of another function to run within the
+ * same emulation entry (same CpuRunContext, same saved UC context and
+ * same stack switch). Next is called outside of the critical section,
+ * and returns FALSE when there is nothing more to run. Returns what
+ * the last function run returned.
+ */
+UINT64
+CpuRunFuncBatch (
+  IN  CpuContext           *Cpu,
+  IN  EFI_VIRTUAL_ADDRESS  ProgramCounter,
+  IN  UINT64               *Args,
+  IN  BOOLEAN (*Next)(CpuRunContext *, VOID *),
+  IN  VOID                 *NextContext
+  )
+{
+  UINT64         Ret;
+  CpuRunContext  *Context;
+
+  ASSERT (Cpu != NULL);
+  ASSERT (Next != NULL);
+
+  Context = CpuAllocContext (CpuPickEngine (Cpu));
   if (Context == NULL) {
     DEBUG ((DEBUG_ERROR, "Could not allocate CpuRunContext\n"));
     return EFI_OUT_OF_RESOURCES;
@@ -1483,6 +1917,8 @@ CpuRunFunc (
 
   Context->ProgramCounter = ProgramCounter;
   Context->Args           = Args;
+  Context->Next           = Next;
+  Context->NextContext    = NextContext;
 
   Ret = CpuRunCtx (Context);
 
@@ -1490,6 +1926,8 @@ CpuRunFunc (
   return Ret;
 }
 
+#endif /* MAU_WRAPPED_ENTRY_POINTS */
+
 CpuRunContext *
 CpuGetTopContext (
   VOID
@@ -1587,7 +2025,7 @@ CpuRunImage (
   ASSERT (Record != NULL);
   ASSERT (Record->Cpu != NULL);
 
-  Context = CpuAllocContext (Record->Cpu);
+  Context = CpuAllocContext (CpuPickEngine (Record->Cpu));
   DEBUG ((DEBUG_ERROR, "Ctx %p vs %p\n", Context->Cpu, Record->Cpu));
   if (Context == NULL) {
     DEBUG ((DEBUG_ERROR, "Could not allocate CpuRunContext\n"));
@@ -1613,6 +2051,9 @@ CpuRunImage (
   /*
    * Image exited via gBS->Exit.
    */
+ #ifdef MAU_CALL_RECORD
+  RecordEmuReturn (Record->Cpu, Record->ImageExitStatus);
+ #endif /* MAU_CALL_RECORD */
   CpuCompressLeakedContexts (Context, TRUE);
 
   Status = gBS->Exit (
@@ -1676,25 +2117,35 @@ CpuExitImage (
   UNREACHABLE ();
 }
 
+/*
+ * Whether any of [Address, Address + Size) is in a Unicorn code buffer.
+ */
 BOOLEAN
-CpuAddrIsCodeGen (
-  IN  EFI_PHYSICAL_ADDRESS  Address
+CpuRangeIsCodeGen (
+  IN  EFI_PHYSICAL_ADDRESS  Address,
+  IN  UINT64                Size
   )
 {
+  UNUSED CpuContext  *Engine;
+
  #ifdef MAU_SUPPORTS_X64_BINS
-  if ((Address >= CpuX64.UnicornCodeGenBuf) &&
-      (Address < CpuX64.UnicornCodeGenBufEnd))
-  {
-    return TRUE;
+  for (Engine = &CpuX64; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    if ((Address < Engine->UnicornCodeGenBufEnd) &&
+        (Engine->UnicornCodeGenBuf < Address + Size))
+    {
+      return TRUE;
+    }
   }
 
  #endif /* MAU_SUPPORTS_X64_BINS */
 
  #ifdef MAU_SUPPORTS_AARCH64_BINS
-  if ((Address >= CpuAArch64.UnicornCodeGenBuf) &&
-      (Address < CpuAArch64.UnicornCodeGenBufEnd))
-  {
-    return TRUE;
+  for (Engine = &CpuAArch64; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    if ((Address < Engine->UnicornCodeGenBufEnd) &&
+        (Engine->UnicornCodeGenBuf < Address + Size))
+    {
+      return TRUE;
+    }
   }
 
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
@@ -1702,6 +2153,14 @@ CpuAddrIsCodeGen (
   return FALSE;
 }
 
+BOOLEAN
+CpuAddrIsCodeGen (
+  IN  EFI_PHYSICAL_ADDRESS  Address
+  )
+{
+  return CpuRangeIsCodeGen (Address, 1);
+}
+
 #ifndef NDEBUG
 EFI_STATUS
 EFIAPI
@@ -1709,7 +2168,8 @@ CpuGetDebugState (
   OUT EMU_TEST_DEBUG_STATE  *DebugState
   )
 {
-  CpuRunContext  *Context;
+  CpuRunContext      *Context;
+  UNUSED CpuContext  *Engine;
 
   ASSERT (DebugState != NULL);
 
@@ -1743,11 +2203,69 @@ CpuGetDebugState (
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
  #endif /* MAU_EMU_TIMEOUT_NONE */
  #ifdef MAU_SUPPORTS_X64_BINS
-  DebugState->X64ContextCount = CpuX64.Contexts;
+  for (Engine = &CpuX64; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    DebugState->X64ContextCount += Engine->Contexts;
+  }
+
+ #ifdef MAU_ENGINE_POOL
+  DebugState->EngineDepthMax   = MAX (DebugState->EngineDepthMax, CpuX64.EngineDepthMax);
+  DebugState->EngineFallbacks += CpuX64.EngineFallbacks;
+ #endif /* MAU_ENGINE_POOL */
  #endif /* MAU_SUPPORTS_X64_BINS */
  #ifdef MAU_SUPPORTS_AARCH64_BINS
-  DebugState->AArch64ContextCount = CpuAArch64.Contexts;
+  for (Engine = &CpuAArch64; Engine != NULL; Engine = CPU_NEXT_ENGINE (Engine)) {
+    DebugState->AArch64ContextCount += Engine->Contexts;
+  }
+
+ #ifdef MAU_ENGINE_POOL
+  DebugState->EngineDepthMax   = MAX (DebugState->EngineDepthMax, CpuAArch64.EngineDepthMax);
+  DebugState->EngineFallbacks += CpuAArch64.EngineFallbacks;
+ #endif /* MAU_ENGINE_POOL */
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
+  DebugState->EnginePoolSize = CPU_ENGINE_POOL_SIZE;
+ #ifdef MAU_WRAPPED_ENTRY_POINTS
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_WRAPPED_EVENTS;
+  EfiWrappersGetDebugState (DebugState);
+ #endif /* MAU_WRAPPED_ENTRY_POINTS */
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_PROTOCOL_TRAMPOLINES;
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+ #ifdef MAU_MP_SERVICES
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_MP_SERVICES;
+ #endif /* MAU_MP_SERVICES */
+ #ifdef MAU_SHADOW_TPL
+  TplGetDebugState (DebugState);
+ #endif /* MAU_SHADOW_TPL */
+ #ifdef MAU_X64_REP_STRINGS
+  RepStringGetDebugState (DebugState);
+ #endif /* MAU_X64_REP_STRINGS */
+ #ifdef MAU_HLE
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_HLE;
+  HleGetDebugState (DebugState);
+ #endif /* MAU_HLE */
+ #ifdef MAU_GOP_BLT
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_GOP_BLT;
+  GopBltGetDebugState (DebugState);
+ #endif /* MAU_GOP_BLT */
+ #ifdef MAU_FAST_PCI_IO
+  PciIoGetDebugState (DebugState);
+ #endif /* MAU_FAST_PCI_IO */
+ #ifdef MAU_PIO_DELAY
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_PIO_DELAY;
+ #endif /* MAU_PIO_DELAY */
+  PioGetDebugState (DebugState);
+ #ifdef MAU_LOW_MEM
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_LOW_MEM;
+  LowMemGetDebugState (DebugState);
+ #endif /* MAU_LOW_MEM */
+ #ifdef MAU_SUPPORTED_CACHE
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_SUPPORTED_CACHE;
+  SupportedCacheGetDebugState (DebugState);
+ #endif /* MAU_SUPPORTED_CACHE */
+ #ifdef MAU_SNP_THROTTLE
+  DebugState->Flags |= EMU_TEST_DEBUG_FLAG_SNP_THROTTLE;
+  SnpThrottleGetDebugState (DebugState);
+ #endif /* MAU_SNP_THROTTLE */
   CriticalEnd ();
 
   return EFI_SUCCESS;
@@ -26,6 +26,9 @@ BOOLEAN                             gApparentInterruptState;
 STATIC EFI_CPU_ENABLE_INTERRUPT     mRealEnableInterrupt;
 STATIC EFI_CPU_DISABLE_INTERRUPT    mRealDisableInterrupt;
 STATIC EFI_CPU_GET_INTERRUPT_STATE  mRealGetInterruptState;
+#ifdef MAU_LOW_MEM
+STATIC EFI_FREE_POOL  mRealFreePool;
+#endif /* MAU_LOW_MEM */
 
 EFI_STATUS
 EFIAPI
@@ -76,6 +79,39 @@ EfiHooksCpuGetInterruptState (
   return EFI_SUCCESS;
 }
 
+#ifdef MAU_LOW_MEM
+
+/*
+ * Pool memory handed out by LowMem to emulated code isn't
+ * core pool, yet may be freed by anyone.
+ */
+EFI_STATUS
+EFIAPI
+EfiHooksFreePool (
+  IN VOID  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+
+  if (LowMemFreePool (Buffer, &Status)) {
+    return Status;
+  }
+
+  return mRealFreePool (Buffer);
+}
+
+STATIC
+VOID
+EfiHooksUpdateBootServicesCrc (
+  VOID
+  )
+{
+  gBS->Hdr.CRC32 = 0;
+  gBS->Hdr.CRC32 = CalculateCrc32 (gBS, gBS->Hdr.HeaderSize);
+}
+
+#endif /* MAU_LOW_MEM */
+
 EFI_STATUS
 EfiHooksInit (
   VOID
@@ -120,6 +156,11 @@ EfiHooksInit (
   gCpu->EnableInterrupt   = EfiHooksCpuEnableInterrupt;
   gCpu->DisableInterrupt  = EfiHooksCpuDisableInterrupt;
   gCpu->GetInterruptState = EfiHooksCpuGetInterruptState;
+ #ifdef MAU_LOW_MEM
+  mRealFreePool = gBS->FreePool;
+  gBS->FreePool = EfiHooksFreePool;
+  EfiHooksUpdateBootServicesCrc ();
+ #endif /* MAU_LOW_MEM */
   CriticalEnd ();
 
   return EFI_SUCCESS;
@@ -134,5 +175,9 @@ EfiHooksCleanup (
   gCpu->EnableInterrupt   = mRealEnableInterrupt;
   gCpu->DisableInterrupt  = mRealDisableInterrupt;
   gCpu->GetInterruptState = mRealGetInterruptState;
+ #ifdef MAU_LOW_MEM
+  gBS->FreePool = mRealFreePool;
+  EfiHooksUpdateBootServicesCrc ();
+ #endif /* MAU_LOW_MEM */
   CriticalEnd ();
 }
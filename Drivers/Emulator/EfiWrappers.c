@@ -21,43 +21,239 @@
  */
 
 #ifdef MAU_WRAPPED_ENTRY_POINTS
-STATIC LIST_ENTRY  mEventList;
+
+/*
+ * Wrapped event records are hashed by EFI_EVENT, and come from
+ * their own ObjectAlloc cache.
+ *
+ * Notifications for plain EVT_NOTIFY_SIGNAL events (timers and
+ * completion events) are not run from the native notification
+ * function. Instead, the record is queued on the dispatcher for
+ * the event TPL, which is itself an event signalled at that TPL.
+ * By the time the dispatcher runs, every such event signalled at
+ * the same TPL is queued too, and consecutive notifications for
+ * the same engine are run within a single emulation entry
+ * (CpuRunFuncBatch). UEFI only orders notifications by TPL, so
+ * running these after others already queued at the same TPL is fine.
+ */
+#define WRAPPED_EVENT_BUCKETS    64
+#define WRAPPED_EVENT_RECORDS    64
+#define WRAPPED_EVENT_SIGNATURE  SIGNATURE_32 ('W', 'E', 'V', 'T')
+#define WRAPPED_EVENT_HASH(Event)  \
+  ((((UINTN)(Event)) >> 4) % WRAPPED_EVENT_BUCKETS)
 
 typedef struct {
-  LIST_ENTRY          Link;
-  EFI_EVENT           Event;
-  VOID                *X64NotifyContext;
-  EFI_EVENT_NOTIFY    X64NotifyFunction;
-  UINT64              CallerProgramCounter;
-  CpuContext          *Cpu;
+  LIST_ENTRY    Pending;
+  EFI_EVENT     Event;
+  UINT64        Args[MAX_ARGS];
+} WRAPPED_EVENT_DISPATCH;
+
+typedef struct {
+  /*
+   * Managed by ObjectAlloc.
+   */
+  ObjectHeader              Header;
+  LIST_ENTRY                Link;
+  /*
+   * Empty unless queued on Dispatch.
+   */
+  LIST_ENTRY                PendingLink;
+  EFI_EVENT                 Event;
+  VOID                      *X64NotifyContext;
+  EFI_EVENT_NOTIFY          X64NotifyFunction;
+  UINT64                    CallerProgramCounter;
+  CpuContext                *Cpu;
+  /*
+   * NULL if notifications are not batched.
+   */
+  WRAPPED_EVENT_DISPATCH    *Dispatch;
 } WRAPPED_EVENT_RECORD;
 
+STATIC LIST_ENTRY              mEventBuckets[WRAPPED_EVENT_BUCKETS];
+STATIC ObjectAllocContext      *mEventAlloc;
+STATIC WRAPPED_EVENT_DISPATCH  *mEventDispatch[TPL_HIGH_LEVEL];
+STATIC UINTN                   mEventNotifies;
+STATIC UINTN                   mEventEntries;
+
 STATIC
 VOID
 EfiWrappersDumpEvents (
   )
 {
+  UINTN                 Bucket;
   LIST_ENTRY            *Entry;
   WRAPPED_EVENT_RECORD  *Record;
   ImageRecord           *Image;
 
   DEBUG ((DEBUG_ERROR, "Wrapped EFI_EVENTs:\n"));
-  for (Entry = GetFirstNode (&mEventList);
-       !IsNull (&mEventList, Entry);
-       Entry = GetNextNode (&mEventList, Entry))
-  {
-    Record = BASE_CR (Entry, WRAPPED_EVENT_RECORD, Link);
-    Image  = ImageFindByAddress (Record->CallerProgramCounter);
+  for (Bucket = 0; Bucket < WRAPPED_EVENT_BUCKETS; Bucket++) {
+    for (Entry = GetFirstNode (&mEventBuckets[Bucket]);
+         !IsNull (&mEventBuckets[Bucket], Entry);
+         Entry = GetNextNode (&mEventBuckets[Bucket], Entry))
+    {
+      Record = BASE_CR (Entry, WRAPPED_EVENT_RECORD, Link);
+      Image  = ImageFindByAddress (Record->CallerProgramCounter);
+
+      DEBUG ((
+        DEBUG_ERROR,
+        "\t%7a ImageBase 0x%lx Event %p Fn %p Context %p%a\n",
+        Image->Cpu->Name,
+        Image->ImageBase,
+        Record->Event,
+        Record->X64NotifyFunction,
+        Record->X64NotifyContext,
+        IsListEmpty (&Record->PendingLink) ? "" : " (pending)"
+        ));
+    }
+  }
+}
 
-    DEBUG ((
-      DEBUG_ERROR,
-      "\t%7a ImageBase 0x%lx Event %p Fn %p Context %p\n",
-      Image->Cpu->Name,
-      Image->ImageBase,
-      Record->Event,
-      Record->X64NotifyFunction,
-      Record->X64NotifyContext
-      ));
+STATIC
+WRAPPED_EVENT_RECORD *
+EfiWrappersAllocEvent (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  ObjectHeader          *Object;
+  WRAPPED_EVENT_RECORD  *Record;
+
+  if (mEventAlloc == NULL) {
+    return NULL;
+  }
+
+  Status = ObjectAlloc (mEventAlloc, &Object);
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  Record = (VOID *)Object;
+  InitializeListHead (&Record->PendingLink);
+  return Record;
+}
+
+STATIC
+VOID
+EfiWrappersFreeEvent (
+  IN  WRAPPED_EVENT_RECORD  *Record
+  )
+{
+  ObjectFree (mEventAlloc, &Record->Header);
+}
+
+/*
+ * Returns the first pending notification function and sets up
+ * Dispatch->Args for it, or 0. If *Cpu is set, only a notification
+ * for the same engine is returned.
+ */
+STATIC
+UINT64
+EfiWrappersNextPending (
+  IN      WRAPPED_EVENT_DISPATCH  *Dispatch,
+  IN OUT  CpuContext              **Cpu
+  )
+{
+  WRAPPED_EVENT_RECORD  *Record;
+  UINT64                NotifyFunction;
+
+  NotifyFunction = 0;
+
+  /*
+   * The record can be closed (and freed) as soon as it is
+   * no longer pending, so copy everything needed.
+   */
+  CriticalBegin ();
+  if (!IsListEmpty (&Dispatch->Pending)) {
+    Record = BASE_CR (GetFirstNode (&Dispatch->Pending), WRAPPED_EVENT_RECORD, PendingLink);
+    if ((*Cpu == NULL) || (CPU_PRIMARY (*Cpu) == CPU_PRIMARY (Record->Cpu))) {
+      RemoveEntryList (&Record->PendingLink);
+      InitializeListHead (&Record->PendingLink);
+
+      Dispatch->Args[0] = (UINT64)Record->Event;
+      Dispatch->Args[1] = (UINT64)Record->X64NotifyContext;
+      NotifyFunction    = (UINT64)Record->X64NotifyFunction;
+      *Cpu              = Record->Cpu;
+      mEventNotifies++;
+    }
+  }
+
+  CriticalEnd ();
+  return NotifyFunction;
+}
+
+STATIC
+BOOLEAN
+EfiWrappersEventNext (
+  IN  CpuRunContext  *Context,
+  IN  VOID           *NextContext
+  )
+{
+  WRAPPED_EVENT_DISPATCH  *Dispatch = NextContext;
+  CpuContext              *Cpu      = Context->Cpu;
+  UINT64                  NotifyFunction;
+
+  NotifyFunction = EfiWrappersNextPending (Dispatch, &Cpu);
+  if (NotifyFunction == 0) {
+    return FALSE;
+  }
+
+  Context->ProgramCounter = NotifyFunction;
+  Context->Args           = Dispatch->Args;
+  return TRUE;
+}
+
+STATIC
+VOID
+EFIAPI
+EfiWrappersEventDispatch (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  WRAPPED_EVENT_DISPATCH  *Dispatch = Context;
+  CpuContext              *Cpu;
+  UINT64                  NotifyFunction;
+
+  for ( ; ;) {
+    Cpu            = NULL;
+    NotifyFunction = EfiWrappersNextPending (Dispatch, &Cpu);
+    if (NotifyFunction == 0) {
+      break;
+    }
+
+    mEventEntries++;
+    CpuRunFuncBatch (
+      Cpu,
+      NotifyFunction,
+      Dispatch->Args,
+      EfiWrappersEventNext,
+      Dispatch
+      );
+  }
+}
+
+STATIC
+VOID
+EFIAPI
+EfiWrappersEventQueue (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  WRAPPED_EVENT_RECORD    *Record   = Context;
+  WRAPPED_EVENT_DISPATCH  *Dispatch = Record->Dispatch;
+  BOOLEAN                 Signal;
+
+  CriticalBegin ();
+  Signal = IsListEmpty (&Dispatch->Pending);
+  if (IsListEmpty (&Record->PendingLink)) {
+    InsertTailList (&Dispatch->Pending, &Record->PendingLink);
+  }
+
+  CriticalEnd ();
+
+  if (Signal) {
+    gBS->SignalEvent (Dispatch->Event);
   }
 }
 
@@ -69,24 +265,84 @@ EfiWrappersEventNotify (
   IN  VOID       *Context
   )
 {
-  WRAPPED_EVENT_RECORD  *Record = Context;
-  UINT64                Args[2] = { (UINT64)Event, (UINT64)Record->X64NotifyContext };
+  WRAPPED_EVENT_RECORD  *Record         = Context;
+  UINT64                Args[MAX_ARGS] = { (UINT64)Event, (UINT64)Record->X64NotifyContext };
 
+  mEventNotifies++;
+  mEventEntries++;
   CpuRunFunc (Record->Cpu, (UINT64)Record->X64NotifyFunction, Args);
 }
 
+STATIC
+WRAPPED_EVENT_DISPATCH *
+EfiWrappersGetDispatch (
+  IN  EFI_TPL  NotifyTpl
+  )
+{
+  EFI_STATUS              Status;
+  WRAPPED_EVENT_DISPATCH  *Dispatch;
+  WRAPPED_EVENT_DISPATCH  *Existing;
+
+  if (NotifyTpl >= ARRAY_SIZE (mEventDispatch)) {
+    return NULL;
+  }
+
+  if (mEventDispatch[NotifyTpl] != NULL) {
+    return mEventDispatch[NotifyTpl];
+  }
+
+  Dispatch = AllocateZeroPool (sizeof (*Dispatch));
+  if (Dispatch == NULL) {
+    return NULL;
+  }
+
+  InitializeListHead (&Dispatch->Pending);
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  NotifyTpl,
+                  EfiWrappersEventDispatch,
+                  Dispatch,
+                  &Dispatch->Event
+                  );
+  if (EFI_ERROR (Status)) {
+    FreePool (Dispatch);
+    return NULL;
+  }
+
+  /*
+   * A notification at a higher TPL could have beaten us to it.
+   */
+  CriticalBegin ();
+  Existing = mEventDispatch[NotifyTpl];
+  if (Existing == NULL) {
+    mEventDispatch[NotifyTpl] = Dispatch;
+  }
+
+  CriticalEnd ();
+
+  if (Existing != NULL) {
+    gBS->CloseEvent (Dispatch->Event);
+    FreePool (Dispatch);
+    return Existing;
+  }
+
+  return Dispatch;
+}
+
 STATIC
 WRAPPED_EVENT_RECORD *
 EfiWrappersFindEvent (
   IN  EFI_EVENT  Event
   )
 {
+  LIST_ENTRY            *Bucket;
   LIST_ENTRY            *Entry;
   WRAPPED_EVENT_RECORD  *Record;
 
-  for (Entry = GetFirstNode (&mEventList);
-       !IsNull (&mEventList, Entry);
-       Entry = GetNextNode (&mEventList, Entry))
+  Bucket = &mEventBuckets[WRAPPED_EVENT_HASH (Event)];
+  for (Entry = GetFirstNode (Bucket);
+       !IsNull (Bucket, Entry);
+       Entry = GetNextNode (Bucket, Entry))
   {
     Record = BASE_CR (Entry, WRAPPED_EVENT_RECORD, Link);
 
@@ -109,14 +365,26 @@ EfiWrapperCloseEvent (
   WRAPPED_EVENT_RECORD  *Record;
   EFI_STATUS            Status;
 
-  Record = EfiWrappersFindEvent (Event);
-  Status = gBS->CloseEvent (Record->Event);
+  /*
+   * After CloseEvent, the record can't get queued anymore. If the
+   * EFI_EVENT is reused meanwhile, the new record is hashed after
+   * this one.
+   */
+  Status = gBS->CloseEvent (Event);
 
+  CriticalBegin ();
+  Record = EfiWrappersFindEvent (Event);
   if (Record != NULL) {
-    CriticalBegin ();
     RemoveEntryList (&Record->Link);
-    CriticalEnd ();
-    FreePool (Record);
+    if (!IsListEmpty (&Record->PendingLink)) {
+      RemoveEntryList (&Record->PendingLink);
+    }
+  }
+
+  CriticalEnd ();
+
+  if (Record != NULL) {
+    EfiWrappersFreeEvent (Record);
   }
 
   return Status;
@@ -146,26 +414,26 @@ EfiWrapperCreateEventCommon (
     Event      = (VOID *)Args[5];
   }
 
-  Record = AllocatePool (sizeof *Record);
+  Record = EfiWrappersAllocEvent ();
   if (Record == NULL) {
     DEBUG ((DEBUG_ERROR, "failed to allocate event wrapper\n"));
     return EFI_OUT_OF_RESOURCES;
   }
 
+  Record->Dispatch = NULL;
+  if ((EventGroup == NULL) &&
+      ((Type == EVT_NOTIFY_SIGNAL) || (Type == (EVT_TIMER | EVT_NOTIFY_SIGNAL))))
+  {
+    Record->Dispatch = EfiWrappersGetDispatch (NotifyTpl);
+  }
+
   Record->Cpu                  = CpuGetTopContext ()->Cpu;
   Record->CallerProgramCounter = ReturnAddress;
   Record->X64NotifyContext     = NotifyContext;
   Record->X64NotifyFunction    = NotifyFunction;
-  NotifyFunction               = EfiWrappersEventNotify;
-  NotifyContext                = Record;
-
-  /*
-   * Before CreateEvent to avoid races! After CreateEvent succeeds,
-   * the event could be signalled (and closed from notification fn).
-   */
-  CriticalBegin ();
-  InsertTailList (&mEventList, &Record->Link);
-  CriticalEnd ();
+  NotifyFunction               = Record->Dispatch != NULL ?
+                                 EfiWrappersEventQueue : EfiWrappersEventNotify;
+  NotifyContext = Record;
 
   if (OriginalProgramCounter == (UINT64)gBS->CreateEvent) {
     Status = gBS->CreateEvent (
@@ -188,21 +456,197 @@ EfiWrapperCreateEventCommon (
 
   if (EFI_ERROR (Status)) {
     *Event = NULL;
-    FreePool (Record);
+    EfiWrappersFreeEvent (Record);
     return Status;
   }
 
+  /*
+   * Notifications get the record as their context, so it only
+   * needs to be found by EFI_EVENT once the caller knows it.
+   */
+  CriticalBegin ();
+  InsertTailList (&mEventBuckets[WRAPPED_EVENT_HASH (Record->Event)], &Record->Link);
+  CriticalEnd ();
+
   *Event = Record->Event;
   return EFI_SUCCESS;
 }
 
+STATIC
+VOID
+EfiWrappersInitEvents (
+  VOID
+  )
+{
+  EFI_STATUS         Status;
+  UINTN              Bucket;
+  ObjectAllocConfig  AllocConfig;
+
+  for (Bucket = 0; Bucket < WRAPPED_EVENT_BUCKETS; Bucket++) {
+    InitializeListHead (&mEventBuckets[Bucket]);
+  }
+
+  ZeroMem (&AllocConfig, sizeof (AllocConfig));
+  AllocConfig.Name        = "WRAPPED_EVENT_RECORD";
+  AllocConfig.ObjectSize  = sizeof (WRAPPED_EVENT_RECORD);
+  AllocConfig.ObjectCount = WRAPPED_EVENT_RECORDS;
+  AllocConfig.Growable    = TRUE;
+  AllocConfig.Signature   = WRAPPED_EVENT_SIGNATURE;
+
+  Status = ObjectAllocCreate (&AllocConfig, &mEventAlloc);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: ObjectAllocCreate: %r\n", __func__, Status));
+    mEventAlloc = NULL;
+  }
+}
+
+STATIC
+VOID
+EfiWrappersCleanupEvents (
+  VOID
+  )
+{
+  if (mEventAlloc != NULL) {
+    ObjectAllocDestroy (mEventAlloc);
+    mEventAlloc = NULL;
+  }
+}
+
+VOID
+EfiWrappersGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->EventNotifies = mEventNotifies;
+  DebugState->EventEntries  = mEventEntries;
+}
+
 #endif /* MAU_WRAPPED_ENTRY_POINTS */
 
+#if defined (MAU_PROTOCOL_TRAMPOLINES) || defined (MAU_GOP_BLT) || \
+  defined (MAU_SUPPORTED_CACHE) || defined (MAU_SNP_THROTTLE)
+STATIC
+VOID
+EfiWrapperPatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  )
+{
+ #ifdef MAU_GOP_BLT
+  /*
+   * Before the trampolines, as it looks for emulated Blt.
+   */
+  GopBltPatchInterface (Protocol, Interface);
+ #endif /* MAU_GOP_BLT */
+ #ifdef MAU_SUPPORTED_CACHE
+  /*
+   * Likewise for Supported.
+   */
+  SupportedCachePatchInterface (Protocol, Interface);
+ #endif /* MAU_SUPPORTED_CACHE */
+ #ifdef MAU_SNP_THROTTLE
+  /*
+   * And for SNP Receive, Transmit and GetStatus.
+   */
+  SnpThrottlePatchInterface (Protocol, Interface);
+ #endif /* MAU_SNP_THROTTLE */
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  TrampolinePatchInterface (Protocol, Interface);
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+}
+
+EFI_STATUS
+EfiWrapperInstallProtocolInterface (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_HANDLE          *Handle       = (VOID *)Args[0];
+  EFI_GUID            *Protocol     = (VOID *)Args[1];
+  EFI_INTERFACE_TYPE  InterfaceType = Args[2];
+  VOID                *Interface    = (VOID *)Args[3];
+
+  EfiWrapperPatchInterface (Protocol, Interface);
+  return gBS->InstallProtocolInterface (
+                Handle,
+                Protocol,
+                InterfaceType,
+                Interface
+                );
+}
+
+EFI_STATUS
+EfiWrapperReinstallProtocolInterface (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_HANDLE  Handle        = (VOID *)Args[0];
+  EFI_GUID    *Protocol     = (VOID *)Args[1];
+  VOID        *OldInterface = (VOID *)Args[2];
+  VOID        *NewInterface = (VOID *)Args[3];
+
+  EfiWrapperPatchInterface (Protocol, NewInterface);
+  return gBS->ReinstallProtocolInterface (
+                Handle,
+                Protocol,
+                OldInterface,
+                NewInterface
+                );
+}
+
+EFI_STATUS
+EfiWrapperInstallMultipleProtocolInterfaces (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  UINTN  Index;
+
+  /*
+   * Handle, followed by NULL-terminated GUID/interface pairs.
+   * Like any other native call, limited to MAX_ARGS arguments.
+   */
+  for (Index = 1; Index + 1 < MAX_ARGS && Args[Index] != 0; Index += 2) {
+    EfiWrapperPatchInterface ((VOID *)Args[Index], (VOID *)Args[Index + 1]);
+  }
+
+  return gBS->InstallMultipleProtocolInterfaces (
+                (VOID *)Args[0],
+                Args[1],
+                Args[2],
+                Args[3],
+                Args[4],
+                Args[5],
+                Args[6],
+                Args[7],
+                Args[8],
+                Args[9],
+                Args[10],
+                Args[11],
+                Args[12],
+                Args[13],
+                Args[14],
+                Args[15]
+                );
+}
+
+#endif /* MAU_PROTOCOL_TRAMPOLINES || MAU_GOP_BLT || MAU_SUPPORTED_CACHE ||
+           MAU_SNP_THROTTLE */
+
 UINT64
 EfiWrappersOverride (
   IN  UINT64  ProgramCounter
   )
 {
+ #if defined (MAU_MP_SERVICES) || defined (MAU_SHADOW_TPL) || \
+  defined (MAU_FAST_PCI_IO) || defined (MAU_LOW_MEM)
+  UINT64  Override;
+
+ #endif /* MAU_MP_SERVICES || MAU_SHADOW_TPL || MAU_FAST_PCI_IO || MAU_LOW_MEM */
  #ifdef MAU_WRAPPED_ENTRY_POINTS
   if (ProgramCounter == (UINT64)gBS->CreateEvent) {
     return (UINT64)EfiWrapperCreateEventCommon;
@@ -213,6 +657,46 @@ EfiWrappersOverride (
   }
 
  #endif /* MAU_WRAPPED_ENTRY_POINTS */
+ #if defined (MAU_PROTOCOL_TRAMPOLINES) || defined (MAU_GOP_BLT) || \
+  defined (MAU_SUPPORTED_CACHE) || defined (MAU_SNP_THROTTLE)
+  if (ProgramCounter == (UINT64)gBS->InstallProtocolInterface) {
+    return (UINT64)EfiWrapperInstallProtocolInterface;
+  } else if (ProgramCounter == (UINT64)gBS->ReinstallProtocolInterface) {
+    return (UINT64)EfiWrapperReinstallProtocolInterface;
+  } else if (ProgramCounter == (UINT64)gBS->InstallMultipleProtocolInterfaces) {
+    return (UINT64)EfiWrapperInstallMultipleProtocolInterfaces;
+  }
+
+ #endif /* MAU_PROTOCOL_TRAMPOLINES || MAU_GOP_BLT || MAU_SUPPORTED_CACHE ||
+            MAU_SNP_THROTTLE */
+ #ifdef MAU_MP_SERVICES
+  Override = MpServicesOverride (ProgramCounter);
+  if (Override != ProgramCounter) {
+    return Override;
+  }
+
+ #endif /* MAU_MP_SERVICES */
+ #ifdef MAU_SHADOW_TPL
+  Override = TplOverride (ProgramCounter);
+  if (Override != ProgramCounter) {
+    return Override;
+  }
+
+ #endif /* MAU_SHADOW_TPL */
+ #ifdef MAU_FAST_PCI_IO
+  Override = PciIoOverride (ProgramCounter);
+  if (Override != ProgramCounter) {
+    return Override;
+  }
+
+ #endif /* MAU_FAST_PCI_IO */
+ #ifdef MAU_LOW_MEM
+  Override = LowMemOverride (ProgramCounter);
+  if (Override != ProgramCounter) {
+    return Override;
+  }
+
+ #endif /* MAU_LOW_MEM */
   if (ProgramCounter == (UINTN)gBS->ExitBootServices) {
     DEBUG ((
       DEBUG_ERROR,
@@ -248,8 +732,24 @@ EfiWrappersInit (
   )
 {
  #ifdef MAU_WRAPPED_ENTRY_POINTS
-  InitializeListHead (&mEventList);
+  EfiWrappersInitEvents ();
+ #endif /* MAU_WRAPPED_ENTRY_POINTS */
+ #ifdef MAU_MP_SERVICES
+  MpServicesInit ();
+ #endif /* MAU_MP_SERVICES */
+}
+
+VOID
+EfiWrappersCleanup (
+  VOID
+  )
+{
+ #ifdef MAU_WRAPPED_ENTRY_POINTS
+  EfiWrappersCleanupEvents ();
  #endif /* MAU_WRAPPED_ENTRY_POINTS */
+ #ifdef MAU_MP_SERVICES
+  MpServicesCleanup ();
+ #endif /* MAU_MP_SERVICES */
 }
 
 VOID
@@ -14,24 +14,125 @@
 
 BOOLEAN
 EmulatorIsNativeCall (
-  IN  UINT64  ProgramCounter
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter
   )
 {
-  if ((ProgramCounter & (NATIVE_INSN_ALIGNMENT - 1)) != 0) {
-    return FALSE;
-  }
+  ImageRecord  *Record;
 
   if (ProgramCounter < EFI_PAGE_SIZE) {
     return TRUE;
   }
 
-  if (ImageFindByAddress (ProgramCounter) != NULL) {
+  Record = ImageFindByAddress (ProgramCounter);
+  if (Record != NULL) {
+    /*
+     * Code of another emulated ISA is "native" as far as
+     * Cpu is concerned, and is dispatched by NativeThunk.
+     */
+    return Record->Cpu != CPU_PRIMARY (Cpu);
+  }
+
+  if ((ProgramCounter & (NATIVE_INSN_ALIGNMENT - 1)) != 0) {
     return FALSE;
   }
 
   return TRUE;
 }
 
+/*
+ * Returns a NUL-terminated copy (to be freed with FreePool) of a
+ * space-separated list kept in an emulator variable, or NULL if
+ * the variable is not set.
+ */
+CHAR8 *
+EmulatorGetListVariable (
+  IN  CONST CHAR16  *Name
+  )
+{
+  EFI_STATUS  Status;
+  CHAR8       *Variable;
+  CHAR8       *List;
+  UINTN       VariableSize;
+
+  Status = GetVariable2 (
+             Name,
+             &gEfiCallerIdGuid,
+             (VOID **)&Variable,
+             &VariableSize
+             );
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  /*
+   * setvar doesn't NUL-terminate.
+   */
+  List = AllocateZeroPool (VariableSize + 1);
+  if (List != NULL) {
+    CopyMem (List, Variable, VariableSize);
+  }
+
+  FreePool (Variable);
+  return List;
+}
+
+/*
+ * Returns the next item of a list (not NUL-terminated, Length
+ * characters long) and advances List past it, or NULL at the end.
+ */
+CONST CHAR8 *
+EmulatorListNext (
+  IN OUT CONST CHAR8  **List,
+  OUT    UINTN        *Length
+  )
+{
+  CONST CHAR8  *Item;
+
+  Item = *List;
+  while (*Item == ' ') {
+    Item++;
+  }
+
+  for (*Length = 0; Item[*Length] != '\0' && Item[*Length] != ' '; (*Length)++) {
+  }
+
+  *List = Item + *Length;
+  return *Length == 0 ? NULL : Item;
+}
+
+/*
+ * Whether a list names Name (NameLength characters long) or
+ * has the "*" item standing for everything.
+ */
+BOOLEAN
+EmulatorListHas (
+  IN  CONST CHAR8  *List,
+  IN  CONST CHAR8  *Name,
+  IN  UINTN        NameLength
+  )
+{
+  CONST CHAR8  *Item;
+  UINTN        Length;
+
+  if (List == NULL) {
+    return FALSE;
+  }
+
+  for (Item = EmulatorListNext (&List, &Length);
+       Item != NULL;
+       Item = EmulatorListNext (&List, &Length))
+  {
+    if (((Length == 1) && (*Item == '*')) ||
+        ((Length == NameLength) && (AsciiStrnCmp (Item, Name, Length) == 0)))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 #ifdef MAU_SUPPORTS_X64_BINS
 STATIC EDKII_PECOFF_IMAGE_EMULATOR_PROTOCOL  mEmulatorProtocolX64 = {
   ImageProtocolSupported,
@@ -70,6 +171,10 @@ EmulatorDump (
 {
   ImageDump ();
   EfiWrappersDump ();
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  TrampolineDump ();
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+  ObjectAllocDump ();
   CpuDump ();
 }
 
@@ -96,23 +201,42 @@ EmulatorStart (
   EFI_HANDLE  EmuHandleAArch64 = NULL;
  #endif /* MAU_SUPPORTS_AARCH64_BINS */
 
+  Status = RamInit ();
+  if (EFI_ERROR (Status)) {
+    /*
+     * Nothing is treated as RAM then, which is always safe.
+     */
+    DEBUG ((DEBUG_ERROR, "Couldn't get memory map: %r\n", Status));
+  }
+
+ #ifdef MAU_TRACE
+  TraceInit (ControllerHandle);
+ #endif /* MAU_TRACE */
+ #ifdef MAU_BB_TRACE
+  BbTraceInit (ControllerHandle);
+ #endif /* MAU_BB_TRACE */
+ #ifdef MAU_CALL_RECORD
+  RecordInit (ControllerHandle);
+ #endif /* MAU_CALL_RECORD */
+
   Status = EfiHooksInit ();
   if (EFI_ERROR (Status)) {
-    return Status;
+    goto fail_hooks;
   }
 
   EfiWrappersInit ();
+ #ifdef MAU_SUPPORTS_X64_BINS
+  PioInit ();
+ #endif /* MAU_SUPPORTS_X64_BINS */
 
   Status = CpuInit ();
   if (EFI_ERROR (Status)) {
-    return Status;
+    goto fail_cpu;
   }
 
   Status = ArchInit ();
   if (EFI_ERROR (Status)) {
-    CpuCleanup ();
-    EfiHooksCleanup ();
-    return Status;
+    goto fail_arch;
   }
 
  #ifdef MAU_SUPPORTS_X64_BINS
@@ -152,32 +276,53 @@ EmulatorStart (
 done:
  #endif
 
-  if (EFI_ERROR (Status)) {
+  if (!EFI_ERROR (Status)) {
+    return EFI_SUCCESS;
+  }
+
+  /*
+   * Each failure point unwinds everything set up before it.
+   */
  #ifdef MAU_SUPPORTS_X64_BINS
-    if (EmuHandleX64 != NULL) {
-      gBS->UninstallProtocolInterface (
-             EmuHandleX64,
-             &gEdkiiPeCoffImageEmulatorProtocolGuid,
-             &mEmulatorProtocolX64
-             );
-    }
+  if (EmuHandleX64 != NULL) {
+    gBS->UninstallProtocolInterface (
+           EmuHandleX64,
+           &gEdkiiPeCoffImageEmulatorProtocolGuid,
+           &mEmulatorProtocolX64
+           );
+  }
 
  #endif /* MAU_SUPPORTS_X64_BINS */
 
  #ifdef MAU_SUPPORTS_AARCH64_BINS
-    if (EmuHandleAArch64 != NULL) {
-      gBS->UninstallProtocolInterface (
-             EmuHandleAArch64,
-             &gEdkiiPeCoffImageEmulatorProtocolGuid,
-             &mEmulatorProtocolAArch64
-             );
-    }
-
- #endif /* MAU_SUPPORTS_AARCH64_BINS */
-    ArchCleanup ();
-    CpuCleanup ();
-    EfiHooksCleanup ();
+  if (EmuHandleAArch64 != NULL) {
+    gBS->UninstallProtocolInterface (
+           EmuHandleAArch64,
+           &gEdkiiPeCoffImageEmulatorProtocolGuid,
+           &mEmulatorProtocolAArch64
+           );
   }
 
+ #endif /* MAU_SUPPORTS_AARCH64_BINS */
+  ArchCleanup ();
+fail_arch:
+  CpuCleanup ();
+fail_cpu:
+ #ifdef MAU_SUPPORTS_X64_BINS
+  PioCleanup ();
+ #endif /* MAU_SUPPORTS_X64_BINS */
+  EfiWrappersCleanup ();
+  EfiHooksCleanup ();
+fail_hooks:
+ #ifdef MAU_TRACE
+  TraceCleanup (ControllerHandle);
+ #endif /* MAU_TRACE */
+ #ifdef MAU_BB_TRACE
+  BbTraceCleanup (ControllerHandle);
+ #endif /* MAU_BB_TRACE */
+ #ifdef MAU_CALL_RECORD
+  RecordCleanup (ControllerHandle);
+ #endif /* MAU_CALL_RECORD */
+  RamCleanup ();
   return Status;
 }
@@ -28,6 +28,9 @@
 #include <Protocol/PeCoffImageEmulator.h>
 #include <Protocol/LoadedImage.h>
 #include <Protocol/EmuTestProtocol.h>
+#include <Protocol/EmuTraceProtocol.h>
+#include <Protocol/EmuBbTraceProtocol.h>
+#include <Protocol/EmuCallRecordProtocol.h>
 
 /*
  * Maximum # of arguments thunked between native and emulated code.
@@ -40,6 +43,22 @@
  */
 #define MAX_CPU_RUN_CONTEXTS  32
 
+#ifdef MAU_ENGINE_POOL
+
+/*
+ * # of additional engines per ISA, used for nested entries
+ * into emulated code instead of saving and restoring the
+ * state of an engine that is already running.
+ */
+#define CPU_ENGINE_POOL_SIZE  3
+#define CPU_NEXT_ENGINE(Cpu)  ((Cpu)->NextEngine)
+#else /* MAU_ENGINE_POOL */
+#define CPU_ENGINE_POOL_SIZE  0
+#define CPU_NEXT_ENGINE(Cpu)  ((CpuContext *)NULL)
+#endif /* MAU_ENGINE_POOL */
+
+#define CPU_PRIMARY(Cpu)  ((Cpu)->Primary)
+
 #ifdef MDE_CPU_AARCH64
 #define NATIVE_INSN_ALIGNMENT  4
 #elif defined (MDE_CPU_RISCV64)
@@ -85,7 +104,10 @@
 typedef struct uc_struct   uc_engine;
 typedef struct uc_context  uc_context;
 
-typedef struct CpuRunContext CpuRunContext;
+typedef struct CpuRunContext   CpuRunContext;
+typedef struct CpuPoolImage    CpuPoolImage;
+typedef struct BbTraceImage    BbTraceImage;
+typedef struct RepStringImage  RepStringImage;
 
 typedef struct {
   UINT64        Signature;
@@ -93,11 +115,23 @@ typedef struct {
 } ObjectHeader;
 
 typedef struct {
-  UINTN     ObjectSize;
-  UINTN     ObjectAlignment;
-  UINTN     ObjectCount;
-  VOID      *CbContext;
-  UINT64    Signature;
+  CONST CHAR8    *Name;
+  UINTN          ObjectSize;
+  /*
+   * 0 for the default (8 bytes).
+   */
+  UINTN          ObjectAlignment;
+  /*
+   * # of objects per slab, rounded up to fill
+   * the slab for growable caches.
+   */
+  UINTN          ObjectCount;
+  /*
+   * Add another slab when out of objects, instead of failing.
+   */
+  BOOLEAN        Growable;
+  VOID           *CbContext;
+  UINT64         Signature;
   EFI_STATUS EFIAPI (*OnCreate)(ObjectHeader *Object, VOID *CbContext);
   EFI_STATUS EFIAPI (*OnAlloc)(ObjectHeader *Object, VOID *CbContext);
   VOID EFIAPI (*OnFree)(ObjectHeader *Object, VOID *CbContext);
@@ -105,10 +139,23 @@ typedef struct {
 } ObjectAllocConfig;
 
 typedef struct {
-  VOID                 *Arena;
-  UINTN                ArenaSize;
+  LIST_ENTRY           Link;
+  LIST_ENTRY           Slabs;
+  /*
+   * Free objects.
+   */
   LIST_ENTRY           List;
+  UINTN                ObjectStride;
+  UINTN                ObjectOffset;
+  UINTN                SlabPages;
   ObjectAllocConfig    Config;
+  /*
+   * Usage stats, see ObjectAllocDump.
+   */
+  UINTN                SlabCount;
+  UINTN                InUse;
+  UINTN                MaxInUse;
+  UINTN                Allocs;
 } ObjectAllocContext;
 
 typedef struct CpuContext {
@@ -147,9 +194,27 @@ typedef struct CpuContext {
   UINT64                  ExitPeriodTicks;
   BOOLEAN                 StoppedOnTimeout;
  #endif /* MAU_EMU_TIMEOUT_NONE */
+  /*
+   * The CpuContext images are registered with (CpuX64 or
+   * CpuAArch64). Other engines of the same ISA point to it.
+   */
+  struct CpuContext       *Primary;
+ #ifdef MAU_ENGINE_POOL
+  /*
+   * The Primary is followed by the pool engines via NextEngine.
+   * EngineDepthMax and EngineFallbacks are only tracked in the Primary.
+   */
+  struct CpuContext       *NextEngine;
+  UINTN                   EngineDepthMax;
+  UINTN                   EngineFallbacks;
+ #endif /* MAU_ENGINE_POOL */
 } CpuContext;
 
 typedef struct {
+  /*
+   * Managed by ObjectAlloc.
+   */
+  ObjectHeader                Header;
   LIST_ENTRY                  Link;
   EFI_PHYSICAL_ADDRESS        ImageBase;
   EFI_PHYSICAL_ADDRESS        ImageEntry;
@@ -168,6 +233,21 @@ typedef struct {
   EFI_STATUS                  ImageExitStatus;
   UINTN                       ImageExitDataSize;
   CHAR16                      *ImageExitData;
+ #ifdef MAU_BB_TRACE
+  BbTraceImage                *BbTrace;
+ #endif /* MAU_BB_TRACE */
+ #ifdef MAU_X64_REP_STRINGS
+  RepStringImage              *RepString;
+ #endif /* MAU_X64_REP_STRINGS */
+ #ifdef MAU_ENGINE_POOL
+  CpuPoolImage                *Pool;
+ #endif /* MAU_ENGINE_POOL */
+ #ifdef MAU_LOW_MEM
+  /*
+   * Memory allocated by the image comes from below 4GiB.
+   */
+  BOOLEAN                     LowMem;
+ #endif /* MAU_LOW_MEM */
 } ImageRecord;
 
 typedef struct CpuRunContext {
@@ -194,6 +274,25 @@ typedef struct CpuRunContext {
    * Only set when we're invoking the entry point of an image.
    */
   ImageRecord             *ImageRecord;
+#ifdef MAU_SHADOW_TPL
+  /*
+   * TPL as seen by emulated code, and the real TPL, which only
+   * catches up when leaving the engine. Only valid if TplKnown.
+   */
+  EFI_TPL                 ShadowTpl;
+  EFI_TPL                 RealTpl;
+  BOOLEAN                 TplKnown;
+#endif /* MAU_SHADOW_TPL */
+#ifdef MAU_WRAPPED_ENTRY_POINTS
+  /*
+   * Only set for CpuRunFuncBatch.
+   */
+  BOOLEAN                 (*Next)(
+    struct CpuRunContext *,
+    VOID *
+    );
+  VOID                    *NextContext;
+#endif /* MAU_WRAPPED_ENTRY_POINTS */
 } CpuRunContext;
 
 #ifdef MAU_SUPPORTS_X64_BINS
@@ -214,6 +313,12 @@ ImageFindByAddress (
   IN  EFI_PHYSICAL_ADDRESS  Address
   );
 
+ImageRecord *
+ImageFindByRange (
+  IN  EFI_PHYSICAL_ADDRESS  Address,
+  IN  UINT64                Size
+  );
+
 ImageRecord *
 ImageFindByHandle (
   IN  EFI_HANDLE  Handle
@@ -253,6 +358,22 @@ CpuStackPop64 (
   IN  CpuContext  *Cpu
   );
 
+#if defined (MAU_SHADOW_TPL) || defined (MAU_FAST_PCI_IO)
+VOID
+CpuGetCallArgs (
+  IN  CpuContext  *Cpu,
+  OUT UINT64      *Args,
+  IN  UINTN       Count
+  );
+
+UINT64
+CpuCallReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  );
+
+#endif /* MAU_SHADOW_TPL || MAU_FAST_PCI_IO */
+
 VOID
 CpuDump (
   VOID
@@ -285,7 +406,26 @@ EmulatorDump (
 
 BOOLEAN
 EmulatorIsNativeCall (
-  IN  UINT64  ProgramCounter
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter
+  );
+
+CHAR8 *
+EmulatorGetListVariable (
+  IN  CONST CHAR16  *Name
+  );
+
+CONST CHAR8 *
+EmulatorListNext (
+  IN OUT CONST CHAR8  **List,
+  OUT    UINTN        *Length
+  );
+
+BOOLEAN
+EmulatorListHas (
+  IN  CONST CHAR8  *List,
+  IN  CONST CHAR8  *Name,
+  IN  UINTN        NameLength
   );
 
 EFI_STATUS
@@ -319,6 +459,18 @@ CpuRunFunc (
   IN  UINT64               *Args
   );
 
+#ifdef MAU_WRAPPED_ENTRY_POINTS
+UINT64
+CpuRunFuncBatch (
+  IN  CpuContext           *Cpu,
+  IN  EFI_VIRTUAL_ADDRESS  ProgramCounter,
+  IN  UINT64               *Args,
+  IN  BOOLEAN (*Next)(CpuRunContext *, VOID *),
+  IN  VOID                 *NextContext
+  );
+
+#endif /* MAU_WRAPPED_ENTRY_POINTS */
+
 #ifndef NDEBUG
 EFI_STATUS
 EFIAPI
@@ -342,11 +494,30 @@ CpuRegisterCodeRange (
   IN  UINT64                ImageSize
   );
 
+#ifdef MAU_ENGINE_POOL
+VOID
+CpuPoolImageRegister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+CpuPoolImageUnregister (
+  IN  ImageRecord  *Record
+  );
+
+#endif /* MAU_ENGINE_POOL */
+
 BOOLEAN
 CpuAddrIsCodeGen (
   IN  EFI_PHYSICAL_ADDRESS  Address
   );
 
+BOOLEAN
+CpuRangeIsCodeGen (
+  IN  EFI_PHYSICAL_ADDRESS  Address,
+  IN  UINT64                Size
+  );
+
 #ifdef MAU_SUPPORTS_X64_BINS
 UINT64
 NativeThunkX64 (
@@ -378,6 +549,200 @@ TestProtocolInit (
   IN  EFI_HANDLE  ImageHandle
   );
 
+#ifdef MAU_TRACE
+#define TRACE_EVENT(Event, MachineType, Arg0, Arg1, Arg2, Arg3)  \
+  TraceEvent (                                                    \
+    (Event),                                                      \
+    (MachineType),                                                \
+    (UINT64)(Arg0),                                               \
+    (UINT64)(Arg1),                                               \
+    (UINT64)(Arg2),                                               \
+    (UINT64)(Arg3)                                                \
+    )
+
+VOID
+TraceEvent (
+  IN  UINT16  Event,
+  IN  UINT16  MachineType,
+  IN  UINT64  Arg0,
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3
+  );
+
+VOID
+TraceInit (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+VOID
+TraceCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+#else /* MAU_TRACE */
+#define TRACE_EVENT(Event, MachineType, Arg0, Arg1, Arg2, Arg3)
+#endif /* MAU_TRACE */
+
+#ifdef MAU_BB_TRACE
+#define BB_TRACE_NATIVE_CALL(ReturnAddress, Target)  \
+  BbTraceNativeCall ((ReturnAddress), (Target))
+
+VOID
+BbTraceNativeCall (
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  Target
+  );
+
+VOID
+BbTraceImageRegister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+BbTraceImageUnregister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+BbTraceInit (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+VOID
+BbTraceCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+#else /* MAU_BB_TRACE */
+#define BB_TRACE_NATIVE_CALL(ReturnAddress, Target)
+#endif /* MAU_BB_TRACE */
+
+#ifdef MAU_CALL_RECORD
+VOID
+RecordEmuCall (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter,
+  IN  UINT64      *Args,
+  IN  UINT64      ReturnAddress
+  );
+
+VOID
+RecordEmuReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  );
+
+VOID
+RecordNativeCall (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ReturnAddress,
+  IN  UINT64      ProgramCounter,
+  IN  UINT64      *Args
+  );
+
+VOID
+RecordNativeReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  );
+
+VOID
+RecordImage (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+RecordTouchRange (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Address,
+  IN  UINT64      Size,
+  IN  BOOLEAN     Write
+  );
+
+EFI_STATUS
+RecordCpuInit (
+  IN  CpuContext  *Cpu
+  );
+
+VOID
+RecordInit (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+VOID
+RecordCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  );
+
+#endif /* MAU_CALL_RECORD */
+
+#ifdef MAU_PROTOCOL_TRAMPOLINES
+UINT64
+TrampolineFind (
+  IN  UINT64       Address,
+  OUT ImageRecord  **Image OPTIONAL
+  );
+
+VOID
+TrampolinePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  );
+
+VOID
+TrampolineImageUnregister (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+TrampolineDump (
+  VOID
+  );
+
+#endif /* MAU_PROTOCOL_TRAMPOLINES */
+
+#ifdef MAU_SHADOW_TPL
+UINT64
+TplShadowCall (
+  IN  CpuRunContext  *Context
+  );
+
+VOID
+TplSync (
+  IN  CpuRunContext  *Context
+  );
+
+UINT64
+TplOverride (
+  IN  UINT64  ProgramCounter
+  );
+
+VOID
+TplGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_SHADOW_TPL */
+
+#ifdef MAU_MP_SERVICES
+UINT64
+MpServicesOverride (
+  IN  UINT64  ProgramCounter
+  );
+
+VOID
+MpServicesInit (
+  VOID
+  );
+
+VOID
+MpServicesCleanup (
+  VOID
+  );
+
+#endif /* MAU_MP_SERVICES */
+
 EFI_STATUS
 ArchInit (
   VOID
@@ -388,6 +753,263 @@ ArchCleanup (
   VOID
   );
 
+EFI_STATUS
+RamInit (
+  VOID
+  );
+
+VOID
+RamCleanup (
+  VOID
+  );
+
+BOOLEAN
+RamIsRange (
+  IN  EFI_PHYSICAL_ADDRESS  Start,
+  IN  UINT64                Size
+  );
+
+#ifdef MAU_X64_REP_STRINGS
+VOID
+RepStringImageRegister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+RepStringImageUnregister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+RepStringGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_X64_REP_STRINGS */
+
+#ifdef MAU_HLE
+VOID
+HleImageRegister (
+  IN  ImageRecord  *Record
+  );
+
+VOID
+HleGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_HLE */
+
+#ifdef MAU_LOW_MEM
+VOID
+LowMemImageRegister (
+  IN  ImageRecord  *Record
+  );
+
+UINT64
+LowMemOverride (
+  IN  UINT64  ProgramCounter
+  );
+
+BOOLEAN
+LowMemFreePool (
+  IN  VOID        *Buffer,
+  OUT EFI_STATUS  *Status
+  );
+
+VOID
+LowMemGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_LOW_MEM */
+
+#if defined (MAU_GOP_BLT) || defined (MAU_SUPPORTED_CACHE) || \
+  defined (MAU_SNP_THROTTLE)
+#define PATCHED_INTERFACE_MAX_FUNCTIONS  4
+
+typedef struct {
+  LIST_ENTRY     Link;
+  VOID           *Interface;
+  ImageRecord    *Image;
+  /*
+   * The replaced functions, see PatchedInterfaceCall.
+   */
+  UINT64         Emulated[PATCHED_INTERFACE_MAX_FUNCTIONS];
+} PatchedInterface;
+
+typedef struct {
+  /*
+   * Of the PatchedInterface records.
+   */
+  LIST_ENTRY     List;
+  CONST CHAR8    *Name;
+  EFI_GUID       *Protocol;
+  /*
+   * sizeof (PatchedInterface) and then any per-interface state.
+   */
+  UINTN          RecordSize;
+  UINTN          FunctionCount;
+  /*
+   * Offsets of the replaced functions in the interface,
+   * and their native replacements.
+   */
+  UINTN          Offsets[PATCHED_INTERFACE_MAX_FUNCTIONS];
+  VOID           *Natives[PATCHED_INTERFACE_MAX_FUNCTIONS];
+} PatchedInterfaceConfig;
+
+PatchedInterface *
+PatchedInterfaceFind (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  VOID                    *Interface
+  );
+
+PatchedInterface *
+PatchedInterfacePatch (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  EFI_GUID                *Protocol,
+  IN  VOID                    *Interface
+  );
+
+UINT64
+PatchedInterfaceCall (
+  IN  PatchedInterface  *Record,
+  IN  UINTN             Index,
+  IN  UINT64            *Args
+  );
+
+VOID
+PatchedInterfaceImageUnregister (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  ImageRecord             *Image
+  );
+
+#endif /* MAU_GOP_BLT || MAU_SUPPORTED_CACHE || MAU_SNP_THROTTLE */
+
+#ifdef MAU_GOP_BLT
+VOID
+GopBltPatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  );
+
+VOID
+GopBltImageUnregister (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+GopBltGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_GOP_BLT */
+
+#ifdef MAU_SUPPORTED_CACHE
+VOID
+SupportedCachePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  );
+
+VOID
+SupportedCacheImageUnregister (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+SupportedCacheGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_SUPPORTED_CACHE */
+
+#ifdef MAU_SNP_THROTTLE
+VOID
+SnpThrottlePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  );
+
+VOID
+SnpThrottleImageUnregister (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+SnpThrottleGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_SNP_THROTTLE */
+
+#ifdef MAU_FAST_PCI_IO
+UINT64
+PciIoShadowCall (
+  IN  CpuRunContext  *Context
+  );
+
+UINT64
+PciIoOverride (
+  IN  UINT64  ProgramCounter
+  );
+
+VOID
+PciIoImageUnregister (
+  IN  ImageRecord  *Image
+  );
+
+VOID
+PciIoGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_FAST_PCI_IO */
+
+UINT32
+PioRead (
+  IN  UINT32  Port,
+  IN  UINT32  Size
+  );
+
+VOID
+PioWrite (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINT32  Value
+  );
+
+VOID
+PioReadFifo (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINTN   Count,
+  OUT VOID    *Buffer
+  );
+
+VOID
+PioWriteFifo (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINTN   Count,
+  IN  VOID    *Buffer
+  );
+
+VOID
+PioInit (
+  VOID
+  );
+
+VOID
+PioCleanup (
+  VOID
+  );
+
+VOID
+PioGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
 EFI_STATUS
 EfiHooksInit (
   VOID
@@ -403,6 +1025,11 @@ EfiWrappersInit (
   VOID
   );
 
+VOID
+EfiWrappersCleanup (
+  VOID
+  );
+
 UINT64
 EfiWrappersOverride (
   IN  UINT64  ProgramCounter
@@ -413,6 +1040,14 @@ EfiWrappersDump (
   VOID
   );
 
+#ifdef MAU_WRAPPED_ENTRY_POINTS
+VOID
+EfiWrappersGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  );
+
+#endif /* MAU_WRAPPED_ENTRY_POINTS */
+
 EFI_STATUS
 ObjectAllocCreate (
   IN  ObjectAllocConfig   *Config,
@@ -436,6 +1071,11 @@ ObjectFree (
   IN  ObjectHeader        *Object
   );
 
+VOID
+ObjectAllocDump (
+  VOID
+  );
+
 STATIC
 inline
 VOID
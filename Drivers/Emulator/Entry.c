@@ -69,7 +69,6 @@ DriverEntry (
     return Status;
   }
 
- #ifndef MAU_EMU_X64_RAZ_WI_PIO
   Status = gBS->LocateProtocol (
                   &gEfiCpuIo2ProtocolGuid,
                   NULL,
@@ -77,8 +76,6 @@ DriverEntry (
                   );
   ASSERT (Status == EFI_SUCCESS);
 
- #endif /* MAU_EMU_X64_RAZ_WI_PIO */
-
   Status = gBS->InstallMultipleProtocolInterfaces (
                   &mDevice,
                   &gEfiDevicePathProtocolGuid,
@@ -0,0 +1,275 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Protocol/GraphicsOutput.h>
+
+/*
+ * Every character drawn by the (native) console stack on an
+ * emulated GOP is an emulated Blt call, as is every scroll. For
+ * GOP instances installed by emulated drivers, Blt is replaced with
+ * GopBltNative, which does the Blt directly on the framebuffer when
+ * the current mode has a linear 32bpp BGRX framebuffer (the BltBuffer
+ * pixel format), like FrameBufferBltLib would. Everything else,
+ * including invalid requests, goes to the emulated Blt.
+ */
+
+#ifdef MAU_GOP_BLT
+
+STATIC
+EFI_STATUS
+EFIAPI
+GopBltNative (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL       *This,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_PIXEL      *BltBuffer OPTIONAL,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_OPERATION  BltOperation,
+  IN  UINTN                              SourceX,
+  IN  UINTN                              SourceY,
+  IN  UINTN                              DestinationX,
+  IN  UINTN                              DestinationY,
+  IN  UINTN                              Width,
+  IN  UINTN                              Height,
+  IN  UINTN                              Delta OPTIONAL
+  );
+
+STATIC PatchedInterfaceConfig  mGopBltPatch = {
+  INITIALIZE_LIST_HEAD_VARIABLE (mGopBltPatch.List),
+  "GOP Blt",
+  &gEfiGraphicsOutputProtocolGuid,
+  sizeof (PatchedInterface),
+  1,
+  { OFFSET_OF (EFI_GRAPHICS_OUTPUT_PROTOCOL, Blt) },
+  { (VOID *)GopBltNative }
+};
+
+STATIC UINTN  mGopBltNative;
+STATIC UINTN  mGopBltEmulated;
+
+/*
+ * Returns the framebuffer if the Blt can be done on it natively,
+ * or NULL.
+ */
+STATIC
+UINT32 *
+GopBltFrameBuffer (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL       *Gop,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_OPERATION  BltOperation,
+  IN  UINTN                              SourceX,
+  IN  UINTN                              SourceY,
+  IN  UINTN                              DestinationX,
+  IN  UINTN                              DestinationY,
+  IN  UINTN                              Width,
+  IN  UINTN                              Height
+  )
+{
+  EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE     *Mode;
+  EFI_GRAPHICS_OUTPUT_MODE_INFORMATION  *Info;
+  UINTN                                 HorizontalResolution;
+  UINTN                                 VerticalResolution;
+
+  if (BltOperation >= EfiGraphicsOutputBltOperationMax) {
+    return NULL;
+  }
+
+  Mode = Gop->Mode;
+  if ((Mode == NULL) || (Mode->Info == NULL) || (Mode->FrameBufferBase == 0)) {
+    return NULL;
+  }
+
+  Info                 = Mode->Info;
+  HorizontalResolution = Info->HorizontalResolution;
+  VerticalResolution   = Info->VerticalResolution;
+  if ((Info->PixelFormat != PixelBlueGreenRedReserved8BitPerColor) ||
+      (Info->PixelsPerScanLine < HorizontalResolution) ||
+      ((UINT64)Info->PixelsPerScanLine * VerticalResolution * sizeof (UINT32) >
+       Mode->FrameBufferSize))
+  {
+    return NULL;
+  }
+
+  if ((Width == 0) || (Height == 0) ||
+      (Width > HorizontalResolution) || (Height > VerticalResolution))
+  {
+    return NULL;
+  }
+
+  if ((BltOperation == EfiBltVideoToBltBuffer) ||
+      (BltOperation == EfiBltVideoToVideo))
+  {
+    if ((SourceX > HorizontalResolution - Width) ||
+        (SourceY > VerticalResolution - Height))
+    {
+      return NULL;
+    }
+  }
+
+  if ((BltOperation == EfiBltVideoFill) ||
+      (BltOperation == EfiBltBufferToVideo) ||
+      (BltOperation == EfiBltVideoToVideo))
+  {
+    if ((DestinationX > HorizontalResolution - Width) ||
+        (DestinationY > VerticalResolution - Height))
+    {
+      return NULL;
+    }
+  }
+
+  /*
+   * Framebuffers are identity mapped.
+   */
+  return (UINT32 *)(UINTN)Mode->FrameBufferBase;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+GopBltNative (
+  IN  EFI_GRAPHICS_OUTPUT_PROTOCOL       *This,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_PIXEL      *BltBuffer OPTIONAL,
+  IN  EFI_GRAPHICS_OUTPUT_BLT_OPERATION  BltOperation,
+  IN  UINTN                              SourceX,
+  IN  UINTN                              SourceY,
+  IN  UINTN                              DestinationX,
+  IN  UINTN                              DestinationY,
+  IN  UINTN                              Width,
+  IN  UINTN                              Height,
+  IN  UINTN                              Delta OPTIONAL
+  )
+{
+  PatchedInterface  *Record;
+  UINT32            *FrameBuffer;
+  UINTN             Stride;
+  UINTN             RowSize;
+  UINTN             Row;
+  UINTN             Line;
+  UINT8             *Buffer;
+
+  Record = PatchedInterfaceFind (&mGopBltPatch, This);
+  ASSERT (Record != NULL);
+  if (Record == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  FrameBuffer = NULL;
+  if ((BltBuffer != NULL) || (BltOperation == EfiBltVideoToVideo)) {
+    FrameBuffer = GopBltFrameBuffer (
+                    This,
+                    BltOperation,
+                    SourceX,
+                    SourceY,
+                    DestinationX,
+                    DestinationY,
+                    Width,
+                    Height
+                    );
+  }
+
+  if (FrameBuffer == NULL) {
+    UINT64  Args[MAX_ARGS] = {
+      (UINT64)This,  (UINT64)BltBuffer, BltOperation, SourceX,
+      SourceY,       DestinationX,      DestinationY, Width,
+      Height,        Delta
+    };
+
+    mGopBltEmulated++;
+    return PatchedInterfaceCall (Record, 0, Args);
+  }
+
+  mGopBltNative++;
+  Stride  = This->Mode->Info->PixelsPerScanLine;
+  RowSize = Width * sizeof (UINT32);
+  if (Delta == 0) {
+    Delta = RowSize;
+  }
+
+  switch (BltOperation) {
+    case EfiBltVideoFill:
+      for (Row = 0; Row < Height; Row++) {
+        SetMem32 (
+          FrameBuffer + (DestinationY + Row) * Stride + DestinationX,
+          RowSize,
+          *(UINT32 *)BltBuffer
+          );
+      }
+
+      break;
+    case EfiBltVideoToBltBuffer:
+      Buffer = (UINT8 *)BltBuffer + DestinationY * Delta + DestinationX * sizeof (UINT32);
+      for (Row = 0; Row < Height; Row++, Buffer += Delta) {
+        CopyMem (
+          Buffer,
+          FrameBuffer + (SourceY + Row) * Stride + SourceX,
+          RowSize
+          );
+      }
+
+      break;
+    case EfiBltBufferToVideo:
+      Buffer = (UINT8 *)BltBuffer + SourceY * Delta + SourceX * sizeof (UINT32);
+      for (Row = 0; Row < Height; Row++, Buffer += Delta) {
+        CopyMem (
+          FrameBuffer + (DestinationY + Row) * Stride + DestinationX,
+          Buffer,
+          RowSize
+          );
+      }
+
+      break;
+    default:
+      /*
+       * EfiBltVideoToVideo. Rows may overlap, so copy
+       * bottom-up when moving down.
+       */
+      for (Row = 0; Row < Height; Row++) {
+        Line = DestinationY > SourceY ? Height - 1 - Row : Row;
+        CopyMem (
+          FrameBuffer + (DestinationY + Line) * Stride + DestinationX,
+          FrameBuffer + (SourceY + Line) * Stride + SourceX,
+          RowSize
+          );
+      }
+
+      break;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Called for interfaces installed by emulated code.
+ */
+VOID
+GopBltPatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  )
+{
+  PatchedInterfacePatch (&mGopBltPatch, Protocol, Interface);
+}
+
+VOID
+GopBltImageUnregister (
+  IN  ImageRecord  *Image
+  )
+{
+  PatchedInterfaceImageUnregister (&mGopBltPatch, Image);
+}
+
+VOID
+GopBltGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->GopBltNative   = mGopBltNative;
+  DebugState->GopBltEmulated = mGopBltEmulated;
+}
+
+#endif /* MAU_GOP_BLT */
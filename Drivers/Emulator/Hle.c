@@ -0,0 +1,478 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+
+/*
+ * High-level emulation of well-known library routines statically
+ * linked into emulated images (BaseMemoryLib, BaseLib strings, CRC32).
+ *
+ * When an image is registered, each function in its .pdata is
+ * matched against mHleSignatures by size and CRC32 of its bytes.
+ * Matched functions get their first instruction(s) replaced by a
+ * jump to the native implementation, which emulated callers then
+ * reach via the regular native call path, with the caller's return
+ * address and arguments untouched.
+ *
+ * Signatures are generated with Tools/HleFingerprint.py from builds
+ * of the library routines, into HleSignatures.h. Only functions
+ * without base relocations are fingerprinted, so the bytes of a
+ * loaded image match the file. As they depend on the compiler, flags
+ * and library instances used, signatures may also be given at runtime
+ * in the HleSignatures variable (gEfiCallerIdGuid), as a
+ * space-separated list of Name:MachineType:Size:Crc32 items with hex
+ * numbers.
+ *
+ * The HleDisable variable (gEfiCallerIdGuid) holds a space-separated
+ * list of routine names not to redirect, or "*" for all.
+ */
+
+#ifdef MAU_HLE
+
+#define HLE_DISABLE_VARIABLE     L"HleDisable"
+#define HLE_SIGNATURES_VARIABLE  L"HleSignatures"
+
+#define HLE_X64_PATCH_SIZE      14
+#define HLE_AARCH64_PATCH_SIZE  20
+#define HLE_AARCH64_LDR_X16     0x58000050 // ldr x16, #8
+#define HLE_AARCH64_LDR_X16_12  0x58000070 // ldr x16, #12
+#define HLE_AARCH64_BR_X16      0xD61F0200 // br x16
+#define HLE_AARCH64_NOP         0xD503201F
+
+typedef struct {
+  CONST CHAR8    *Name;
+  VOID           *Native;
+} HleNative;
+
+typedef struct {
+  CONST CHAR8    *Name;
+  UINT16         MachineType;
+  UINT32         Size;
+  UINT32         Crc32;
+} HleSignature;
+
+STATIC CONST HleNative  mHleNatives[] = {
+  { "CopyMem",        (VOID *)CopyMem        },
+  { "SetMem",         (VOID *)SetMem         },
+  { "SetMem16",       (VOID *)SetMem16       },
+  { "SetMem32",       (VOID *)SetMem32       },
+  { "SetMem64",       (VOID *)SetMem64       },
+  { "SetMemN",        (VOID *)SetMemN        },
+  { "ZeroMem",        (VOID *)ZeroMem        },
+  { "CompareMem",     (VOID *)CompareMem     },
+  { "ScanMem8",       (VOID *)ScanMem8       },
+  { "ScanMem16",      (VOID *)ScanMem16      },
+  { "ScanMem32",      (VOID *)ScanMem32      },
+  { "ScanMem64",      (VOID *)ScanMem64      },
+  { "StrLen",         (VOID *)StrLen         },
+  { "StrSize",        (VOID *)StrSize        },
+  { "StrCmp",         (VOID *)StrCmp         },
+  { "StrnCmp",        (VOID *)StrnCmp        },
+  { "AsciiStrLen",    (VOID *)AsciiStrLen    },
+  { "AsciiStrSize",   (VOID *)AsciiStrSize   },
+  { "AsciiStrCmp",    (VOID *)AsciiStrCmp    },
+  { "AsciiStrnCmp",   (VOID *)AsciiStrnCmp   },
+  { "CalculateCrc32", (VOID *)CalculateCrc32 },
+};
+
+/*
+ * Generated by Tools/HleFingerprint.py. Several signatures
+ * may share a name (different compilers, flags or library
+ * instances). Terminated by a NULL Name, like the tables
+ * parsed from HLE_SIGNATURES_VARIABLE.
+ */
+STATIC CONST HleSignature  mHleSignatures[] = {
+#include "HleSignatures.h"
+  { NULL }
+};
+
+STATIC UINTN  mHleFunctions;
+
+/*
+ * Name is NameLength characters long, and need not be NUL-terminated.
+ */
+STATIC
+CONST HleNative *
+HleFindNative (
+  IN  CONST CHAR8  *Name,
+  IN  UINTN        NameLength
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < ARRAY_SIZE (mHleNatives); Index++) {
+    if ((AsciiStrLen (mHleNatives[Index].Name) == NameLength) &&
+        (AsciiStrnCmp (mHleNatives[Index].Name, Name, NameLength) == 0))
+    {
+      return &mHleNatives[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Parses a HLE_SIGNATURES_VARIABLE list into a table terminated
+ * by a NULL Name. Items for routines without a native
+ * implementation, or malformed, are skipped.
+ */
+STATIC
+HleSignature *
+HleParseSignatures (
+  IN  CONST CHAR8  *List
+  )
+{
+  CONST CHAR8      *Walk;
+  CONST CHAR8      *Item;
+  CHAR8            *End;
+  UINTN            Length;
+  UINTN            NameLength;
+  UINTN            Count;
+  UINTN            Index;
+  UINTN            Values[3];
+  CONST HleNative  *Native;
+  HleSignature     *Sigs;
+
+  Walk = List;
+  for (Count = 0; EmulatorListNext (&Walk, &Length) != NULL; Count++) {
+  }
+
+  Sigs = AllocateZeroPool ((Count + 1) * sizeof (*Sigs));
+  if (Sigs == NULL) {
+    return NULL;
+  }
+
+  Count = 0;
+  Walk  = List;
+  while ((Item = EmulatorListNext (&Walk, &Length)) != NULL) {
+    for (NameLength = 0; (NameLength < Length) && (Item[NameLength] != ':'); NameLength++) {
+    }
+
+    End = (CHAR8 *)Item + NameLength;
+    for (Index = 0; Index < ARRAY_SIZE (Values); Index++) {
+      if ((End >= Item + Length) || (*End != ':') ||
+          RETURN_ERROR (AsciiStrHexToUintnS (End + 1, &End, &Values[Index])))
+      {
+        break;
+      }
+    }
+
+    Native = HleFindNative (Item, NameLength);
+    if ((Index < ARRAY_SIZE (Values)) || (End != Item + Length) ||
+        (Values[0] > MAX_UINT16) || (Values[1] > MAX_UINT32) ||
+        (Values[2] > MAX_UINT32) || (Native == NULL))
+    {
+      DEBUG ((DEBUG_ERROR, "HLE: skipping bad %s item %u\n", HLE_SIGNATURES_VARIABLE, Count));
+      continue;
+    }
+
+    Sigs[Count].Name        = Native->Name;
+    Sigs[Count].MachineType = (UINT16)Values[0];
+    Sigs[Count].Size        = (UINT32)Values[1];
+    Sigs[Count].Crc32       = (UINT32)Values[2];
+    Count++;
+  }
+
+  return Sigs;
+}
+
+/*
+ * Returns the signature in Sigs matching the function at
+ * Begin..Begin + Size - 1, or NULL. The CRC32 of the function
+ * is only computed once a signature of the same size is found,
+ * and kept in *Crc32 across calls.
+ */
+STATIC
+CONST HleSignature *
+HleFindSignature (
+  IN     CONST HleSignature  *Sigs,
+  IN     ImageRecord         *Record,
+  IN     UINT32              Begin,
+  IN     UINT32              Size,
+  IN OUT BOOLEAN             *HaveCrc32,
+  IN OUT UINT32              *Crc32
+  )
+{
+  for ( ; Sigs->Name != NULL; Sigs++) {
+    if ((Sigs->MachineType != Record->Cpu->EmuMachineType) ||
+        (Sigs->Size != Size))
+    {
+      continue;
+    }
+
+    if (!*HaveCrc32) {
+      *Crc32     = CalculateCrc32 ((VOID *)(Record->ImageBase + Begin), Size);
+      *HaveCrc32 = TRUE;
+    }
+
+    if (Sigs->Crc32 == *Crc32) {
+      return Sigs;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+EFI_IMAGE_DATA_DIRECTORY *
+HleGetPdata (
+  IN  ImageRecord  *Record
+  )
+{
+  EFI_IMAGE_DOS_HEADER      *DosHdr;
+  EFI_IMAGE_NT_HEADERS64    *Hdr;
+  EFI_IMAGE_DATA_DIRECTORY  *Dir;
+  UINT32                    Offset;
+
+  DosHdr = (VOID *)Record->ImageBase;
+  Offset = 0;
+  if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE) {
+    Offset = DosHdr->e_lfanew;
+  }
+
+  if (Offset + sizeof (*Hdr) > Record->ImageSize) {
+    return NULL;
+  }
+
+  Hdr = (VOID *)(Record->ImageBase + Offset);
+  if ((Hdr->Signature != EFI_IMAGE_NT_SIGNATURE) ||
+      (Hdr->OptionalHeader.Magic != EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC) ||
+      (Hdr->OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION))
+  {
+    return NULL;
+  }
+
+  Dir = &Hdr->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+  if ((Dir->Size == 0) ||
+      (Dir->VirtualAddress >= Record->ImageSize) ||
+      (Dir->Size > Record->ImageSize - Dir->VirtualAddress))
+  {
+    return NULL;
+  }
+
+  return Dir;
+}
+
+/*
+ * Returns the function at .pdata entry Index as Begin..Begin + Size - 1,
+ * or FALSE if past the end of the .pdata or malformed.
+ */
+STATIC
+BOOLEAN
+HleGetFunction (
+  IN  ImageRecord               *Record,
+  IN  EFI_IMAGE_DATA_DIRECTORY  *Pdata,
+  IN  UINTN                     Index,
+  OUT UINT32                    *Begin,
+  OUT UINT32                    *Size
+  )
+{
+  UINT32  *Entry;
+  UINT32  Unwind;
+
+  if (Record->Cpu->EmuMachineType == EFI_IMAGE_MACHINE_X64) {
+    /*
+     * RUNTIME_FUNCTION: BeginAddress, EndAddress, UnwindData.
+     */
+    if ((Index + 1) * 3 * sizeof (UINT32) > Pdata->Size) {
+      return FALSE;
+    }
+
+    Entry  = (UINT32 *)(Record->ImageBase + Pdata->VirtualAddress) + Index * 3;
+    if (Entry[1] < Entry[0]) {
+      return FALSE;
+    }
+
+    *Begin = Entry[0];
+    *Size  = Entry[1] - Entry[0];
+  } else {
+    /*
+     * Function start and either packed unwind data or
+     * the .xdata RVA, both including the function length
+     * in instructions.
+     */
+    if ((Index + 1) * 2 * sizeof (UINT32) > Pdata->Size) {
+      return FALSE;
+    }
+
+    Entry  = (UINT32 *)(Record->ImageBase + Pdata->VirtualAddress) + Index * 2;
+    *Begin = Entry[0];
+    Unwind = Entry[1];
+    if ((Unwind & 3) != 0) {
+      *Size = ((Unwind >> 2) & 0x7FF) * 4;
+    } else {
+      if (Unwind > Record->ImageSize - sizeof (UINT32)) {
+        return FALSE;
+      }
+
+      *Size = (*(UINT32 *)(Record->ImageBase + Unwind) & 0x3FFFF) * 4;
+    }
+  }
+
+  return *Begin < Record->ImageSize && *Size <= Record->ImageSize - *Begin;
+}
+
+STATIC
+UINTN
+HlePatchSize (
+  IN  ImageRecord  *Record
+  )
+{
+  if (Record->Cpu->EmuMachineType == EFI_IMAGE_MACHINE_X64) {
+    return HLE_X64_PATCH_SIZE;
+  }
+
+  return HLE_AARCH64_PATCH_SIZE;
+}
+
+/*
+ * The image is not yet running, so no TBs need invalidating.
+ */
+STATIC
+VOID
+HlePatch (
+  IN  ImageRecord  *Record,
+  IN  UINT64       Function,
+  IN  VOID         *Native
+  )
+{
+  UINT8   *Code;
+  UINT32  *Insn;
+
+  if (Record->Cpu->EmuMachineType == EFI_IMAGE_MACHINE_X64) {
+    /*
+     * jmp [rip + 0]
+     */
+    Code    = (UINT8 *)Function;
+    Code[0] = 0xFF;
+    Code[1] = 0x25;
+    WriteUnaligned32 ((UINT32 *)(Code + 2), 0);
+    WriteUnaligned64 ((UINT64 *)(Code + 6), (UINT64)Native);
+    return;
+  }
+
+  /*
+   * Keep the literal naturally aligned.
+   */
+  Insn = (UINT32 *)Function;
+  if (((Function + 8) & 7) == 0) {
+    Insn[0] = HLE_AARCH64_LDR_X16;
+    Insn[1] = HLE_AARCH64_BR_X16;
+    WriteUnaligned64 ((UINT64 *)&Insn[2], (UINT64)Native);
+  } else {
+    Insn[0] = HLE_AARCH64_LDR_X16_12;
+    Insn[1] = HLE_AARCH64_BR_X16;
+    Insn[2] = HLE_AARCH64_NOP;
+    WriteUnaligned64 ((UINT64 *)&Insn[3], (UINT64)Native);
+  }
+}
+
+VOID
+HleImageRegister (
+  IN  ImageRecord  *Record
+  )
+{
+  EFI_IMAGE_DATA_DIRECTORY  *Pdata;
+  CHAR8                     *Disable;
+  CHAR8                     *List;
+  HleSignature              *Extra;
+  UINTN                     Index;
+  UINTN                     Matched;
+  UINT32                    Begin;
+  UINT32                    Size;
+  UINT32                    Crc32;
+  BOOLEAN                   HaveCrc32;
+  CONST HleSignature        *Sig;
+  CONST HleNative           *Native;
+
+  Pdata = HleGetPdata (Record);
+  if (Pdata == NULL) {
+    return;
+  }
+
+  Disable = EmulatorGetListVariable (HLE_DISABLE_VARIABLE);
+  Extra   = NULL;
+  List    = EmulatorGetListVariable (HLE_SIGNATURES_VARIABLE);
+  if (List != NULL) {
+    Extra = HleParseSignatures (List);
+    FreePool (List);
+  }
+
+  Matched = 0;
+  for (Index = 0; HleGetFunction (Record, Pdata, Index, &Begin, &Size); Index++) {
+    if (Size < HlePatchSize (Record)) {
+      continue;
+    }
+
+    HaveCrc32 = FALSE;
+    Crc32     = 0;
+    Sig       = HleFindSignature (mHleSignatures, Record, Begin, Size, &HaveCrc32, &Crc32);
+    if ((Sig == NULL) && (Extra != NULL)) {
+      Sig = HleFindSignature (Extra, Record, Begin, Size, &HaveCrc32, &Crc32);
+    }
+
+    if (Sig == NULL) {
+      continue;
+    }
+
+    Native = HleFindNative (Sig->Name, AsciiStrLen (Sig->Name));
+    if (Native == NULL) {
+      continue;
+    }
+
+    if (EmulatorListHas (Disable, Sig->Name, AsciiStrLen (Sig->Name))) {
+      DEBUG ((
+        DEBUG_INFO,
+        "HLE: %a at 0x%lx disabled\n",
+        Sig->Name,
+        Record->ImageBase + Begin
+        ));
+      continue;
+    }
+
+    HlePatch (Record, Record->ImageBase + Begin, Native->Native);
+    DEBUG ((
+      DEBUG_INFO,
+      "HLE: %a at 0x%lx redirected to 0x%lx\n",
+      Sig->Name,
+      Record->ImageBase + Begin,
+      Native->Native
+      ));
+    Matched++;
+  }
+
+  if (Disable != NULL) {
+    FreePool (Disable);
+  }
+
+  if (Extra != NULL) {
+    FreePool (Extra);
+  }
+
+  mHleFunctions += Matched;
+  DEBUG ((
+    DEBUG_INFO,
+    "HLE: %u of %u functions redirected in image at 0x%lx\n",
+    Matched,
+    Index,
+    Record->ImageBase
+    ));
+}
+
+VOID
+HleGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->HleFunctions = mHleFunctions;
+}
+
+#endif /* MAU_HLE */
@@ -0,0 +1,23 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+/*
+ * Built-in HLE signatures, included by Hle.c into mHleSignatures.
+ *
+ * Generated from the X64 EmulatorTest.efi (which links every routine
+ * in mHleNatives) built with each supported toolchain and target:
+ *
+ *   Tools/HleFingerprint.py --map EmulatorTest.map \
+ *     --header Drivers/Emulator/HleSignatures.h EmulatorTest.efi
+ *
+ * See "Building With MAU_HLE=YES" in Docs/Building.md. Entries are
+ * merged and kept sorted by the tool, one per line.
+ */
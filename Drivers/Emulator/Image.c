@@ -12,7 +12,44 @@
 
 #include "Emulator.h"
 
-STATIC LIST_ENTRY  mImageList = INITIALIZE_LIST_HEAD_VARIABLE (mImageList);
+#define IMAGE_RECORD_SIGNATURE  SIGNATURE_32 ('I', 'M', 'G', 'R')
+#define IMAGE_RECORDS           32
+
+STATIC LIST_ENTRY          mImageList = INITIALIZE_LIST_HEAD_VARIABLE (mImageList);
+STATIC ObjectAllocContext  *mImageAlloc;
+
+STATIC
+ImageRecord *
+ImageAllocRecord (
+  VOID
+  )
+{
+  EFI_STATUS         Status;
+  ObjectHeader       *Object;
+  ObjectAllocConfig  AllocConfig;
+
+  if (mImageAlloc == NULL) {
+    ZeroMem (&AllocConfig, sizeof (AllocConfig));
+    AllocConfig.Name        = "ImageRecord";
+    AllocConfig.ObjectSize  = sizeof (ImageRecord);
+    AllocConfig.ObjectCount = IMAGE_RECORDS;
+    AllocConfig.Growable    = TRUE;
+    AllocConfig.Signature   = IMAGE_RECORD_SIGNATURE;
+
+    Status = ObjectAllocCreate (&AllocConfig, &mImageAlloc);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a: ObjectAllocCreate: %r\n", __func__, Status));
+      return NULL;
+    }
+  }
+
+  Status = ObjectAlloc (mImageAlloc, &Object);
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  return (VOID *)Object;
+}
 
 VOID
 ImageDump (
@@ -64,6 +101,34 @@ ImageFindByAddress (
   return NULL;
 }
 
+/*
+ * Returns the first image overlapping Address..Address + Size - 1.
+ */
+ImageRecord *
+ImageFindByRange (
+  IN  EFI_PHYSICAL_ADDRESS  Address,
+  IN  UINT64                Size
+  )
+{
+  LIST_ENTRY   *Entry;
+  ImageRecord  *Record;
+
+  for (Entry = GetFirstNode (&mImageList);
+       !IsNull (&mImageList, Entry);
+       Entry = GetNextNode (&mImageList, Entry))
+  {
+    Record = BASE_CR (Entry, ImageRecord, Link);
+
+    if ((Address < Record->ImageBase + Record->ImageSize) &&
+        (Record->ImageBase < Address + Size))
+    {
+      return Record;
+    }
+  }
+
+  return NULL;
+}
+
 ImageRecord *
 ImageFindByHandle (
   IN  EFI_HANDLE  Handle
@@ -115,7 +180,7 @@ ImageProtocolRegister (
     ImageContext.ImageType == EFI_IMAGE_SUBSYSTEM_EFI_BOOT_SERVICE_DRIVER
     );
 
-  Record = AllocatePool (sizeof (*Record));
+  Record = ImageAllocRecord ();
   if (Record == NULL) {
     return EFI_OUT_OF_RESOURCES;
   }
@@ -139,9 +204,35 @@ ImageProtocolRegister (
   Record->ImageEntry = (UINT64)*EntryPoint;
   Record->ImageSize  = ImageSize;
 
+ #ifdef MAU_HLE
+  HleImageRegister (Record);
+ #endif /* MAU_HLE */
+ #ifdef MAU_LOW_MEM
+  LowMemImageRegister (Record);
+ #endif /* MAU_LOW_MEM */
   CpuRegisterCodeRange (Record->Cpu, ImageBase, ImageSize);
+ #ifdef MAU_ENGINE_POOL
+  CpuPoolImageRegister (Record);
+ #endif /* MAU_ENGINE_POOL */
 
   InsertTailList (&mImageList, &Record->Link);
+ #ifdef MAU_X64_REP_STRINGS
+  RepStringImageRegister (Record);
+ #endif /* MAU_X64_REP_STRINGS */
+ #ifdef MAU_BB_TRACE
+  BbTraceImageRegister (Record);
+ #endif /* MAU_BB_TRACE */
+ #ifdef MAU_CALL_RECORD
+  RecordImage (Record);
+ #endif /* MAU_CALL_RECORD */
+  TRACE_EVENT (
+    EmuTraceImageRegister,
+    Record->Cpu->EmuMachineType,
+    ImageBase,
+    ImageSize,
+    Record->ImageEntry,
+    0
+    );
 
   /*
    * On AArch64, this code relies on no-execute protection of the "foreign"
@@ -187,6 +278,38 @@ ImageProtocolUnregister (
     return EFI_NOT_FOUND;
   }
 
+  TRACE_EVENT (
+    EmuTraceImageUnregister,
+    Record->Cpu->EmuMachineType,
+    Record->ImageBase,
+    0,
+    0,
+    0
+    );
+ #ifdef MAU_BB_TRACE
+  BbTraceImageUnregister (Record);
+ #endif /* MAU_BB_TRACE */
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  TrampolineImageUnregister (Record);
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+ #ifdef MAU_GOP_BLT
+  GopBltImageUnregister (Record);
+ #endif /* MAU_GOP_BLT */
+ #ifdef MAU_SUPPORTED_CACHE
+  SupportedCacheImageUnregister (Record);
+ #endif /* MAU_SUPPORTED_CACHE */
+ #ifdef MAU_SNP_THROTTLE
+  SnpThrottleImageUnregister (Record);
+ #endif /* MAU_SNP_THROTTLE */
+ #ifdef MAU_FAST_PCI_IO
+  PciIoImageUnregister (Record);
+ #endif /* MAU_FAST_PCI_IO */
+ #ifdef MAU_X64_REP_STRINGS
+  RepStringImageUnregister (Record);
+ #endif /* MAU_X64_REP_STRINGS */
+ #ifdef MAU_ENGINE_POOL
+  CpuPoolImageUnregister (Record);
+ #endif /* MAU_ENGINE_POOL */
   CpuUnregisterCodeRange (Record->Cpu, Record->ImageBase, Record->ImageSize);
 
   /*
@@ -200,7 +323,7 @@ ImageProtocolUnregister (
                    );
 
   RemoveEntryList (&Record->Link);
-  FreePool (Record);
+  ObjectFree (mImageAlloc, &Record->Header);
 
   return Status;
 }
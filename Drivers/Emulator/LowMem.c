@@ -0,0 +1,626 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Protocol/PciIo.h>
+#include <Protocol/PciEnumerationComplete.h>
+
+/*
+ * Some emulated drivers aren't 64-bit clean, and quietly truncate
+ * pointers to allocated memory or DMA addresses. Images named in the
+ * LowMemImages variable (gEfiCallerIdGuid, space-separated PDB base
+ * names, "*" for all) get all their memory from below 4GiB:
+ *
+ * - AllocatePool is served from core pool when that lands below
+ *   4GiB, so native code can free it (e.g. HII ExtractConfig results,
+ *   Driver Health messages or AIP GetInformation buffers). Otherwise,
+ *   up to LOW_MEM_CLASS_MAX bytes come from a low memory arena, carved
+ *   into power-of-two size classes with per-class free lists, and
+ *   larger requests and non-boot services data pool types get pages
+ *   below 4GiB. These are recognized by FreePool whoever calls it,
+ *   as EfiHooks has gBS->FreePool go through LowMemFreePool.
+ * - AllocatePages is limited to below 4GiB.
+ * - PciIo AllocateBuffer has DUAL_ADDRESS_CYCLE cleared, so the
+ *   root bridge allocates below 4GiB.
+ * - PciIo Map of a buffer (partly) above 4GiB for a bus master read
+ *   or write goes through a bounce buffer below 4GiB. Bounce buffers
+ *   are cached across Map/Unmap cycles instead of being freed.
+ */
+
+#ifdef MAU_LOW_MEM
+
+#define LOW_MEM_VARIABLE      L"LowMemImages"
+#define LOW_MEM_SIGNATURE     SIGNATURE_32 ('L', 'M', 'E', 'M')
+#define LOW_MEM_ARENA_PAGES   1024
+#define LOW_MEM_CLASS_MIN     32
+#define LOW_MEM_CLASSES       8
+#define LOW_MEM_CLASS_MAX     (LOW_MEM_CLASS_MIN << (LOW_MEM_CLASSES - 1))
+#define LOW_MEM_CLASS_PAGES   MAX_UINT32
+#define LOW_MEM_BOUNCE_CACHE  16
+
+typedef struct {
+  UINT32    Signature;
+  UINT32    Class;
+  UINT64    Pages;
+} LOW_MEM_HEADER;
+
+typedef struct LOW_MEM_CHUNK {
+  struct LOW_MEM_CHUNK    *Next;
+} LOW_MEM_CHUNK;
+
+typedef struct {
+  LIST_ENTRY                       Link;
+  EFI_PHYSICAL_ADDRESS             Buffer;
+  UINTN                            Pages;
+  /*
+   * Valid while mapped.
+   */
+  VOID                             *Mapping;
+  VOID                             *HostAddress;
+  UINTN                            NumberOfBytes;
+  EFI_PCI_IO_PROTOCOL_OPERATION    Operation;
+} LOW_MEM_BOUNCE;
+
+STATIC EFI_PHYSICAL_ADDRESS  mLowMemArena;
+STATIC EFI_PHYSICAL_ADDRESS  mLowMemArenaNext;
+STATIC EFI_PHYSICAL_ADDRESS  mLowMemArenaEnd;
+STATIC LOW_MEM_CHUNK         *mLowMemFree[LOW_MEM_CLASSES];
+STATIC LIST_ENTRY            mLowMemBounceFree   = INITIALIZE_LIST_HEAD_VARIABLE (mLowMemBounceFree);
+STATIC LIST_ENTRY            mLowMemBounceMapped = INITIALIZE_LIST_HEAD_VARIABLE (mLowMemBounceMapped);
+STATIC UINTN                 mLowMemBounceFreeCount;
+STATIC UINTN                 mLowMemImages;
+STATIC UINTN                 mLowMemAllocations;
+STATIC UINTN                 mLowMemBounceReused;
+STATIC EFI_PCI_IO_PROTOCOL   mLowMemPciIo;
+STATIC VOID                  *mLowMemRegistration;
+
+STATIC
+BOOLEAN
+LowMemIsCaller (
+  IN  UINT64  ReturnAddress
+  )
+{
+  ImageRecord  *Record;
+
+  Record = ImageFindByAddress (ReturnAddress);
+  return Record != NULL && Record->LowMem;
+}
+
+STATIC
+EFI_STATUS
+LowMemAllocatePages (
+  IN  EFI_MEMORY_TYPE       MemoryType,
+  IN  UINTN                 Pages,
+  OUT EFI_PHYSICAL_ADDRESS  *Memory
+  )
+{
+  *Memory = BASE_4GB - 1;
+  return gBS->AllocatePages (AllocateMaxAddress, MemoryType, Pages, Memory);
+}
+
+/*
+ * Returns a free chunk of the class, carving a new page from
+ * the arena if needed.
+ */
+STATIC
+LOW_MEM_CHUNK *
+LowMemGetChunk (
+  IN  UINTN  Class
+  )
+{
+  LOW_MEM_CHUNK  *Chunk;
+  UINTN          ChunkSize;
+  UINTN          Offset;
+
+  Chunk = mLowMemFree[Class];
+  if (Chunk != NULL) {
+    mLowMemFree[Class] = Chunk->Next;
+    return Chunk;
+  }
+
+  if (mLowMemArenaNext == mLowMemArenaEnd) {
+    return NULL;
+  }
+
+  ChunkSize = LOW_MEM_CLASS_MIN << Class;
+  for (Offset = ChunkSize; Offset < EFI_PAGE_SIZE; Offset += ChunkSize) {
+    Chunk              = (VOID *)(UINTN)(mLowMemArenaNext + Offset);
+    Chunk->Next        = mLowMemFree[Class];
+    mLowMemFree[Class] = Chunk;
+  }
+
+  Chunk             = (VOID *)(UINTN)mLowMemArenaNext;
+  mLowMemArenaNext += EFI_PAGE_SIZE;
+  return Chunk;
+}
+
+STATIC
+EFI_STATUS
+LowMemWrapperAllocatePool (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_MEMORY_TYPE       PoolType = Args[0];
+  UINTN                 Size     = Args[1];
+  VOID                  **Buffer = (VOID *)Args[2];
+  EFI_STATUS            Status;
+  UINTN                 Class;
+  LOW_MEM_HEADER        *Header;
+  EFI_PHYSICAL_ADDRESS  Pages;
+
+  if (!LowMemIsCaller (ReturnAddress)) {
+    return gBS->AllocatePool (PoolType, Size, Buffer);
+  }
+
+  if ((Buffer == NULL) || (Size > MAX_UINTN - EFI_PAGE_SIZE)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = gBS->AllocatePool (PoolType, Size, Buffer);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if ((UINTN)*Buffer + Size <= BASE_4GB) {
+    mLowMemAllocations++;
+    return EFI_SUCCESS;
+  }
+
+  gBS->FreePool (*Buffer);
+
+  Header = NULL;
+  if ((PoolType == EfiBootServicesData) &&
+      (Size + sizeof (*Header) <= LOW_MEM_CLASS_MAX))
+  {
+    for (Class = 0; (LOW_MEM_CLASS_MIN << Class) < Size + sizeof (*Header); Class++) {
+    }
+
+    CriticalBegin ();
+    Header = (VOID *)LowMemGetChunk (Class);
+    CriticalEnd ();
+    if (Header != NULL) {
+      Header->Class = (UINT32)Class;
+      Header->Pages = 0;
+    }
+  }
+
+  if (Header == NULL) {
+    Status = LowMemAllocatePages (
+               PoolType,
+               EFI_SIZE_TO_PAGES (Size + sizeof (*Header)),
+               &Pages
+               );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Header        = (VOID *)(UINTN)Pages;
+    Header->Class = LOW_MEM_CLASS_PAGES;
+    Header->Pages = EFI_SIZE_TO_PAGES (Size + sizeof (*Header));
+  }
+
+  Header->Signature = LOW_MEM_SIGNATURE;
+  *Buffer           = Header + 1;
+  mLowMemAllocations++;
+  return EFI_SUCCESS;
+}
+
+/*
+ * Called for every gBS->FreePool, by native or emulated code.
+ * Frees arena and page-backed pool allocations, returning FALSE
+ * for anything else, which is core pool.
+ */
+BOOLEAN
+LowMemFreePool (
+  IN  VOID        *Buffer,
+  OUT EFI_STATUS  *Status
+  )
+{
+  UINTN           Address;
+  UINTN           Class;
+  LOW_MEM_HEADER  *Header;
+  LOW_MEM_CHUNK   *Chunk;
+
+  if ((mLowMemImages == 0) || (Buffer == NULL)) {
+    return FALSE;
+  }
+
+  Address = (UINTN)Buffer;
+  Header  = (LOW_MEM_HEADER *)Buffer - 1;
+  if ((Address >= mLowMemArena) && (Address < mLowMemArenaEnd)) {
+    if ((Header->Signature != LOW_MEM_SIGNATURE) ||
+        (Header->Class >= LOW_MEM_CLASSES))
+    {
+      *Status = EFI_INVALID_PARAMETER;
+      return TRUE;
+    }
+
+    Class             = Header->Class;
+    Header->Signature = 0;
+    Chunk             = (VOID *)Header;
+    CriticalBegin ();
+    Chunk->Next        = mLowMemFree[Class];
+    mLowMemFree[Class] = Chunk;
+    CriticalEnd ();
+    *Status = EFI_SUCCESS;
+    return TRUE;
+  }
+
+  /*
+   * Page-backed allocations. Core pool allocations have
+   * (the end of) a POOL_HEAD in place of LOW_MEM_HEADER.
+   */
+  if ((Address < BASE_4GB) &&
+      ((Address & EFI_PAGE_MASK) == sizeof (*Header)) &&
+      (Header->Signature == LOW_MEM_SIGNATURE) &&
+      (Header->Class == LOW_MEM_CLASS_PAGES))
+  {
+    Header->Signature = 0;
+    *Status           = gBS->FreePages ((UINTN)Header, Header->Pages);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+STATIC
+EFI_STATUS
+LowMemWrapperAllocatePages (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_ALLOCATE_TYPE     Type       = Args[0];
+  EFI_MEMORY_TYPE       MemoryType = Args[1];
+  UINTN                 Pages      = Args[2];
+  EFI_PHYSICAL_ADDRESS  *Memory    = (VOID *)Args[3];
+
+  if ((Memory != NULL) && LowMemIsCaller (ReturnAddress)) {
+    if (Type == AllocateAnyPages) {
+      Type    = AllocateMaxAddress;
+      *Memory = BASE_4GB - 1;
+    } else if ((Type == AllocateMaxAddress) && (*Memory >= BASE_4GB)) {
+      *Memory = BASE_4GB - 1;
+    }
+  }
+
+  return gBS->AllocatePages (Type, MemoryType, Pages, Memory);
+}
+
+STATIC
+EFI_STATUS
+LowMemWrapperPciIoAllocateBuffer (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_PCI_IO_PROTOCOL  *PciIo        = (VOID *)Args[0];
+  EFI_ALLOCATE_TYPE    Type          = Args[1];
+  EFI_MEMORY_TYPE      MemoryType    = Args[2];
+  UINTN                Pages         = Args[3];
+  VOID                 **HostAddress = (VOID *)Args[4];
+  UINT64               Attributes    = Args[5];
+
+  if (LowMemIsCaller (ReturnAddress)) {
+    Attributes &= ~(UINT64)EFI_PCI_IO_ATTRIBUTE_DUAL_ADDRESS_CYCLE;
+  }
+
+  return PciIo->AllocateBuffer (PciIo, Type, MemoryType, Pages, HostAddress, Attributes);
+}
+
+STATIC
+LOW_MEM_BOUNCE *
+LowMemGetBounce (
+  IN  UINTN  Pages
+  )
+{
+  LIST_ENTRY      *Entry;
+  LOW_MEM_BOUNCE  *Bounce;
+  EFI_STATUS      Status;
+
+  CriticalBegin ();
+  for (Entry = GetFirstNode (&mLowMemBounceFree);
+       !IsNull (&mLowMemBounceFree, Entry);
+       Entry = GetNextNode (&mLowMemBounceFree, Entry))
+  {
+    Bounce = BASE_CR (Entry, LOW_MEM_BOUNCE, Link);
+    if (Bounce->Pages >= Pages) {
+      RemoveEntryList (&Bounce->Link);
+      mLowMemBounceFreeCount--;
+      mLowMemBounceReused++;
+      CriticalEnd ();
+      return Bounce;
+    }
+  }
+
+  CriticalEnd ();
+
+  Bounce = AllocatePool (sizeof (*Bounce));
+  if (Bounce == NULL) {
+    return NULL;
+  }
+
+  Status = LowMemAllocatePages (EfiBootServicesData, Pages, &Bounce->Buffer);
+  if (EFI_ERROR (Status)) {
+    FreePool (Bounce);
+    return NULL;
+  }
+
+  Bounce->Pages = Pages;
+  return Bounce;
+}
+
+STATIC
+VOID
+LowMemPutBounce (
+  IN  LOW_MEM_BOUNCE  *Bounce
+  )
+{
+  if (mLowMemBounceFreeCount == LOW_MEM_BOUNCE_CACHE) {
+    gBS->FreePages (Bounce->Buffer, Bounce->Pages);
+    FreePool (Bounce);
+    return;
+  }
+
+  CriticalBegin ();
+  InsertHeadList (&mLowMemBounceFree, &Bounce->Link);
+  mLowMemBounceFreeCount++;
+  CriticalEnd ();
+}
+
+STATIC
+EFI_STATUS
+LowMemWrapperPciIoMap (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_PCI_IO_PROTOCOL            *PciIo         = (VOID *)Args[0];
+  EFI_PCI_IO_PROTOCOL_OPERATION  Operation      = Args[1];
+  VOID                           *HostAddress   = (VOID *)Args[2];
+  UINTN                          *NumberOfBytes = (VOID *)Args[3];
+  EFI_PHYSICAL_ADDRESS           *DeviceAddress = (VOID *)Args[4];
+  VOID                           **Mapping      = (VOID *)Args[5];
+  LOW_MEM_BOUNCE                 *Bounce;
+  EFI_STATUS                     Status;
+
+  /*
+   * Common buffers come from AllocateBuffer.
+   */
+  if ((NumberOfBytes == NULL) || (*NumberOfBytes == 0) || (Mapping == NULL) ||
+      (Operation >= EfiPciIoOperationBusMasterCommonBuffer) ||
+      ((UINTN)HostAddress + *NumberOfBytes <= BASE_4GB) ||
+      !LowMemIsCaller (ReturnAddress))
+  {
+    return PciIo->Map (PciIo, Operation, HostAddress, NumberOfBytes, DeviceAddress, Mapping);
+  }
+
+  Bounce = LowMemGetBounce (EFI_SIZE_TO_PAGES (*NumberOfBytes));
+  if (Bounce == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (Operation == EfiPciIoOperationBusMasterRead) {
+    CopyMem ((VOID *)(UINTN)Bounce->Buffer, HostAddress, *NumberOfBytes);
+  }
+
+  Status = PciIo->Map (
+                    PciIo,
+                    Operation,
+                    (VOID *)(UINTN)Bounce->Buffer,
+                    NumberOfBytes,
+                    DeviceAddress,
+                    &Bounce->Mapping
+                    );
+  if (EFI_ERROR (Status)) {
+    LowMemPutBounce (Bounce);
+    return Status;
+  }
+
+  Bounce->HostAddress   = HostAddress;
+  Bounce->NumberOfBytes = *NumberOfBytes;
+  Bounce->Operation     = Operation;
+  CriticalBegin ();
+  InsertTailList (&mLowMemBounceMapped, &Bounce->Link);
+  CriticalEnd ();
+
+  *Mapping = Bounce;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+LowMemWrapperPciIoUnmap (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_PCI_IO_PROTOCOL  *PciIo   = (VOID *)Args[0];
+  VOID                 *Mapping = (VOID *)Args[1];
+  LIST_ENTRY           *Entry;
+  LOW_MEM_BOUNCE       *Bounce;
+  EFI_STATUS           Status;
+
+  for (Entry = GetFirstNode (&mLowMemBounceMapped);
+       !IsNull (&mLowMemBounceMapped, Entry);
+       Entry = GetNextNode (&mLowMemBounceMapped, Entry))
+  {
+    Bounce = BASE_CR (Entry, LOW_MEM_BOUNCE, Link);
+    if (Bounce == Mapping) {
+      break;
+    }
+  }
+
+  if (IsNull (&mLowMemBounceMapped, Entry)) {
+    return PciIo->Unmap (PciIo, Mapping);
+  }
+
+  Status = PciIo->Unmap (PciIo, Bounce->Mapping);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (Bounce->Operation == EfiPciIoOperationBusMasterWrite) {
+    CopyMem (Bounce->HostAddress, (VOID *)(UINTN)Bounce->Buffer, Bounce->NumberOfBytes);
+  }
+
+  CriticalBegin ();
+  RemoveEntryList (&Bounce->Link);
+  CriticalEnd ();
+  LowMemPutBounce (Bounce);
+  return EFI_SUCCESS;
+}
+
+UINT64
+LowMemOverride (
+  IN  UINT64  ProgramCounter
+  )
+{
+  if (mLowMemImages == 0) {
+    return ProgramCounter;
+  }
+
+  if (ProgramCounter == (UINT64)gBS->AllocatePool) {
+    return (UINT64)LowMemWrapperAllocatePool;
+  } else if (ProgramCounter == (UINT64)gBS->AllocatePages) {
+    return (UINT64)LowMemWrapperAllocatePages;
+  } else if (ProgramCounter == (UINT64)mLowMemPciIo.AllocateBuffer) {
+    return (UINT64)LowMemWrapperPciIoAllocateBuffer;
+  } else if (ProgramCounter == (UINT64)mLowMemPciIo.Map) {
+    return (UINT64)LowMemWrapperPciIoMap;
+  } else if (ProgramCounter == (UINT64)mLowMemPciIo.Unmap) {
+    return (UINT64)LowMemWrapperPciIoUnmap;
+  }
+
+  return ProgramCounter;
+}
+
+/*
+ * PciIo instances produced by PciBusDxe all share the same functions.
+ */
+STATIC
+VOID
+EFIAPI
+LowMemPciNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  EFI_STATUS           Status;
+  EFI_PCI_IO_PROTOCOL  *PciIo;
+
+  Status = gBS->LocateProtocol (&gEfiPciIoProtocolGuid, NULL, (VOID **)&PciIo);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  mLowMemPciIo.AllocateBuffer = PciIo->AllocateBuffer;
+  mLowMemPciIo.Map            = PciIo->Map;
+  mLowMemPciIo.Unmap          = PciIo->Unmap;
+  gBS->CloseEvent (Event);
+}
+
+STATIC
+BOOLEAN
+LowMemIsListed (
+  IN  ImageRecord  *Record,
+  IN  CONST CHAR8  *List
+  )
+{
+  CHAR8  *Pdb;
+  CHAR8  *Base;
+  UINTN  Length;
+
+  Pdb = PeCoffLoaderGetPdbPointer ((VOID *)(UINTN)Record->ImageBase);
+  if (Pdb == NULL) {
+    return EmulatorListHas (List, "", 0);
+  }
+
+  /*
+   * E.g. "c:\build\X64\Foo\DEBUG\FooDxe.pdb" is "FooDxe".
+   */
+  for (Base = Pdb; *Pdb != '\0'; Pdb++) {
+    if ((*Pdb == '\\') || (*Pdb == '/')) {
+      Base = Pdb + 1;
+    }
+  }
+
+  for (Length = 0; (Base[Length] != '\0') && (Base[Length] != '.'); Length++) {
+  }
+
+  return EmulatorListHas (List, Base, Length);
+}
+
+VOID
+LowMemImageRegister (
+  IN  ImageRecord  *Record
+  )
+{
+  EFI_STATUS  Status;
+  CHAR8       *List;
+
+  Record->LowMem = FALSE;
+
+  List = EmulatorGetListVariable (LOW_MEM_VARIABLE);
+  if (List == NULL) {
+    return;
+  }
+
+  Record->LowMem = LowMemIsListed (Record, List);
+  FreePool (List);
+  if (!Record->LowMem) {
+    return;
+  }
+
+  if (mLowMemArena == 0) {
+    Status = LowMemAllocatePages (
+               EfiBootServicesData,
+               LOW_MEM_ARENA_PAGES,
+               &mLowMemArena
+               );
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "failed to allocate low memory arena: %r\n", Status));
+      mLowMemArena = 0;
+    } else {
+      mLowMemArenaNext = mLowMemArena;
+      mLowMemArenaEnd  = mLowMemArena + EFI_PAGES_TO_SIZE (LOW_MEM_ARENA_PAGES);
+    }
+  }
+
+  if (mLowMemImages++ == 0) {
+    EfiCreateProtocolNotifyEvent (
+      &gEfiPciEnumerationCompleteProtocolGuid,
+      TPL_CALLBACK,
+      LowMemPciNotify,
+      NULL,
+      &mLowMemRegistration
+      );
+  }
+
+  DEBUG ((DEBUG_INFO, "Image at 0x%lx uses memory below 4GiB\n", Record->ImageBase));
+}
+
+VOID
+LowMemGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->LowMemAllocations  = mLowMemAllocations;
+  DebugState->LowMemBounceReused = mLowMemBounceReused;
+}
+
+#endif /* MAU_LOW_MEM */
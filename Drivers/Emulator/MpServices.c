@@ -0,0 +1,354 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Protocol/MpService.h>
+
+/*
+ * StartupAllAPs and StartupThisAP, when called by emulated code
+ * with an emulated Procedure, run the Procedure on the BSP instead,
+ * once for every AP it was meant for.
+ *
+ * Emulated code can't run on an AP: Unicorn allocates memory while
+ * translating code, and the engine hooks use boot services and
+ * emulator state, none of which may be used on an AP.
+ *
+ * While such a Procedure runs, WhoAmI called by emulated code
+ * returns the AP the BSP stands in for, and StartupAllAPs and
+ * StartupThisAP return EFI_DEVICE_ERROR, as they would on an AP.
+ *
+ * Running procedures one after another can't honor a Timeout or
+ * return before they are done, so non-blocking calls and calls
+ * with a Timeout get EFI_UNSUPPORTED. Procedures waiting for each
+ * other (e.g. rendezvous on a shared counter) can't work.
+ */
+
+#ifdef MAU_MP_SERVICES
+
+#define MP_NO_AP  MAX_UINTN
+
+STATIC EFI_MP_SERVICES_PROTOCOL  *mMpServices;
+STATIC VOID                      *mMpRegistration;
+STATIC EFI_EVENT                 mMpEvent;
+STATIC UINTN                     mMpCurrentAp = MP_NO_AP;
+
+STATIC
+VOID
+EFIAPI
+MpIdleProcedure (
+  IN  VOID  *Buffer
+  )
+{
+}
+
+/*
+ * Returns EFI_SUCCESS for an enabled AP, or what
+ * StartupThisAP is supposed to return otherwise.
+ */
+STATIC
+EFI_STATUS
+MpCheckAp (
+  IN  UINTN  ProcessorNumber
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_PROCESSOR_INFORMATION  Info;
+
+  Status = mMpServices->GetProcessorInfo (mMpServices, ProcessorNumber, &Info);
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (((Info.StatusFlag & PROCESSOR_AS_BSP_BIT) != 0) ||
+      ((Info.StatusFlag & PROCESSOR_ENABLED_BIT) == 0))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /*
+   * An AP still busy with a native non-blocking call
+   * makes this return EFI_NOT_READY.
+   */
+  return mMpServices->StartupThisAP (
+                        mMpServices,
+                        MpIdleProcedure,
+                        ProcessorNumber,
+                        NULL,
+                        0,
+                        NULL,
+                        NULL
+                        );
+}
+
+/*
+ * Returns EFI_SUCCESS if an emulated Procedure can be run on the
+ * BSP on behalf of APs.
+ */
+STATIC
+EFI_STATUS
+MpCheckCall (
+  IN  EFI_EVENT  WaitEvent,
+  IN  UINTN      Timeout
+  )
+{
+  if (mMpCurrentAp != MP_NO_AP) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  if ((WaitEvent != NULL) || (Timeout != 0)) {
+    DEBUG ((DEBUG_ERROR, "non-blocking or timed out MP calls unsupported for emulated procedures\n"));
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+MpRunProcedure (
+  IN  ImageRecord  *Image,
+  IN  UINT64       Procedure,
+  IN  UINT64       Argument,
+  IN  UINTN        ProcessorNumber
+  )
+{
+  UINTN   PreviousAp;
+  UINT64  Args[MAX_ARGS] = { Argument };
+
+  /*
+   * Procedures may themselves use MP services.
+   */
+  PreviousAp   = mMpCurrentAp;
+  mMpCurrentAp = ProcessorNumber;
+  CpuRunFunc (Image->Cpu, Procedure, Args);
+  mMpCurrentAp = PreviousAp;
+}
+
+EFI_STATUS
+MpWrapperStartupAllAPs (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_MP_SERVICES_PROTOCOL  *This             = (VOID *)Args[0];
+  EFI_AP_PROCEDURE          Procedure         = (VOID *)Args[1];
+  BOOLEAN                   SingleThread      = (BOOLEAN)Args[2];
+  EFI_EVENT                 WaitEvent         = (VOID *)Args[3];
+  UINTN                     Timeout           = Args[4];
+  VOID                      *ProcedureArgument = (VOID *)Args[5];
+  UINTN                     **FailedCpuList   = (VOID *)Args[6];
+  ImageRecord               *Image;
+  EFI_STATUS                Status;
+  UINTN                     Count;
+  UINTN                     EnabledCount;
+  UINTN                     Index;
+  UINTN                     Started;
+
+  Image = ImageFindByAddress ((UINT64)Procedure);
+  if (Image == NULL) {
+    return mMpServices->StartupAllAPs (
+                          This,
+                          Procedure,
+                          SingleThread,
+                          WaitEvent,
+                          Timeout,
+                          ProcedureArgument,
+                          FailedCpuList
+                          );
+  }
+
+  Status = MpCheckCall (WaitEvent, Timeout);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = mMpServices->GetNumberOfProcessors (mMpServices, &Count, &EnabledCount);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  /*
+   * Nothing is run unless all enabled APs are idle.
+   */
+  Started = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Status = MpCheckAp (Index);
+    if (Status == EFI_NOT_READY) {
+      return Status;
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Started++;
+    }
+  }
+
+  if (Started == 0) {
+    return EFI_NOT_STARTED;
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    if (!EFI_ERROR (MpCheckAp (Index))) {
+      MpRunProcedure (Image, (UINT64)Procedure, (UINT64)ProcedureArgument, Index);
+    }
+  }
+
+  if (FailedCpuList != NULL) {
+    *FailedCpuList = NULL;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MpWrapperStartupThisAP (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_MP_SERVICES_PROTOCOL  *This             = (VOID *)Args[0];
+  EFI_AP_PROCEDURE          Procedure         = (VOID *)Args[1];
+  UINTN                     ProcessorNumber   = Args[2];
+  EFI_EVENT                 WaitEvent         = (VOID *)Args[3];
+  UINTN                     Timeout           = Args[4];
+  VOID                      *ProcedureArgument = (VOID *)Args[5];
+  BOOLEAN                   *Finished         = (VOID *)Args[6];
+  ImageRecord               *Image;
+  EFI_STATUS                Status;
+
+  Image = ImageFindByAddress ((UINT64)Procedure);
+  if (Image == NULL) {
+    return mMpServices->StartupThisAP (
+                          This,
+                          Procedure,
+                          ProcessorNumber,
+                          WaitEvent,
+                          Timeout,
+                          ProcedureArgument,
+                          Finished
+                          );
+  }
+
+  Status = MpCheckCall (WaitEvent, Timeout);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = MpCheckAp (ProcessorNumber);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  MpRunProcedure (Image, (UINT64)Procedure, (UINT64)ProcedureArgument, ProcessorNumber);
+
+  if (Finished != NULL) {
+    *Finished = TRUE;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MpWrapperWhoAmI (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_MP_SERVICES_PROTOCOL  *This            = (VOID *)Args[0];
+  UINTN                     *ProcessorNumber = (VOID *)Args[1];
+
+  if (mMpCurrentAp == MP_NO_AP) {
+    return mMpServices->WhoAmI (This, ProcessorNumber);
+  }
+
+  if (ProcessorNumber == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *ProcessorNumber = mMpCurrentAp;
+  return EFI_SUCCESS;
+}
+
+UINT64
+MpServicesOverride (
+  IN  UINT64  ProgramCounter
+  )
+{
+  if (mMpServices == NULL) {
+    return ProgramCounter;
+  }
+
+  if (ProgramCounter == (UINT64)mMpServices->StartupAllAPs) {
+    return (UINT64)MpWrapperStartupAllAPs;
+  } else if (ProgramCounter == (UINT64)mMpServices->StartupThisAP) {
+    return (UINT64)MpWrapperStartupThisAP;
+  } else if (ProgramCounter == (UINT64)mMpServices->WhoAmI) {
+    return (UINT64)MpWrapperWhoAmI;
+  }
+
+  return ProgramCounter;
+}
+
+STATIC
+VOID
+EFIAPI
+MpServicesNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  EFI_STATUS                Status;
+  EFI_MP_SERVICES_PROTOCOL  *MpServices;
+
+  Status = gBS->LocateProtocol (
+                  &gEfiMpServiceProtocolGuid,
+                  mMpRegistration,
+                  (VOID **)&MpServices
+                  );
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  gBS->CloseEvent (Event);
+  mMpEvent    = NULL;
+  mMpServices = MpServices;
+}
+
+VOID
+MpServicesInit (
+  VOID
+  )
+{
+  mMpEvent = EfiCreateProtocolNotifyEvent (
+               &gEfiMpServiceProtocolGuid,
+               TPL_CALLBACK,
+               MpServicesNotify,
+               NULL,
+               &mMpRegistration
+               );
+}
+
+VOID
+MpServicesCleanup (
+  VOID
+  )
+{
+  if (mMpEvent != NULL) {
+    gBS->CloseEvent (mMpEvent);
+    mMpEvent = NULL;
+  }
+
+  mMpServices = NULL;
+}
+
+#endif /* MAU_MP_SERVICES */
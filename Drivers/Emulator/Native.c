@@ -61,12 +61,66 @@ NativeUnsupported (
   return EFI_UNSUPPORTED;
 }
 
+#if defined (MAU_SUPPORTS_X64_BINS) && defined (MAU_SUPPORTS_AARCH64_BINS)
+STATIC
+ImageRecord *
+NativeFindEmulatedTarget (
+  IN  UINT64  ProgramCounter,
+  OUT UINT64  *Target
+  )
+{
+  ImageRecord  *Record;
+
+  *Target = ProgramCounter;
+  Record  = ImageFindByAddress (ProgramCounter);
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  if (Record == NULL) {
+    *Target = TrampolineFind (ProgramCounter, &Record);
+  }
+
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+
+  return Record;
+}
+
+/*
+ * Calls into an image of another emulated ISA go straight to
+ * the other CpuContext, instead of calling the address natively
+ * and coming back in via the exception path and EmulatorThunk.
+ */
+STATIC
+EFI_STATUS
+EFIAPI
+NativeCrossIsaCall (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  ImageRecord  *Record;
+  UINT64       Target;
+
+  Record = NativeFindEmulatedTarget (OriginalProgramCounter, &Target);
+  ASSERT (Record != NULL);
+
+  return CpuRunFunc (Record->Cpu, Target, Args);
+}
+
+#endif /* MAU_SUPPORTS_X64_BINS && MAU_SUPPORTS_AARCH64_BINS */
+
 STATIC
 UINT64
 NativeValidateSupportedCall (
-  IN  UINT64  ProgramCounter
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter
   )
 {
+ #if defined (MAU_SUPPORTS_X64_BINS) && defined (MAU_SUPPORTS_AARCH64_BINS)
+  ImageRecord  *Record;
+  UINT64       Target;
+
+ #endif /* MAU_SUPPORTS_X64_BINS && MAU_SUPPORTS_AARCH64_BINS */
+
   /*
    * Prevent things that won't work in principle or that
    * could kill the emulator.
@@ -76,9 +130,44 @@ NativeValidateSupportedCall (
     return (UINT64)&NativeUnsupported;
   }
 
+ #if defined (MAU_SUPPORTS_X64_BINS) && defined (MAU_SUPPORTS_AARCH64_BINS)
+  Record = NativeFindEmulatedTarget (ProgramCounter, &Target);
+  if ((Record != NULL) && (Record->Cpu != CPU_PRIMARY (Cpu))) {
+    return (UINT64)&NativeCrossIsaCall;
+  }
+
+ #endif /* MAU_SUPPORTS_X64_BINS && MAU_SUPPORTS_AARCH64_BINS */
+
   return EfiWrappersOverride (ProgramCounter);
 }
 
+#ifdef MAU_PROTOCOL_TRAMPOLINES
+/*
+ * Emulated code calling through a protocol produced by an emulated
+ * image of the same ISA (e.g. a bus driver calling into a child's
+ * protocol). Returns the emulated function to continue at, instead
+ * of taking the trampoline back into a nested CpuRunFunc.
+ */
+STATIC
+UINT64
+NativeTrampolineTarget (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter
+  )
+{
+  ImageRecord  *Image;
+  UINT64       Target;
+
+  Target = TrampolineFind (ProgramCounter, &Image);
+  if ((Target == 0) || (Image->Cpu != CPU_PRIMARY (Cpu))) {
+    return 0;
+  }
+
+  return Target;
+}
+
+#endif /* MAU_PROTOCOL_TRAMPOLINES */
+
 STATIC
 VOID
 NativeThunkCheckLeakedContexts (
@@ -117,8 +206,15 @@ NativeThunkAArch64 (
   Fn          Func;
   CpuContext  *Cpu;
 
-  Cpu                 = Context->Cpu;
-  Func.ProgramCounter = NativeValidateSupportedCall (ProgramCounter);
+  Cpu = Context->Cpu;
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  Func.ProgramCounter = NativeTrampolineTarget (Cpu, ProgramCounter);
+  if (Func.ProgramCounter != 0) {
+    return Func.ProgramCounter;
+  }
+
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+  Func.ProgramCounter = NativeValidateSupportedCall (Cpu, ProgramCounter);
   WrapperCall         = Func.ProgramCounter != ProgramCounter;
 
   Lr = REG_READ (Cpu, UC_ARM64_REG_LR);
@@ -144,23 +240,27 @@ NativeThunkAArch64 (
    * ----------------
    */
 
-  DEBUG ((
-    DEBUG_VERBOSE,
-    "%a 0x%lx -> %a 0x%lx(%lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx)\n",
-    Cpu->Name,
+  TRACE_EVENT (
+    WrapperCall ? EmuTraceWrapperCall : EmuTraceNativeCall,
+    Cpu->EmuMachineType,
     Lr,
-    WrapperCall ? "wrapper" : "native",
+    ProgramCounter,
     Func.ProgramCounter,
-    X0,
-    X1,
-    X2,
-    X3,
-    X4,
-    X5,
-    X6,
-    X7,
-    StackArgs[0]
-    ));
+    X0
+    );
+  BB_TRACE_NATIVE_CALL (Lr, ProgramCounter);
+ #ifdef MAU_CALL_RECORD
+  {
+    UINT64  RecordArgs[MAX_ARGS] = {
+      X0,           X1,           X2, X3, X4, X5, X6, X7,
+      StackArgs[0], StackArgs[1],
+      StackArgs[2], StackArgs[3],
+      StackArgs[4], StackArgs[5],
+      StackArgs[6], StackArgs[7]
+    };
+    RecordNativeCall (Cpu, Lr, ProgramCounter, RecordArgs);
+  }
+ #endif /* MAU_CALL_RECORD */
 
   if (WrapperCall) {
     UINT64  WrapperArgs[MAX_ARGS] = {
@@ -192,7 +292,18 @@ NativeThunkAArch64 (
                 );
   }
 
+  TRACE_EVENT (
+    EmuTraceNativeReturn,
+    Cpu->EmuMachineType,
+    Lr,
+    X0,
+    0,
+    0
+    );
   NativeThunkCheckLeakedContexts (Context);
+ #ifdef MAU_CALL_RECORD
+  RecordNativeReturn (Cpu, X0);
+ #endif /* MAU_CALL_RECORD */
 
   REG_WRITE (Cpu, UC_ARM64_REG_X0, X0);
 
@@ -213,8 +324,15 @@ NativeThunkX64 (
   Fn          Func;
   CpuContext  *Cpu;
 
-  Cpu                 = Context->Cpu;
-  Func.ProgramCounter = NativeValidateSupportedCall (ProgramCounter);
+  Cpu = Context->Cpu;
+ #ifdef MAU_PROTOCOL_TRAMPOLINES
+  Func.ProgramCounter = NativeTrampolineTarget (Cpu, ProgramCounter);
+  if (Func.ProgramCounter != 0) {
+    return Func.ProgramCounter;
+  }
+
+ #endif /* MAU_PROTOCOL_TRAMPOLINES */
+  Func.ProgramCounter = NativeValidateSupportedCall (Cpu, ProgramCounter);
   WrapperCall         = Func.ProgramCounter != ProgramCounter;
 
   Rsp = REG_READ (Cpu, UC_X86_REG_RSP);
@@ -244,23 +362,26 @@ NativeThunkX64 (
    * ----------------
    */
 
-  DEBUG ((
-    DEBUG_VERBOSE,
-    "%a 0x%lx -> %a 0x%lx(%lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx, %lx)\n",
-    Cpu->Name,
+  TRACE_EVENT (
+    WrapperCall ? EmuTraceWrapperCall : EmuTraceNativeCall,
+    Cpu->EmuMachineType,
     StackArgs[0],
-    WrapperCall ? "wrapper" : "native",
+    ProgramCounter,
     Func.ProgramCounter,
-    Rcx,
-    Rdx,
-    R8,
-    R9,
-    StackArgs[5],
-    StackArgs[6],
-    StackArgs[7],
-    StackArgs[8],
-    StackArgs[9]
-    ));
+    Rcx
+    );
+  BB_TRACE_NATIVE_CALL (StackArgs[0], ProgramCounter);
+ #ifdef MAU_CALL_RECORD
+  {
+    UINT64  RecordArgs[MAX_ARGS] = {
+      Rcx,           Rdx,           R8,            R9,
+      StackArgs[5],  StackArgs[6],  StackArgs[7],  StackArgs[8],
+      StackArgs[9],  StackArgs[10], StackArgs[11], StackArgs[12],
+      StackArgs[13], StackArgs[14], StackArgs[15], StackArgs[16]
+    };
+    RecordNativeCall (Cpu, StackArgs[0], ProgramCounter, RecordArgs);
+  }
+ #endif /* MAU_CALL_RECORD */
 
   if (WrapperCall) {
     StackArgs[1] = Rcx;
@@ -289,7 +410,18 @@ NativeThunkX64 (
                  );
   }
 
+  TRACE_EVENT (
+    EmuTraceNativeReturn,
+    Cpu->EmuMachineType,
+    StackArgs[0],
+    Rax,
+    0,
+    0
+    );
   NativeThunkCheckLeakedContexts (Context);
+ #ifdef MAU_CALL_RECORD
+  RecordNativeReturn (Cpu, Rax);
+ #endif /* MAU_CALL_RECORD */
 
   REG_WRITE (Cpu, UC_X86_REG_RAX, Rax);
 
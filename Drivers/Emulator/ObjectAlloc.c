@@ -11,86 +11,247 @@
 
 #include "Emulator.h"
 
+/*
+ * A slab allocator for emulator metadata. Each ObjectAllocContext
+ * is a cache of objects of one type, carved out of page-sized slabs.
+ * Objects are laid out so that small ones never straddle a cache
+ * line, and larger ones start on one. Free objects are reused
+ * most-recently-freed first.
+ *
+ * A cache starts with one slab of ObjectCount objects, and growable
+ * caches add another slab when out of objects. A growable cache fills
+ * its slabs, so may have more than ObjectCount objects per slab, while
+ * a fixed cache has exactly ObjectCount objects (e.g. the count of
+ * CpuRunContext objects is the emulation nesting limit).
+ *
+ * In DEBUG builds, free objects of types without OnCreate (which
+ * keep no state across ObjectFree) are poisoned, and checked
+ * on allocation to catch writes after free.
+ */
+
+#define OBJECT_CACHE_LINE  64
+#define OBJECT_POISON      0xAF
+
+typedef struct {
+  LIST_ENTRY    Link;
+} OBJECT_SLAB;
+
+STATIC LIST_ENTRY  mObjectCaches = INITIALIZE_LIST_HEAD_VARIABLE (mObjectCaches);
+
+STATIC
+ObjectHeader *
+ObjectAt (
+  IN  ObjectAllocContext  *Context,
+  IN  OBJECT_SLAB         *Slab,
+  IN  UINTN               Index
+  )
+{
+  return (VOID *)((UINTN)Slab + Context->ObjectOffset + Index * Context->ObjectStride);
+}
+
+STATIC
+BOOLEAN
+ObjectIsPoisoned (
+  IN  ObjectAllocContext  *Context
+  )
+{
+  return Context->Config.OnCreate == NULL;
+}
+
+STATIC
+VOID
+ObjectPoison (
+  IN  ObjectAllocContext  *Context,
+  IN  ObjectHeader        *Object
+  )
+{
+  DEBUG_CODE_BEGIN ();
+  {
+    if (ObjectIsPoisoned (Context)) {
+      SetMem (Object + 1, Context->Config.ObjectSize - sizeof (*Object), OBJECT_POISON);
+    }
+  }
+  DEBUG_CODE_END ();
+}
+
+STATIC
+VOID
+ObjectCheckPoison (
+  IN  ObjectAllocContext  *Context,
+  IN  ObjectHeader        *Object
+  )
+{
+  DEBUG_CODE_BEGIN ();
+  {
+    UINT8  *Byte;
+    UINT8  *End;
+
+    if (ObjectIsPoisoned (Context)) {
+      End = (UINT8 *)Object + Context->Config.ObjectSize;
+      for (Byte = (UINT8 *)(Object + 1); Byte < End; Byte++) {
+        if (*Byte != OBJECT_POISON) {
+          DEBUG ((
+            DEBUG_ERROR,
+            "%a object %p modified after free at +0x%lx\n",
+            Context->Config.Name,
+            Object,
+            (UINT64)(Byte - (UINT8 *)Object)
+            ));
+          ASSERT (FALSE);
+          break;
+        }
+      }
+    }
+  }
+  DEBUG_CODE_END ();
+}
+
+STATIC
+VOID
+ObjectSlabDestroy (
+  IN  ObjectAllocContext  *Context,
+  IN  OBJECT_SLAB         *Slab,
+  IN  UINTN               Count
+  )
+{
+  ObjectAllocConfig  *Config;
+
+  Config = &Context->Config;
+  while (Count-- != 0) {
+    if (Config->OnDestroy != NULL) {
+      Config->OnDestroy (ObjectAt (Context, Slab, Count), Config->CbContext);
+    }
+  }
+
+  FreePages (Slab, Context->SlabPages);
+}
+
+STATIC
+EFI_STATUS
+ObjectSlabAdd (
+  IN  ObjectAllocContext  *Context
+  )
+{
+  UINTN              Index;
+  EFI_STATUS         Status;
+  OBJECT_SLAB        *Slab;
+  ObjectHeader       *Object;
+  ObjectAllocConfig  *Config;
+
+  Config = &Context->Config;
+  Slab   = AllocatePages (Context->SlabPages);
+  if (Slab == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (Slab, EFI_PAGES_TO_SIZE (Context->SlabPages));
+
+  for (Index = 0; Index < Config->ObjectCount; Index++) {
+    Object            = ObjectAt (Context, Slab, Index);
+    Object->Signature = Config->Signature;
+
+    if (Config->OnCreate != NULL) {
+      Status = Config->OnCreate (Object, Config->CbContext);
+      if (EFI_ERROR (Status)) {
+        /*
+         * Undo OnCreate for successfully created objects.
+         */
+        ObjectSlabDestroy (Context, Slab, Index);
+        return Status;
+      }
+    }
+
+    ObjectPoison (Context, Object);
+  }
+
+  CriticalBegin ();
+  InsertTailList (&Context->Slabs, &Slab->Link);
+  for (Index = 0; Index < Config->ObjectCount; Index++) {
+    InsertTailList (&Context->List, &ObjectAt (Context, Slab, Index)->Link);
+  }
+
+  Context->SlabCount++;
+  CriticalEnd ();
+
+  return EFI_SUCCESS;
+}
+
 EFI_STATUS
 ObjectAllocCreate (
   IN  ObjectAllocConfig   *Config,
   OUT ObjectAllocContext  **Context
   )
 {
-  UINTN               Index;
+  UINTN               Alignment;
+  UINTN               Stride;
+  UINTN               Offset;
   UINTN               Pages;
-  UINTN               ObjectSize;
   EFI_STATUS          Status;
-  ObjectHeader        *Object;
   ObjectAllocContext  *ObjectContext;
 
-  ObjectContext = AllocatePool (sizeof (*ObjectContext));
-  if (ObjectContext == NULL) {
-    return EFI_OUT_OF_RESOURCES;
-  }
-
-  ObjectContext->Config = *Config;
-  Config                = &ObjectContext->Config;
-
   ASSERT (Config->OnCreate == NULL || IsDriverImagePointer (Config->OnCreate));
   ASSERT (Config->OnDestroy == NULL || IsDriverImagePointer (Config->OnDestroy));
   ASSERT (Config->OnAlloc == NULL || IsDriverImagePointer (Config->OnAlloc));
   ASSERT (Config->OnFree == NULL || IsDriverImagePointer (Config->OnFree));
 
-  ObjectSize = ROUND_UP (Config->ObjectSize, Config->ObjectAlignment);
+  Alignment = Config->ObjectAlignment;
+  if (Alignment == 0) {
+    Alignment = sizeof (UINT64);
+  }
 
-  if (ObjectSize < sizeof (ObjectHeader)) {
+  if ((Config->ObjectSize < sizeof (ObjectHeader)) ||
+      (Config->ObjectCount == 0) ||
+      ((Alignment & (Alignment - 1)) != 0) ||
+      (Alignment > EFI_PAGE_SIZE))
+  {
     return EFI_INVALID_PARAMETER;
   }
 
-  Pages                    = EFI_SIZE_TO_PAGES (ObjectSize * Config->ObjectCount);
-  ObjectContext->ArenaSize = EFI_PAGES_TO_SIZE (Pages);
-  Config->ObjectCount      = ObjectContext->ArenaSize / ObjectSize;
-
-  ObjectContext->Arena = AllocatePages (Pages);
-  if (ObjectContext->Arena == NULL) {
-    FreePool (ObjectContext);
-    return EFI_OUT_OF_RESOURCES;
+  /*
+   * Objects up to a cache line in size are padded to a power of two,
+   * so they never straddle cache lines. Larger objects are padded to
+   * a multiple of the cache line size.
+   */
+  Stride = ROUND_UP (Config->ObjectSize, Alignment);
+  if (Stride > OBJECT_CACHE_LINE) {
+    Stride = ROUND_UP (Stride, OBJECT_CACHE_LINE);
+  } else if (Stride != GetPowerOfTwo64 (Stride)) {
+    Stride = GetPowerOfTwo64 (Stride) << 1;
   }
 
-  ZeroMem (ObjectContext->Arena, ObjectContext->ArenaSize);
-  InitializeListHead (&ObjectContext->List);
+  Offset = ROUND_UP (sizeof (OBJECT_SLAB), MAX (Alignment, MIN (Stride, OBJECT_CACHE_LINE)));
+  Pages  = EFI_SIZE_TO_PAGES (Offset + Stride * Config->ObjectCount);
 
-  for (Object = ObjectContext->Arena, Index = 0;
-       Index < Config->ObjectCount;
-       Object = (VOID *)(((UINTN)Object) + ObjectSize), Index++)
-  {
-    Object->Signature = Config->Signature;
+  ObjectContext = AllocateZeroPool (sizeof (*ObjectContext));
+  if (ObjectContext == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-    if (Config->OnCreate != NULL) {
-      Status = Config->OnCreate (Object, Config->CbContext);
-      if (EFI_ERROR (Status)) {
-        break;
-      }
-    }
+  ObjectContext->Config       = *Config;
+  ObjectContext->ObjectStride = Stride;
+  ObjectContext->ObjectOffset = Offset;
+  ObjectContext->SlabPages    = Pages;
+  if (Config->Growable) {
+    ObjectContext->Config.ObjectCount = (EFI_PAGES_TO_SIZE (Pages) - Offset) / Stride;
+  }
 
-    InsertTailList (&ObjectContext->List, &Object->Link);
+  if (ObjectContext->Config.Name == NULL) {
+    ObjectContext->Config.Name = "Object";
   }
 
-  if (EFI_ERROR (Status)) {
-    /*
-     * Object points to the first failed object.
-     */
-    while (Index-- != 0) {
-      /*
-       * Undo OnCreate for successfully created objects.
-       */
-      Object = (VOID *)(((UINTN)Object) - ObjectSize);
-      if (Config->OnDestroy != NULL) {
-        Config->OnDestroy (Object, Config->CbContext);
-      }
-    }
+  InitializeListHead (&ObjectContext->Slabs);
+  InitializeListHead (&ObjectContext->List);
 
-    FreePages (ObjectContext->Arena, Pages);
+  Status = ObjectSlabAdd (ObjectContext);
+  if (EFI_ERROR (Status)) {
     FreePool (ObjectContext);
     return Status;
   }
 
+  CriticalBegin ();
+  InsertTailList (&mObjectCaches, &ObjectContext->Link);
+  CriticalEnd ();
+
   *Context = ObjectContext;
   return EFI_SUCCESS;
 }
@@ -100,27 +261,23 @@ ObjectAllocDestroy (
   IN  ObjectAllocContext  *Context
   )
 {
-  UINTN              Index;
-  UINTN              ObjectSize;
-  ObjectHeader       *Object;
-  ObjectAllocConfig  *Config;
+  OBJECT_SLAB  *Slab;
 
-  Config     = &Context->Config;
-  ObjectSize = ROUND_UP (Config->ObjectSize, Config->ObjectAlignment);
+  /*
+   * No objects ought to be allocated at this time.
+   */
+  ASSERT (Context->InUse == 0);
 
-  for (Object = Context->Arena, Index = 0;
-       Index < Config->ObjectCount;
-       Object = (VOID *)(((UINTN)Object) + ObjectSize), Index++)
-  {
-    /*
-     * IsListEmpty is true only for allocated objects. No objects
-     * ought to be allocated at this time.
-     */
-    ASSERT (!IsListEmpty (&Object->Link));
-    Config->OnDestroy (Object, Config->CbContext);
+  CriticalBegin ();
+  RemoveEntryList (&Context->Link);
+  CriticalEnd ();
+
+  while (!IsListEmpty (&Context->Slabs)) {
+    Slab = BASE_CR (GetFirstNode (&Context->Slabs), OBJECT_SLAB, Link);
+    RemoveEntryList (&Slab->Link);
+    ObjectSlabDestroy (Context, Slab, Context->Config.ObjectCount);
   }
 
-  FreePages (Context->Arena, EFI_SIZE_TO_PAGES (ObjectSize * Config->ObjectCount));
   FreePool (Context);
 }
 
@@ -136,29 +293,55 @@ ObjectAlloc (
   ObjectAllocConfig  *Config;
 
   ASSERT (Context != NULL);
-  ASSERT (Context->Arena != NULL);
 
   Config = &Context->Config;
-  if (IsListEmpty (&Context->List)) {
-    return EFI_OUT_OF_RESOURCES;
-  }
 
-  ObjectEntry = GetFirstNode (&Context->List);
-  Object      = CR (ObjectEntry, ObjectHeader, Link, Config->Signature);
+  CriticalBegin ();
+  while (IsListEmpty (&Context->List)) {
+    /*
+     * Not in the critical section, as AllocatePages
+     * restores the TPL (and thus enables interrupts).
+     */
+    CriticalEnd ();
+    if (!Config->Growable) {
+      return EFI_OUT_OF_RESOURCES;
+    }
 
-  if (Config->OnAlloc != NULL) {
-    Status = Config->OnAlloc (Object, Config->CbContext);
+    Status = ObjectSlabAdd (Context);
     if (EFI_ERROR (Status)) {
       return Status;
     }
+
+    CriticalBegin ();
   }
 
+  ObjectEntry = GetFirstNode (&Context->List);
   RemoveEntryList (ObjectEntry);
 
   /*
-   * This allows us to detect still-allocated objects in ObjectAllocDestroy.
+   * This allows us to detect still-allocated objects in ObjectFree.
    */
   InitializeListHead (ObjectEntry);
+  Context->InUse++;
+  Context->MaxInUse = MAX (Context->MaxInUse, Context->InUse);
+  Context->Allocs++;
+  CriticalEnd ();
+
+  Object = CR (ObjectEntry, ObjectHeader, Link, Config->Signature);
+  ObjectCheckPoison (Context, Object);
+
+  if (Config->OnAlloc != NULL) {
+    Status = Config->OnAlloc (Object, Config->CbContext);
+    if (EFI_ERROR (Status)) {
+      ObjectPoison (Context, Object);
+      CriticalBegin ();
+      InsertHeadList (&Context->List, ObjectEntry);
+      Context->InUse--;
+      Context->Allocs--;
+      CriticalEnd ();
+      return Status;
+    }
+  }
 
   *ObjectReturned = Object;
   return EFI_SUCCESS;
@@ -173,14 +356,51 @@ ObjectFree (
   ObjectAllocConfig  *Config;
 
   ASSERT (Context != NULL);
-  ASSERT (Context->Arena != NULL);
 
   Config = &Context->Config;
 
+  ASSERT (Object->Signature == Config->Signature);
   ASSERT (IsListEmpty (&Object->Link));
   if (Config->OnFree != NULL) {
     Config->OnFree (Object, Config->CbContext);
   }
 
-  InsertTailList (&Context->List, &Object->Link);
+  ObjectPoison (Context, Object);
+
+  /*
+   * Most recently freed objects are the most likely to be cached.
+   */
+  CriticalBegin ();
+  InsertHeadList (&Context->List, &Object->Link);
+  Context->InUse--;
+  CriticalEnd ();
+}
+
+VOID
+ObjectAllocDump (
+  VOID
+  )
+{
+  LIST_ENTRY          *Entry;
+  ObjectAllocContext  *Context;
+
+  DEBUG ((DEBUG_ERROR, "Object caches:\n"));
+  for (Entry = GetFirstNode (&mObjectCaches);
+       !IsNull (&mObjectCaches, Entry);
+       Entry = GetNextNode (&mObjectCaches, Entry))
+  {
+    Context = BASE_CR (Entry, ObjectAllocContext, Link);
+
+    DEBUG ((
+      DEBUG_ERROR,
+      "\t%a: %lu in use (max %lu), %lu allocs, %lu slab(s) of %lu x %lu bytes\n",
+      Context->Config.Name,
+      (UINT64)Context->InUse,
+      (UINT64)Context->MaxInUse,
+      (UINT64)Context->Allocs,
+      (UINT64)Context->SlabCount,
+      (UINT64)Context->Config.ObjectCount,
+      (UINT64)Context->ObjectStride
+      ));
+  }
 }
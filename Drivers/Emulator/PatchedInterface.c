@@ -0,0 +1,166 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+
+/*
+ * Bookkeeping for interfaces installed by emulated drivers that
+ * have some of their functions replaced with native ones (GopBlt,
+ * SupportedCache, SnpThrottle). A PatchedInterface remembers the
+ * emulated functions, for the native replacements to fall back
+ * on with PatchedInterfaceCall, and is forgotten with the image.
+ *
+ * Users may keep their own per-interface state after the
+ * PatchedInterface header (see PatchedInterfaceConfig.RecordSize),
+ * which is zeroed every time the interface is patched.
+ */
+
+#if defined (MAU_GOP_BLT) || defined (MAU_SUPPORTED_CACHE) || \
+  defined (MAU_SNP_THROTTLE)
+
+STATIC
+UINT64 *
+PatchedInterfaceFunction (
+  IN  VOID   *Interface,
+  IN  UINTN  Offset
+  )
+{
+  return (UINT64 *)((UINT8 *)Interface + Offset);
+}
+
+PatchedInterface *
+PatchedInterfaceFind (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  VOID                    *Interface
+  )
+{
+  LIST_ENTRY        *Entry;
+  PatchedInterface  *Record;
+
+  for (Entry = GetFirstNode (&Config->List);
+       !IsNull (&Config->List, Entry);
+       Entry = GetNextNode (&Config->List, Entry))
+  {
+    Record = BASE_CR (Entry, PatchedInterface, Link);
+    if (Record->Interface == Interface) {
+      return Record;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Called for interfaces installed by emulated code. Only patches
+ * interfaces of Config->Protocol, with all the functions to replace
+ * being in the same emulated image.
+ */
+PatchedInterface *
+PatchedInterfacePatch (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  EFI_GUID                *Protocol,
+  IN  VOID                    *Interface
+  )
+{
+  PatchedInterface  *Record;
+  ImageRecord       *Image;
+  UINTN             Index;
+
+  ASSERT (Config->FunctionCount <= PATCHED_INTERFACE_MAX_FUNCTIONS);
+  ASSERT (Config->RecordSize >= sizeof (PatchedInterface));
+
+  if ((Protocol == NULL) || (Interface == NULL) ||
+      !CompareGuid (Protocol, Config->Protocol))
+  {
+    return NULL;
+  }
+
+  Image = ImageFindByAddress (*PatchedInterfaceFunction (Interface, Config->Offsets[0]));
+  if (Image == NULL) {
+    return NULL;
+  }
+
+  for (Index = 1; Index < Config->FunctionCount; Index++) {
+    if (ImageFindByAddress (*PatchedInterfaceFunction (Interface, Config->Offsets[Index])) != Image) {
+      return NULL;
+    }
+  }
+
+  /*
+   * Interface memory may be reused by a reinstalled interface.
+   */
+  Record = PatchedInterfaceFind (Config, Interface);
+  if (Record == NULL) {
+    Record = AllocatePool (Config->RecordSize);
+    if (Record == NULL) {
+      DEBUG ((DEBUG_ERROR, "failed to allocate %a record for %p\n", Config->Name, Interface));
+      return NULL;
+    }
+
+    Record->Interface = Interface;
+    CriticalBegin ();
+    InsertTailList (&Config->List, &Record->Link);
+    CriticalEnd ();
+  }
+
+  ZeroMem (Record + 1, Config->RecordSize - sizeof (*Record));
+  Record->Image = Image;
+  for (Index = 0; Index < Config->FunctionCount; Index++) {
+    Record->Emulated[Index] = *PatchedInterfaceFunction (Interface, Config->Offsets[Index]);
+    *PatchedInterfaceFunction (Interface, Config->Offsets[Index]) = (UINT64)Config->Natives[Index];
+  }
+
+  return Record;
+}
+
+/*
+ * Calls the emulated function Config->Offsets[Index] replaced.
+ */
+UINT64
+PatchedInterfaceCall (
+  IN  PatchedInterface  *Record,
+  IN  UINTN             Index,
+  IN  UINT64            *Args
+  )
+{
+  return CpuRunFunc (Record->Image->Cpu, Record->Emulated[Index], Args);
+}
+
+/*
+ * An interface still pointing to the native replacements can't
+ * have been used safely anyway, as the image is gone.
+ */
+VOID
+PatchedInterfaceImageUnregister (
+  IN  PatchedInterfaceConfig  *Config,
+  IN  ImageRecord             *Image
+  )
+{
+  LIST_ENTRY        *Entry;
+  LIST_ENTRY        *Next;
+  PatchedInterface  *Record;
+
+  for (Entry = GetFirstNode (&Config->List);
+       !IsNull (&Config->List, Entry);
+       Entry = Next)
+  {
+    Next   = GetNextNode (&Config->List, Entry);
+    Record = BASE_CR (Entry, PatchedInterface, Link);
+    if (Record->Image == Image) {
+      CriticalBegin ();
+      RemoveEntryList (&Record->Link);
+      CriticalEnd ();
+      FreePool (Record);
+    }
+  }
+}
+
+#endif /* MAU_GOP_BLT || MAU_SUPPORTED_CACHE || MAU_SNP_THROTTLE */
@@ -0,0 +1,582 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <unicorn.h>
+#include "Emulator.h"
+#include <Library/PcdLib.h>
+#include <IndustryStandard/Acpi.h>
+#include <IndustryStandard/Pci.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/PciRootBridgeIo.h>
+
+/*
+ * Emulated drivers call EFI_PCI_IO_PROTOCOL Mem, Io and Pci accessors
+ * in tight loops, each call leaving the engine for a native call into
+ * PciBusDxe, which then goes through the root bridge to CpuIo2.
+ *
+ * PciIo instances produced by PciBusDxe and opened by emulated code
+ * (via the OpenProtocol and HandleProtocol wrappers) have their BARs
+ * looked up. Other PciIo producers (e.g. MockPciDevice) may have side
+ * effects on BAR accesses, so are left alone. Single aligned
+ * Uint8..Uint64 BAR accesses within a BAR are then done straight
+ * from the engine (PciIoShadowCall), as loads and stores to the
+ * identity-mapped host address of memory BARs, or of I/O BARs in
+ * the PCI I/O MMIO window at PcdPciIoTranslation (like Pio.c).
+ * Single config space reads are passed to Pci.Read without leaving
+ * the engine. Everything else still goes through the regular
+ * native call path.
+ */
+
+#ifdef MAU_FAST_PCI_IO
+
+#define PCI_IO_BARS  PCI_MAX_BAR
+
+typedef struct {
+  UINT8     ResType;
+  UINT64    Length;
+  /*
+   * Host address the BAR is accessed at, or 0 if it
+   * can't be accessed directly.
+   */
+  UINTN     Address;
+} PCI_IO_BAR;
+
+/*
+ * One per PciIo and emulated image that opened it.
+ */
+typedef struct {
+  LIST_ENTRY             Link;
+  EFI_PCI_IO_PROTOCOL    *PciIo;
+  ImageRecord            *Image;
+  PCI_IO_BAR             Bars[PCI_IO_BARS];
+} PCI_IO_RECORD;
+
+STATIC LIST_ENTRY  mPciIoList = INITIALIZE_LIST_HEAD_VARIABLE (mPciIoList);
+STATIC UINTN       mPciIoShadowCalls;
+
+/*
+ * Image NULL matches records of any image.
+ */
+STATIC
+PCI_IO_RECORD *
+PciIoFind (
+  IN  EFI_PCI_IO_PROTOCOL  *PciIo,
+  IN  ImageRecord          *Image
+  )
+{
+  LIST_ENTRY     *Entry;
+  PCI_IO_RECORD  *Record;
+
+  for (Entry = GetFirstNode (&mPciIoList);
+       !IsNull (&mPciIoList, Entry);
+       Entry = GetNextNode (&mPciIoList, Entry))
+  {
+    Record = BASE_CR (Entry, PCI_IO_RECORD, Link);
+    if ((Record->PciIo == PciIo) &&
+        ((Image == NULL) || (Record->Image == Image)))
+    {
+      return Record;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Drops the records of PciIo (or of any PciIo if NULL)
+ * and Image (or of any image if NULL).
+ */
+STATIC
+VOID
+PciIoForget (
+  IN  EFI_PCI_IO_PROTOCOL  *PciIo OPTIONAL,
+  IN  ImageRecord          *Image OPTIONAL
+  )
+{
+  LIST_ENTRY     *Entry;
+  LIST_ENTRY     *Next;
+  PCI_IO_RECORD  *Record;
+
+  for (Entry = GetFirstNode (&mPciIoList);
+       !IsNull (&mPciIoList, Entry);
+       Entry = Next)
+  {
+    Next   = GetNextNode (&mPciIoList, Entry);
+    Record = BASE_CR (Entry, PCI_IO_RECORD, Link);
+    if (((PciIo == NULL) || (Record->PciIo == PciIo)) &&
+        ((Image == NULL) || (Record->Image == Image)))
+    {
+      CriticalBegin ();
+      RemoveEntryList (&Record->Link);
+      CriticalEnd ();
+      FreePool (Record);
+    }
+  }
+}
+
+/*
+ * PciBusDxe opens the root bridge PciRootBridgeIo
+ * BY_CHILD_CONTROLLER for every PciIo handle it creates.
+ */
+STATIC
+BOOLEAN
+PciIoIsPciBusChild (
+  IN  EFI_HANDLE  Handle
+  )
+{
+  EFI_STATUS                           Status;
+  EFI_DEVICE_PATH_PROTOCOL             *DevicePath;
+  EFI_HANDLE                           RootBridge;
+  EFI_OPEN_PROTOCOL_INFORMATION_ENTRY  *Info;
+  UINTN                                Count;
+  UINTN                                Index;
+  BOOLEAN                              IsChild;
+
+  Status = gBS->HandleProtocol (
+                  Handle,
+                  &gEfiDevicePathProtocolGuid,
+                  (VOID **)&DevicePath
+                  );
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+
+  Status = gBS->LocateDevicePath (
+                  &gEfiPciRootBridgeIoProtocolGuid,
+                  &DevicePath,
+                  &RootBridge
+                  );
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+
+  Status = gBS->OpenProtocolInformation (
+                  RootBridge,
+                  &gEfiPciRootBridgeIoProtocolGuid,
+                  &Info,
+                  &Count
+                  );
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+
+  IsChild = FALSE;
+  for (Index = 0; Index < Count; Index++) {
+    if ((Info[Index].ControllerHandle == Handle) &&
+        ((Info[Index].Attributes & EFI_OPEN_PROTOCOL_BY_CHILD_CONTROLLER) != 0))
+    {
+      IsChild = TRUE;
+      break;
+    }
+  }
+
+  FreePool (Info);
+  return IsChild;
+}
+
+STATIC
+VOID
+PciIoGetBar (
+  IN  EFI_PCI_IO_PROTOCOL  *PciIo,
+  IN  UINT8                BarIndex,
+  OUT PCI_IO_BAR           *Bar
+  )
+{
+  EFI_STATUS                         Status;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR  *Desc;
+  VOID                               *Resources;
+  UINT64                             Base;
+
+  Bar->Length  = 0;
+  Bar->Address = 0;
+
+  Status = PciIo->GetBarAttributes (PciIo, BarIndex, NULL, &Resources);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  /*
+   * A single descriptor, followed by the end tag. AddrRangeMin
+   * is a bus address, and the root bridge translation gives
+   * the host address (or port, for I/O).
+   */
+  Desc = Resources;
+  if ((Desc->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR) &&
+      ((Desc->ResType == ACPI_ADDRESS_SPACE_TYPE_MEM) ||
+       (Desc->ResType == ACPI_ADDRESS_SPACE_TYPE_IO)))
+  {
+    Bar->ResType = Desc->ResType;
+    Bar->Length  = Desc->AddrLen;
+    Base         = Desc->AddrRangeMin - Desc->AddrTranslationOffset;
+    if (Desc->ResType == ACPI_ADDRESS_SPACE_TYPE_MEM) {
+      Bar->Address = (UINTN)Base;
+    } else if (PcdGet64 (PcdPciIoTranslation) != 0) {
+      Bar->Address = (UINTN)(PcdGet64 (PcdPciIoTranslation) + Base);
+    }
+  }
+
+  FreePool (Resources);
+}
+
+/*
+ * Called for PciIo instances obtained by emulated code.
+ *
+ * PciBusDxe may have destroyed the PciIo a record was made for
+ * (e.g. on disconnect or hot-unplug), and created another at the
+ * same address, possibly for a different device or with different
+ * BARs, while the image that opened it stayed loaded. So the BARs
+ * are read again every time, for the records of all images.
+ */
+STATIC
+VOID
+PciIoRegister (
+  IN  EFI_HANDLE           Handle,
+  IN  EFI_PCI_IO_PROTOCOL  *PciIo,
+  IN  UINT64               ReturnAddress
+  )
+{
+  LIST_ENTRY     *Entry;
+  PCI_IO_RECORD  *Record;
+  ImageRecord    *Image;
+  UINT8          BarIndex;
+  PCI_IO_BAR     Bars[PCI_IO_BARS];
+
+  Image = ImageFindByAddress (ReturnAddress);
+  if ((PciIo == NULL) || (Image == NULL)) {
+    return;
+  }
+
+  if (!PciIoIsPciBusChild (Handle)) {
+    PciIoForget (PciIo, NULL);
+    return;
+  }
+
+  for (BarIndex = 0; BarIndex < PCI_IO_BARS; BarIndex++) {
+    PciIoGetBar (PciIo, BarIndex, &Bars[BarIndex]);
+  }
+
+  CriticalBegin ();
+  for (Entry = GetFirstNode (&mPciIoList);
+       !IsNull (&mPciIoList, Entry);
+       Entry = GetNextNode (&mPciIoList, Entry))
+  {
+    Record = BASE_CR (Entry, PCI_IO_RECORD, Link);
+    if (Record->PciIo == PciIo) {
+      CopyMem (Record->Bars, Bars, sizeof (Bars));
+    }
+  }
+
+  CriticalEnd ();
+
+  if (PciIoFind (PciIo, Image) != NULL) {
+    return;
+  }
+
+  Record = AllocateZeroPool (sizeof (*Record));
+  if (Record == NULL) {
+    return;
+  }
+
+  Record->PciIo = PciIo;
+  Record->Image = Image;
+  CopyMem (Record->Bars, Bars, sizeof (Bars));
+
+  CriticalBegin ();
+  InsertTailList (&mPciIoList, &Record->Link);
+  CriticalEnd ();
+}
+
+EFI_STATUS
+PciIoWrapperOpenProtocol (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_HANDLE  Handle           = (VOID *)Args[0];
+  EFI_GUID    *Protocol        = (VOID *)Args[1];
+  VOID        **Interface      = (VOID *)Args[2];
+  EFI_HANDLE  AgentHandle      = (VOID *)Args[3];
+  EFI_HANDLE  ControllerHandle = (VOID *)Args[4];
+  UINT32      Attributes       = Args[5];
+  EFI_STATUS  Status;
+
+  Status = gBS->OpenProtocol (
+                  Handle,
+                  Protocol,
+                  Interface,
+                  AgentHandle,
+                  ControllerHandle,
+                  Attributes
+                  );
+  /*
+   * With TEST_PROTOCOL, Interface is ignored (and may be garbage).
+   */
+  if (!EFI_ERROR (Status) && (Interface != NULL) &&
+      (Attributes != EFI_OPEN_PROTOCOL_TEST_PROTOCOL) &&
+      CompareGuid (Protocol, &gEfiPciIoProtocolGuid))
+  {
+    PciIoRegister (Handle, *Interface, ReturnAddress);
+  }
+
+  return Status;
+}
+
+/*
+ * A driver closes the PciIo it opened BY_DRIVER in Stop, after
+ * which the PciIo may be destroyed, so records of the image are
+ * dropped. Other opens by the same image just lose the fast path
+ * until the PciIo is opened again.
+ */
+EFI_STATUS
+PciIoWrapperCloseProtocol (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_HANDLE           Handle           = (VOID *)Args[0];
+  EFI_GUID             *Protocol        = (VOID *)Args[1];
+  EFI_HANDLE           AgentHandle      = (VOID *)Args[2];
+  EFI_HANDLE           ControllerHandle = (VOID *)Args[3];
+  EFI_PCI_IO_PROTOCOL  *PciIo;
+  ImageRecord          *Image;
+  EFI_STATUS           Status;
+
+  PciIo = NULL;
+  if ((Protocol != NULL) && CompareGuid (Protocol, &gEfiPciIoProtocolGuid)) {
+    gBS->HandleProtocol (Handle, Protocol, (VOID **)&PciIo);
+  }
+
+  Status = gBS->CloseProtocol (Handle, Protocol, AgentHandle, ControllerHandle);
+  if (!EFI_ERROR (Status) && (PciIo != NULL)) {
+    Image = ImageFindByAddress (ReturnAddress);
+    if (Image != NULL) {
+      PciIoForget (PciIo, Image);
+    }
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+PciIoWrapperHandleProtocol (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  EFI_HANDLE  Handle     = (VOID *)Args[0];
+  EFI_GUID    *Protocol  = (VOID *)Args[1];
+  VOID        **Interface = (VOID *)Args[2];
+  EFI_STATUS  Status;
+
+  Status = gBS->HandleProtocol (Handle, Protocol, Interface);
+  if (!EFI_ERROR (Status) && CompareGuid (Protocol, &gEfiPciIoProtocolGuid)) {
+    PciIoRegister (Handle, *Interface, ReturnAddress);
+  }
+
+  return Status;
+}
+
+UINT64
+PciIoOverride (
+  IN  UINT64  ProgramCounter
+  )
+{
+  if (ProgramCounter == (UINT64)gBS->OpenProtocol) {
+    return (UINT64)PciIoWrapperOpenProtocol;
+  } else if (ProgramCounter == (UINT64)gBS->CloseProtocol) {
+    return (UINT64)PciIoWrapperCloseProtocol;
+  } else if (ProgramCounter == (UINT64)gBS->HandleProtocol) {
+    return (UINT64)PciIoWrapperHandleProtocol;
+  }
+
+  return ProgramCounter;
+}
+
+/*
+ * A single naturally aligned access at a BAR host address. Buffer
+ * is emulated memory, with no alignment guarantees.
+ */
+STATIC
+VOID
+PciIoDirectAccess (
+  IN      UINTN    Address,
+  IN      UINT64   Width,
+  IN      BOOLEAN  Write,
+  IN OUT  VOID     *Buffer
+  )
+{
+  switch (Width) {
+    case EfiPciIoWidthUint8:
+      if (Write) {
+        *(volatile UINT8 *)Address = *(UINT8 *)Buffer;
+      } else {
+        *(UINT8 *)Buffer = *(volatile UINT8 *)Address;
+      }
+
+      break;
+    case EfiPciIoWidthUint16:
+      if (Write) {
+        *(volatile UINT16 *)Address = ReadUnaligned16 (Buffer);
+      } else {
+        WriteUnaligned16 (Buffer, *(volatile UINT16 *)Address);
+      }
+
+      break;
+    case EfiPciIoWidthUint32:
+      if (Write) {
+        *(volatile UINT32 *)Address = ReadUnaligned32 (Buffer);
+      } else {
+        WriteUnaligned32 (Buffer, *(volatile UINT32 *)Address);
+      }
+
+      break;
+    default:
+      ASSERT (Width == EfiPciIoWidthUint64);
+      if (Write) {
+        *(volatile UINT64 *)Address = ReadUnaligned64 (Buffer);
+      } else {
+        WriteUnaligned64 (Buffer, *(volatile UINT64 *)Address);
+      }
+
+      break;
+  }
+}
+
+/*
+ * Returns the address to continue emulation at if the call was
+ * a PciIo access completed without leaving the engine, or 0.
+ */
+UINT64
+PciIoShadowCall (
+  IN  CpuRunContext  *Context
+  )
+{
+  CpuContext           *Cpu;
+  UINT64               ProgramCounter;
+  UINT64               Args[6];
+  EFI_PCI_IO_PROTOCOL  *PciIo;
+  PCI_IO_RECORD        *Record;
+  PCI_IO_BAR           *Bar;
+  UINT64               Width;
+  UINT64               BarIndex;
+  UINT64               Offset;
+  UINT64               Count;
+  VOID                 *Buffer;
+  BOOLEAN              Write;
+  EFI_STATUS           Status;
+
+  if (IsListEmpty (&mPciIoList)) {
+    return 0;
+  }
+
+  Cpu            = Context->Cpu;
+  ProgramCounter = REG_READ (Cpu, Cpu->ProgramCounterReg);
+
+  /*
+   * Mem.Read (This, Width, BarIndex, Offset, Count, Buffer), and the
+   * same for Mem.Write, Io.Read and Io.Write. Pci.Read (This, Width,
+   * Offset, Count, Buffer).
+   */
+  CpuGetCallArgs (Cpu, Args, ARRAY_SIZE (Args));
+  PciIo  = (VOID *)Args[0];
+  Record = PciIoFind (PciIo, NULL);
+  if (Record == NULL) {
+    return 0;
+  }
+
+  Width = Args[1];
+  if (Width > EfiPciIoWidthUint64) {
+    return 0;
+  }
+
+  if (ProgramCounter == (UINT64)PciIo->Pci.Read) {
+    Offset = Args[2];
+    Count  = Args[3];
+    Buffer = (VOID *)Args[4];
+    if (Count != 1) {
+      return 0;
+    }
+
+    Status = PciIo->Pci.Read (PciIo, Width, (UINT32)Offset, 1, Buffer);
+    mPciIoShadowCalls++;
+    return CpuCallReturn (Cpu, Status);
+  }
+
+  if ((ProgramCounter == (UINT64)PciIo->Mem.Read) ||
+      (ProgramCounter == (UINT64)PciIo->Io.Read))
+  {
+    Write = FALSE;
+  } else if ((ProgramCounter == (UINT64)PciIo->Mem.Write) ||
+             (ProgramCounter == (UINT64)PciIo->Io.Write))
+  {
+    Write = TRUE;
+  } else {
+    return 0;
+  }
+
+  BarIndex = Args[2];
+  Offset   = Args[3];
+  Count    = Args[4];
+  Buffer   = (VOID *)Args[5];
+  if ((Count != 1) || (BarIndex >= PCI_IO_BARS)) {
+    return 0;
+  }
+
+  Bar = &Record->Bars[BarIndex];
+  if ((Bar->Address == 0) ||
+      (Bar->Length < (1U << Width)) ||
+      (Offset > Bar->Length - (1U << Width)) ||
+      (((Bar->Address + Offset) & ((1U << Width) - 1)) != 0))
+  {
+    return 0;
+  }
+
+  if ((ProgramCounter == (UINT64)PciIo->Mem.Read) ||
+      (ProgramCounter == (UINT64)PciIo->Mem.Write))
+  {
+    if (Bar->ResType != ACPI_ADDRESS_SPACE_TYPE_MEM) {
+      return 0;
+    }
+  } else if ((Bar->ResType != ACPI_ADDRESS_SPACE_TYPE_IO) ||
+             (Width == EfiPciIoWidthUint64))
+  {
+    return 0;
+  }
+
+  PciIoDirectAccess (Bar->Address + (UINTN)Offset, Width, Write, Buffer);
+  mPciIoShadowCalls++;
+  return CpuCallReturn (Cpu, EFI_SUCCESS);
+}
+
+/*
+ * The PciIo may be gone (or reused by another device) once
+ * the image that opened it is, so its BARs are forgotten.
+ */
+VOID
+PciIoImageUnregister (
+  IN  ImageRecord  *Image
+  )
+{
+  PciIoForget (NULL, Image);
+}
+
+VOID
+PciIoGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->PciIoShadowCalls = mPciIoShadowCalls;
+}
+
+#endif /* MAU_FAST_PCI_IO */
@@ -0,0 +1,917 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Library/PcdLib.h>
+#include <IndustryStandard/Acpi.h>
+#include <Protocol/PciRootBridgeIo.h>
+#include <Protocol/PciEnumerationComplete.h>
+
+/*
+ * Emulated x64 port I/O (in/out).
+ *
+ * The PioRazWi variable (gEfiCallerIdGuid) holds a space-separated
+ * list of hex ports and port ranges (e.g. "80 3f8-3ff") that read
+ * as zero and ignore writes, or "*" for all ports. This used to be
+ * the build-time MAU_EMU_X64_RAZ_WI_PIO, which now just makes "*"
+ * the default when the variable is absent.
+ *
+ * With MAU_PIO_DELAY, the policy table also starts out with the
+ * ports legacy code uses for timing: writes to (and reads from)
+ * 0x80 and 0xED are ~1us I/O delays, done as a native stall, and
+ * PIT channel 2 (ports 0x42, 0x43 and 0x61) is modeled on native
+ * time. Port 0x61 reads see the refresh toggle (bit 4) flip every
+ * 15us, and the channel 2 output (bit 5) follow the count programmed
+ * with 0x43 and 0x42 and the gate (0x61 bit 0), so the usual "program
+ * channel 2, poll bit 5" delays take as long as they should.
+ *
+ * With MAU_DIRECT_PIO, ports within the host root bridge I/O
+ * apertures are accessed directly in the PCI I/O MMIO window at
+ * PcdPciIoTranslation, which is all CpuIo2 does on hosts without
+ * port I/O. The apertures are resolved once when the emulator
+ * starts and again on PCI enumeration completion, as is the
+ * policy. Everything else still goes to CpuIo2.
+ */
+
+#define PIO_RAZ_WI_VARIABLE  L"PioRazWi"
+#define PIO_PORT_MAX         0xFFFF
+#define PIO_WINDOWS_MAX      8
+#define PIO_DELAY_US         1
+#define PIO_REFRESH_NS       15085
+#define PIO_PIT_HZ           1193182
+#define PIO_PIT_CONTROL      0x43
+#define PIO_PIT_CHANNEL2     0x42
+#define PIO_PIT_PORT_B       0x61
+
+/*
+ * Per-port policies.
+ */
+#define PIO_POLICY_NONE     0
+#define PIO_POLICY_RAZ_WI   1
+#define PIO_POLICY_DELAY    2
+#define PIO_POLICY_PIT      3
+
+/*
+ * PIT channel 2 state. Only modes 0 and 1 (one-shot) and 3 (square
+ * wave) are modeled, other modes have the output stay high. Counting
+ * runs while the gate is high, from when the count was loaded or the
+ * gate was raised (whichever is later), and is frozen while the gate
+ * is low.
+ */
+typedef struct {
+  BOOLEAN    Programmed;
+  BOOLEAN    Loaded;
+  UINT8      Mode;
+  UINT8      Access;
+  BOOLEAN    WriteMsb;
+  BOOLEAN    ReadMsb;
+  BOOLEAN    Latched;
+  UINT16     Latch;
+  UINT16     Pending;
+  UINT32     Count;
+  BOOLEAN    Gate;
+  BOOLEAN    Speaker;
+  UINT64     StartNs;
+  UINT64     StopNs;
+} PIO_PIT;
+
+/*
+ * PIO_PORT_MAX + 1 entries.
+ */
+STATIC UINT8      *mPioPolicy;
+STATIC UINTN      mPioRazWiOps;
+STATIC UINTN      mPioDelayOps;
+STATIC VOID       *mPioRegistration;
+STATIC EFI_EVENT  mPioEvent;
+STATIC PIO_PIT    mPioPit;
+
+#ifdef MAU_DIRECT_PIO
+ #if defined (MDE_CPU_X64) || defined (MDE_CPU_IA32)
+  #error "MAU_DIRECT_PIO is for hosts without port I/O"
+ #endif
+
+typedef struct {
+  UINT32    First;
+  UINT32    Last;
+} PIO_RANGE;
+
+STATIC PIO_RANGE  mPioWindows[PIO_WINDOWS_MAX];
+STATIC UINTN      mPioWindowCount;
+STATIC UINTN      mPioTranslation;
+STATIC UINTN      mPioDirectOps;
+
+STATIC
+BOOLEAN
+PioInRanges (
+  IN  CONST PIO_RANGE  *Ranges,
+  IN  UINTN            Count,
+  IN  UINT32           Port,
+  IN  UINT32           Size
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < Count; Index++) {
+    if ((Port >= Ranges[Index].First) &&
+        (Port + Size - 1 <= Ranges[Index].Last))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+#endif /* MAU_DIRECT_PIO */
+
+STATIC
+BOOLEAN
+PioParsePort (
+  IN OUT CONST CHAR8  **String,
+  OUT    UINT32       *Port
+  )
+{
+  CONST CHAR8  *Walk;
+  UINT32       Value;
+  UINTN        Digit;
+
+  Walk = *String;
+  if ((Walk[0] == '0') && ((Walk[1] == 'x') || (Walk[1] == 'X'))) {
+    Walk += 2;
+  }
+
+  Value = 0;
+  for ( ; ; Walk++) {
+    if ((*Walk >= '0') && (*Walk <= '9')) {
+      Digit = *Walk - '0';
+    } else if ((*Walk >= 'a') && (*Walk <= 'f')) {
+      Digit = *Walk - 'a' + 10;
+    } else if ((*Walk >= 'A') && (*Walk <= 'F')) {
+      Digit = *Walk - 'A' + 10;
+    } else {
+      break;
+    }
+
+    Value = Value * 16 + Digit;
+    if (Value > PIO_PORT_MAX) {
+      return FALSE;
+    }
+  }
+
+  if (Walk == *String) {
+    return FALSE;
+  }
+
+  *String = Walk;
+  *Port   = Value;
+  return TRUE;
+}
+
+/*
+ * Marks the ports listed in Policy as RAZ/WI in Table.
+ */
+STATIC
+BOOLEAN
+PioParsePolicy (
+  IN  CONST CHAR8  *Policy,
+  OUT UINT8        *Table
+  )
+{
+  CONST CHAR8  *Item;
+  CONST CHAR8  *Walk;
+  UINTN        Length;
+  UINT32       First;
+  UINT32       Last;
+
+  for (Item = EmulatorListNext (&Policy, &Length);
+       Item != NULL;
+       Item = EmulatorListNext (&Policy, &Length))
+  {
+    Walk = Item;
+    if (*Walk == '*') {
+      Walk++;
+      First = 0;
+      Last  = PIO_PORT_MAX;
+    } else if (PioParsePort (&Walk, &First)) {
+      Last = First;
+      if (*Walk == '-') {
+        Walk++;
+        if (!PioParsePort (&Walk, &Last) || (Last < First)) {
+          return FALSE;
+        }
+      }
+    } else {
+      return FALSE;
+    }
+
+    if (Walk != Item + Length) {
+      return FALSE;
+    }
+
+    SetMem (Table + First, Last - First + 1, PIO_POLICY_RAZ_WI);
+  }
+
+  return TRUE;
+}
+
+STATIC
+UINT8 *
+PioNewPolicy (
+  VOID
+  )
+{
+  UINT8  *Table;
+
+  Table = AllocateZeroPool (PIO_PORT_MAX + 1);
+ #ifdef MAU_PIO_DELAY
+  if (Table != NULL) {
+    Table[0x80] = PIO_POLICY_DELAY;
+    Table[0xED] = PIO_POLICY_DELAY;
+    Table[PIO_PIT_CHANNEL2] = PIO_POLICY_PIT;
+    Table[PIO_PIT_CONTROL]  = PIO_POLICY_PIT;
+    Table[PIO_PIT_PORT_B]   = PIO_POLICY_PIT;
+  }
+
+ #endif /* MAU_PIO_DELAY */
+  return Table;
+}
+
+STATIC
+VOID
+PioSetPolicy (
+  IN  UINT8  *Table
+  )
+{
+  UINT8  *Old;
+
+  CriticalBegin ();
+  Old        = mPioPolicy;
+  mPioPolicy = Table;
+  CriticalEnd ();
+
+  if (Old != NULL) {
+    FreePool (Old);
+  }
+}
+
+STATIC
+VOID
+PioUpdatePolicy (
+  VOID
+  )
+{
+  CHAR8  *Policy;
+  UINT8  *Table;
+
+  Policy = EmulatorGetListVariable (PIO_RAZ_WI_VARIABLE);
+  if (Policy == NULL) {
+    return;
+  }
+
+  Table = PioNewPolicy ();
+  if (Table == NULL) {
+    FreePool (Policy);
+    return;
+  }
+
+  if (!PioParsePolicy (Policy, Table)) {
+    DEBUG ((DEBUG_ERROR, "Ignoring malformed %s '%a'\n", PIO_RAZ_WI_VARIABLE, Policy));
+    FreePool (Table);
+    FreePool (Policy);
+    return;
+  }
+
+  DEBUG ((DEBUG_INFO, "Port I/O RAZ/WI policy '%a'\n", Policy));
+  FreePool (Policy);
+  PioSetPolicy (Table);
+}
+
+#ifdef MAU_DIRECT_PIO
+
+STATIC
+VOID
+PioUpdateWindows (
+  VOID
+  )
+{
+  EFI_STATUS                         Status;
+  EFI_HANDLE                         *Handles;
+  UINTN                              HandleCount;
+  UINTN                              Index;
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL    *RootBridgeIo;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR  *Desc;
+  PIO_RANGE                          Windows[PIO_WINDOWS_MAX];
+  UINTN                              Count;
+  UINT64                             First;
+
+  if (PcdGet64 (PcdPciIoTranslation) == 0) {
+    return;
+  }
+
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiPciRootBridgeIoProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  Count = 0;
+  for (Index = 0; Index < HandleCount; Index++) {
+    Status = gBS->HandleProtocol (
+                    Handles[Index],
+                    &gEfiPciRootBridgeIoProtocolGuid,
+                    (VOID **)&RootBridgeIo
+                    );
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = RootBridgeIo->Configuration (RootBridgeIo, (VOID **)&Desc);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    /*
+     * Configuration describes the resources assigned so far,
+     * in root bridge (bus) addresses.
+     */
+    for ( ; Desc->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Desc++) {
+      if ((Desc->ResType != ACPI_ADDRESS_SPACE_TYPE_IO) ||
+          (Desc->AddrLen == 0))
+      {
+        continue;
+      }
+
+      First = Desc->AddrRangeMin - Desc->AddrTranslationOffset;
+      if ((First > PIO_PORT_MAX) || (Count == PIO_WINDOWS_MAX)) {
+        continue;
+      }
+
+      Windows[Count].First = (UINT32)First;
+      Windows[Count].Last  = (UINT32)MIN (First + Desc->AddrLen - 1, PIO_PORT_MAX);
+      DEBUG ((
+        DEBUG_INFO,
+        "Direct port I/O 0x%x-0x%x\n",
+        Windows[Count].First,
+        Windows[Count].Last
+        ));
+      Count++;
+    }
+  }
+
+  FreePool (Handles);
+
+  CriticalBegin ();
+  CopyMem (mPioWindows, Windows, Count * sizeof (*Windows));
+  mPioWindowCount = Count;
+  mPioTranslation = (UINTN)PcdGet64 (PcdPciIoTranslation);
+  CriticalEnd ();
+}
+
+#endif /* MAU_DIRECT_PIO */
+
+STATIC
+VOID
+EFIAPI
+PioNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  PioUpdatePolicy ();
+ #ifdef MAU_DIRECT_PIO
+  PioUpdateWindows ();
+ #endif /* MAU_DIRECT_PIO */
+}
+
+STATIC
+UINT8
+PioGetPolicy (
+  IN  UINT32  Port
+  )
+{
+  if ((mPioPolicy == NULL) || (Port > PIO_PORT_MAX)) {
+    return PIO_POLICY_NONE;
+  }
+
+  return mPioPolicy[Port];
+}
+
+/*
+ * Nanoseconds channel 2 has been counting for, and the length
+ * of a count in nanoseconds.
+ */
+STATIC
+UINT64
+PioPitElapsed (
+  IN  UINT64  Now,
+  OUT UINT64  *CountNs
+  )
+{
+  *CountNs = DivU64x32 (MultU64x32 (mPioPit.Count, 1000000000), PIO_PIT_HZ);
+  return (mPioPit.Gate ? Now : mPioPit.StopNs) - mPioPit.StartNs;
+}
+
+STATIC
+BOOLEAN
+PioPitOut (
+  IN  UINT64  Now
+  )
+{
+  UINT64  Elapsed;
+  UINT64  CountNs;
+  UINT64  Phase;
+
+  /*
+   * Whatever firmware left it at.
+   */
+  if (!mPioPit.Programmed) {
+    return TRUE;
+  }
+
+  switch (mPioPit.Mode) {
+    case 0:
+    case 1:
+      /*
+       * Mode 0 drives the output low from the control word on.
+       */
+      if (!mPioPit.Loaded) {
+        return mPioPit.Mode != 0;
+      }
+
+      return PioPitElapsed (Now, &CountNs) >= CountNs;
+    case 3:
+      if (!mPioPit.Loaded || !mPioPit.Gate) {
+        return TRUE;
+      }
+
+      Elapsed = PioPitElapsed (Now, &CountNs);
+      DivU64x64Remainder (Elapsed, CountNs, &Phase);
+      return Phase < CountNs / 2;
+    default:
+      return TRUE;
+  }
+}
+
+STATIC
+UINT16
+PioPitCount (
+  IN  UINT64  Now
+  )
+{
+  UINT64  Elapsed;
+  UINT64  CountNs;
+  UINT64  Phase;
+
+  if (!mPioPit.Loaded) {
+    return 0;
+  }
+
+  /*
+   * Counters keep going (and wrap) past the terminal count.
+   */
+  Elapsed = PioPitElapsed (Now, &CountNs);
+  DivU64x64Remainder (Elapsed, CountNs, &Phase);
+  return (UINT16)(mPioPit.Count - DivU64x32 (MultU64x32 (Phase, PIO_PIT_HZ), 1000000000));
+}
+
+STATIC
+UINT32
+PioPitAccess (
+  IN  UINT32   Port,
+  IN  BOOLEAN  Write,
+  IN  UINT32   Value
+  )
+{
+  UINT64   Now;
+  UINT16   Count;
+  BOOLEAN  Gate;
+  UINT8    Result;
+
+  Now = GetTimeInNanoSecond (GetPerformanceCounter ());
+  if (Port == PIO_PIT_PORT_B) {
+    if (!Write) {
+      return (mPioPit.Gate ? BIT0 : 0) |
+             (mPioPit.Speaker ? BIT1 : 0) |
+             ((DivU64x32 (Now, PIO_REFRESH_NS) & 1) != 0 ? BIT4 : 0) |
+             (PioPitOut (Now) ? BIT5 : 0);
+    }
+
+    Gate            = (Value & BIT0) != 0;
+    mPioPit.Speaker = (Value & BIT1) != 0;
+    if (Gate && !mPioPit.Gate) {
+      mPioPit.StartNs = Now;
+    } else if (!Gate && mPioPit.Gate) {
+      mPioPit.StopNs = Now;
+    }
+
+    mPioPit.Gate = Gate;
+    return 0;
+  }
+
+  if (Port == PIO_PIT_CONTROL) {
+    /*
+     * Only channel 2 is modeled.
+     */
+    if (!Write || ((Value & (BIT7 | BIT6)) != BIT7)) {
+      return 0;
+    }
+
+    if ((Value & (BIT5 | BIT4)) == 0) {
+      mPioPit.Latched = TRUE;
+      mPioPit.Latch   = PioPitCount (Now);
+      return 0;
+    }
+
+    mPioPit.Programmed = TRUE;
+    mPioPit.Loaded     = FALSE;
+    mPioPit.Latched    = FALSE;
+    mPioPit.Access     = (UINT8)((Value >> 4) & 3);
+    mPioPit.Mode       = (UINT8)((Value >> 1) & 7);
+    if (mPioPit.Mode > 5) {
+      mPioPit.Mode -= 4;
+    }
+
+    mPioPit.WriteMsb = mPioPit.Access == 2;
+    mPioPit.ReadMsb  = mPioPit.Access == 2;
+    return 0;
+  }
+
+  ASSERT (Port == PIO_PIT_CHANNEL2);
+  if (Write) {
+    if (!mPioPit.Programmed) {
+      return 0;
+    }
+
+    if (mPioPit.WriteMsb) {
+      mPioPit.Pending |= (UINT16)((Value & 0xFF) << 8);
+    } else {
+      mPioPit.Pending = (UINT16)(Value & 0xFF);
+    }
+
+    if ((mPioPit.Access == 3) && !mPioPit.WriteMsb) {
+      mPioPit.WriteMsb = TRUE;
+      return 0;
+    }
+
+    mPioPit.WriteMsb = mPioPit.Access == 2;
+    mPioPit.Count    = mPioPit.Pending == 0 ? 0x10000 : mPioPit.Pending;
+    mPioPit.Loaded   = TRUE;
+    mPioPit.StartNs  = Now;
+    mPioPit.StopNs   = Now;
+    return 0;
+  }
+
+  if (mPioPit.Latched) {
+    Count = mPioPit.Latch;
+  } else {
+    Count = PioPitCount (Now);
+  }
+
+  Result = mPioPit.ReadMsb ? (UINT8)(Count >> 8) : (UINT8)Count;
+  if (mPioPit.Access == 3) {
+    mPioPit.ReadMsb = !mPioPit.ReadMsb;
+    if (mPioPit.ReadMsb) {
+      return Result;
+    }
+  }
+
+  /*
+   * A latched count is held until fully read.
+   */
+  mPioPit.Latched = FALSE;
+  return Result;
+}
+
+/*
+ * Does an access to a port with a policy, returning
+ * the value read.
+ */
+STATIC
+UINT32
+PioPolicyAccess (
+  IN  UINT8    Policy,
+  IN  UINT32   Port,
+  IN  BOOLEAN  Write,
+  IN  UINT32   Value
+  )
+{
+  switch (Policy) {
+    case PIO_POLICY_DELAY:
+      mPioDelayOps++;
+      MicroSecondDelay (PIO_DELAY_US);
+      return 0;
+    case PIO_POLICY_PIT:
+      mPioDelayOps++;
+      return PioPitAccess (Port, Write, Value);
+    default:
+      ASSERT (Policy == PIO_POLICY_RAZ_WI);
+      mPioRazWiOps++;
+      return 0;
+  }
+}
+
+UINT32
+PioRead (
+  IN  UINT32  Port,
+  IN  UINT32  Size
+  )
+{
+  UINT32  Result = 0;
+  UINT8   Policy;
+
+  Policy = PioGetPolicy (Port);
+  if (Policy != PIO_POLICY_NONE) {
+    return PioPolicyAccess (Policy, Port, FALSE, 0);
+  }
+
+ #ifdef MAU_DIRECT_PIO
+  if (PioInRanges (mPioWindows, mPioWindowCount, Port, Size)) {
+    mPioDirectOps++;
+    switch (Size) {
+      case 1:
+        return *(volatile UINT8 *)(mPioTranslation + Port);
+      case 2:
+        return *(volatile UINT16 *)(mPioTranslation + Port);
+      default:
+        ASSERT (Size == 4);
+        return *(volatile UINT32 *)(mPioTranslation + Port);
+    }
+  }
+
+ #endif /* MAU_DIRECT_PIO */
+
+  if (gCpuIo2 != NULL) {
+    switch (Size) {
+      case 1:
+        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint8, Port, 1, &Result);
+        break;
+      case 2:
+        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint16, Port, 1, &Result);
+        break;
+      default:
+        ASSERT (Size == 4);
+        gCpuIo2->Io.Read (gCpuIo2, EfiCpuIoWidthUint32, Port, 1, &Result);
+        break;
+    }
+  }
+
+  return Result;
+}
+
+VOID
+PioWrite (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINT32  Value
+  )
+{
+  UINT8  Policy;
+
+  Policy = PioGetPolicy (Port);
+  if (Policy != PIO_POLICY_NONE) {
+    PioPolicyAccess (Policy, Port, TRUE, Value);
+    return;
+  }
+
+ #ifdef MAU_DIRECT_PIO
+  if (PioInRanges (mPioWindows, mPioWindowCount, Port, Size)) {
+    mPioDirectOps++;
+    switch (Size) {
+      case 1:
+        *(volatile UINT8 *)(mPioTranslation + Port) = (UINT8)Value;
+        break;
+      case 2:
+        *(volatile UINT16 *)(mPioTranslation + Port) = (UINT16)Value;
+        break;
+      default:
+        ASSERT (Size == 4);
+        *(volatile UINT32 *)(mPioTranslation + Port) = Value;
+        break;
+    }
+
+    return;
+  }
+
+ #endif /* MAU_DIRECT_PIO */
+
+  if (gCpuIo2 != NULL) {
+    switch (Size) {
+      case 1:
+        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint8, Port, 1, &Value);
+        break;
+      case 2:
+        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint16, Port, 1, &Value);
+        break;
+      default:
+        ASSERT (Size == 4);
+        gCpuIo2->Io.Write (gCpuIo2, EfiCpuIoWidthUint32, Port, 1, &Value);
+        break;
+    }
+  }
+}
+
+/*
+ * Port string I/O (rep ins) of Count Size-byte elements into
+ * a Size-aligned Buffer.
+ */
+VOID
+PioReadFifo (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINTN   Count,
+  OUT VOID    *Buffer
+  )
+{
+  UINTN   Index;
+  UINT8   Policy;
+  UINT32  Value;
+
+ #ifdef MAU_DIRECT_PIO
+  UINTN  Address;
+ #endif /* MAU_DIRECT_PIO */
+
+  Policy = PioGetPolicy (Port);
+  if (Policy != PIO_POLICY_NONE) {
+    for (Index = 0; Index < Count; Index++) {
+      Value = PioPolicyAccess (Policy, Port, FALSE, 0);
+      CopyMem ((UINT8 *)Buffer + Index * Size, &Value, Size);
+    }
+
+    return;
+  }
+
+ #ifdef MAU_DIRECT_PIO
+  if (PioInRanges (mPioWindows, mPioWindowCount, Port, Size)) {
+    mPioDirectOps++;
+    Address = mPioTranslation + Port;
+    for (Index = 0; Index < Count; Index++) {
+      switch (Size) {
+        case 1:
+          ((UINT8 *)Buffer)[Index] = *(volatile UINT8 *)Address;
+          break;
+        case 2:
+          ((UINT16 *)Buffer)[Index] = *(volatile UINT16 *)Address;
+          break;
+        default:
+          ASSERT (Size == 4);
+          ((UINT32 *)Buffer)[Index] = *(volatile UINT32 *)Address;
+          break;
+      }
+    }
+
+    return;
+  }
+
+ #endif /* MAU_DIRECT_PIO */
+
+  if (gCpuIo2 != NULL) {
+    gCpuIo2->Io.Read (
+                  gCpuIo2,
+                  EfiCpuIoWidthFifoUint8 + HighBitSet32 (Size),
+                  Port,
+                  Count,
+                  Buffer
+                  );
+  } else {
+    ZeroMem (Buffer, Count * Size);
+  }
+}
+
+/*
+ * Port string I/O (rep outs) of Count Size-byte elements from
+ * a Size-aligned Buffer.
+ */
+VOID
+PioWriteFifo (
+  IN  UINT32  Port,
+  IN  UINT32  Size,
+  IN  UINTN   Count,
+  IN  VOID    *Buffer
+  )
+{
+  UINTN   Index;
+  UINT8   Policy;
+  UINT32  Value;
+
+ #ifdef MAU_DIRECT_PIO
+  UINTN  Address;
+ #endif /* MAU_DIRECT_PIO */
+
+  Policy = PioGetPolicy (Port);
+  if (Policy != PIO_POLICY_NONE) {
+    for (Index = 0; Index < Count; Index++) {
+      Value = 0;
+      CopyMem (&Value, (UINT8 *)Buffer + Index * Size, Size);
+      PioPolicyAccess (Policy, Port, TRUE, Value);
+    }
+
+    return;
+  }
+
+ #ifdef MAU_DIRECT_PIO
+  if (PioInRanges (mPioWindows, mPioWindowCount, Port, Size)) {
+    mPioDirectOps++;
+    Address = mPioTranslation + Port;
+    for (Index = 0; Index < Count; Index++) {
+      switch (Size) {
+        case 1:
+          *(volatile UINT8 *)Address = ((UINT8 *)Buffer)[Index];
+          break;
+        case 2:
+          *(volatile UINT16 *)Address = ((UINT16 *)Buffer)[Index];
+          break;
+        default:
+          ASSERT (Size == 4);
+          *(volatile UINT32 *)Address = ((UINT32 *)Buffer)[Index];
+          break;
+      }
+    }
+
+    return;
+  }
+
+ #endif /* MAU_DIRECT_PIO */
+
+  if (gCpuIo2 != NULL) {
+    gCpuIo2->Io.Write (
+                  gCpuIo2,
+                  EfiCpuIoWidthFifoUint8 + HighBitSet32 (Size),
+                  Port,
+                  Count,
+                  Buffer
+                  );
+  }
+}
+
+VOID
+PioInit (
+  VOID
+  )
+{
+  UINT8  *Table;
+
+  Table = PioNewPolicy ();
+ #ifdef MAU_EMU_X64_RAZ_WI_PIO
+  if (Table != NULL) {
+    UINTN  Port;
+
+    for (Port = 0; Port <= PIO_PORT_MAX; Port++) {
+      if (Table[Port] == PIO_POLICY_NONE) {
+        Table[Port] = PIO_POLICY_RAZ_WI;
+      }
+    }
+  }
+
+ #endif /* MAU_EMU_X64_RAZ_WI_PIO */
+  PioSetPolicy (Table);
+
+  /*
+   * Also signalled right away, which covers emulator start
+   * after PCI enumeration or without PCI at all.
+   */
+  mPioEvent = EfiCreateProtocolNotifyEvent (
+                &gEfiPciEnumerationCompleteProtocolGuid,
+                TPL_CALLBACK,
+                PioNotify,
+                NULL,
+                &mPioRegistration
+                );
+}
+
+VOID
+PioCleanup (
+  VOID
+  )
+{
+  if (mPioEvent != NULL) {
+    gBS->CloseEvent (mPioEvent);
+    mPioEvent = NULL;
+  }
+
+  PioSetPolicy (NULL);
+}
+
+VOID
+PioGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->PioRazWiOps = mPioRazWiOps;
+  DebugState->PioDelayOps = mPioDelayOps;
+ #ifdef MAU_DIRECT_PIO
+  DebugState->PioDirectOps = mPioDirectOps;
+ #endif /* MAU_DIRECT_PIO */
+}
@@ -0,0 +1,162 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+
+/*
+ * A sorted snapshot of the RAM ranges in the memory map, for telling
+ * RAM from MMIO while running emulated code (where the memory map
+ * can't be fetched). Types of RAM don't change, but which type a
+ * particular RAM page is does, so only the first is looked at.
+ * Adjacent ranges are merged.
+ */
+
+typedef struct {
+  EFI_PHYSICAL_ADDRESS    Start;
+  EFI_PHYSICAL_ADDRESS    End;
+} RamRange;
+
+STATIC RamRange  *mRam;
+STATIC UINTN     mRamCount;
+
+EFI_STATUS
+RamInit (
+  VOID
+  )
+{
+  EFI_STATUS             Status;
+  UINTN                  MapSize;
+  UINTN                  MapKey;
+  UINTN                  DescriptorSize;
+  UINT32                 DescriptorVersion;
+  EFI_MEMORY_DESCRIPTOR  *Map;
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+  UINTN                  Index;
+  UINTN                  Count;
+  RamRange               Temp;
+
+  MapSize = 0;
+  Status  = gBS->GetMemoryMap (&MapSize, NULL, &MapKey, &DescriptorSize, &DescriptorVersion);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return Status;
+  }
+
+  /*
+   * The allocation below can grow the memory map.
+   */
+  MapSize += 2 * DescriptorSize;
+  Map      = AllocatePool (MapSize);
+  if (Map == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = gBS->GetMemoryMap (&MapSize, Map, &MapKey, &DescriptorSize, &DescriptorVersion);
+  if (EFI_ERROR (Status)) {
+    FreePool (Map);
+    return Status;
+  }
+
+  Count = MapSize / DescriptorSize;
+  mRam  = AllocatePool (Count * sizeof (*mRam));
+  if (mRam == NULL) {
+    FreePool (Map);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Desc = Map, Index = 0; Index < Count;
+       Index++, Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize))
+  {
+    if ((Desc->Type == EfiReservedMemoryType) ||
+        (Desc->Type == EfiUnusableMemory) ||
+        (Desc->Type == EfiMemoryMappedIO) ||
+        (Desc->Type == EfiMemoryMappedIOPortSpace))
+    {
+      continue;
+    }
+
+    mRam[mRamCount].Start = Desc->PhysicalStart;
+    mRam[mRamCount].End   = Desc->PhysicalStart +
+                            EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
+    mRamCount++;
+  }
+
+  FreePool (Map);
+
+  /*
+   * The memory map isn't guaranteed to be sorted. It's small,
+   * so insertion sort is fine.
+   */
+  for (Index = 1; Index < mRamCount; Index++) {
+    Temp = mRam[Index];
+    for (Count = Index; Count > 0 && mRam[Count - 1].Start > Temp.Start; Count--) {
+      mRam[Count] = mRam[Count - 1];
+    }
+
+    mRam[Count] = Temp;
+  }
+
+  for (Index = 0, Count = 0; Index < mRamCount; Index++) {
+    if ((Count > 0) && (mRam[Index].Start == mRam[Count - 1].End)) {
+      mRam[Count - 1].End = mRam[Index].End;
+    } else {
+      mRam[Count++] = mRam[Index];
+    }
+  }
+
+  mRamCount = Count;
+
+  return EFI_SUCCESS;
+}
+
+VOID
+RamCleanup (
+  VOID
+  )
+{
+  if (mRam != NULL) {
+    FreePool (mRam);
+    mRam      = NULL;
+    mRamCount = 0;
+  }
+}
+
+/*
+ * Returns TRUE if all of Start..Start + Size - 1 is RAM.
+ */
+BOOLEAN
+RamIsRange (
+  IN  EFI_PHYSICAL_ADDRESS  Start,
+  IN  UINT64                Size
+  )
+{
+  UINTN  Low;
+  UINTN  High;
+  UINTN  Mid;
+
+  if ((Size == 0) || (Start + Size < Start)) {
+    return FALSE;
+  }
+
+  Low  = 0;
+  High = mRamCount;
+  while (Low < High) {
+    Mid = (Low + High) / 2;
+    if (Start < mRam[Mid].Start) {
+      High = Mid;
+    } else if (Start >= mRam[Mid].End) {
+      Low = Mid + 1;
+    } else {
+      return (Start + Size) <= mRam[Mid].End;
+    }
+  }
+
+  return FALSE;
+}
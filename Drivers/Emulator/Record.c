@@ -0,0 +1,707 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <unicorn.h>
+#include "Emulator.h"
+
+#ifdef MAU_CALL_RECORD
+
+/*
+ * Allocation is attempted at RECORD_BUFFER_SIZE, then halved
+ * until RECORD_BUFFER_SIZE_MIN.
+ */
+#define RECORD_BUFFER_SIZE      SIZE_64MB
+#define RECORD_BUFFER_SIZE_MIN  SIZE_4MB
+
+/*
+ * Pages ever touched by emulated code. Never shrinks, and
+ * is at most 3/4 full.
+ */
+#define RECORD_PAGE_BITS   16
+#define RECORD_PAGE_LIMIT  ((1U << RECORD_PAGE_BITS) / 4 * 3)
+#define RECORD_PAGE_HASH(Page)                                          \
+  ((UINT32)(((Page) >> EFI_PAGE_SHIFT) * 0x9E3779B97F4A7C15ULL >> (64 - RECORD_PAGE_BITS)))
+
+/*
+ * Pages written by emulated code since the last switch to native
+ * code, which need their checksum refreshed. Only an optimization:
+ * a page missing here just gets snapshotted again unnecessarily.
+ */
+#define RECORD_DIRTY_MAX  64
+
+/*
+ * Part of the emulated stack (above the stack pointer) compared
+ * before and after each native call.
+ */
+#define RECORD_STACK_WINDOW  512
+
+#define RECORD_PAGE_SEEN   BIT0
+#define RECORD_PAGE_SKIP   BIT1
+#define RECORD_PAGE_DIRTY  BIT2
+
+typedef struct {
+  EFI_PHYSICAL_ADDRESS    Page;
+  UINT32                  Crc;
+  UINT16                  Generation;
+  UINT16                  Flags;
+} RecordPage;
+
+typedef struct {
+  UINT64    StackPointer;
+  UINT32    Size;
+  UINT8     Bytes[RECORD_STACK_WINDOW];
+} RecordStackWindow;
+
+STATIC EMU_CALL_RECORD_HEADER  *mRecordHeader;
+STATIC UINT8                   *mRecordData;
+STATIC RecordPage              *mRecordPages;
+STATIC UINT32                  mRecordPageCount;
+STATIC UINT16                  mRecordGeneration;
+STATIC RecordPage              *mRecordDirty[RECORD_DIRTY_MAX];
+STATIC UINTN                   mRecordDirtyCount;
+STATIC RecordStackWindow       mRecordWindows[MAX_CPU_RUN_CONTEXTS];
+STATIC EFI_GUID                mEmuCallRecordProtocolGuid = EMU_CALL_RECORD_PROTOCOL_GUID;
+
+STATIC
+BOOLEAN
+RecordEnabled (
+  VOID
+  )
+{
+  return (mRecordHeader != NULL) &&
+         ((mRecordHeader->Flags & EMU_CALL_RECORD_FLAG_ENABLED) != 0);
+}
+
+/*
+ * Must be called with interrupts disabled. Returns NULL
+ * (and stops recording) once the buffer is full.
+ */
+STATIC
+VOID *
+RecordAlloc (
+  IN  UINT16  Type,
+  IN  UINT16  MachineType,
+  IN  UINTN   Size
+  )
+{
+  EMU_CALL_RECORD  *Record;
+
+  Size = ALIGN_VALUE (Size, sizeof (UINT64));
+  if (mRecordHeader->Used + Size > mRecordHeader->BufferSize - mRecordHeader->HeaderSize) {
+    mRecordHeader->Flags &= ~EMU_CALL_RECORD_FLAG_ENABLED;
+    mRecordHeader->Flags |= EMU_CALL_RECORD_FLAG_OVERFLOW;
+    return NULL;
+  }
+
+  Record               = (VOID *)(mRecordData + mRecordHeader->Used);
+  Record->Type         = Type;
+  Record->MachineType  = MachineType;
+  Record->Size         = (UINT32)Size;
+  Record->Timestamp    = GetPerformanceCounter ();
+  mRecordHeader->Used += Size;
+  return Record;
+}
+
+/*
+ * The number of live CpuRunContexts, which is what
+ * native calls are matched with their returns by.
+ */
+STATIC
+UINTN
+RecordDepth (
+  VOID
+  )
+{
+  UINTN          Depth;
+  CpuRunContext  *Context;
+
+  Depth = 0;
+  for (Context = CpuGetTopContext (); Context != NULL; Context = Context->PrevContext) {
+    Depth++;
+  }
+
+  return Depth;
+}
+
+STATIC
+RecordPage *
+RecordFindPage (
+  IN  EFI_PHYSICAL_ADDRESS  Page
+  )
+{
+  UINT32      Index;
+  RecordPage  *Entry;
+
+  Index = RECORD_PAGE_HASH (Page);
+  for ( ; ;) {
+    Entry = &mRecordPages[Index];
+    if (Entry->Page == Page) {
+      return Entry;
+    }
+
+    if (Entry->Flags == 0) {
+      if (mRecordPageCount == RECORD_PAGE_LIMIT) {
+        mRecordHeader->Flags |= EMU_CALL_RECORD_FLAG_INCOMPLETE;
+        return NULL;
+      }
+
+      mRecordPageCount++;
+      Entry->Page  = Page;
+      Entry->Flags = RECORD_PAGE_SEEN;
+
+      /*
+       * Don't touch MMIO or the NULL page.
+       */
+      if ((Page == 0) || !RamIsRange (Page, EFI_PAGE_SIZE)) {
+        Entry->Flags |= RECORD_PAGE_SKIP;
+      }
+
+      return Entry;
+    }
+
+    Index = (Index + 1) & ((1U << RECORD_PAGE_BITS) - 1);
+  }
+}
+
+STATIC
+VOID
+RecordTouchPage (
+  IN  CpuContext            *Cpu,
+  IN  EFI_PHYSICAL_ADDRESS  Page,
+  IN  BOOLEAN               Write
+  )
+{
+  UINT32                Crc;
+  BOOLEAN               New;
+  RecordPage            *Entry;
+  EMU_CALL_RECORD_PAGE  *Record;
+
+  Entry = RecordFindPage (Page);
+  if ((Entry == NULL) || ((Entry->Flags & RECORD_PAGE_SKIP) != 0)) {
+    return;
+  }
+
+  /*
+   * A page only needs to be looked at again once native code
+   * had a chance to change it (i.e. Generation moved).
+   */
+  New = Entry->Generation == 0;
+  if (New || (Entry->Generation != mRecordGeneration)) {
+    Entry->Generation = mRecordGeneration;
+    Crc               = CalculateCrc32 ((VOID *)(UINTN)Page, EFI_PAGE_SIZE);
+    if (New || (Crc != Entry->Crc)) {
+      Record = RecordAlloc (EmuRecordPage, Cpu->EmuMachineType, sizeof (*Record) + EFI_PAGE_SIZE);
+      if (Record != NULL) {
+        Record->Address = Page;
+        CopyMem (Record + 1, (VOID *)(UINTN)Page, EFI_PAGE_SIZE);
+      }
+    }
+
+    Entry->Crc = Crc;
+  }
+
+  /*
+   * Track pages modified by emulated code, so their checksum can be
+   * brought up to date before native code runs, otherwise they'd be
+   * needlessly snapshotted again on next access.
+   */
+  if (Write && ((Entry->Flags & RECORD_PAGE_DIRTY) == 0) &&
+      (mRecordDirtyCount < RECORD_DIRTY_MAX))
+  {
+    Entry->Flags                      |= RECORD_PAGE_DIRTY;
+    mRecordDirty[mRecordDirtyCount++] = Entry;
+  }
+}
+
+STATIC
+VOID
+RecordFlushDirty (
+  VOID
+  )
+{
+  UINTN       Index;
+  RecordPage  *Entry;
+
+  for (Index = 0; Index < mRecordDirtyCount; Index++) {
+    Entry         = mRecordDirty[Index];
+    Entry->Crc    = CalculateCrc32 ((VOID *)(UINTN)Entry->Page, EFI_PAGE_SIZE);
+    Entry->Flags &= ~RECORD_PAGE_DIRTY;
+  }
+
+  mRecordDirtyCount = 0;
+}
+
+/*
+ * About to run native code.
+ */
+STATIC
+VOID
+RecordLeaveEmulation (
+  VOID
+  )
+{
+  RecordFlushDirty ();
+}
+
+/*
+ * Native code ran, so any page could have changed.
+ */
+STATIC
+VOID
+RecordEnterEmulation (
+  VOID
+  )
+{
+  /*
+   * 0 is reserved for never seen pages.
+   */
+  if (++mRecordGeneration == 0) {
+    mRecordGeneration++;
+  }
+}
+
+/*
+ * For emulated accesses to [Address, Address + Size) done
+ * without Unicorn (and thus RecordMemCb) seeing them. Must
+ * be called before the access, with interrupts disabled.
+ */
+VOID
+RecordTouchRange (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Address,
+  IN  UINT64      Size,
+  IN  BOOLEAN     Write
+  )
+{
+  UINT64  Page;
+  UINT64  Last;
+
+  if (!RecordEnabled () || (Size == 0)) {
+    return;
+  }
+
+  Last = (Address + Size - 1) & ~EFI_PAGE_MASK;
+  for (Page = Address & ~EFI_PAGE_MASK; Page <= Last; Page += EFI_PAGE_SIZE) {
+    /*
+     * The emulated stack is handled by RecordNativeReturn.
+     */
+    if ((Page + EFI_PAGE_SIZE <= Cpu->EmuStackStart) || (Page >= Cpu->EmuStackTop)) {
+      RecordTouchPage (Cpu, Page, Write);
+    }
+  }
+}
+
+/*
+ * Only called from within uc_emu_start, so always with
+ * interrupts disabled.
+ */
+STATIC
+VOID
+RecordMemCb (
+  IN  uc_engine    *UE,
+  IN  uc_mem_type  Type,
+  IN  UINT64       Address,
+  IN  INT32        Size,
+  IN  INT64        Value,
+  IN  VOID         *UserData
+  )
+{
+  CpuContext  *Cpu = UserData;
+  UINT64      Last;
+
+  /*
+   * The emulated stack is handled by RecordNativeReturn.
+   */
+  if (!RecordEnabled () ||
+      ((Address >= Cpu->EmuStackStart) && (Address < Cpu->EmuStackTop)))
+  {
+    return;
+  }
+
+  Last = Address + Size - 1;
+  RecordTouchPage (Cpu, Address & ~EFI_PAGE_MASK, Type == UC_MEM_WRITE);
+  if (((Last ^ Address) & ~EFI_PAGE_MASK) != 0) {
+    RecordTouchPage (Cpu, Last & ~EFI_PAGE_MASK, Type == UC_MEM_WRITE);
+  }
+}
+
+VOID
+RecordEmuCall (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ProgramCounter,
+  IN  UINT64      *Args,
+  IN  UINT64      ReturnAddress
+  )
+{
+  BOOLEAN                   InterruptState;
+  EMU_CALL_RECORD_EMU_CALL  *Record;
+
+  if (!RecordEnabled ()) {
+    return;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  RecordEnterEmulation ();
+  Record = RecordAlloc (EmuRecordEmuCall, Cpu->EmuMachineType, sizeof (*Record));
+  if (Record != NULL) {
+    Record->ProgramCounter = ProgramCounter;
+    Record->StackPointer   = REG_READ (Cpu, Cpu->StackReg);
+    Record->ReturnAddress  = ReturnAddress;
+    CopyMem (Record->Args, Args, sizeof (Record->Args));
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+VOID
+RecordEmuReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  )
+{
+  BOOLEAN                     InterruptState;
+  EMU_CALL_RECORD_EMU_RETURN  *Record;
+
+  if (!RecordEnabled ()) {
+    return;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  RecordLeaveEmulation ();
+  Record = RecordAlloc (EmuRecordEmuReturn, Cpu->EmuMachineType, sizeof (*Record));
+  if (Record != NULL) {
+    Record->Ret = Ret;
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+VOID
+RecordNativeCall (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      ReturnAddress,
+  IN  UINT64      ProgramCounter,
+  IN  UINT64      *Args
+  )
+{
+  UINTN                        Depth;
+  UINT64                       StackPointer;
+  BOOLEAN                      InterruptState;
+  RecordStackWindow            *Window;
+  EMU_CALL_RECORD_NATIVE_CALL  *Record;
+
+  if (!RecordEnabled ()) {
+    return;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  RecordLeaveEmulation ();
+
+  StackPointer = REG_READ (Cpu, Cpu->StackReg);
+  Record       = RecordAlloc (EmuRecordNativeCall, Cpu->EmuMachineType, sizeof (*Record));
+  if (Record != NULL) {
+    Record->ProgramCounter = ProgramCounter;
+    Record->ReturnAddress  = ReturnAddress;
+    Record->StackPointer   = StackPointer;
+    CopyMem (Record->Args, Args, sizeof (Record->Args));
+  }
+
+  Depth = RecordDepth ();
+  ASSERT (Depth != 0);
+  if (Depth <= MAX_CPU_RUN_CONTEXTS) {
+    Window               = &mRecordWindows[Depth - 1];
+    Window->StackPointer = StackPointer;
+    Window->Size         = (UINT32)MIN (RECORD_STACK_WINDOW, Cpu->EmuStackTop - StackPointer);
+    CopyMem (Window->Bytes, (VOID *)(UINTN)StackPointer, Window->Size);
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+VOID
+RecordNativeReturn (
+  IN  CpuContext  *Cpu,
+  IN  UINT64      Ret
+  )
+{
+  UINTN                          Depth;
+  UINTN                          Index;
+  UINTN                          Start;
+  UINTN                          Size;
+  UINT32                         RunCount;
+  UINT8                          *Stack;
+  UINT8                          *Out;
+  BOOLEAN                        InterruptState;
+  RecordStackWindow              *Window;
+  EMU_CALL_RECORD_STACK_RUN      *Run;
+  EMU_CALL_RECORD_NATIVE_RETURN  *Record;
+
+  if (!RecordEnabled ()) {
+    return;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  RecordEnterEmulation ();
+
+  Depth  = RecordDepth ();
+  Window = NULL;
+  Stack  = NULL;
+  if ((Depth != 0) && (Depth <= MAX_CPU_RUN_CONTEXTS)) {
+    Window = &mRecordWindows[Depth - 1];
+  }
+
+  /*
+   * Two passes over the stack window: one to size
+   * the record, the other to fill it in.
+   */
+  RunCount = 0;
+  Size     = sizeof (*Record);
+  if (Window != NULL) {
+    Stack = (VOID *)(UINTN)Window->StackPointer;
+    for (Index = 0; Index < Window->Size; ) {
+      if (Stack[Index] == Window->Bytes[Index]) {
+        Index++;
+        continue;
+      }
+
+      for (Start = Index; Index < Window->Size &&
+           Stack[Index] != Window->Bytes[Index]; Index++) {
+      }
+
+      RunCount++;
+      Size += sizeof (*Run) + Index - Start;
+    }
+  }
+
+  Record = RecordAlloc (EmuRecordNativeReturn, Cpu->EmuMachineType, Size);
+  if (Record != NULL) {
+    Record->Ret          = Ret;
+    Record->StackPointer = (Window != NULL) ? Window->StackPointer : 0;
+    Record->RunCount     = RunCount;
+
+    Out = (VOID *)(Record + 1);
+    for (Index = 0; RunCount != 0 && Index < Window->Size; ) {
+      if (Stack[Index] == Window->Bytes[Index]) {
+        Index++;
+        continue;
+      }
+
+      for (Start = Index; Index < Window->Size &&
+           Stack[Index] != Window->Bytes[Index]; Index++) {
+      }
+
+      Run         = (VOID *)Out;
+      Run->Offset = (UINT16)Start;
+      Run->Length = (UINT16)(Index - Start);
+      CopyMem (Run + 1, Stack + Start, Run->Length);
+      Out += sizeof (*Run) + Run->Length;
+    }
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+VOID
+RecordImage (
+  IN  ImageRecord  *Image
+  )
+{
+  BOOLEAN                InterruptState;
+  EMU_CALL_RECORD_IMAGE  *Record;
+
+  if (!RecordEnabled ()) {
+    return;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  Record         = RecordAlloc (
+                     EmuRecordImage,
+                     Image->Cpu->EmuMachineType,
+                     sizeof (*Record) + Image->ImageSize
+                     );
+  if (Record != NULL) {
+    Record->ImageBase  = Image->ImageBase;
+    Record->ImageSize  = Image->ImageSize;
+    Record->ImageEntry = Image->ImageEntry;
+    CopyMem (Record + 1, (VOID *)(UINTN)Image->ImageBase, Image->ImageSize);
+  }
+
+  SetInterruptState (InterruptState);
+}
+
+EFI_STATUS
+RecordCpuInit (
+  IN  CpuContext  *Cpu
+  )
+{
+  uc_err               UcErr;
+  uc_hook              MemHook;
+  BOOLEAN              InterruptState;
+  EMU_CALL_RECORD_CPU  *Record;
+
+  if (mRecordHeader == NULL) {
+    return EFI_SUCCESS;
+  }
+
+  UcErr = uc_hook_add (
+            Cpu->UE,
+            &MemHook,
+            UC_HOOK_MEM_READ | UC_HOOK_MEM_WRITE,
+            RecordMemCb,
+            Cpu,
+            1,
+            0
+            );
+  if (UcErr != UC_ERR_OK) {
+    DEBUG ((DEBUG_ERROR, "Record hook failed: %a\n", uc_strerror (UcErr)));
+    return EFI_UNSUPPORTED;
+  }
+
+  InterruptState = SaveAndDisableInterrupts ();
+  Record         = RecordAlloc (EmuRecordCpu, Cpu->EmuMachineType, sizeof (*Record));
+  if (Record != NULL) {
+    Record->StackStart = Cpu->EmuStackStart;
+    Record->StackTop   = Cpu->EmuStackTop;
+  }
+
+  SetInterruptState (InterruptState);
+  return EFI_SUCCESS;
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+RecordSetEnabled (
+  IN  BOOLEAN  Enabled
+  )
+{
+  BOOLEAN  WasEnabled;
+  BOOLEAN  InterruptState;
+
+  InterruptState = SaveAndDisableInterrupts ();
+  WasEnabled     = (mRecordHeader->Flags & EMU_CALL_RECORD_FLAG_ENABLED) != 0;
+
+  /*
+   * A recording that ran out of space can't be continued.
+   */
+  if (Enabled && ((mRecordHeader->Flags & EMU_CALL_RECORD_FLAG_OVERFLOW) == 0)) {
+    mRecordHeader->Flags |= EMU_CALL_RECORD_FLAG_ENABLED;
+  } else {
+    mRecordHeader->Flags &= ~EMU_CALL_RECORD_FLAG_ENABLED;
+  }
+
+  SetInterruptState (InterruptState);
+  return WasEnabled;
+}
+
+STATIC EMU_CALL_RECORD_PROTOCOL  mEmuCallRecordProtocol = {
+  EMU_CALL_RECORD_VERSION,
+  NULL,
+  RecordSetEnabled
+};
+
+STATIC
+VOID
+RecordFree (
+  VOID
+  )
+{
+  if (mRecordHeader != NULL) {
+    FreePages (mRecordHeader, EFI_SIZE_TO_PAGES (mRecordHeader->BufferSize));
+    mRecordHeader = NULL;
+  }
+
+  if (mRecordPages != NULL) {
+    FreePool (mRecordPages);
+    mRecordPages = NULL;
+  }
+}
+
+VOID
+RecordInit (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       BufferSize;
+
+  /*
+   * Recording is best effort, and never prevents the emulator
+   * from starting.
+   */
+  mRecordPages = AllocateZeroPool (sizeof (*mRecordPages) << RECORD_PAGE_BITS);
+  for (BufferSize = RECORD_BUFFER_SIZE; mRecordPages != NULL &&
+       BufferSize >= RECORD_BUFFER_SIZE_MIN; BufferSize /= 2)
+  {
+    mRecordHeader = AllocatePages (EFI_SIZE_TO_PAGES (BufferSize));
+    if (mRecordHeader != NULL) {
+      break;
+    }
+  }
+
+  if (mRecordHeader == NULL) {
+    DEBUG ((DEBUG_ERROR, "Couldn't allocate call recording buffer\n"));
+    RecordFree ();
+    return;
+  }
+
+  ZeroMem (mRecordHeader, sizeof (*mRecordHeader));
+  mRecordData       = (VOID *)(mRecordHeader + 1);
+  mRecordGeneration = 1;
+
+  mRecordHeader->Signature       = EMU_CALL_RECORD_SIGNATURE;
+  mRecordHeader->Version         = EMU_CALL_RECORD_VERSION;
+  mRecordHeader->HeaderSize      = sizeof (EMU_CALL_RECORD_HEADER);
+  mRecordHeader->BufferSize      = BufferSize;
+  mRecordHeader->Flags           = EMU_CALL_RECORD_FLAG_ENABLED;
+  mRecordHeader->HostMachineType = HOST_MACHINE_TYPE;
+  mRecordHeader->Frequency       = GetPerformanceCounterProperties (
+                                     &mRecordHeader->CounterStart,
+                                     &mRecordHeader->CounterEnd
+                                     );
+
+  mEmuCallRecordProtocol.Header = mRecordHeader;
+  Status                        = gBS->InstallProtocolInterface (
+                                         &ImageHandle,
+                                         &mEmuCallRecordProtocolGuid,
+                                         EFI_NATIVE_INTERFACE,
+                                         &mEmuCallRecordProtocol
+                                         );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "InstallProtocolInterface failed: %r\n", Status));
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "Call recording buffer at %p (0x%lx bytes)\n",
+    mRecordHeader,
+    (UINT64)BufferSize
+    ));
+}
+
+VOID
+RecordCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  if (mRecordHeader == NULL) {
+    return;
+  }
+
+  gBS->UninstallProtocolInterface (
+         ImageHandle,
+         &mEmuCallRecordProtocolGuid,
+         &mEmuCallRecordProtocol
+         );
+  RecordFree ();
+}
+
+#endif /* MAU_CALL_RECORD */
@@ -0,0 +1,400 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <unicorn.h>
+#include "Emulator.h"
+
+/*
+ * Unicorn runs each iteration of a rep movs/stos as a separate TB
+ * execution, starting at the rep instruction itself (the first
+ * iteration may be part of an earlier TB). So a UC_HOOK_BLOCK hook
+ * sees every TB starting with a rep movs/stos, and can do all the
+ * remaining iterations at once with CopyMem/SetMem, leaving RCX at 0
+ * so the instruction completes without doing anything more. Neither
+ * instruction affects flags.
+ *
+ * Only plain forms (no segment or address size overrides) with DF
+ * clear are handled, and only when everything accessed is RAM (not
+ * MMIO, where access sizes matter), isn't the NULL page, and isn't
+ * code (writes to which must be seen by Unicorn).
+ *
+ * rep ins/outs are handled the same way, as a single FIFO port
+ * access (PioReadFifo/PioWriteFifo) on the RAM buffer, instead of
+ * a Unicorn I/O callback and a CpuIo2 call per element.
+ *
+ * The hook only covers x64 images, on every x64 engine, so TBs
+ * elsewhere don't pay for the callback. As memory is accessed
+ * without Unicorn, the call recorder is told about it.
+ */
+
+#ifdef MAU_X64_REP_STRINGS
+
+#ifndef MAU_SUPPORTS_X64_BINS
+  #error "MAU_X64_REP_STRINGS requires MAU_SUPPORTS_X64_BINS"
+#endif /* MAU_SUPPORTS_X64_BINS */
+
+#define X86_PREFIX_REP      0xF3
+#define X86_PREFIX_OPSIZE   0x66
+#define X86_REX_MASK        0xF0
+#define X86_REX             0x40
+#define X86_REX_W           BIT3
+#define X86_OP_MOVSB        0xA4
+#define X86_OP_MOVS         0xA5
+#define X86_OP_STOSB        0xAA
+#define X86_OP_STOS         0xAB
+#define X86_OP_INSB         0x6C
+#define X86_OP_INS          0x6D
+#define X86_OP_OUTSB        0x6E
+#define X86_OP_OUTS         0x6F
+#define X86_EFLAGS_DF       BIT10
+#define X86_REP_MAX_PREFIX  3
+
+struct RepStringImage {
+  /*
+   * One per x64 engine (see CPU_NEXT_ENGINE).
+   */
+  uc_hook    Hooks[1 + CPU_ENGINE_POOL_SIZE];
+};
+
+STATIC UINTN  mRepStringOps;
+STATIC UINTN  mRepIoOps;
+
+STATIC
+BOOLEAN
+RepStringIsPlainRam (
+  IN  UINT64  Address,
+  IN  UINT64  Size
+  )
+{
+  if (Address < EFI_PAGE_SIZE) {
+    return FALSE;
+  }
+
+  if (!RamIsRange (Address, Size)) {
+    return FALSE;
+  }
+
+  if ((ImageFindByRange (Address, Size) != NULL) ||
+      CpuRangeIsCodeGen (Address, Size))
+  {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+STATIC
+VOID
+RepStringIo (
+  IN  CpuContext  *Cpu,
+  IN  UINT8       Opcode,
+  IN  UINTN       ElementSize,
+  IN  UINT64      Count
+  )
+{
+  UINT64  Length;
+  UINT64  Rsi;
+  UINT64  Rdi;
+  UINT32  Port;
+
+  /*
+   * REX.W doesn't make port I/O 64-bit.
+   */
+  if ((Opcode == X86_OP_INSB) || (Opcode == X86_OP_OUTSB)) {
+    ElementSize = 1;
+  } else if (ElementSize == 8) {
+    ElementSize = 4;
+  }
+
+  if (Count > (MAX_UINTN / ElementSize)) {
+    return;
+  }
+
+  Length = Count * ElementSize;
+  Port   = (UINT16)REG_READ (Cpu, UC_X86_REG_RDX);
+  if (Opcode <= X86_OP_INS) {
+    Rdi = REG_READ (Cpu, UC_X86_REG_RDI);
+    if (!RepStringIsPlainRam (Rdi, Length) || ((Rdi & (ElementSize - 1)) != 0)) {
+      return;
+    }
+
+ #ifdef MAU_CALL_RECORD
+    RecordTouchRange (Cpu, Rdi, Length, TRUE);
+ #endif /* MAU_CALL_RECORD */
+    PioReadFifo (Port, (UINT32)ElementSize, Count, (VOID *)Rdi);
+    REG_WRITE (Cpu, UC_X86_REG_RDI, Rdi + Length);
+  } else {
+    Rsi = REG_READ (Cpu, UC_X86_REG_RSI);
+    if (!RamIsRange (Rsi, Length) || (Rsi < EFI_PAGE_SIZE) ||
+        ((Rsi & (ElementSize - 1)) != 0))
+    {
+      return;
+    }
+
+ #ifdef MAU_CALL_RECORD
+    RecordTouchRange (Cpu, Rsi, Length, FALSE);
+ #endif /* MAU_CALL_RECORD */
+    PioWriteFifo (Port, (UINT32)ElementSize, Count, (VOID *)Rsi);
+    REG_WRITE (Cpu, UC_X86_REG_RSI, Rsi + Length);
+  }
+
+  REG_WRITE (Cpu, UC_X86_REG_RCX, 0);
+  mRepIoOps++;
+}
+
+/*
+ * Only called from within uc_emu_start, so always with
+ * interrupts disabled.
+ */
+STATIC
+VOID
+RepStringCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Address,
+  IN  UINT32     Size,
+  IN  VOID       *UserData
+  )
+{
+  CpuContext  *Cpu = UserData;
+  UINT8       *Insn;
+  UINTN       Index;
+  UINT8       Opcode;
+  UINTN       ElementSize;
+  UINT64      Count;
+  UINT64      Length;
+  UINT64      Rsi;
+  UINT64      Rdi;
+  UINT64      Rax;
+
+  /*
+   * Code ranges are identity mapped.
+   */
+  Insn = (UINT8 *)Address;
+  if ((Size < 2) || (Insn[0] != X86_PREFIX_REP)) {
+    return;
+  }
+
+  ElementSize = 4;
+  for (Index = 1; Index < MIN (Size, X86_REP_MAX_PREFIX); Index++) {
+    if (Insn[Index] == X86_PREFIX_OPSIZE) {
+      ElementSize = 2;
+    } else if ((Insn[Index] & X86_REX_MASK) == X86_REX) {
+      if ((Insn[Index] & X86_REX_W) != 0) {
+        ElementSize = 8;
+      }
+
+      /*
+       * REX is always the last prefix.
+       */
+      Index++;
+      break;
+    } else {
+      break;
+    }
+  }
+
+  if (Index >= Size) {
+    return;
+  }
+
+  Opcode = Insn[Index];
+  if ((Opcode == X86_OP_MOVSB) || (Opcode == X86_OP_STOSB)) {
+    ElementSize = 1;
+  } else if ((Opcode != X86_OP_MOVS) && (Opcode != X86_OP_STOS) &&
+             ((Opcode < X86_OP_INSB) || (Opcode > X86_OP_OUTS)))
+  {
+    return;
+  }
+
+  if ((REG_READ (Cpu, UC_X86_REG_EFLAGS) & X86_EFLAGS_DF) != 0) {
+    return;
+  }
+
+  Count = REG_READ (Cpu, UC_X86_REG_RCX);
+  if (Count == 0) {
+    return;
+  }
+
+  if ((Opcode >= X86_OP_INSB) && (Opcode <= X86_OP_OUTS)) {
+    RepStringIo (Cpu, Opcode, ElementSize, Count);
+    return;
+  }
+
+  if (Count > (MAX_UINT64 / ElementSize)) {
+    return;
+  }
+
+  Length = Count * ElementSize;
+  Rdi    = REG_READ (Cpu, UC_X86_REG_RDI);
+  if (!RepStringIsPlainRam (Rdi, Length)) {
+    return;
+  }
+
+  /*
+   * SetMem16 and friends want aligned buffers.
+   */
+  if ((Rdi & (ElementSize - 1)) != 0) {
+    return;
+  }
+
+  if ((Opcode == X86_OP_MOVSB) || (Opcode == X86_OP_MOVS)) {
+    Rsi = REG_READ (Cpu, UC_X86_REG_RSI);
+    if (!RamIsRange (Rsi, Length) || (Rsi < EFI_PAGE_SIZE)) {
+      return;
+    }
+
+    /*
+     * A forward copy onto a later part of the source (e.g.
+     * the rep movsb pattern fill idiom) isn't a memmove.
+     */
+    if ((Rdi > Rsi) && (Rdi < Rsi + Length)) {
+      return;
+    }
+
+ #ifdef MAU_CALL_RECORD
+    RecordTouchRange (Cpu, Rsi, Length, FALSE);
+    RecordTouchRange (Cpu, Rdi, Length, TRUE);
+ #endif /* MAU_CALL_RECORD */
+    CopyMem ((VOID *)Rdi, (VOID *)Rsi, Length);
+    REG_WRITE (Cpu, UC_X86_REG_RSI, Rsi + Length);
+  } else {
+ #ifdef MAU_CALL_RECORD
+    RecordTouchRange (Cpu, Rdi, Length, TRUE);
+ #endif /* MAU_CALL_RECORD */
+    Rax = REG_READ (Cpu, UC_X86_REG_RAX);
+    switch (ElementSize) {
+      case 1:
+        SetMem ((VOID *)Rdi, Length, (UINT8)Rax);
+        break;
+      case 2:
+        SetMem16 ((VOID *)Rdi, Length, (UINT16)Rax);
+        break;
+      case 4:
+        SetMem32 ((VOID *)Rdi, Length, (UINT32)Rax);
+        break;
+      default:
+        SetMem64 ((VOID *)Rdi, Length, Rax);
+        break;
+    }
+  }
+
+  REG_WRITE (Cpu, UC_X86_REG_RDI, Rdi + Length);
+  REG_WRITE (Cpu, UC_X86_REG_RCX, 0);
+  mRepStringOps++;
+}
+
+/*
+ * Removes the hooks of the first Count engines. Not safe
+ * to call while we are in JIT (uc_emu_start).
+ */
+STATIC
+VOID
+RepStringHooksDel (
+  IN  ImageRecord  *Record,
+  IN  UINTN        Count
+  )
+{
+  UINTN       Index;
+  CpuContext  *Engine;
+
+  for (Engine = Record->Cpu, Index = 0;
+       Engine != NULL && Index < Count;
+       Engine = CPU_NEXT_ENGINE (Engine), Index++)
+  {
+    uc_hook_del (Engine->UE, Record->RepString->Hooks[Index]);
+  }
+}
+
+VOID
+RepStringImageRegister (
+  IN  ImageRecord  *Record
+  )
+{
+  uc_err          UcErr;
+  UINTN           Index;
+  CpuContext      *Engine;
+  RepStringImage  *RepString;
+
+  Record->RepString = NULL;
+  if (Record->Cpu->EmuMachineType != EFI_IMAGE_MACHINE_X64) {
+    return;
+  }
+
+  RepString = AllocateZeroPool (sizeof (*RepString));
+  if (RepString == NULL) {
+    return;
+  }
+
+  Record->RepString = RepString;
+
+  /*
+   * uc_hook_add is not safe to call while we are in JIT (uc_emu_start).
+   */
+  UcErr = UC_ERR_OK;
+  CriticalBegin ();
+  for (Engine = Record->Cpu, Index = 0;
+       Engine != NULL;
+       Engine = CPU_NEXT_ENGINE (Engine), Index++)
+  {
+    ASSERT (Index < ARRAY_SIZE (RepString->Hooks));
+    UcErr = uc_hook_add (
+              Engine->UE,
+              &RepString->Hooks[Index],
+              UC_HOOK_BLOCK,
+              RepStringCb,
+              Engine,
+              Record->ImageBase,
+              Record->ImageBase + Record->ImageSize - 1
+              );
+    if (UcErr != UC_ERR_OK) {
+      break;
+    }
+  }
+
+  if (UcErr != UC_ERR_OK) {
+    RepStringHooksDel (Record, Index);
+  }
+
+  CriticalEnd ();
+  if (UcErr != UC_ERR_OK) {
+    DEBUG ((DEBUG_ERROR, "rep string hook failed: %a\n", uc_strerror (UcErr)));
+    FreePool (RepString);
+    Record->RepString = NULL;
+  }
+}
+
+VOID
+RepStringImageUnregister (
+  IN  ImageRecord  *Record
+  )
+{
+  if (Record->RepString == NULL) {
+    return;
+  }
+
+  CriticalBegin ();
+  RepStringHooksDel (Record, ARRAY_SIZE (Record->RepString->Hooks));
+  CriticalEnd ();
+
+  FreePool (Record->RepString);
+  Record->RepString = NULL;
+}
+
+VOID
+RepStringGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->X64RepStringOps = mRepStringOps;
+  DebugState->X64RepIoOps     = mRepIoOps;
+}
+
+#endif /* MAU_X64_REP_STRINGS */
@@ -0,0 +1,306 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Protocol/SimpleNetwork.h>
+
+/*
+ * MnpDxe (and anything busy-polling, like PXE) keeps calling SNP
+ * Receive and GetStatus even when the link is idle, each being
+ * an emulated call for an emulated NIC driver.
+ *
+ * For SNP instances installed by emulated drivers, Receive,
+ * Transmit and GetStatus are replaced with native functions:
+ * - After SNP_IDLE_POLLS EFI_NOT_READY results in a row, Receive
+ *   returns EFI_NOT_READY without calling the emulated Receive
+ *   until a backoff period has passed. The backoff doubles (up to
+ *   SNP_BACKOFF_MAX_NS) while the emulated Receive keeps returning
+ *   EFI_NOT_READY, and is dropped as soon as a packet is received
+ *   or one is transmitted (as a reply is then likely).
+ * - Transmitted buffers are counted, and a GetStatus call that only
+ *   asks for a recycled transmit buffer gets NULL right away when
+ *   no transmit is outstanding.
+ */
+
+#ifdef MAU_SNP_THROTTLE
+
+#define SNP_IDLE_POLLS      8
+#define SNP_BACKOFF_MIN_NS  50000ULL
+#define SNP_BACKOFF_MAX_NS  2000000ULL
+
+typedef struct {
+  PatchedInterface    Header;
+  UINTN               IdlePolls;
+  UINT64              BackoffNs;
+  UINT64              NextPollNs;
+  UINTN               TxPending;
+} SNP_THROTTLE_RECORD;
+
+/*
+ * Indices into SNP_THROTTLE_RECORD.Header.Emulated.
+ */
+#define SNP_THROTTLE_RECEIVE     0
+#define SNP_THROTTLE_TRANSMIT    1
+#define SNP_THROTTLE_GET_STATUS  2
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleReceive (
+  IN     EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT    UINTN                        *HeaderSize OPTIONAL,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  OUT    EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  OUT    UINT16                       *Protocol OPTIONAL
+  );
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleTransmit (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  IN  UINTN                        HeaderSize,
+  IN  UINTN                        BufferSize,
+  IN  VOID                         *Buffer,
+  IN  EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  IN  EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  IN  UINT16                       *Protocol OPTIONAL
+  );
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleGetStatus (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT UINT32                       *InterruptStatus OPTIONAL,
+  OUT VOID                         **TxBuf OPTIONAL
+  );
+
+STATIC PatchedInterfaceConfig  mSnpThrottlePatch = {
+  INITIALIZE_LIST_HEAD_VARIABLE (mSnpThrottlePatch.List),
+  "SNP throttle",
+  &gEfiSimpleNetworkProtocolGuid,
+  sizeof (SNP_THROTTLE_RECORD),
+  3,
+  {
+    OFFSET_OF (EFI_SIMPLE_NETWORK_PROTOCOL, Receive),
+    OFFSET_OF (EFI_SIMPLE_NETWORK_PROTOCOL, Transmit),
+    OFFSET_OF (EFI_SIMPLE_NETWORK_PROTOCOL, GetStatus)
+  },
+  {
+    (VOID *)SnpThrottleReceive,
+    (VOID *)SnpThrottleTransmit,
+    (VOID *)SnpThrottleGetStatus
+  }
+};
+
+STATIC UINTN  mSnpPollsSkipped;
+STATIC UINTN  mSnpStatusSkipped;
+
+STATIC
+SNP_THROTTLE_RECORD *
+SnpThrottleFind (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *Snp
+  )
+{
+  return (VOID *)PatchedInterfaceFind (&mSnpThrottlePatch, Snp);
+}
+
+STATIC
+VOID
+SnpThrottleReset (
+  IN  SNP_THROTTLE_RECORD  *Record
+  )
+{
+  Record->IdlePolls = 0;
+  Record->BackoffNs = 0;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleReceive (
+  IN     EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT    UINTN                        *HeaderSize OPTIONAL,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  OUT    EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  OUT    UINT16                       *Protocol OPTIONAL
+  )
+{
+  SNP_THROTTLE_RECORD  *Record;
+  UINT64               Now;
+  EFI_STATUS           Status;
+
+  Record = SnpThrottleFind (This);
+  ASSERT (Record != NULL);
+  if (Record == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  Now = GetTimeInNanoSecond (GetPerformanceCounter ());
+  if ((Record->BackoffNs != 0) && (Now < Record->NextPollNs)) {
+    mSnpPollsSkipped++;
+    return EFI_NOT_READY;
+  }
+
+  {
+    UINT64  Args[MAX_ARGS] = {
+      (UINT64)This,    (UINT64)HeaderSize, (UINT64)BufferSize, (UINT64)Buffer,
+      (UINT64)SrcAddr, (UINT64)DestAddr,   (UINT64)Protocol
+    };
+
+    Status = PatchedInterfaceCall (&Record->Header, SNP_THROTTLE_RECEIVE, Args);
+  }
+
+  if (Status != EFI_NOT_READY) {
+    SnpThrottleReset (Record);
+    return Status;
+  }
+
+  Record->IdlePolls++;
+  if (Record->IdlePolls >= SNP_IDLE_POLLS) {
+    if (Record->BackoffNs == 0) {
+      Record->BackoffNs = SNP_BACKOFF_MIN_NS;
+    } else {
+      Record->BackoffNs = MIN (Record->BackoffNs * 2, SNP_BACKOFF_MAX_NS);
+    }
+
+    Record->NextPollNs = Now + Record->BackoffNs;
+  }
+
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleTransmit (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  IN  UINTN                        HeaderSize,
+  IN  UINTN                        BufferSize,
+  IN  VOID                         *Buffer,
+  IN  EFI_MAC_ADDRESS              *SrcAddr OPTIONAL,
+  IN  EFI_MAC_ADDRESS              *DestAddr OPTIONAL,
+  IN  UINT16                       *Protocol OPTIONAL
+  )
+{
+  SNP_THROTTLE_RECORD  *Record;
+  EFI_STATUS           Status;
+
+  Record = SnpThrottleFind (This);
+  ASSERT (Record != NULL);
+  if (Record == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  {
+    UINT64  Args[MAX_ARGS] = {
+      (UINT64)This,    HeaderSize,       BufferSize, (UINT64)Buffer,
+      (UINT64)SrcAddr, (UINT64)DestAddr, (UINT64)Protocol
+    };
+
+    Status = PatchedInterfaceCall (&Record->Header, SNP_THROTTLE_TRANSMIT, Args);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    CriticalBegin ();
+    Record->TxPending++;
+    CriticalEnd ();
+  }
+
+  SnpThrottleReset (Record);
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SnpThrottleGetStatus (
+  IN  EFI_SIMPLE_NETWORK_PROTOCOL  *This,
+  OUT UINT32                       *InterruptStatus OPTIONAL,
+  OUT VOID                         **TxBuf OPTIONAL
+  )
+{
+  SNP_THROTTLE_RECORD  *Record;
+  EFI_STATUS           Status;
+
+  Record = SnpThrottleFind (This);
+  ASSERT (Record != NULL);
+  if (Record == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  /*
+   * Recycling transmit buffers, with nothing to recycle. Both
+   * being NULL is invalid, so let the emulated driver say so.
+   */
+  if ((InterruptStatus == NULL) && (TxBuf != NULL) &&
+      (Record->TxPending == 0))
+  {
+    mSnpStatusSkipped++;
+    *TxBuf = NULL;
+    return EFI_SUCCESS;
+  }
+
+  {
+    UINT64  Args[MAX_ARGS] = {
+      (UINT64)This, (UINT64)InterruptStatus, (UINT64)TxBuf
+    };
+
+    Status = PatchedInterfaceCall (&Record->Header, SNP_THROTTLE_GET_STATUS, Args);
+  }
+
+  if (!EFI_ERROR (Status) && (TxBuf != NULL) && (*TxBuf != NULL)) {
+    CriticalBegin ();
+    if (Record->TxPending != 0) {
+      Record->TxPending--;
+    }
+
+    CriticalEnd ();
+  }
+
+  return Status;
+}
+
+/*
+ * Called for interfaces installed by emulated code.
+ */
+VOID
+SnpThrottlePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  )
+{
+  PatchedInterfacePatch (&mSnpThrottlePatch, Protocol, Interface);
+}
+
+VOID
+SnpThrottleImageUnregister (
+  IN  ImageRecord  *Image
+  )
+{
+  PatchedInterfaceImageUnregister (&mSnpThrottlePatch, Image);
+}
+
+VOID
+SnpThrottleGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->SnpPollsSkipped  = mSnpPollsSkipped;
+  DebugState->SnpStatusSkipped = mSnpStatusSkipped;
+}
+
+#endif /* MAU_SNP_THROTTLE */
@@ -0,0 +1,382 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+
+/*
+ * ConnectController calls the Supported function of every driver
+ * for the controller, and ConnectAll does that for every handle.
+ * For emulated drivers, that's an emulated call each, mostly
+ * returning EFI_UNSUPPORTED after an OpenProtocol or two.
+ *
+ * For DriverBinding instances installed by emulated drivers,
+ * Supported is replaced with SupportedCacheSupported, which
+ * remembers EFI_UNSUPPORTED results per (driver, controller).
+ * A cached result is only used while the controller looks the
+ * same as when it was obtained: same protocols, same interfaces
+ * and same agents having them open. Any protocol installed,
+ * reinstalled or uninstalled on the controller, and any driver
+ * starting or stopping on it, invalidates the result. Checking
+ * this is all native, and much cheaper than the emulated call.
+ *
+ * Calls with a RemainingDevicePath are never cached.
+ */
+
+#ifdef MAU_SUPPORTED_CACHE
+
+#define SUPPORTED_CACHE_BUCKETS    256
+#define SUPPORTED_CACHE_ENTRIES    256
+#define SUPPORTED_CACHE_SIGNATURE  SIGNATURE_32 ('S', 'U', 'P', 'C')
+#define SUPPORTED_CACHE_HASH(Driver, Controller)                 \
+  (((((UINTN)(Driver)) >> 4) ^ (((UINTN)(Controller)) >> 4)) %   \
+   SUPPORTED_CACHE_BUCKETS)
+
+typedef struct {
+  /*
+   * Managed by ObjectAlloc.
+   */
+  ObjectHeader        Header;
+  LIST_ENTRY          Link;
+  PatchedInterface    *Driver;
+  EFI_HANDLE          Controller;
+  UINT64              Fingerprint;
+} SUPPORTED_CACHE_ENTRY;
+
+STATIC
+EFI_STATUS
+EFIAPI
+SupportedCacheSupported (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath OPTIONAL
+  );
+
+STATIC PatchedInterfaceConfig  mSupportedCachePatch = {
+  INITIALIZE_LIST_HEAD_VARIABLE (mSupportedCachePatch.List),
+  "Supported",
+  &gEfiDriverBindingProtocolGuid,
+  sizeof (PatchedInterface),
+  1,
+  { OFFSET_OF (EFI_DRIVER_BINDING_PROTOCOL, Supported) },
+  { (VOID *)SupportedCacheSupported }
+};
+
+STATIC LIST_ENTRY          mSupportedCache[SUPPORTED_CACHE_BUCKETS];
+STATIC ObjectAllocContext  *mSupportedCacheAlloc;
+STATIC UINTN               mSupportedCacheHits;
+STATIC UINTN               mSupportedEmulated;
+
+STATIC
+SUPPORTED_CACHE_ENTRY *
+SupportedCacheFind (
+  IN  PatchedInterface  *Driver,
+  IN  EFI_HANDLE        Controller
+  )
+{
+  LIST_ENTRY             *Bucket;
+  LIST_ENTRY             *Entry;
+  SUPPORTED_CACHE_ENTRY  *CacheEntry;
+
+  Bucket = &mSupportedCache[SUPPORTED_CACHE_HASH (Driver, Controller)];
+  for (Entry = GetFirstNode (Bucket);
+       !IsNull (Bucket, Entry);
+       Entry = GetNextNode (Bucket, Entry))
+  {
+    CacheEntry = BASE_CR (Entry, SUPPORTED_CACHE_ENTRY, Link);
+    if ((CacheEntry->Driver == Driver) &&
+        (CacheEntry->Controller == Controller))
+    {
+      return CacheEntry;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+UINT64
+SupportedCacheMix (
+  IN  UINT64  Fingerprint,
+  IN  UINT64  Value
+  )
+{
+  return (Fingerprint ^ Value) * 0x100000001B3ULL;
+}
+
+/*
+ * Returns a value that changes whenever protocols on the controller,
+ * or their open state, change, or 0 if the controller is gone.
+ */
+STATIC
+UINT64
+SupportedCacheFingerprint (
+  IN  EFI_HANDLE  Controller
+  )
+{
+  EFI_STATUS                           Status;
+  EFI_GUID                             **Guids;
+  UINTN                                GuidCount;
+  UINTN                                GuidIndex;
+  EFI_OPEN_PROTOCOL_INFORMATION_ENTRY  *Info;
+  UINTN                                InfoCount;
+  UINTN                                InfoIndex;
+  VOID                                 *Interface;
+  UINT64                               Fingerprint;
+
+  Status = gBS->ProtocolsPerHandle (Controller, &Guids, &GuidCount);
+  if (EFI_ERROR (Status)) {
+    return 0;
+  }
+
+  Fingerprint = SupportedCacheMix (0xCBF29CE484222325ULL, GuidCount);
+  for (GuidIndex = 0; GuidIndex < GuidCount; GuidIndex++) {
+    Fingerprint = SupportedCacheMix (Fingerprint, ReadUnaligned64 ((VOID *)Guids[GuidIndex]));
+    Fingerprint = SupportedCacheMix (Fingerprint, ReadUnaligned64 ((VOID *)((UINT8 *)Guids[GuidIndex] + 8)));
+
+    Status = gBS->HandleProtocol (Controller, Guids[GuidIndex], &Interface);
+    if (!EFI_ERROR (Status)) {
+      Fingerprint = SupportedCacheMix (Fingerprint, (UINT64)Interface);
+    }
+
+    Status = gBS->OpenProtocolInformation (Controller, Guids[GuidIndex], &Info, &InfoCount);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    for (InfoIndex = 0; InfoIndex < InfoCount; InfoIndex++) {
+      Fingerprint = SupportedCacheMix (Fingerprint, (UINT64)Info[InfoIndex].AgentHandle);
+      Fingerprint = SupportedCacheMix (Fingerprint, (UINT64)Info[InfoIndex].ControllerHandle);
+      Fingerprint = SupportedCacheMix (Fingerprint, Info[InfoIndex].Attributes);
+    }
+
+    FreePool (Info);
+  }
+
+  FreePool (Guids);
+  return Fingerprint | 1;
+}
+
+STATIC
+VOID
+SupportedCacheUpdate (
+  IN  PatchedInterface  *Driver,
+  IN  EFI_HANDLE        Controller,
+  IN  UINT64            Fingerprint,
+  IN  EFI_STATUS        Status
+  )
+{
+  SUPPORTED_CACHE_ENTRY  *CacheEntry;
+  ObjectHeader           *Object;
+
+  CriticalBegin ();
+  CacheEntry = SupportedCacheFind (Driver, Controller);
+  if (CacheEntry != NULL) {
+    if (Status == EFI_UNSUPPORTED) {
+      CacheEntry->Fingerprint = Fingerprint;
+      CacheEntry              = NULL;
+    } else {
+      RemoveEntryList (&CacheEntry->Link);
+    }
+
+    CriticalEnd ();
+    if (CacheEntry != NULL) {
+      ObjectFree (mSupportedCacheAlloc, &CacheEntry->Header);
+    }
+
+    return;
+  }
+
+  CriticalEnd ();
+
+  /*
+   * Not in the critical section, as the cache may need to grow.
+   */
+  if ((Status != EFI_UNSUPPORTED) ||
+      EFI_ERROR (ObjectAlloc (mSupportedCacheAlloc, &Object)))
+  {
+    return;
+  }
+
+  CacheEntry              = (VOID *)Object;
+  CacheEntry->Driver      = Driver;
+  CacheEntry->Controller  = Controller;
+  CacheEntry->Fingerprint = Fingerprint;
+
+  CriticalBegin ();
+  if (SupportedCacheFind (Driver, Controller) == NULL) {
+    InsertTailList (
+      &mSupportedCache[SUPPORTED_CACHE_HASH (Driver, Controller)],
+      &CacheEntry->Link
+      );
+    CacheEntry = NULL;
+  }
+
+  CriticalEnd ();
+
+  if (CacheEntry != NULL) {
+    ObjectFree (mSupportedCacheAlloc, &CacheEntry->Header);
+  }
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SupportedCacheSupported (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath OPTIONAL
+  )
+{
+  PatchedInterface       *Driver;
+  SUPPORTED_CACHE_ENTRY  *CacheEntry;
+  UINT64                 Fingerprint;
+  BOOLEAN                Hit;
+  EFI_STATUS             Status;
+
+  Driver = PatchedInterfaceFind (&mSupportedCachePatch, This);
+  ASSERT (Driver != NULL);
+  if (Driver == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  /*
+   * ConnectController can also be called from notifications
+   * (up to TPL_CALLBACK), e.g. by bus drivers handling hot-plug.
+   */
+  Fingerprint = 0;
+  if (RemainingDevicePath == NULL) {
+    Fingerprint = SupportedCacheFingerprint (ControllerHandle);
+  }
+
+  if (Fingerprint != 0) {
+    CriticalBegin ();
+    CacheEntry = SupportedCacheFind (Driver, ControllerHandle);
+    Hit        = (CacheEntry != NULL) && (CacheEntry->Fingerprint == Fingerprint);
+    CriticalEnd ();
+
+    if (Hit) {
+      mSupportedCacheHits++;
+      return EFI_UNSUPPORTED;
+    }
+  }
+
+  {
+    UINT64  Args[MAX_ARGS] = {
+      (UINT64)This, (UINT64)ControllerHandle, (UINT64)RemainingDevicePath
+    };
+
+    mSupportedEmulated++;
+    Status = PatchedInterfaceCall (Driver, 0, Args);
+  }
+
+  if (Fingerprint != 0) {
+    SupportedCacheUpdate (Driver, ControllerHandle, Fingerprint, Status);
+  }
+
+  return Status;
+}
+
+STATIC
+VOID
+SupportedCacheInit (
+  VOID
+  )
+{
+  EFI_STATUS         Status;
+  UINTN              Bucket;
+  ObjectAllocConfig  AllocConfig;
+
+  for (Bucket = 0; Bucket < SUPPORTED_CACHE_BUCKETS; Bucket++) {
+    InitializeListHead (&mSupportedCache[Bucket]);
+  }
+
+  ZeroMem (&AllocConfig, sizeof (AllocConfig));
+  AllocConfig.Name        = "SUPPORTED_CACHE_ENTRY";
+  AllocConfig.ObjectSize  = sizeof (SUPPORTED_CACHE_ENTRY);
+  AllocConfig.ObjectCount = SUPPORTED_CACHE_ENTRIES;
+  AllocConfig.Growable    = TRUE;
+  AllocConfig.Signature   = SUPPORTED_CACHE_SIGNATURE;
+
+  Status = ObjectAllocCreate (&AllocConfig, &mSupportedCacheAlloc);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: ObjectAllocCreate: %r\n", __func__, Status));
+    mSupportedCacheAlloc = NULL;
+  }
+}
+
+/*
+ * Called for interfaces installed by emulated code.
+ */
+VOID
+SupportedCachePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  )
+{
+  if ((Protocol == NULL) || (Interface == NULL) ||
+      !CompareGuid (Protocol, &gEfiDriverBindingProtocolGuid))
+  {
+    return;
+  }
+
+  if (mSupportedCacheAlloc == NULL) {
+    SupportedCacheInit ();
+    if (mSupportedCacheAlloc == NULL) {
+      return;
+    }
+  }
+
+  PatchedInterfacePatch (&mSupportedCachePatch, Protocol, Interface);
+}
+
+VOID
+SupportedCacheImageUnregister (
+  IN  ImageRecord  *Image
+  )
+{
+  LIST_ENTRY             *Entry;
+  LIST_ENTRY             *Next;
+  SUPPORTED_CACHE_ENTRY  *CacheEntry;
+  UINTN                  Bucket;
+
+  if (mSupportedCacheAlloc == NULL) {
+    return;
+  }
+
+  for (Bucket = 0; Bucket < SUPPORTED_CACHE_BUCKETS; Bucket++) {
+    for (Entry = GetFirstNode (&mSupportedCache[Bucket]);
+         !IsNull (&mSupportedCache[Bucket], Entry);
+         Entry = Next)
+    {
+      Next       = GetNextNode (&mSupportedCache[Bucket], Entry);
+      CacheEntry = BASE_CR (Entry, SUPPORTED_CACHE_ENTRY, Link);
+      if (CacheEntry->Driver->Image == Image) {
+        CriticalBegin ();
+        RemoveEntryList (&CacheEntry->Link);
+        CriticalEnd ();
+        ObjectFree (mSupportedCacheAlloc, &CacheEntry->Header);
+      }
+    }
+  }
+
+  PatchedInterfaceImageUnregister (&mSupportedCachePatch, Image);
+}
+
+VOID
+SupportedCacheGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->SupportedCacheHits = mSupportedCacheHits;
+  DebugState->SupportedEmulated  = mSupportedEmulated;
+}
+
+#endif /* MAU_SUPPORTED_CACHE */
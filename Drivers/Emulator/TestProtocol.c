@@ -243,6 +243,202 @@ TestLj (
   UNREACHABLE ();
 }
 
+STATIC
+UINT64
+EFIAPI
+TestNop0 (
+  VOID
+  )
+{
+  return 1;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestNop4 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4
+  )
+{
+  return Arg4 != 0;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestNop8 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4,
+  IN  UINT64  Arg5,
+  IN  UINT64  Arg6,
+  IN  UINT64  Arg7,
+  IN  UINT64  Arg8
+  )
+{
+  return Arg8 != 0;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestNop16 (
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3,
+  IN  UINT64  Arg4,
+  IN  UINT64  Arg5,
+  IN  UINT64  Arg6,
+  IN  UINT64  Arg7,
+  IN  UINT64  Arg8,
+  IN  UINT64  Arg9,
+  IN  UINT64  Arg10,
+  IN  UINT64  Arg11,
+  IN  UINT64  Arg12,
+  IN  UINT64  Arg13,
+  IN  UINT64  Arg14,
+  IN  UINT64  Arg15,
+  IN  UINT64  Arg16
+  )
+{
+  return Arg16 != 0;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestLoopCb (
+  IN  VOID     *Cb,
+  IN  UINTN    ArgCount,
+  IN  BOOLEAN  Wrapped,
+  IN  UINT64   Count
+  )
+{
+  UINT64       Index;
+  UINT64       Result;
+  ImageRecord  *Record;
+  CbFn         Fn;
+  UINT64       Args[MAX_ARGS];
+
+  Result = 0;
+  Fn     = (CbFn)Cb;
+  Record = ImageFindByAddress ((UINT64)Cb);
+  if (Wrapped && (Record != NULL)) {
+    ASSERT (Record->Cpu != NULL);
+    ZeroMem (Args, sizeof (Args));
+    for (Index = 0; Index < MIN (ArgCount, MAX_ARGS); Index++) {
+      Args[Index] = ARG_VAL (1) + Index;
+    }
+
+    for (Index = 0; Index < Count; Index++) {
+      Result += CpuRunFunc (Record->Cpu, (UINT64)Cb, Args);
+    }
+
+    return Result;
+  }
+
+  /*
+   * Calling with fewer arguments than CbFn has is fine with the
+   * EFIAPI calling convention, and is what decides how many arguments
+   * the exception path entry into emulated code sees as set up.
+   */
+  switch (ArgCount) {
+    case 0:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(VOID))Fn)();
+      }
+
+      break;
+    case 4:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(UINT64, UINT64, UINT64, UINT64))Fn)(
+                                                                           ARG_VAL (1),
+                                                                           ARG_VAL (2),
+                                                                           ARG_VAL (3),
+                                                                           ARG_VAL (4)
+                                                                           );
+      }
+
+      break;
+    case 8:
+      for (Index = 0; Index < Count; Index++) {
+        Result += ((UINT64 EFIAPI (*)(UINT64, UINT64, UINT64, UINT64,
+                                      UINT64, UINT64, UINT64, UINT64))Fn)(
+                                                                          ARG_VAL (1),
+                                                                          ARG_VAL (2),
+                                                                          ARG_VAL (3),
+                                                                          ARG_VAL (4),
+                                                                          ARG_VAL (5),
+                                                                          ARG_VAL (6),
+                                                                          ARG_VAL (7),
+                                                                          ARG_VAL (8)
+                                                                          );
+      }
+
+      break;
+    default:
+      for (Index = 0; Index < Count; Index++) {
+        Result += Fn (
+                    ARG_VAL (1),
+                    ARG_VAL (2),
+                    ARG_VAL (3),
+                    ARG_VAL (4),
+                    ARG_VAL (5),
+                    ARG_VAL (6),
+                    ARG_VAL (7),
+                    ARG_VAL (8),
+                    ARG_VAL (9),
+                    ARG_VAL (10),
+                    ARG_VAL (11),
+                    ARG_VAL (12),
+                    ARG_VAL (13),
+                    ARG_VAL (14),
+                    ARG_VAL (15),
+                    ARG_VAL (16)
+                    );
+      }
+
+      break;
+  }
+
+  return Result;
+}
+
+STATIC
+UINT64
+EFIAPI
+TestNest (
+  IN  UINT64 EFIAPI  (*Cb)(UINT64),
+  IN  UINT64         Depth
+  )
+{
+  return Cb (Depth);
+}
+
+STATIC
+UINT64
+EFIAPI
+TestLoopNest (
+  IN  UINT64 EFIAPI  (*Cb)(UINT64),
+  IN  UINT64         Depth,
+  IN  UINT64         Count
+  )
+{
+  UINT64  Index;
+  UINT64  Result;
+
+  Result = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Result += Cb (Depth);
+  }
+
+  return Result;
+}
+
 STATIC EMU_TEST_PROTOCOL  mEmuTestProtocol = {
   TestRet,
   TestArgs,
@@ -251,7 +447,14 @@ STATIC EMU_TEST_PROTOCOL  mEmuTestProtocol = {
   TestSj,
   TestLj,
   GetPerformanceCounterProperties,
-  GetPerformanceCounter
+  GetPerformanceCounter,
+  TestNop0,
+  TestNop4,
+  TestNop8,
+  TestNop16,
+  TestLoopCb,
+  TestLoopNest,
+  TestNest
 };
 
 STATIC EFI_GUID  mEmuTestProtocolGuid = EMU_TEST_PROTOCOL_GUID;
@@ -0,0 +1,164 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <unicorn.h>
+#include "Emulator.h"
+
+/*
+ * Emulated code runs with interrupts masked (see CpuRunCtxInternal),
+ * so the TPL doesn't matter until the engine is left, either for a
+ * native call or to let timers fire. Thus RaiseTPL and RestoreTPL
+ * can be done on a shadow TPL without leaving the engine, as long as
+ * the real TPL is brought up to the shadow TPL before interrupts are
+ * unmasked (TplSync).
+ *
+ * A RestoreTPL below the real TPL still goes to the real RestoreTPL,
+ * as that's where pending events are dispatched. So does everything
+ * involving TPL_HIGH_LEVEL, to keep the apparent interrupt state
+ * maintained by EfiHooks correct.
+ *
+ * The real TPL isn't known (there is no GetTPL) until the first
+ * RaiseTPL or RestoreTPL in each context goes through the wrappers
+ * below.
+ */
+
+#ifdef MAU_SHADOW_TPL
+
+extern UINTN  gIgnoreInterruptManipulation;
+STATIC UINTN  mTplShadowCalls;
+
+/*
+ * Returns the address to continue emulation at if the call
+ * was completed on the shadow TPL, or 0.
+ */
+UINT64
+TplShadowCall (
+  IN  CpuRunContext  *Context
+  )
+{
+  CpuContext  *Cpu;
+  UINT64      ProgramCounter;
+  UINT64      Arg;
+  UINT64      Ret;
+
+  if (!Context->TplKnown) {
+    return 0;
+  }
+
+  ASSERT (gIgnoreInterruptManipulation != 0);
+  ASSERT (Context->RealTpl <= Context->ShadowTpl);
+
+  Cpu            = Context->Cpu;
+  ProgramCounter = REG_READ (Cpu, Cpu->ProgramCounterReg);
+  CpuGetCallArgs (Cpu, &Arg, 1);
+
+  if (ProgramCounter == (UINT64)gBS->RaiseTPL) {
+    if ((Arg < Context->ShadowTpl) || (Arg >= TPL_HIGH_LEVEL)) {
+      return 0;
+    }
+
+    Ret                = Context->ShadowTpl;
+    Context->ShadowTpl = Arg;
+  } else if (ProgramCounter == (UINT64)gBS->RestoreTPL) {
+    if ((Arg > Context->ShadowTpl) || (Arg < Context->RealTpl)) {
+      return 0;
+    }
+
+    Ret                = 0;
+    Context->ShadowTpl = Arg;
+  } else {
+    return 0;
+  }
+
+  mTplShadowCalls++;
+  return CpuCallReturn (Cpu, Ret);
+}
+
+/*
+ * Called before interrupts are unmasked.
+ */
+VOID
+TplSync (
+  IN  CpuRunContext  *Context
+  )
+{
+  if (!Context->TplKnown) {
+    return;
+  }
+
+  ASSERT (gIgnoreInterruptManipulation != 0);
+  if (Context->ShadowTpl != Context->RealTpl) {
+    ASSERT (Context->ShadowTpl > Context->RealTpl);
+    gBS->RaiseTPL (Context->ShadowTpl);
+    Context->RealTpl = Context->ShadowTpl;
+  }
+}
+
+EFI_STATUS
+TplWrapperRaiseTpl (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  CpuRunContext  *Context = CpuGetTopContext ();
+  EFI_TPL        NewTpl   = Args[0];
+  EFI_TPL        OldTpl;
+
+  OldTpl = gBS->RaiseTPL (NewTpl);
+
+  Context->RealTpl   = NewTpl;
+  Context->ShadowTpl = NewTpl;
+  Context->TplKnown  = TRUE;
+  return OldTpl;
+}
+
+EFI_STATUS
+TplWrapperRestoreTpl (
+  IN  UINT64  OriginalProgramCounter,
+  IN  UINT64  ReturnAddress,
+  IN  UINT64  *Args
+  )
+{
+  CpuRunContext  *Context = CpuGetTopContext ();
+  EFI_TPL        OldTpl   = Args[0];
+
+  gBS->RestoreTPL (OldTpl);
+
+  Context->RealTpl   = OldTpl;
+  Context->ShadowTpl = OldTpl;
+  Context->TplKnown  = TRUE;
+  return 0;
+}
+
+UINT64
+TplOverride (
+  IN  UINT64  ProgramCounter
+  )
+{
+  if (ProgramCounter == (UINT64)gBS->RaiseTPL) {
+    return (UINT64)TplWrapperRaiseTpl;
+  } else if (ProgramCounter == (UINT64)gBS->RestoreTPL) {
+    return (UINT64)TplWrapperRestoreTpl;
+  }
+
+  return ProgramCounter;
+}
+
+VOID
+TplGetDebugState (
+  OUT EMU_TEST_DEBUG_STATE  *DebugState
+  )
+{
+  DebugState->TplShadowCalls = mTplShadowCalls;
+}
+
+#endif /* MAU_SHADOW_TPL */
@@ -0,0 +1,177 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+
+#ifdef MAU_TRACE
+
+/*
+ * Must be a power of two. 4096 entries is 192KiB, which is
+ * a few seconds worth of transitions for a chatty OpRom.
+ */
+#define TRACE_ENTRY_COUNT  4096
+#define TRACE_BUFFER_SIZE  (sizeof (EMU_TRACE_HEADER) +           \
+                            TRACE_ENTRY_COUNT * sizeof (EMU_TRACE_ENTRY))
+
+STATIC EMU_TRACE_HEADER  *mTraceHeader;
+STATIC EMU_TRACE_ENTRY   *mTraceEntries;
+STATIC EFI_GUID          mEmuTraceProtocolGuid = EMU_TRACE_PROTOCOL_GUID;
+
+VOID
+TraceEvent (
+  IN  UINT16  Event,
+  IN  UINT16  MachineType,
+  IN  UINT64  Arg0,
+  IN  UINT64  Arg1,
+  IN  UINT64  Arg2,
+  IN  UINT64  Arg3
+  )
+{
+  BOOLEAN          InterruptState;
+  EMU_TRACE_ENTRY  *Entry;
+
+  if ((mTraceHeader == NULL) ||
+      ((mTraceHeader->Flags & EMU_TRACE_FLAG_ENABLED) == 0))
+  {
+    return;
+  }
+
+  /*
+   * Events can be logged from timer callbacks that interrupt
+   * other logging. Not CriticalBegin, as this is also called
+   * from within the critical section around uc_emu_start.
+   */
+  InterruptState = SaveAndDisableInterrupts ();
+  Entry          = &mTraceEntries[mTraceHeader->Head++ & (TRACE_ENTRY_COUNT - 1)];
+
+  Entry->Timestamp   = GetPerformanceCounter ();
+  Entry->Event       = Event;
+  Entry->MachineType = MachineType;
+  Entry->Args[0]     = Arg0;
+  Entry->Args[1]     = Arg1;
+  Entry->Args[2]     = Arg2;
+  Entry->Args[3]     = Arg3;
+  SetInterruptState (InterruptState);
+}
+
+STATIC
+VOID
+EFIAPI
+TraceReset (
+  VOID
+  )
+{
+  BOOLEAN  InterruptState;
+
+  InterruptState     = SaveAndDisableInterrupts ();
+  mTraceHeader->Head = 0;
+  SetInterruptState (InterruptState);
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+TraceSetEnabled (
+  IN  BOOLEAN  Enabled
+  )
+{
+  BOOLEAN  WasEnabled;
+
+  WasEnabled = (mTraceHeader->Flags & EMU_TRACE_FLAG_ENABLED) != 0;
+  if (Enabled) {
+    mTraceHeader->Flags |= EMU_TRACE_FLAG_ENABLED;
+  } else {
+    mTraceHeader->Flags &= ~EMU_TRACE_FLAG_ENABLED;
+  }
+
+  return WasEnabled;
+}
+
+STATIC EMU_TRACE_PROTOCOL  mEmuTraceProtocol = {
+  EMU_TRACE_VERSION,
+  NULL,
+  TRACE_BUFFER_SIZE,
+  TraceReset,
+  TraceSetEnabled
+};
+
+VOID
+TraceInit (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS  Status;
+
+  /*
+   * Tracing is best effort, and never prevents the emulator
+   * from starting.
+   */
+  mTraceHeader = AllocatePages (EFI_SIZE_TO_PAGES (TRACE_BUFFER_SIZE));
+  if (mTraceHeader == NULL) {
+    DEBUG ((DEBUG_ERROR, "Couldn't allocate trace buffer\n"));
+    return;
+  }
+
+  ZeroMem (mTraceHeader, TRACE_BUFFER_SIZE);
+  mTraceEntries = (VOID *)(mTraceHeader + 1);
+
+  mTraceHeader->Signature       = EMU_TRACE_SIGNATURE;
+  mTraceHeader->Version         = EMU_TRACE_VERSION;
+  mTraceHeader->HeaderSize      = sizeof (EMU_TRACE_HEADER);
+  mTraceHeader->EntrySize       = sizeof (EMU_TRACE_ENTRY);
+  mTraceHeader->EntryCount      = TRACE_ENTRY_COUNT;
+  mTraceHeader->Flags           = EMU_TRACE_FLAG_ENABLED;
+  mTraceHeader->HostMachineType = HOST_MACHINE_TYPE;
+  mTraceHeader->Frequency       = GetPerformanceCounterProperties (
+                                    &mTraceHeader->CounterStart,
+                                    &mTraceHeader->CounterEnd
+                                    );
+
+  mEmuTraceProtocol.Header = mTraceHeader;
+  Status                   = gBS->InstallProtocolInterface (
+                                    &ImageHandle,
+                                    &mEmuTraceProtocolGuid,
+                                    EFI_NATIVE_INTERFACE,
+                                    &mEmuTraceProtocol
+                                    );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "InstallProtocolInterface failed: %r\n", Status));
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "Trace buffer at %p (0x%lx bytes)\n",
+    mTraceHeader,
+    (UINT64)TRACE_BUFFER_SIZE
+    ));
+}
+
+VOID
+TraceCleanup (
+  IN  EFI_HANDLE  ImageHandle
+  )
+{
+  if (mTraceHeader == NULL) {
+    return;
+  }
+
+  gBS->UninstallProtocolInterface (
+         ImageHandle,
+         &mEmuTraceProtocolGuid,
+         &mEmuTraceProtocol
+         );
+
+  FreePages (mTraceHeader, EFI_SIZE_TO_PAGES (TRACE_BUFFER_SIZE));
+  mTraceHeader  = NULL;
+  mTraceEntries = NULL;
+}
+
+#endif /* MAU_TRACE */
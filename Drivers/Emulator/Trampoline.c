@@ -0,0 +1,464 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include "Emulator.h"
+#include <Library/CacheMaintenanceLib.h>
+#include <Protocol/AtaPassThru.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/DiskIo.h>
+#include <Protocol/ExtScsiPassThru.h>
+#include <Protocol/GraphicsOutput.h>
+#include <Protocol/LoadFile.h>
+#include <Protocol/NvmExpressPassthru.h>
+#include <Protocol/SimpleNetwork.h>
+#include <Protocol/SimpleTextIn.h>
+#include <Protocol/SimpleTextOut.h>
+
+/*
+ * Native code calling into an emulated driver normally takes an
+ * exception (on the XP-protected image, or on an illegal instruction
+ * without an MMU), which is then fixed up to enter EmulatorThunk.
+ * For the protocols emulated drivers commonly produce, the function
+ * pointers in the interface are instead replaced, in place, with small
+ * native trampolines that load the emulated ProgramCounter and the
+ * ImageRecord and jump straight to EmulatorThunk.
+ *
+ * Interfaces are patched in place, as drivers use CR() to get from
+ * the interface back to their private data. Only the function
+ * pointer members listed in mTrampolineProtocols are looked at, as
+ * interfaces also contain data pointers (e.g. EFI_BLOCK_IO_MEDIA)
+ * that may well point into the emulated image.
+ */
+
+#ifdef MAU_PROTOCOL_TRAMPOLINES
+
+#define TRAMPOLINE_SIZE       64
+#define TRAMPOLINES_PER_PAGE  (EFI_PAGE_SIZE / TRAMPOLINE_SIZE)
+
+/*
+ * Trampolines of unregistered images are filled with this, and are
+ * never handed out again: native code may still hold pointers to
+ * them (e.g. an interface that was never uninstalled), and must
+ * fault instead of entering whatever image got the slot next.
+ */
+#define TRAMPOLINE_TOMBSTONE  ((ImageRecord *)(UINTN)MAX_UINTN)
+#ifdef MDE_CPU_AARCH64
+#define TRAMPOLINE_TRAP  0xD4200000 /* brk #0 */
+#elif defined (MDE_CPU_RISCV64)
+#define TRAMPOLINE_TRAP  0x00100073 /* ebreak */
+#elif defined (MDE_CPU_LOONGARCH64)
+#define TRAMPOLINE_TRAP  0x002A0000 /* break 0 */
+#endif
+
+typedef struct {
+  EFI_GUID    *Guid;
+  UINTN       First;
+  UINTN       Last;
+} TRAMPOLINE_PROTOCOL;
+
+#define TRAMPOLINE_PROTOCOL(Guid, Type, First, Last) \
+  { &(Guid), OFFSET_OF (Type, First), OFFSET_OF (Type, Last) }
+
+STATIC CONST TRAMPOLINE_PROTOCOL  mTrampolineProtocols[] = {
+  TRAMPOLINE_PROTOCOL (
+    gEfiDriverBindingProtocolGuid,
+    EFI_DRIVER_BINDING_PROTOCOL,
+    Supported,
+    Stop
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiComponentNameProtocolGuid,
+    EFI_COMPONENT_NAME_PROTOCOL,
+    GetDriverName,
+    GetControllerName
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiComponentName2ProtocolGuid,
+    EFI_COMPONENT_NAME2_PROTOCOL,
+    GetDriverName,
+    GetControllerName
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiBlockIoProtocolGuid,
+    EFI_BLOCK_IO_PROTOCOL,
+    Reset,
+    FlushBlocks
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiBlockIo2ProtocolGuid,
+    EFI_BLOCK_IO2_PROTOCOL,
+    Reset,
+    FlushBlocksEx
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiDiskIoProtocolGuid,
+    EFI_DISK_IO_PROTOCOL,
+    ReadDisk,
+    WriteDisk
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiSimpleNetworkProtocolGuid,
+    EFI_SIMPLE_NETWORK_PROTOCOL,
+    Start,
+    Receive
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiGraphicsOutputProtocolGuid,
+    EFI_GRAPHICS_OUTPUT_PROTOCOL,
+    QueryMode,
+    Blt
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiSimpleTextInProtocolGuid,
+    EFI_SIMPLE_TEXT_INPUT_PROTOCOL,
+    Reset,
+    ReadKeyStroke
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiSimpleTextOutProtocolGuid,
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL,
+    Reset,
+    EnableCursor
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiLoadFileProtocolGuid,
+    EFI_LOAD_FILE_PROTOCOL,
+    LoadFile,
+    LoadFile
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiExtScsiPassThruProtocolGuid,
+    EFI_EXT_SCSI_PASS_THRU_PROTOCOL,
+    PassThru,
+    GetNextTarget
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiNvmExpressPassThruProtocolGuid,
+    EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL,
+    PassThru,
+    GetNamespace
+    ),
+  TRAMPOLINE_PROTOCOL (
+    gEfiAtaPassThruProtocolGuid,
+    EFI_ATA_PASS_THRU_PROTOCOL,
+    PassThru,
+    ResetDevice
+    ),
+};
+
+typedef struct {
+  UINT64         ProgramCounter;
+  /*
+   * NULL if the trampoline was never used, TRAMPOLINE_TOMBSTONE
+   * if its image was unregistered.
+   */
+  ImageRecord    *Image;
+} TRAMPOLINE_ENTRY;
+
+typedef struct {
+  LIST_ENTRY          Link;
+  UINT8               *Code;
+  TRAMPOLINE_ENTRY    Entries[TRAMPOLINES_PER_PAGE];
+} TRAMPOLINE_PAGE;
+
+/*
+ * Defined in EmulatorThunk.S. The template ends with three UINT64s,
+ * filled in with the ProgramCounter, the ImageRecord and EmulatorThunk.
+ */
+extern UINT8  EmulatorTrampolineTemplate[];
+extern UINT8  EmulatorTrampolineTemplateEnd[];
+extern VOID   EmulatorThunk (VOID);
+
+STATIC LIST_ENTRY  mTrampolinePages = INITIALIZE_LIST_HEAD_VARIABLE (mTrampolinePages);
+
+STATIC
+TRAMPOLINE_PAGE *
+TrampolinePageAlloc (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  TRAMPOLINE_PAGE       *Page;
+  EFI_PHYSICAL_ADDRESS  Code;
+
+  Page = AllocateZeroPool (sizeof (*Page));
+  if (Page == NULL) {
+    return NULL;
+  }
+
+  Status = gBS->AllocatePages (
+                  AllocateAnyPages,
+                  EfiBootServicesCode,
+                  1,
+                  &Code
+                  );
+  if (EFI_ERROR (Status)) {
+    FreePool (Page);
+    return NULL;
+  }
+
+  Status = gCpu->SetMemoryAttributes (gCpu, Code, EFI_PAGE_SIZE, 0);
+  if (EFI_ERROR (Status)) {
+    gBS->FreePages (Code, 1);
+    FreePool (Page);
+    return NULL;
+  }
+
+  Page->Code = (VOID *)Code;
+
+  CriticalBegin ();
+  InsertTailList (&mTrampolinePages, &Page->Link);
+  CriticalEnd ();
+
+  return Page;
+}
+
+STATIC
+UINT64
+TrampolineGet (
+  IN  ImageRecord  *Image,
+  IN  UINT64       ProgramCounter
+  )
+{
+  LIST_ENTRY        *Entry;
+  TRAMPOLINE_PAGE   *Page;
+  TRAMPOLINE_ENTRY  *Free;
+  UINT64            *Data;
+  UINT8             *Code;
+  UINTN             Size;
+  UINTN             Index;
+
+  Free = NULL;
+  Code = NULL;
+  for (Entry = GetFirstNode (&mTrampolinePages);
+       !IsNull (&mTrampolinePages, Entry);
+       Entry = GetNextNode (&mTrampolinePages, Entry))
+  {
+    Page = BASE_CR (Entry, TRAMPOLINE_PAGE, Link);
+    for (Index = 0; Index < TRAMPOLINES_PER_PAGE; Index++) {
+      if (Page->Entries[Index].Image == NULL) {
+        if (Free == NULL) {
+          Free = &Page->Entries[Index];
+          Code = Page->Code + Index * TRAMPOLINE_SIZE;
+        }
+      } else if ((Page->Entries[Index].Image != TRAMPOLINE_TOMBSTONE) &&
+                 (Page->Entries[Index].ProgramCounter == ProgramCounter))
+      {
+        return (UINT64)(Page->Code + Index * TRAMPOLINE_SIZE);
+      }
+    }
+  }
+
+  if (Free == NULL) {
+    Page = TrampolinePageAlloc ();
+    if (Page == NULL) {
+      return 0;
+    }
+
+    Free = &Page->Entries[0];
+    Code = Page->Code;
+  }
+
+  Size = EmulatorTrampolineTemplateEnd - EmulatorTrampolineTemplate;
+  ASSERT (Size <= TRAMPOLINE_SIZE);
+
+  CopyMem (Code, EmulatorTrampolineTemplate, Size);
+  Data    = (UINT64 *)(Code + Size) - 3;
+  Data[0] = ProgramCounter;
+  Data[1] = (UINT64)Image;
+  Data[2] = (UINT64)EmulatorThunk;
+  InvalidateInstructionCacheRange (Code, Size);
+
+  /*
+   * Published last, for lookups done by NativeThunk*.
+   */
+  Free->ProgramCounter = ProgramCounter;
+  Free->Image          = Image;
+
+  return (UINT64)Code;
+}
+
+/*
+ * Returns the emulated ProgramCounter a trampoline enters,
+ * or 0 if Address is not a trampoline.
+ */
+UINT64
+TrampolineFind (
+  IN  UINT64       Address,
+  OUT ImageRecord  **Image OPTIONAL
+  )
+{
+  LIST_ENTRY        *Entry;
+  TRAMPOLINE_PAGE   *Page;
+  TRAMPOLINE_ENTRY  *Trampoline;
+
+  for (Entry = GetFirstNode (&mTrampolinePages);
+       !IsNull (&mTrampolinePages, Entry);
+       Entry = GetNextNode (&mTrampolinePages, Entry))
+  {
+    Page = BASE_CR (Entry, TRAMPOLINE_PAGE, Link);
+    if ((Address < (UINT64)Page->Code) ||
+        (Address >= (UINT64)Page->Code + EFI_PAGE_SIZE))
+    {
+      continue;
+    }
+
+    if ((Address - (UINT64)Page->Code) % TRAMPOLINE_SIZE != 0) {
+      return 0;
+    }
+
+    Trampoline = &Page->Entries[(Address - (UINT64)Page->Code) / TRAMPOLINE_SIZE];
+    if ((Trampoline->Image == NULL) || (Trampoline->Image == TRAMPOLINE_TOMBSTONE)) {
+      return 0;
+    }
+
+    if (Image != NULL) {
+      *Image = Trampoline->Image;
+    }
+
+    return Trampoline->ProgramCounter;
+  }
+
+  return 0;
+}
+
+/*
+ * Called for interfaces installed by emulated code. Unknown
+ * protocols are left alone and keep going through the
+ * exception path.
+ */
+VOID
+TrampolinePatchInterface (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Interface
+  )
+{
+  UINTN        Index;
+  UINTN        Offset;
+  UINT64       *Slot;
+  UINT64       Trampoline;
+  ImageRecord  *Image;
+
+  if ((Protocol == NULL) || (Interface == NULL)) {
+    return;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (mTrampolineProtocols); Index++) {
+    if (CompareGuid (Protocol, mTrampolineProtocols[Index].Guid)) {
+      break;
+    }
+  }
+
+  if (Index == ARRAY_SIZE (mTrampolineProtocols)) {
+    return;
+  }
+
+  for (Offset = mTrampolineProtocols[Index].First;
+       Offset <= mTrampolineProtocols[Index].Last;
+       Offset += sizeof (UINT64))
+  {
+    Slot  = (UINT64 *)((UINT8 *)Interface + Offset);
+    Image = ImageFindByAddress (*Slot);
+    if (Image == NULL) {
+      continue;
+    }
+
+    Trampoline = TrampolineGet (Image, *Slot);
+    if (Trampoline == 0) {
+      DEBUG ((DEBUG_ERROR, "failed to allocate trampoline for 0x%lx\n", *Slot));
+      return;
+    }
+
+    *Slot = Trampoline;
+  }
+}
+
+/*
+ * Interfaces still pointing to the image's trampolines can't
+ * have been used safely anyway, as the image is gone. Calls
+ * through them trap (see TRAMPOLINE_TOMBSTONE).
+ */
+VOID
+TrampolineImageUnregister (
+  IN  ImageRecord  *Image
+  )
+{
+  LIST_ENTRY       *Entry;
+  TRAMPOLINE_PAGE  *Page;
+  UINT8            *Code;
+  UINTN            Index;
+
+  for (Entry = GetFirstNode (&mTrampolinePages);
+       !IsNull (&mTrampolinePages, Entry);
+       Entry = GetNextNode (&mTrampolinePages, Entry))
+  {
+    Page = BASE_CR (Entry, TRAMPOLINE_PAGE, Link);
+    for (Index = 0; Index < TRAMPOLINES_PER_PAGE; Index++) {
+      if (Page->Entries[Index].Image != Image) {
+        continue;
+      }
+
+      /*
+       * Unpublished first, for lookups done by NativeThunk*.
+       */
+      Page->Entries[Index].Image          = TRAMPOLINE_TOMBSTONE;
+      Page->Entries[Index].ProgramCounter = 0;
+
+      Code = Page->Code + Index * TRAMPOLINE_SIZE;
+      SetMem32 (Code, TRAMPOLINE_SIZE, TRAMPOLINE_TRAP);
+      InvalidateInstructionCacheRange (Code, TRAMPOLINE_SIZE);
+    }
+  }
+}
+
+VOID
+TrampolineDump (
+  VOID
+  )
+{
+  LIST_ENTRY       *Entry;
+  TRAMPOLINE_PAGE  *Page;
+  UINTN            Index;
+  UINTN            Tombstones;
+
+  Tombstones = 0;
+  DEBUG ((DEBUG_ERROR, "Protocol trampolines:\n"));
+  for (Entry = GetFirstNode (&mTrampolinePages);
+       !IsNull (&mTrampolinePages, Entry);
+       Entry = GetNextNode (&mTrampolinePages, Entry))
+  {
+    Page = BASE_CR (Entry, TRAMPOLINE_PAGE, Link);
+    for (Index = 0; Index < TRAMPOLINES_PER_PAGE; Index++) {
+      if (Page->Entries[Index].Image == NULL) {
+        continue;
+      }
+
+      if (Page->Entries[Index].Image == TRAMPOLINE_TOMBSTONE) {
+        Tombstones++;
+        continue;
+      }
+
+      DEBUG ((
+        DEBUG_ERROR,
+        "\t%7a ImageBase 0x%lx Trampoline %p -> 0x%lx\n",
+        Page->Entries[Index].Image->Cpu->Name,
+        Page->Entries[Index].Image->ImageBase,
+        Page->Code + Index * TRAMPOLINE_SIZE,
+        Page->Entries[Index].ProgramCounter
+        ));
+    }
+  }
+
+  DEBUG ((DEBUG_ERROR, "\t%u trampolines of unregistered images\n", Tombstones));
+}
+
+#endif /* MAU_PROTOCOL_TRAMPOLINES */
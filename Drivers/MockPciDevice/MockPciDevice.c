@@ -0,0 +1,815 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/DevicePath.h>
+#include <IndustryStandard/Pci.h>
+#include <IndustryStandard/Acpi.h>
+#include <IndustryStandard/MockPciDevice.h>
+
+/*
+ * A fake PCI function with memory-backed config space and BARs,
+ * for running SyntheticOpRom (or any other driver written against
+ * it) without real hardware. Device addresses are host addresses.
+ */
+
+#define MOCK_PCI_SIGNATURE  SIGNATURE_32 ('M', 'P', 'C', 'I')
+
+typedef struct {
+  VENDOR_DEVICE_PATH          Vendor;
+  EFI_DEVICE_PATH_PROTOCOL    End;
+} MOCK_PCI_DEVICE_PATH;
+
+typedef struct {
+  UINT32                  Signature;
+  EFI_HANDLE              Handle;
+  EFI_PCI_IO_PROTOCOL     PciIo;
+  MOCK_PCI_DEVICE_PATH    DevicePath;
+  UINT64                  Attributes;
+  UINT32                  PollCountdown;
+  PCI_TYPE00              Config;
+  UINT8                   *Regs;
+  UINT8                   *Memory;
+} MOCK_PCI_DEVICE;
+
+#define MOCK_PCI_FROM_PCI_IO(a)  CR (a, MOCK_PCI_DEVICE, PciIo, MOCK_PCI_SIGNATURE)
+
+STATIC EFI_GUID  mMockPciDeviceGuid = {
+  0x8b2b5a0e, 0x3f6e, 0x4c3a, { 0xa1, 0x0c, 0x5e, 0x91, 0x27, 0x4d, 0x6b, 0x3f }
+};
+
+STATIC
+UINT32
+MockPciReadReg (
+  IN  MOCK_PCI_DEVICE  *Device,
+  IN  UINTN            Offset
+  )
+{
+  return *(UINT32 *)(Device->Regs + Offset);
+}
+
+STATIC
+VOID
+MockPciWriteReg (
+  IN  MOCK_PCI_DEVICE  *Device,
+  IN  UINTN            Offset,
+  IN  UINT32           Value
+  )
+{
+  *(UINT32 *)(Device->Regs + Offset) = Value;
+}
+
+STATIC
+VOID
+MockPciComplete (
+  IN  MOCK_PCI_DEVICE  *Device
+  )
+{
+  UINT64  Src;
+  UINT64  Dst;
+  UINT32  Length;
+
+  Src    = *(UINT64 *)(Device->Regs + MOCK_PCI_REG_DMA_SRC);
+  Dst    = *(UINT64 *)(Device->Regs + MOCK_PCI_REG_DMA_DST);
+  Length = MockPciReadReg (Device, MOCK_PCI_REG_DMA_LENGTH);
+
+  if ((Device->Attributes & EFI_PCI_IO_ATTRIBUTE_BUS_MASTER) != 0) {
+    CopyMem ((VOID *)(UINTN)Dst, (VOID *)(UINTN)Src, Length);
+  } else {
+    DEBUG ((DEBUG_ERROR, "MockPciDevice: DMA with bus mastering disabled\n"));
+  }
+
+  MockPciWriteReg (Device, MOCK_PCI_REG_STATUS, MOCK_PCI_STATUS_DONE);
+}
+
+/*
+ * Register side effects, for aligned 32-bit accesses.
+ */
+STATIC
+VOID
+MockPciRegAccess (
+  IN  MOCK_PCI_DEVICE  *Device,
+  IN  UINTN            Offset,
+  IN  BOOLEAN          Write
+  )
+{
+  UINT32  Value;
+
+  if (Write) {
+    switch (Offset) {
+      case MOCK_PCI_REG_ID:
+        MockPciWriteReg (Device, Offset, MOCK_PCI_ID);
+        break;
+      case MOCK_PCI_REG_CONTROL:
+        Value = MockPciReadReg (Device, Offset);
+        MockPciWriteReg (Device, Offset, 0);
+        if ((Value & MOCK_PCI_CONTROL_ACK) != 0) {
+          MockPciWriteReg (Device, MOCK_PCI_REG_STATUS, 0);
+        }
+
+        if (((Value & MOCK_PCI_CONTROL_START) != 0) &&
+            ((MockPciReadReg (Device, MOCK_PCI_REG_STATUS) & MOCK_PCI_STATUS_BUSY) == 0))
+        {
+          Device->PollCountdown = MockPciReadReg (Device, MOCK_PCI_REG_POLL_COUNT);
+          MockPciWriteReg (Device, MOCK_PCI_REG_STATUS, MOCK_PCI_STATUS_BUSY);
+          if (Device->PollCountdown == 0) {
+            MockPciComplete (Device);
+          }
+        }
+
+        break;
+      default:
+        break;
+    }
+  } else if (Offset == MOCK_PCI_REG_STATUS) {
+    if ((MockPciReadReg (Device, Offset) & MOCK_PCI_STATUS_BUSY) != 0) {
+      if (--Device->PollCountdown == 0) {
+        MockPciComplete (Device);
+      }
+    }
+  }
+}
+
+STATIC
+EFI_STATUS
+MockPciAccess (
+  IN      MOCK_PCI_DEVICE            *Device,
+  IN      UINT8                      *Base,
+  IN      UINTN                      Size,
+  IN      EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN      UINT64                     Offset,
+  IN      UINTN                      Count,
+  IN  OUT VOID                       *Buffer,
+  IN      BOOLEAN                    Write
+  )
+{
+  UINTN    Index;
+  UINTN    AccessSize;
+  UINTN    InStride;
+  UINTN    OutStride;
+  UINT8    *Uint8Buffer;
+  BOOLEAN  IsRegs;
+
+  if ((Buffer == NULL) || ((UINT32)Width >= EfiPciIoWidthMaximum)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  AccessSize = (UINTN)1 << (Width & 0x03);
+  InStride   = AccessSize;
+  OutStride  = AccessSize;
+  if ((Width >= EfiPciIoWidthFifoUint8) && (Width <= EfiPciIoWidthFifoUint64)) {
+    InStride = 0;
+  } else if ((Width >= EfiPciIoWidthFillUint8) && (Width <= EfiPciIoWidthFillUint64)) {
+    OutStride = 0;
+  }
+
+  if ((Offset & (AccessSize - 1)) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((Offset >= Size) ||
+      (Offset + (InStride != 0 ? Count * AccessSize : AccessSize) > Size))
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  IsRegs      = Base == Device->Regs;
+  Uint8Buffer = Buffer;
+  for (Index = 0; Index < Count; Index++) {
+    if (Write) {
+      CopyMem (Base + Offset, Uint8Buffer, AccessSize);
+      if (IsRegs && (AccessSize == sizeof (UINT32))) {
+        MockPciRegAccess (Device, Offset, TRUE);
+      }
+    } else {
+      if (IsRegs && (AccessSize == sizeof (UINT32))) {
+        MockPciRegAccess (Device, Offset, FALSE);
+      }
+
+      CopyMem (Uint8Buffer, Base + Offset, AccessSize);
+    }
+
+    Offset      += InStride;
+    Uint8Buffer += OutStride;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+MockPciGetBar (
+  IN  MOCK_PCI_DEVICE  *Device,
+  IN  UINT8            BarIndex,
+  OUT UINT8            **Base,
+  OUT UINTN            *Size
+  )
+{
+  if (BarIndex == MOCK_PCI_REGS_BAR) {
+    *Base = Device->Regs;
+    *Size = MOCK_PCI_REGS_SIZE;
+  } else if (BarIndex == MOCK_PCI_MEMORY_BAR) {
+    *Base = Device->Memory;
+    *Size = MOCK_PCI_MEMORY_SIZE;
+  } else {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((Device->Attributes & EFI_PCI_IO_ATTRIBUTE_MEMORY) == 0) {
+    DEBUG ((DEBUG_WARN, "MockPciDevice: BAR %u access with memory decoding disabled\n", BarIndex));
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciMemRead (
+  IN     EFI_PCI_IO_PROTOCOL        *This,
+  IN     EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN     UINT8                      BarIndex,
+  IN     UINT64                     Offset,
+  IN     UINTN                      Count,
+  IN OUT VOID                       *Buffer
+  )
+{
+  EFI_STATUS       Status;
+  MOCK_PCI_DEVICE  *Device;
+  UINT8            *Base;
+  UINTN            Size;
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  Status = MockPciGetBar (Device, BarIndex, &Base, &Size);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return MockPciAccess (Device, Base, Size, Width, Offset, Count, Buffer, FALSE);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciMemWrite (
+  IN     EFI_PCI_IO_PROTOCOL        *This,
+  IN     EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN     UINT8                      BarIndex,
+  IN     UINT64                     Offset,
+  IN     UINTN                      Count,
+  IN OUT VOID                       *Buffer
+  )
+{
+  EFI_STATUS       Status;
+  MOCK_PCI_DEVICE  *Device;
+  UINT8            *Base;
+  UINTN            Size;
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  Status = MockPciGetBar (Device, BarIndex, &Base, &Size);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return MockPciAccess (Device, Base, Size, Width, Offset, Count, Buffer, TRUE);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciPollMem (
+  IN  EFI_PCI_IO_PROTOCOL        *This,
+  IN  EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN  UINT8                      BarIndex,
+  IN  UINT64                     Offset,
+  IN  UINT64                     Mask,
+  IN  UINT64                     Value,
+  IN  UINT64                     Delay,
+  OUT UINT64                     *Result
+  )
+{
+  EFI_STATUS  Status;
+
+  if ((Result == NULL) || ((UINT32)Width > EfiPciIoWidthUint64)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /*
+   * Delay is in 100ns units.
+   */
+  for ( ; ;) {
+    *Result = 0;
+    Status  = MockPciMemRead (This, Width, BarIndex, Offset, 1, Result);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    if ((*Result & Mask) == Value) {
+      return EFI_SUCCESS;
+    }
+
+    if (Delay == 0) {
+      return EFI_TIMEOUT;
+    }
+
+    gBS->Stall (1);
+    Delay = Delay > 10 ? Delay - 10 : 0;
+  }
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciPollIo (
+  IN  EFI_PCI_IO_PROTOCOL        *This,
+  IN  EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN  UINT8                      BarIndex,
+  IN  UINT64                     Offset,
+  IN  UINT64                     Mask,
+  IN  UINT64                     Value,
+  IN  UINT64                     Delay,
+  OUT UINT64                     *Result
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciIoAccess (
+  IN     EFI_PCI_IO_PROTOCOL        *This,
+  IN     EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN     UINT8                      BarIndex,
+  IN     UINT64                     Offset,
+  IN     UINTN                      Count,
+  IN OUT VOID                       *Buffer
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciConfigRead (
+  IN     EFI_PCI_IO_PROTOCOL        *This,
+  IN     EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN     UINT32                     Offset,
+  IN     UINTN                      Count,
+  IN OUT VOID                       *Buffer
+  )
+{
+  MOCK_PCI_DEVICE  *Device;
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  return MockPciAccess (
+           Device,
+           (UINT8 *)&Device->Config,
+           sizeof (Device->Config),
+           Width,
+           Offset,
+           Count,
+           Buffer,
+           FALSE
+           );
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciConfigWrite (
+  IN     EFI_PCI_IO_PROTOCOL        *This,
+  IN     EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN     UINT32                     Offset,
+  IN     UINTN                      Count,
+  IN OUT VOID                       *Buffer
+  )
+{
+  MOCK_PCI_DEVICE  *Device;
+  PCI_TYPE00       Config;
+  EFI_STATUS       Status;
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  CopyMem (&Config, &Device->Config, sizeof (Config));
+  Status = MockPciAccess (
+             Device,
+             (UINT8 *)&Device->Config,
+             sizeof (Device->Config),
+             Width,
+             Offset,
+             Count,
+             Buffer,
+             TRUE
+             );
+
+  /*
+   * Only the command register and the interrupt line are writable.
+   */
+  Config.Hdr.Command          = Device->Config.Hdr.Command;
+  Config.Device.InterruptLine = Device->Config.Device.InterruptLine;
+  CopyMem (&Device->Config, &Config, sizeof (Config));
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciCopyMem (
+  IN  EFI_PCI_IO_PROTOCOL        *This,
+  IN  EFI_PCI_IO_PROTOCOL_WIDTH  Width,
+  IN  UINT8                      DestBarIndex,
+  IN  UINT64                     DestOffset,
+  IN  UINT8                      SrcBarIndex,
+  IN  UINT64                     SrcOffset,
+  IN  UINTN                      Count
+  )
+{
+  EFI_STATUS       Status;
+  MOCK_PCI_DEVICE  *Device;
+  UINT8            *DestBase;
+  UINT8            *SrcBase;
+  UINTN            DestSize;
+  UINTN            SrcSize;
+  UINTN            Length;
+
+  if ((UINT32)Width > EfiPciIoWidthUint64) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  Length = Count << (Width & 0x03);
+
+  Status = MockPciGetBar (Device, DestBarIndex, &DestBase, &DestSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = MockPciGetBar (Device, SrcBarIndex, &SrcBase, &SrcSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if ((DestOffset > DestSize) || (Length > DestSize - DestOffset) ||
+      (SrcOffset > SrcSize) || (Length > SrcSize - SrcOffset))
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  CopyMem (DestBase + DestOffset, SrcBase + SrcOffset, Length);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciMap (
+  IN     EFI_PCI_IO_PROTOCOL            *This,
+  IN     EFI_PCI_IO_PROTOCOL_OPERATION  Operation,
+  IN     VOID                           *HostAddress,
+  IN OUT UINTN                          *NumberOfBytes,
+  OUT    EFI_PHYSICAL_ADDRESS           *DeviceAddress,
+  OUT    VOID                           **Mapping
+  )
+{
+  if ((HostAddress == NULL) || (NumberOfBytes == NULL) ||
+      (DeviceAddress == NULL) || (Mapping == NULL) ||
+      ((UINT32)Operation >= EfiPciIoOperationMaximum))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *DeviceAddress = (EFI_PHYSICAL_ADDRESS)(UINTN)HostAddress;
+  *Mapping       = HostAddress;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciUnmap (
+  IN  EFI_PCI_IO_PROTOCOL  *This,
+  IN  VOID                 *Mapping
+  )
+{
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciAllocateBuffer (
+  IN  EFI_PCI_IO_PROTOCOL  *This,
+  IN  EFI_ALLOCATE_TYPE    Type,
+  IN  EFI_MEMORY_TYPE      MemoryType,
+  IN  UINTN                Pages,
+  OUT VOID                 **HostAddress,
+  IN  UINT64               Attributes
+  )
+{
+  EFI_STATUS            Status;
+  EFI_PHYSICAL_ADDRESS  Address;
+
+  if (HostAddress == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((MemoryType != EfiBootServicesData) &&
+      (MemoryType != EfiRuntimeServicesData))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = gBS->AllocatePages (AllocateAnyPages, MemoryType, Pages, &Address);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *HostAddress = (VOID *)(UINTN)Address;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciFreeBuffer (
+  IN  EFI_PCI_IO_PROTOCOL  *This,
+  IN  UINTN                Pages,
+  IN  VOID                 *HostAddress
+  )
+{
+  return gBS->FreePages ((EFI_PHYSICAL_ADDRESS)(UINTN)HostAddress, Pages);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciFlush (
+  IN  EFI_PCI_IO_PROTOCOL  *This
+  )
+{
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciGetLocation (
+  IN  EFI_PCI_IO_PROTOCOL  *This,
+  OUT UINTN                *SegmentNumber,
+  OUT UINTN                *BusNumber,
+  OUT UINTN                *DeviceNumber,
+  OUT UINTN                *FunctionNumber
+  )
+{
+  if ((SegmentNumber == NULL) || (BusNumber == NULL) ||
+      (DeviceNumber == NULL) || (FunctionNumber == NULL))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *SegmentNumber  = MOCK_PCI_SEG;
+  *BusNumber      = MOCK_PCI_BUS;
+  *DeviceNumber   = MOCK_PCI_DEV;
+  *FunctionNumber = MOCK_PCI_FUNC;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciAttributes (
+  IN  EFI_PCI_IO_PROTOCOL                      *This,
+  IN  EFI_PCI_IO_PROTOCOL_ATTRIBUTE_OPERATION  Operation,
+  IN  UINT64                                   Attributes,
+  OUT UINT64                                   *Result OPTIONAL
+  )
+{
+  MOCK_PCI_DEVICE  *Device;
+  UINT64           Supported;
+
+  Device    = MOCK_PCI_FROM_PCI_IO (This);
+  Supported = EFI_PCI_IO_ATTRIBUTE_MEMORY | EFI_PCI_IO_ATTRIBUTE_BUS_MASTER |
+              EFI_PCI_IO_ATTRIBUTE_DUAL_ADDRESS_CYCLE;
+
+  switch (Operation) {
+    case EfiPciIoAttributeOperationGet:
+    case EfiPciIoAttributeOperationSupported:
+      if (Result == NULL) {
+        return EFI_INVALID_PARAMETER;
+      }
+
+      *Result = Operation == EfiPciIoAttributeOperationGet ?
+                Device->Attributes : Supported;
+      return EFI_SUCCESS;
+    case EfiPciIoAttributeOperationSet:
+    case EfiPciIoAttributeOperationEnable:
+      if ((Attributes & ~Supported) != 0) {
+        return EFI_UNSUPPORTED;
+      }
+
+      if (Operation == EfiPciIoAttributeOperationSet) {
+        Device->Attributes = Attributes;
+      } else {
+        Device->Attributes |= Attributes;
+      }
+
+      break;
+    case EfiPciIoAttributeOperationDisable:
+      Device->Attributes &= ~Attributes;
+      break;
+    default:
+      return EFI_INVALID_PARAMETER;
+  }
+
+  Device->Config.Hdr.Command = 0;
+  if ((Device->Attributes & EFI_PCI_IO_ATTRIBUTE_MEMORY) != 0) {
+    Device->Config.Hdr.Command |= EFI_PCI_COMMAND_MEMORY_SPACE;
+  }
+
+  if ((Device->Attributes & EFI_PCI_IO_ATTRIBUTE_BUS_MASTER) != 0) {
+    Device->Config.Hdr.Command |= EFI_PCI_COMMAND_BUS_MASTER;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciGetBarAttributes (
+  IN  EFI_PCI_IO_PROTOCOL  *This,
+  IN  UINT8                BarIndex,
+  OUT UINT64               *Supports OPTIONAL,
+  OUT VOID                 **Resources OPTIONAL
+  )
+{
+  EFI_STATUS                         Status;
+  MOCK_PCI_DEVICE                    *Device;
+  UINT8                              *Base;
+  UINTN                              Size;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR  *Descriptor;
+  EFI_ACPI_END_TAG_DESCRIPTOR        *End;
+
+  if ((Supports == NULL) && (Resources == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Device = MOCK_PCI_FROM_PCI_IO (This);
+  Status = MockPciGetBar (Device, BarIndex, &Base, &Size);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (Supports != NULL) {
+    *Supports = 0;
+  }
+
+  if (Resources != NULL) {
+    Descriptor = AllocateZeroPool (sizeof (*Descriptor) + sizeof (*End));
+    if (Descriptor == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Descriptor->Desc                 = ACPI_ADDRESS_SPACE_DESCRIPTOR;
+    Descriptor->Len                  = sizeof (*Descriptor) - 3;
+    Descriptor->ResType              = ACPI_ADDRESS_SPACE_TYPE_MEM;
+    Descriptor->AddrSpaceGranularity = 64;
+    Descriptor->AddrRangeMin         = (UINT64)(UINTN)Base;
+    Descriptor->AddrRangeMax         = (UINT64)(UINTN)Base + Size - 1;
+    Descriptor->AddrLen              = Size;
+
+    End           = (VOID *)(Descriptor + 1);
+    End->Desc     = ACPI_END_TAG_DESCRIPTOR;
+    End->Checksum = 0;
+
+    *Resources = Descriptor;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockPciSetBarAttributes (
+  IN     EFI_PCI_IO_PROTOCOL  *This,
+  IN     UINT64               Attributes,
+  IN     UINT8                BarIndex,
+  IN OUT UINT64               *Offset,
+  IN OUT UINT64               *Length
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC CONST EFI_PCI_IO_PROTOCOL  mMockPciIo = {
+  MockPciPollMem,
+  MockPciPollIo,
+  { MockPciMemRead,  MockPciMemWrite    },
+  { MockPciIoAccess, MockPciIoAccess    },
+  { MockPciConfigRead, MockPciConfigWrite },
+  MockPciCopyMem,
+  MockPciMap,
+  MockPciUnmap,
+  MockPciAllocateBuffer,
+  MockPciFreeBuffer,
+  MockPciFlush,
+  MockPciGetLocation,
+  MockPciAttributes,
+  MockPciGetBarAttributes,
+  MockPciSetBarAttributes,
+  0,
+  NULL
+};
+
+EFI_STATUS
+EFIAPI
+MockPciDeviceEntryPoint (
+  IN  EFI_HANDLE        ImageHandle,
+  IN  EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  EFI_STATUS       Status;
+  MOCK_PCI_DEVICE  *Device;
+
+  Device = AllocateZeroPool (sizeof (*Device));
+  if (Device == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Device->Regs   = AllocateZeroPool (MOCK_PCI_REGS_SIZE);
+  Device->Memory = AllocateZeroPool (MOCK_PCI_MEMORY_SIZE);
+  if ((Device->Regs == NULL) || (Device->Memory == NULL)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Device->Signature = MOCK_PCI_SIGNATURE;
+  CopyMem (&Device->PciIo, &mMockPciIo, sizeof (Device->PciIo));
+
+  Device->Config.Hdr.VendorId     = MOCK_PCI_VENDOR_ID;
+  Device->Config.Hdr.DeviceId     = MOCK_PCI_DEVICE_ID;
+  Device->Config.Hdr.ClassCode[2] = PCI_CLASS_OLD;
+
+  MockPciWriteReg (Device, MOCK_PCI_REG_ID, MOCK_PCI_ID);
+  MockPciWriteReg (Device, MOCK_PCI_REG_POLL_COUNT, MOCK_PCI_DEFAULT_POLL_COUNT);
+
+  Device->DevicePath.Vendor.Header.Type    = HARDWARE_DEVICE_PATH;
+  Device->DevicePath.Vendor.Header.SubType = HW_VENDOR_DP;
+  SetDevicePathNodeLength (&Device->DevicePath.Vendor.Header, sizeof (Device->DevicePath.Vendor));
+  CopyGuid (&Device->DevicePath.Vendor.Guid, &mMockPciDeviceGuid);
+  SetDevicePathEndNode (&Device->DevicePath.End);
+
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &Device->Handle,
+                  &gEfiDevicePathProtocolGuid,
+                  &Device->DevicePath,
+                  &gEfiPciIoProtocolGuid,
+                  &Device->PciIo,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "MockPciDevice: failed to install protocols: %r\n", Status));
+    goto out;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "MockPciDevice: %04x:%02x:%02x:%02x %04x:%04x\n",
+    MOCK_PCI_SEG,
+    MOCK_PCI_BUS,
+    MOCK_PCI_DEV,
+    MOCK_PCI_FUNC,
+    MOCK_PCI_VENDOR_ID,
+    MOCK_PCI_DEVICE_ID
+    ));
+  return EFI_SUCCESS;
+
+out:
+  if (Device->Regs != NULL) {
+    FreePool (Device->Regs);
+  }
+
+  if (Device->Memory != NULL) {
+    FreePool (Device->Memory);
+  }
+
+  FreePool (Device);
+  return Status;
+}
@@ -0,0 +1,580 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/DriverBinding.h>
+#include <Protocol/SyntheticOpRomProtocol.h>
+#include <IndustryStandard/Pci.h>
+#include <IndustryStandard/MockPciDevice.h>
+
+/*
+ * A driver imitating what typical NIC, NVMe and GOP OpRoms do, for
+ * measuring emulation overhead end-to-end with realistic call mixes:
+ * DriverBinding over PciIo, BAR MMIO register polling, DMA buffer
+ * Map/Unmap, a periodic polling timer and protocol installs. Drives
+ * the fake device exposed by MockPciDevice.
+ */
+
+#define SYNTHETIC_OPROM_SIGNATURE  SIGNATURE_32 ('S', 'O', 'P', 'R')
+
+/*
+ * Like MNP, which polls the NIC every 10ms.
+ */
+#define SYNTHETIC_OPROM_TIMER_PERIOD  EFI_TIMER_PERIOD_MILLISECONDS (10)
+
+/*
+ * Bounds the time spent polling for a transfer to complete.
+ */
+#define SYNTHETIC_OPROM_MAX_POLLS  100000
+
+typedef struct {
+  UINT32                      Signature;
+  EFI_PCI_IO_PROTOCOL         *PciIo;
+  UINT64                      OriginalAttributes;
+  EFI_EVENT                   TimerEvent;
+  /*
+   * Common buffer written by the device, like NVMe completion
+   * queues or NIC receive rings.
+   */
+  UINT8                       *CommonBuffer;
+  EFI_PHYSICAL_ADDRESS        CommonBufferDevice;
+  VOID                        *CommonBufferMapping;
+  /*
+   * Mapped for each transfer, like a block I/O or transmit buffer.
+   */
+  UINT8                       *Buffer;
+  SYNTHETIC_OPROM_PROTOCOL    Protocol;
+} SYNTHETIC_OPROM_DEVICE;
+
+#define SYNTHETIC_OPROM_FROM_PROTOCOL(a) \
+  CR (a, SYNTHETIC_OPROM_DEVICE, Protocol, SYNTHETIC_OPROM_SIGNATURE)
+
+STATIC EFI_GUID  mSyntheticOpRomProtocolGuid = SYNTHETIC_OPROM_PROTOCOL_GUID;
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomSupported (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+  );
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomStart (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+  );
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomStop (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  UINTN                        NumberOfChildren,
+  IN  EFI_HANDLE                   *ChildHandleBuffer
+  );
+
+STATIC EFI_DRIVER_BINDING_PROTOCOL  mSyntheticOpRomDriverBinding = {
+  SyntheticOpRomSupported,
+  SyntheticOpRomStart,
+  SyntheticOpRomStop,
+  0xa,
+  NULL,
+  NULL
+};
+
+STATIC
+UINT32
+SyntheticOpRomRead32 (
+  IN  SYNTHETIC_OPROM_DEVICE  *Device,
+  IN  UINT64                  Offset
+  )
+{
+  UINT32  Value;
+
+  Value = MAX_UINT32;
+  Device->PciIo->Mem.Read (
+                       Device->PciIo,
+                       EfiPciIoWidthUint32,
+                       MOCK_PCI_REGS_BAR,
+                       Offset,
+                       1,
+                       &Value
+                       );
+  return Value;
+}
+
+STATIC
+VOID
+SyntheticOpRomWrite32 (
+  IN  SYNTHETIC_OPROM_DEVICE  *Device,
+  IN  UINT64                  Offset,
+  IN  UINT32                  Value
+  )
+{
+  Device->PciIo->Mem.Write (
+                       Device->PciIo,
+                       EfiPciIoWidthUint32,
+                       MOCK_PCI_REGS_BAR,
+                       Offset,
+                       1,
+                       &Value
+                       );
+}
+
+STATIC
+VOID
+SyntheticOpRomWrite64 (
+  IN  SYNTHETIC_OPROM_DEVICE  *Device,
+  IN  UINT64                  Offset,
+  IN  UINT64                  Value
+  )
+{
+  Device->PciIo->Mem.Write (
+                       Device->PciIo,
+                       EfiPciIoWidthUint64,
+                       MOCK_PCI_REGS_BAR,
+                       Offset,
+                       1,
+                       &Value
+                       );
+}
+
+/*
+ * Like a NIC driver checking for received packets.
+ */
+STATIC
+VOID
+EFIAPI
+SyntheticOpRomTimer (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  SYNTHETIC_OPROM_DEVICE  *Device;
+
+  Device = Context;
+  SyntheticOpRomRead32 (Device, MOCK_PCI_REG_ID);
+  Device->Protocol.TimerTicks++;
+}
+
+STATIC
+EFI_STATUS
+SyntheticOpRomTransferOne (
+  IN  SYNTHETIC_OPROM_DEVICE  *Device,
+  IN  UINTN                   Sequence
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 Index;
+  UINTN                 Bytes;
+  UINT32                Value;
+  UINT32                Sum;
+  UINT32                *Words;
+  VOID                  *Mapping;
+  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+
+  /*
+   * Prepare the request in CPU code...
+   */
+  Words = (UINT32 *)Device->Buffer;
+  for (Index = 0; Index < SYNTHETIC_OPROM_TRANSFER_SIZE / sizeof (UINT32); Index++) {
+    Words[Index] = (UINT32)(Sequence + Index);
+  }
+
+  Bytes  = SYNTHETIC_OPROM_TRANSFER_SIZE;
+  Status = Device->PciIo->Map (
+                            Device->PciIo,
+                            EfiPciIoOperationBusMasterRead,
+                            Device->Buffer,
+                            &Bytes,
+                            &DeviceAddress,
+                            &Mapping
+                            );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (Bytes != SYNTHETIC_OPROM_TRANSFER_SIZE) {
+    Device->PciIo->Unmap (Device->PciIo, Mapping);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  /*
+   * ...program the device...
+   */
+  SyntheticOpRomWrite64 (Device, MOCK_PCI_REG_DMA_SRC, DeviceAddress);
+  SyntheticOpRomWrite64 (Device, MOCK_PCI_REG_DMA_DST, Device->CommonBufferDevice);
+  SyntheticOpRomWrite32 (Device, MOCK_PCI_REG_DMA_LENGTH, SYNTHETIC_OPROM_TRANSFER_SIZE);
+  SyntheticOpRomWrite32 (Device, MOCK_PCI_REG_CONTROL, MOCK_PCI_CONTROL_START);
+
+  /*
+   * ...poll for completion...
+   */
+  for (Index = 0; Index < SYNTHETIC_OPROM_MAX_POLLS; Index++) {
+    Value = SyntheticOpRomRead32 (Device, MOCK_PCI_REG_STATUS);
+    if ((Value & MOCK_PCI_STATUS_DONE) != 0) {
+      break;
+    }
+  }
+
+  SyntheticOpRomWrite32 (Device, MOCK_PCI_REG_CONTROL, MOCK_PCI_CONTROL_ACK);
+  Device->PciIo->Unmap (Device->PciIo, Mapping);
+  if (Index == SYNTHETIC_OPROM_MAX_POLLS) {
+    return EFI_TIMEOUT;
+  }
+
+  /*
+   * ...and consume the result, pushing a summary out to
+   * device memory (e.g. a status line drawn into a frame buffer).
+   */
+  Sum   = 0;
+  Words = (UINT32 *)Device->CommonBuffer;
+  for (Index = 0; Index < SYNTHETIC_OPROM_TRANSFER_SIZE / sizeof (UINT32); Index++) {
+    Sum += Words[Index] - (UINT32)(Sequence + Index);
+  }
+
+  if (Sum != 0) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  return Device->PciIo->Mem.Write (
+                              Device->PciIo,
+                              EfiPciIoWidthUint32,
+                              MOCK_PCI_MEMORY_BAR,
+                              (Sequence * SYNTHETIC_OPROM_TRANSFER_SIZE) % MOCK_PCI_MEMORY_SIZE,
+                              SYNTHETIC_OPROM_TRANSFER_SIZE / sizeof (UINT32),
+                              Device->CommonBuffer
+                              );
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomTransfer (
+  IN  SYNTHETIC_OPROM_PROTOCOL  *This,
+  IN  UINTN                     Count
+  )
+{
+  EFI_STATUS              Status;
+  UINTN                   Index;
+  SYNTHETIC_OPROM_DEVICE  *Device;
+
+  Device = SYNTHETIC_OPROM_FROM_PROTOCOL (This);
+  for (Index = 0; Index < Count; Index++) {
+    Status = SyntheticOpRomTransferOne (Device, Index);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "SyntheticOpRom: transfer %lu failed: %r\n", (UINT64)Index, Status));
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomSupported (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+  )
+{
+  EFI_STATUS           Status;
+  EFI_PCI_IO_PROTOCOL  *PciIo;
+  UINT16               Ids[2];
+
+  Status = gBS->OpenProtocol (
+                  ControllerHandle,
+                  &gEfiPciIoProtocolGuid,
+                  (VOID **)&PciIo,
+                  This->DriverBindingHandle,
+                  ControllerHandle,
+                  EFI_OPEN_PROTOCOL_BY_DRIVER
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = PciIo->Pci.Read (
+                        PciIo,
+                        EfiPciIoWidthUint16,
+                        PCI_VENDOR_ID_OFFSET,
+                        ARRAY_SIZE (Ids),
+                        Ids
+                        );
+  if (!EFI_ERROR (Status) &&
+      ((Ids[0] != MOCK_PCI_VENDOR_ID) || (Ids[1] != MOCK_PCI_DEVICE_ID)))
+  {
+    Status = EFI_UNSUPPORTED;
+  }
+
+  gBS->CloseProtocol (
+         ControllerHandle,
+         &gEfiPciIoProtocolGuid,
+         This->DriverBindingHandle,
+         ControllerHandle
+         );
+
+  return Status;
+}
+
+STATIC
+VOID
+SyntheticOpRomFreeDevice (
+  IN  SYNTHETIC_OPROM_DEVICE  *Device
+  )
+{
+  if (Device->TimerEvent != NULL) {
+    gBS->CloseEvent (Device->TimerEvent);
+  }
+
+  if (Device->CommonBufferMapping != NULL) {
+    Device->PciIo->Unmap (Device->PciIo, Device->CommonBufferMapping);
+  }
+
+  if (Device->CommonBuffer != NULL) {
+    Device->PciIo->FreeBuffer (
+                     Device->PciIo,
+                     EFI_SIZE_TO_PAGES (SYNTHETIC_OPROM_TRANSFER_SIZE),
+                     Device->CommonBuffer
+                     );
+  }
+
+  if (Device->Buffer != NULL) {
+    FreePool (Device->Buffer);
+  }
+
+  Device->PciIo->Attributes (
+                   Device->PciIo,
+                   EfiPciIoAttributeOperationSet,
+                   Device->OriginalAttributes,
+                   NULL
+                   );
+  FreePool (Device);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomStart (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+  )
+{
+  EFI_STATUS              Status;
+  EFI_PCI_IO_PROTOCOL     *PciIo;
+  SYNTHETIC_OPROM_DEVICE  *Device;
+  UINTN                   Bytes;
+
+  Status = gBS->OpenProtocol (
+                  ControllerHandle,
+                  &gEfiPciIoProtocolGuid,
+                  (VOID **)&PciIo,
+                  This->DriverBindingHandle,
+                  ControllerHandle,
+                  EFI_OPEN_PROTOCOL_BY_DRIVER
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Device = AllocateZeroPool (sizeof (*Device));
+  if (Device == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto close;
+  }
+
+  Device->Signature         = SYNTHETIC_OPROM_SIGNATURE;
+  Device->PciIo             = PciIo;
+  Device->Protocol.Revision = SYNTHETIC_OPROM_PROTOCOL_REVISION;
+  Device->Protocol.Transfer = SyntheticOpRomTransfer;
+
+  Status = PciIo->Attributes (
+                    PciIo,
+                    EfiPciIoAttributeOperationGet,
+                    0,
+                    &Device->OriginalAttributes
+                    );
+  if (EFI_ERROR (Status)) {
+    FreePool (Device);
+    goto close;
+  }
+
+  Status = PciIo->Attributes (
+                    PciIo,
+                    EfiPciIoAttributeOperationEnable,
+                    EFI_PCI_IO_ATTRIBUTE_MEMORY | EFI_PCI_IO_ATTRIBUTE_BUS_MASTER,
+                    NULL
+                    );
+  if (EFI_ERROR (Status)) {
+    FreePool (Device);
+    goto close;
+  }
+
+  if (SyntheticOpRomRead32 (Device, MOCK_PCI_REG_ID) != MOCK_PCI_ID) {
+    DEBUG ((DEBUG_ERROR, "SyntheticOpRom: unexpected device ID\n"));
+    Status = EFI_DEVICE_ERROR;
+    goto free;
+  }
+
+  Device->Buffer = AllocatePool (SYNTHETIC_OPROM_TRANSFER_SIZE);
+  if (Device->Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto free;
+  }
+
+  Status = PciIo->AllocateBuffer (
+                    PciIo,
+                    AllocateAnyPages,
+                    EfiBootServicesData,
+                    EFI_SIZE_TO_PAGES (SYNTHETIC_OPROM_TRANSFER_SIZE),
+                    (VOID **)&Device->CommonBuffer,
+                    0
+                    );
+  if (EFI_ERROR (Status)) {
+    Device->CommonBuffer = NULL;
+    goto free;
+  }
+
+  Bytes  = SYNTHETIC_OPROM_TRANSFER_SIZE;
+  Status = PciIo->Map (
+                    PciIo,
+                    EfiPciIoOperationBusMasterCommonBuffer,
+                    Device->CommonBuffer,
+                    &Bytes,
+                    &Device->CommonBufferDevice,
+                    &Device->CommonBufferMapping
+                    );
+  if (EFI_ERROR (Status)) {
+    Device->CommonBufferMapping = NULL;
+    goto free;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  SyntheticOpRomTimer,
+                  Device,
+                  &Device->TimerEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    Device->TimerEvent = NULL;
+    goto free;
+  }
+
+  Status = gBS->SetTimer (
+                  Device->TimerEvent,
+                  TimerPeriodic,
+                  SYNTHETIC_OPROM_TIMER_PERIOD
+                  );
+  if (EFI_ERROR (Status)) {
+    goto free;
+  }
+
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &ControllerHandle,
+                  &mSyntheticOpRomProtocolGuid,
+                  &Device->Protocol,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    goto free;
+  }
+
+  return EFI_SUCCESS;
+
+free:
+  SyntheticOpRomFreeDevice (Device);
+close:
+  gBS->CloseProtocol (
+         ControllerHandle,
+         &gEfiPciIoProtocolGuid,
+         This->DriverBindingHandle,
+         ControllerHandle
+         );
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+SyntheticOpRomStop (
+  IN  EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN  EFI_HANDLE                   ControllerHandle,
+  IN  UINTN                        NumberOfChildren,
+  IN  EFI_HANDLE                   *ChildHandleBuffer
+  )
+{
+  EFI_STATUS                Status;
+  SYNTHETIC_OPROM_PROTOCOL  *Protocol;
+  SYNTHETIC_OPROM_DEVICE    *Device;
+
+  Status = gBS->OpenProtocol (
+                  ControllerHandle,
+                  &mSyntheticOpRomProtocolGuid,
+                  (VOID **)&Protocol,
+                  This->DriverBindingHandle,
+                  ControllerHandle,
+                  EFI_OPEN_PROTOCOL_GET_PROTOCOL
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Device = SYNTHETIC_OPROM_FROM_PROTOCOL (Protocol);
+  Status = gBS->UninstallMultipleProtocolInterfaces (
+                  ControllerHandle,
+                  &mSyntheticOpRomProtocolGuid,
+                  &Device->Protocol,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  SyntheticOpRomFreeDevice (Device);
+  return gBS->CloseProtocol (
+                ControllerHandle,
+                &gEfiPciIoProtocolGuid,
+                This->DriverBindingHandle,
+                ControllerHandle
+                );
+}
+
+EFI_STATUS
+EFIAPI
+SyntheticOpRomEntryPoint (
+  IN  EFI_HANDLE        ImageHandle,
+  IN  EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  return EfiLibInstallDriverBinding (
+           ImageHandle,
+           SystemTable,
+           &mSyntheticOpRomDriverBinding,
+           ImageHandle
+           );
+}
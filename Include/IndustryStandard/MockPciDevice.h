@@ -0,0 +1,59 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+/*
+ * The fake PCI function exposed by MockPciDevice, for SyntheticOpRom
+ * to drive without real hardware.
+ */
+#define MOCK_PCI_VENDOR_ID  0x8086
+#define MOCK_PCI_DEVICE_ID  0x7E57
+
+#define MOCK_PCI_SEG       0
+#define MOCK_PCI_BUS       0xFE
+#define MOCK_PCI_DEV       0
+#define MOCK_PCI_FUNC      0
+
+/*
+ * BAR 0 has the registers, BAR 1 is plain memory
+ * (e.g. a frame buffer or packet buffers).
+ */
+#define MOCK_PCI_REGS_BAR     0
+#define MOCK_PCI_REGS_SIZE    SIZE_4KB
+#define MOCK_PCI_MEMORY_BAR   1
+#define MOCK_PCI_MEMORY_SIZE  SIZE_64KB
+
+/*
+ * All registers are 32-bit, except for the 64-bit DMA addresses.
+ */
+#define MOCK_PCI_REG_ID          0x00
+#define MOCK_PCI_REG_STATUS      0x04
+#define MOCK_PCI_REG_CONTROL     0x08
+#define MOCK_PCI_REG_POLL_COUNT  0x0C
+#define MOCK_PCI_REG_DMA_SRC     0x10
+#define MOCK_PCI_REG_DMA_DST     0x18
+#define MOCK_PCI_REG_DMA_LENGTH  0x20
+
+#define MOCK_PCI_ID  SIGNATURE_32 ('M', 'O', 'C', 'K')
+
+#define MOCK_PCI_STATUS_BUSY  BIT0
+#define MOCK_PCI_STATUS_DONE  BIT1
+
+/*
+ * START begins copying DMA_LENGTH bytes from DMA_SRC to DMA_DST,
+ * completing after STATUS has been read POLL_COUNT times while busy.
+ * ACK clears DONE.
+ */
+#define MOCK_PCI_CONTROL_START  BIT0
+#define MOCK_PCI_CONTROL_ACK    BIT1
+
+#define MOCK_PCI_DEFAULT_POLL_COUNT  4
@@ -37,3 +37,17 @@ GetShellArgcArgv (
   OUT UINTN       *Argcp,
   OUT CHAR16      ***Argvp
   );
+
+EFI_STATUS
+WriteShellFile (
+  IN  CONST CHAR16  *FileName,
+  IN  CONST VOID    *Buffer,
+  IN  UINTN         BufferSize
+  );
+
+EFI_STATUS
+ReadShellFile (
+  IN  CONST CHAR16  *FileName,
+  OUT VOID          **Buffer,
+  OUT UINTN         *BufferSize
+  );
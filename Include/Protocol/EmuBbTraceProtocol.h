@@ -0,0 +1,74 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#define EMU_BB_TRACE_PROTOCOL_GUID                                  \
+  { 0xc797138f, 0x40a3, 0x43a4, { 0x8e, 0x05, 0x7f, 0xae, 0xb7, 0x9e, 0x82, 0x80 }};
+
+/*
+ * Basic block trace file layout, one file per emulated image:
+ * an EMU_BB_TRACE_FILE_HEADER, BlockCount EMU_BB_TRACE_BLOCK records
+ * and CallCount EMU_BB_TRACE_CALL records. Blocks and call sites are
+ * aggregated (one record per unique block or call site/target pair,
+ * with an execution count) instead of being a raw execution stream.
+ *
+ * All offsets are relative to ImageBase, so traces from different
+ * runs of the same image can be merged. Everything is little-endian.
+ */
+#define EMU_BB_TRACE_SIGNATURE  SIGNATURE_64 ('M', 'A', 'U', 'B', 'B', 'T', 'R', 'C')
+#define EMU_BB_TRACE_VERSION    1
+
+typedef struct {
+  UINT64    Signature;
+  UINT32    Version;
+  UINT16    MachineType;
+  UINT16    Reserved;
+  UINT64    ImageBase;
+  UINT64    ImageSize;
+  UINT64    ImageEntry;
+  UINT32    BlockCount;
+  UINT32    CallCount;
+  /*
+   * Executions/calls not recorded due to a full table.
+   */
+  UINT64    BlocksDropped;
+  UINT64    CallsDropped;
+  /*
+   * NUL-terminated PDB file name, if the image has one.
+   */
+  CHAR8     Name[64];
+} EMU_BB_TRACE_FILE_HEADER;
+
+typedef struct {
+  UINT32    Offset;
+  UINT32    Size;
+  UINT64    Count;
+} EMU_BB_TRACE_BLOCK;
+
+typedef struct {
+  /*
+   * Offset of the return address of the emulated->native call.
+   */
+  UINT32    ReturnOffset;
+  UINT32    Reserved;
+  UINT64    Target;
+  UINT64    Count;
+} EMU_BB_TRACE_CALL;
+
+typedef struct {
+  UINT32    Revision;
+  /*
+   * Writes out traces for all currently registered images.
+   */
+  EFI_STATUS EFIAPI (*Save)(VOID);
+  VOID EFIAPI (*Reset)(VOID);
+} EMU_BB_TRACE_PROTOCOL;
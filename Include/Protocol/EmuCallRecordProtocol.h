@@ -0,0 +1,160 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#define EMU_CALL_RECORD_PROTOCOL_GUID                               \
+  { 0x6553d581, 0xe5e7, 0x49f1, { 0x8d, 0x7a, 0x30, 0x84, 0x4f, 0xc3, 0x24, 0xa3 }};
+
+/*
+ * A call recording is an EMU_CALL_RECORD_HEADER followed by Used bytes
+ * of variable-sized records, each starting with an EMU_CALL_RECORD and
+ * padded to 8 bytes. Unlike the trace ring buffer, the recording is
+ * linear and stops once full, as replay needs everything from the start.
+ *
+ * The recording captures enough to replay emulated code without the
+ * rest of the system: image contents, every native->emulated and
+ * emulated->native call with arguments and return values, emulated
+ * stack changes made by native calls, and snapshots of every page of
+ * RAM read or written by emulated code, taken the first time it is
+ * touched after having been possibly changed by native code.
+ *
+ * Everything is little-endian.
+ */
+#define EMU_CALL_RECORD_SIGNATURE  SIGNATURE_64 ('M', 'A', 'U', 'C', 'A', 'L', 'L', 'S')
+#define EMU_CALL_RECORD_VERSION    1
+
+#define EMU_CALL_RECORD_FLAG_ENABLED     BIT0
+/*
+ * Buffer filled up, recording stopped.
+ */
+#define EMU_CALL_RECORD_FLAG_OVERFLOW    BIT1
+/*
+ * Some memory accesses couldn't be tracked (page table full),
+ * so replay may diverge.
+ */
+#define EMU_CALL_RECORD_FLAG_INCOMPLETE  BIT2
+
+#define EMU_CALL_RECORD_ARGS  16
+
+typedef struct {
+  UINT64    Signature;
+  UINT32    Version;
+  UINT32    HeaderSize;
+  UINT64    BufferSize;
+  UINT64    Used;
+  UINT64    Flags;
+  UINT64    Frequency;
+  UINT64    CounterStart;
+  UINT64    CounterEnd;
+  UINT16    HostMachineType;
+  UINT16    Reserved[3];
+} EMU_CALL_RECORD_HEADER;
+
+typedef enum {
+  /*
+   * EMU_CALL_RECORD_CPU.
+   */
+  EmuRecordCpu = 1,
+  /*
+   * EMU_CALL_RECORD_IMAGE, followed by ImageSize bytes.
+   */
+  EmuRecordImage,
+  /*
+   * EMU_CALL_RECORD_EMU_CALL.
+   */
+  EmuRecordEmuCall,
+  /*
+   * EMU_CALL_RECORD_EMU_RETURN.
+   */
+  EmuRecordEmuReturn,
+  /*
+   * EMU_CALL_RECORD_NATIVE_CALL.
+   */
+  EmuRecordNativeCall,
+  /*
+   * EMU_CALL_RECORD_NATIVE_RETURN, followed by RunCount
+   * EMU_CALL_RECORD_STACK_RUN, each followed by Length bytes.
+   */
+  EmuRecordNativeReturn,
+  /*
+   * EMU_CALL_RECORD_PAGE, followed by EFI_PAGE_SIZE bytes.
+   */
+  EmuRecordPage,
+} EMU_CALL_RECORD_TYPE;
+
+typedef struct {
+  UINT16    Type;
+  UINT16    MachineType;
+  UINT32    Size;
+  UINT64    Timestamp;
+} EMU_CALL_RECORD;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             StackStart;
+  UINT64             StackTop;
+} EMU_CALL_RECORD_CPU;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             ImageBase;
+  UINT64             ImageSize;
+  UINT64             ImageEntry;
+} EMU_CALL_RECORD_IMAGE;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             ProgramCounter;
+  /*
+   * Before arguments are pushed.
+   */
+  UINT64             StackPointer;
+  UINT64             ReturnAddress;
+  UINT64             Args[EMU_CALL_RECORD_ARGS];
+} EMU_CALL_RECORD_EMU_CALL;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             Ret;
+} EMU_CALL_RECORD_EMU_RETURN;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             ProgramCounter;
+  UINT64             ReturnAddress;
+  UINT64             StackPointer;
+  UINT64             Args[EMU_CALL_RECORD_ARGS];
+} EMU_CALL_RECORD_NATIVE_CALL;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             Ret;
+  UINT64             StackPointer;
+  UINT32             RunCount;
+  UINT32             Reserved;
+} EMU_CALL_RECORD_NATIVE_RETURN;
+
+typedef struct {
+  UINT16    Offset;
+  UINT16    Length;
+} EMU_CALL_RECORD_STACK_RUN;
+
+typedef struct {
+  EMU_CALL_RECORD    Record;
+  UINT64             Address;
+} EMU_CALL_RECORD_PAGE;
+
+typedef struct {
+  UINT32                    Revision;
+  EMU_CALL_RECORD_HEADER    *Header;
+  BOOLEAN EFIAPI (*SetEnabled)(BOOLEAN Enabled);
+} EMU_CALL_RECORD_PROTOCOL;
@@ -14,6 +14,13 @@
 #define EMU_TEST_PROTOCOL_GUID                                      \
   { 0x9af2f62c, 0xac9b, 0xa821, { 0xa0, 0x8d, 0xec, 0x9e, 0xc4, 0x21, 0xb1, 0xb0 }};
 
+/*
+ * EmulatorDxe FILE_GUID, for its configuration variables
+ * (e.g. LowMemImages).
+ */
+#define EMU_VARIABLE_GUID                                           \
+  { 0xe6727a5e, 0xcbcd, 0x44c8, { 0xb3, 0x7f, 0x78, 0xbc, 0x3a, 0x0c, 0x16, 0xc8 }}
+
 #define ARG_VAL(x)  ((x##UL << 56) | (x##UL))
 #define RET_VAL  ARG_VAL(0xFF)
 #define FIELD_VAL(x)  ((1UL << 63) | (x##UL << 56) | (x##UL))
@@ -29,8 +36,128 @@ typedef struct {
   UINTN     AArch64ExitPeriodTicks;
   UINTN     AArch64ExitPeriodTbs;
   UINTN     AArch64ContextCount;
+  UINT64    Flags;
+  /*
+   * # of additional engines per ISA for nested entries, the most
+   * engines of one ISA ever in use at once, and the # of nested
+   * entries that found no free engine.
+   */
+  UINTN     EnginePoolSize;
+  UINTN     EngineDepthMax;
+  UINTN     EngineFallbacks;
+  /*
+   * # of RaiseTPL/RestoreTPL calls completed on the shadow TPL.
+   */
+  UINTN     TplShadowCalls;
+  /*
+   * # of x64 rep movs/stos done with CopyMem/SetMem.
+   */
+  UINTN     X64RepStringOps;
+  /*
+   * # of emulated library functions redirected to native ones.
+   */
+  UINTN     HleFunctions;
+  /*
+   * # of emulated GOP Blt calls done natively and emulated.
+   */
+  UINTN     GopBltNative;
+  UINTN     GopBltEmulated;
+  /*
+   * # of PciIo calls completed without leaving the engine.
+   */
+  UINTN     PciIoShadowCalls;
+  /*
+   * # of emulated port I/O accesses ignored by the RAZ/WI policy
+   * and done directly in the host PCI I/O window.
+   */
+  UINTN     PioRazWiOps;
+  UINTN     PioDirectOps;
+  /*
+   * # of x64 rep ins/outs done as a single port FIFO access.
+   */
+  UINTN     X64RepIoOps;
+  /*
+   * # of port I/O accesses done as delays or timing port reads.
+   */
+  UINTN     PioDelayOps;
+  /*
+   * # of allocations made below 4GiB for images that need it,
+   * and of DMA bounce buffers reused.
+   */
+  UINTN     LowMemAllocations;
+  UINTN     LowMemBounceReused;
+  /*
+   * # of wrapped event notifications, and of emulation entries
+   * they were delivered in.
+   */
+  UINTN     EventNotifies;
+  UINTN     EventEntries;
+  /*
+   * # of emulated DriverBinding Supported calls answered from
+   * the cache, and actually emulated.
+   */
+  UINTN     SupportedCacheHits;
+  UINTN     SupportedEmulated;
+  /*
+   * # of emulated SNP Receive calls skipped while backing off
+   * an idle link, and of GetStatus calls with nothing to recycle.
+   */
+  UINTN     SnpPollsSkipped;
+  UINTN     SnpStatusSkipped;
 } EMU_TEST_DEBUG_STATE;
 
+/*
+ * Event notification functions are called via EfiWrappersEventNotify
+ * instead of via the exception path.
+ */
+#define EMU_TEST_DEBUG_FLAG_WRAPPED_EVENTS  BIT0
+
+/*
+ * Functions in protocols installed by emulated drivers are
+ * entered via native trampolines instead of via the exception path.
+ */
+#define EMU_TEST_DEBUG_FLAG_PROTOCOL_TRAMPOLINES  BIT1
+
+/*
+ * EFI_UNSUPPORTED results of DriverBinding Supported functions
+ * installed by emulated drivers are cached.
+ */
+#define EMU_TEST_DEBUG_FLAG_SUPPORTED_CACHE  BIT2
+
+/*
+ * Blt of GOP instances installed by emulated drivers is done
+ * natively on 32bpp BGRX framebuffers.
+ */
+#define EMU_TEST_DEBUG_FLAG_GOP_BLT  BIT3
+
+/*
+ * Idle SNP Receive polling of SNP instances installed by
+ * emulated drivers backs off.
+ */
+#define EMU_TEST_DEBUG_FLAG_SNP_THROTTLE  BIT4
+
+/*
+ * Images listed in the LowMemImages variable get memory below 4GiB.
+ */
+#define EMU_TEST_DEBUG_FLAG_LOW_MEM  BIT5
+
+/*
+ * Library routines matching signatures are redirected to
+ * native code.
+ */
+#define EMU_TEST_DEBUG_FLAG_HLE  BIT6
+
+/*
+ * Emulated x64 accesses to I/O delay and legacy timing
+ * ports are done natively.
+ */
+#define EMU_TEST_DEBUG_FLAG_PIO_DELAY  BIT7
+
+/*
+ * Emulated MP services procedures are run on the BSP.
+ */
+#define EMU_TEST_DEBUG_FLAG_MP_SERVICES  BIT8
+
 typedef struct {
   UINT64     EFIAPI (*TestRet)(VOID);
   EFI_STATUS EFIAPI (*TestArgs)(UINT64, UINT64, UINT64, UINT64,
@@ -47,4 +174,30 @@ typedef struct {
   UINT64     EFIAPI (*GetPerformanceCounterProperties)(UINT64  *StartValue,
                                                        UINT64  *EndValue);
   UINT64     EFIAPI (*GetPerformanceCounter)(VOID);
+  /*
+   * Native call targets with 0, 4, 8 and 16 arguments,
+   * for measuring emulated->native calls.
+   */
+  UINT64     EFIAPI (*TestNop0)(VOID);
+  UINT64     EFIAPI (*TestNop4)(UINT64, UINT64, UINT64, UINT64);
+  UINT64     EFIAPI (*TestNop8)(UINT64, UINT64, UINT64, UINT64,
+                                UINT64, UINT64, UINT64, UINT64);
+  UINT64     EFIAPI (*TestNop16)(UINT64, UINT64, UINT64, UINT64,
+                                 UINT64, UINT64, UINT64, UINT64,
+                                 UINT64, UINT64, UINT64, UINT64,
+                                 UINT64, UINT64, UINT64, UINT64);
+  /*
+   * Calls Cb with ArgCount (0 to 16) arguments Count times from a
+   * native loop, returning the sum of the return values. With Wrapped,
+   * emulated Cb is entered directly via CpuRunFunc instead of via the
+   * exception path taken when native code calls emulated code.
+   */
+  UINT64     EFIAPI (*TestLoopCb)(VOID *Cb, UINTN ArgCount, BOOLEAN Wrapped, UINT64 Count);
+  /*
+   * Calls Cb (Depth) Count times from a native loop. Cb is
+   * expected to call TestNest (Cb, Depth - 1) until Depth is 1,
+   * resulting in calls nested Depth deep.
+   */
+  UINT64     EFIAPI (*TestLoopNest)(UINT64 EFIAPI (*Cb)(UINT64), UINT64 Depth, UINT64 Count);
+  UINT64     EFIAPI (*TestNest)(UINT64 EFIAPI (*Cb)(UINT64), UINT64 Depth);
 } EMU_TEST_PROTOCOL;
@@ -0,0 +1,105 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#define EMU_TRACE_PROTOCOL_GUID                                     \
+  { 0x5bd6c2a4, 0x1e27, 0x4f0b, { 0x9c, 0x3d, 0x7a, 0x61, 0xe8, 0x02, 0x4b, 0x95 }};
+
+/*
+ * The trace buffer is a single contiguous allocation: an EMU_TRACE_HEADER
+ * followed by EntryCount EMU_TRACE_ENTRY records. It is meant to be
+ * decodable without EmulatorDxe being around, e.g. from a raw memory
+ * dump, so everything here is fixed-size and little-endian.
+ *
+ * Head is the number of entries ever written. The most recent entry is
+ * at index (Head - 1) % EntryCount, and only the last
+ * MIN (Head, EntryCount) entries are valid.
+ */
+#define EMU_TRACE_SIGNATURE  SIGNATURE_64 ('M', 'A', 'U', 'T', 'R', 'A', 'C', 'E')
+#define EMU_TRACE_VERSION    1
+
+#define EMU_TRACE_FLAG_ENABLED  BIT0
+
+typedef struct {
+  UINT64    Signature;
+  UINT32    Version;
+  UINT32    HeaderSize;
+  UINT32    EntrySize;
+  UINT32    EntryCount;
+  UINT64    Head;
+  UINT64    Flags;
+  /*
+   * As returned by GetPerformanceCounterProperties,
+   * for converting entry timestamps.
+   */
+  UINT64    Frequency;
+  UINT64    CounterStart;
+  UINT64    CounterEnd;
+  UINT16    HostMachineType;
+  UINT16    Reserved[3];
+} EMU_TRACE_HEADER;
+
+typedef enum {
+  EmuTraceNone = 0,
+  /*
+   * Args: ProgramCounter, Args[0], Args[1], CpuContext->Contexts.
+   */
+  EmuTraceEnterEmulation,
+  /*
+   * Args: ProgramCounter (entry), Ret, CpuExitReason.
+   */
+  EmuTraceExitEmulation,
+  /*
+   * Args: ReturnAddress, ProgramCounter, Target, Args[0]. Target
+   * is the wrapper for EmuTraceWrapperCall, ProgramCounter otherwise.
+   */
+  EmuTraceNativeCall,
+  EmuTraceWrapperCall,
+  /*
+   * Args: ReturnAddress, Ret.
+   */
+  EmuTraceNativeReturn,
+  /*
+   * Args: CpuRunContext, CpuContext->Contexts.
+   */
+  EmuTraceContextAlloc,
+  EmuTraceContextFree,
+  /*
+   * Args: ProgramCounter, ExitPeriodTbs, overshoot ticks.
+   */
+  EmuTraceSliceExpiry,
+  /*
+   * Args: ImageBase, ImageSize, ImageEntry.
+   */
+  EmuTraceImageRegister,
+  /*
+   * Args: ImageBase.
+   */
+  EmuTraceImageUnregister,
+  EmuTraceMax
+} EMU_TRACE_EVENT;
+
+typedef struct {
+  UINT64    Timestamp;
+  UINT16    Event;
+  UINT16    MachineType;
+  UINT32    Reserved;
+  UINT64    Args[4];
+} EMU_TRACE_ENTRY;
+
+typedef struct {
+  UINT32              Revision;
+  EMU_TRACE_HEADER    *Header;
+  UINTN               BufferSize;
+  VOID                EFIAPI (*Reset)(VOID);
+  BOOLEAN             EFIAPI (*SetEnabled)(BOOLEAN Enabled);
+} EMU_TRACE_PROTOCOL;
@@ -0,0 +1,48 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+**/
+
+#pragma once
+
+#define SYNTHETIC_OPROM_PROTOCOL_GUID                               \
+  { 0x3e0d3b5e, 0x6c1a, 0x4f4b, { 0x9d, 0x27, 0x51, 0x8a, 0x02, 0xc4, 0x7e, 0x19 }};
+
+/*
+ * Installed by SyntheticOpRom on the controller it manages.
+ */
+#define SYNTHETIC_OPROM_PROTOCOL_REVISION  1
+
+/*
+ * Bytes copied by the device per transfer.
+ */
+#define SYNTHETIC_OPROM_TRANSFER_SIZE  SIZE_4KB
+
+typedef struct _SYNTHETIC_OPROM_PROTOCOL SYNTHETIC_OPROM_PROTOCOL;
+
+/*
+ * Performs Count device transfers the way a typical OpRom
+ * does I/O: mapping a buffer for DMA, programming the device
+ * via MMIO, polling for completion and checking the result.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *SYNTHETIC_OPROM_TRANSFER)(
+  IN  SYNTHETIC_OPROM_PROTOCOL  *This,
+  IN  UINTN                     Count
+  );
+
+struct _SYNTHETIC_OPROM_PROTOCOL {
+  UINT32                      Revision;
+  SYNTHETIC_OPROM_TRANSFER    Transfer;
+  /*
+   * Number of times the periodic timer event has run.
+   */
+  UINT64                      TimerTicks;
+};
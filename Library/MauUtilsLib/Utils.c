@@ -16,6 +16,7 @@
 #include <Protocol/LoadedImage.h>
 #include <Protocol/EfiShellInterface.h>
 #include <Protocol/ShellParameters.h>
+#include <Protocol/Shell.h>
 
 EFI_STATUS
 GetOpt (
@@ -130,4 +131,114 @@ GetShellArgcArgv (
   }
 
   return EFI_NOT_FOUND;
+}
+
+EFI_STATUS
+WriteShellFile (
+  IN  CONST CHAR16  *FileName,
+  IN  CONST VOID    *Buffer,
+  IN  UINTN         BufferSize
+  )
+{
+  EFI_STATUS          Status;
+  UINTN               Size;
+  SHELL_FILE_HANDLE   Handle;
+  EFI_SHELL_PROTOCOL  *Shell;
+
+  Status = gBS->LocateProtocol (&gEfiShellProtocolGuid, NULL, (VOID **)&Shell);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // Opening with EFI_FILE_MODE_CREATE doesn't truncate, so
+  // get rid of any existing file first.
+  //
+  Status = Shell->OpenFileByName (
+                    FileName,
+                    &Handle,
+                    EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE
+                    );
+  if (!EFI_ERROR (Status)) {
+    Status = Shell->DeleteFile (Handle);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Status = Shell->OpenFileByName (
+                    FileName,
+                    &Handle,
+                    EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE
+                    );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Size   = BufferSize;
+  Status = Shell->WriteFile (Handle, &Size, (VOID *)Buffer);
+  if (!EFI_ERROR (Status) && (Size != BufferSize)) {
+    Status = EFI_VOLUME_FULL;
+  }
+
+  Shell->CloseFile (Handle);
+  return Status;
+}
+
+EFI_STATUS
+ReadShellFile (
+  IN  CONST CHAR16  *FileName,
+  OUT VOID          **Buffer,
+  OUT UINTN         *BufferSize
+  )
+{
+  EFI_STATUS          Status;
+  UINT64              FileSize;
+  UINTN               Size;
+  VOID                *Data;
+  SHELL_FILE_HANDLE   Handle;
+  EFI_SHELL_PROTOCOL  *Shell;
+
+  Status = gBS->LocateProtocol (&gEfiShellProtocolGuid, NULL, (VOID **)&Shell);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Shell->OpenFileByName (FileName, &Handle, EFI_FILE_MODE_READ);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Shell->GetFileSize (Handle, &FileSize);
+  if (EFI_ERROR (Status)) {
+    Shell->CloseFile (Handle);
+    return Status;
+  }
+
+  if (FileSize >= MAX_UINTN) {
+    Shell->CloseFile (Handle);
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  //
+  // NUL-terminated, for the convenience of callers
+  // parsing text files.
+  //
+  Size = (UINTN)FileSize;
+  Data = AllocateZeroPool (Size + 1);
+  if (Data == NULL) {
+    Shell->CloseFile (Handle);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = Shell->ReadFile (Handle, &Size, Data);
+  Shell->CloseFile (Handle);
+  if (EFI_ERROR (Status)) {
+    FreePool (Data);
+    return Status;
+  }
+
+  *Buffer     = Data;
+  *BufferSize = Size;
+  return EFI_SUCCESS;
 }
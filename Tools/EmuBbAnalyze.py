@@ -0,0 +1,367 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+#
+# SPDX-License-Identifier: BSD-2-Clause-Patent
+#
+# Analyzes EmulatorDxe basic block traces (MauBb-*.bin, see
+# Include/Protocol/EmuBbTraceProtocol.h): hot blocks, coverage,
+# native call sites and candidate functions for native replacement.
+#
+
+import argparse
+import collections
+import struct
+import sys
+
+SIGNATURE = b'MAUBBTRC'
+VERSION = 1
+HEADER = struct.Struct('<8sIHHQQQIIQQ64s')
+BLOCK = struct.Struct('<IIQ')
+CALL = struct.Struct('<IIQQ')
+
+MACHINES = {
+    0x8664: 'X64',
+    0xAA64: 'AArch64',
+}
+
+IMAGE_SCN_CNT_CODE = 0x20
+IMAGE_SCN_MEM_EXECUTE = 0x20000000
+IMAGE_DIRECTORY_ENTRY_EXCEPTION = 3
+IMAGE_DIRECTORY_ENTRY_BASERELOC = 5
+IMAGE_REL_BASED_ABSOLUTE = 0
+IMAGE_REL_BASED_DIR64 = 10
+
+
+class Image:
+    """All traces of one image, merged."""
+
+    def __init__(self, name, machine, size):
+        self.name = name
+        self.machine = machine
+        self.size = size
+        self.bases = set()
+        self.blocks = collections.Counter()
+        self.block_size = {}
+        self.calls = collections.Counter()
+        self.blocks_dropped = 0
+        self.calls_dropped = 0
+
+    def total_bytes(self):
+        return sum(count * self.block_size[offset]
+                   for offset, count in self.blocks.items())
+
+
+def load(path, images):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    (sig, version, machine, _, base, size, entry, block_count, call_count,
+     blocks_dropped, calls_dropped, name) = HEADER.unpack_from(data, 0)
+    if sig != SIGNATURE:
+        raise ValueError('not a block trace')
+    if version != VERSION:
+        raise ValueError('unsupported version %u' % version)
+
+    name = name.split(b'\0', 1)[0].decode('ascii', 'replace')
+    key = (name, machine, size)
+    image = images.get(key)
+    if image is None:
+        image = images[key] = Image(name, machine, size)
+
+    image.bases.add(base)
+    image.blocks_dropped += blocks_dropped
+    image.calls_dropped += calls_dropped
+
+    pos = HEADER.size
+    for _ in range(block_count):
+        offset, bsize, count = BLOCK.unpack_from(data, pos)
+        image.blocks[offset] += count
+        image.block_size[offset] = max(image.block_size.get(offset, 0), bsize)
+        pos += BLOCK.size
+
+    for _ in range(call_count):
+        ret, _, target, count = CALL.unpack_from(data, pos)
+        image.calls[(ret, target)] += count
+        pos += CALL.size
+
+
+class PeImage:
+    """Just enough PE parsing for code sections and .pdata."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+
+        pe = struct.unpack_from('<I', self.data, 0x3c)[0]
+        if self.data[pe:pe + 4] != b'PE\0\0':
+            raise ValueError('%s: not a PE image' % path)
+
+        (self.machine, sections, _, _, _, opt_size,
+         _) = struct.unpack_from('<HHIIIHH', self.data, pe + 4)
+        opt = pe + 24
+        if struct.unpack_from('<H', self.data, opt)[0] != 0x20b:
+            raise ValueError('%s: not a PE32+ image' % path)
+
+        self.image_base = struct.unpack_from('<Q', self.data, opt + 24)[0]
+
+        dirs = struct.unpack_from('<I', self.data, opt + 108)[0]
+        self.pdata = (0, 0)
+        if dirs > IMAGE_DIRECTORY_ENTRY_EXCEPTION:
+            self.pdata = struct.unpack_from('<II', self.data,
+                                            opt + 112 + 8 * IMAGE_DIRECTORY_ENTRY_EXCEPTION)
+        self.reloc = (0, 0)
+        if dirs > IMAGE_DIRECTORY_ENTRY_BASERELOC:
+            self.reloc = struct.unpack_from('<II', self.data,
+                                            opt + 112 + 8 * IMAGE_DIRECTORY_ENTRY_BASERELOC)
+
+        self.sections = []
+        pos = opt + opt_size
+        for _ in range(sections):
+            (name, vsize, rva, raw_size, raw_ptr, _, _, _, _,
+             flags) = struct.unpack_from('<8sIIIIIIHHI', self.data, pos)
+            self.sections.append((rva, vsize, raw_ptr, raw_size, flags))
+            pos += 40
+
+    def code_ranges(self):
+        return [(rva, rva + vsize) for rva, vsize, _, _, flags in self.sections
+                if flags & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)]
+
+    def read(self, rva, size):
+        for start, vsize, raw_ptr, raw_size, _ in self.sections:
+            if start <= rva and rva + size <= start + min(vsize, raw_size):
+                return self.data[raw_ptr + rva - start:raw_ptr + rva - start + size]
+        raise ValueError('RVA 0x%x not in image' % rva)
+
+    def read32(self, rva):
+        return struct.unpack('<I', self.read(rva, 4))[0]
+
+    def relocs(self):
+        """RVAs of all base relocations, with their sizes."""
+        rva, size = self.reloc
+        relocs = []
+        end = rva + size
+        while rva + 8 <= end:
+            page, block_size = self.read32(rva), self.read32(rva + 4)
+            if block_size < 8:
+                break
+            for pos in range(rva + 8, rva + block_size, 2):
+                entry = struct.unpack('<H', self.read(pos, 2))[0]
+                kind = entry >> 12
+                if kind != IMAGE_REL_BASED_ABSOLUTE:
+                    relocs.append((page + (entry & 0xfff),
+                                   8 if kind == IMAGE_REL_BASED_DIR64 else 4))
+            rva += block_size
+        return sorted(relocs)
+
+    def functions(self):
+        rva, size = self.pdata
+        funcs = []
+        if self.machine == 0x8664:
+            for pos in range(rva, rva + size, 12):
+                begin, end = self.read32(pos), self.read32(pos + 4)
+                funcs.append((begin, end))
+        elif self.machine == 0xAA64:
+            for pos in range(rva, rva + size, 8):
+                begin, unwind = self.read32(pos), self.read32(pos + 4)
+                if unwind & 3:
+                    length = ((unwind >> 2) & 0x7ff) * 4
+                else:
+                    length = (self.read32(unwind) & 0x3ffff) * 4
+                funcs.append((begin, begin + length))
+        return sorted(funcs)
+
+
+def merged_ranges(image):
+    ranges = []
+    for offset in sorted(image.blocks):
+        end = offset + image.block_size[offset]
+        if ranges and offset <= ranges[-1][1]:
+            ranges[-1][1] = max(ranges[-1][1], end)
+        else:
+            ranges.append([offset, end])
+    return ranges
+
+
+def guess_functions(image, gap):
+    """
+    Without a PE image, cluster executed blocks that are no more than
+    'gap' bytes apart. Not function boundaries, but close enough to
+    find hot loops and leaf routines.
+    """
+    funcs = []
+    for start, end in merged_ranges(image):
+        if funcs and start - funcs[-1][1] <= gap:
+            funcs[-1][1] = end
+        else:
+            funcs.append([start, end])
+    return [tuple(f) for f in funcs]
+
+
+def print_summary(image):
+    total = image.total_bytes()
+    print('%s (%s, 0x%x bytes, loaded at %s)' % (
+        image.name, MACHINES.get(image.machine, '0x%x' % image.machine),
+        image.size, ', '.join('0x%x' % b for b in sorted(image.bases))))
+    print('  %u blocks, %u block executions, %u bytes executed' % (
+        len(image.blocks), sum(image.blocks.values()), total))
+    print('  %u native call sites, %u native calls' % (
+        len(image.calls), sum(image.calls.values())))
+    if image.blocks_dropped or image.calls_dropped:
+        print('  WARNING: %u block executions and %u calls dropped (table full)' % (
+            image.blocks_dropped, image.calls_dropped))
+
+
+def print_hot(image, top):
+    total = image.total_bytes() or 1
+    print()
+    print('  hot blocks (by bytes executed):')
+    print('    %10s %6s %14s %7s' % ('offset', 'size', 'count', '%'))
+    hot = sorted(image.blocks, key=lambda o: image.blocks[o] * image.block_size[o],
+                 reverse=True)
+    for offset in hot[:top]:
+        count = image.blocks[offset]
+        print('    0x%08x %6u %14u %6.2f%%' % (
+            offset, image.block_size[offset], count,
+            100.0 * count * image.block_size[offset] / total))
+
+
+def print_calls(image, top):
+    print()
+    print('  hot native call sites:')
+    print('    %10s %18s %14s' % ('return', 'target', 'count'))
+    for (ret, target), count in image.calls.most_common(top):
+        print('    0x%08x 0x%016x %14u' % (ret, target, count))
+
+
+def print_coverage(image, pe, verbose):
+    ranges = merged_ranges(image)
+    covered = sum(end - start for start, end in ranges)
+    if pe is not None:
+        code = sum(end - start for start, end in pe.code_ranges())
+        what = 'code section'
+    else:
+        code = image.size
+        what = 'image'
+    print()
+    print('  coverage: %u of 0x%x %s bytes (%.2f%%), %u ranges' % (
+        covered, code, what, 100.0 * covered / (code or 1), len(ranges)))
+    if verbose:
+        for start, end in ranges:
+            print('    0x%08x-0x%08x' % (start, end - 1))
+
+
+def print_functions(image, funcs, top):
+    total = image.total_bytes() or 1
+    offsets = sorted(image.blocks)
+    stats = []
+    index = 0
+    for start, end in funcs:
+        while index < len(offsets) and offsets[index] < start:
+            index += 1
+        weight = 0
+        blocks = 0
+        entry = 0
+        pos = index
+        while pos < len(offsets) and offsets[pos] < end:
+            offset = offsets[pos]
+            weight += image.blocks[offset] * image.block_size[offset]
+            blocks += 1
+            if offset == start:
+                entry = image.blocks[offset]
+            pos += 1
+        if weight == 0:
+            continue
+        calls = sum(count for (ret, _), count in image.calls.items()
+                    if start <= ret <= end)
+        targets = len(set(target for (ret, target) in image.calls
+                          if start <= ret <= end))
+        stats.append((weight, start, end, blocks, entry, calls, targets))
+
+    stats.sort(reverse=True)
+    print()
+    print('  candidate functions for native replacement (by bytes executed):')
+    print('    %-23s %7s %6s %12s %10s %7s  %s' % (
+        'range', '%', 'blocks', 'entries', 'nat calls', 'targets', 'note'))
+    for weight, start, end, blocks, entry, calls, targets in stats[:top]:
+        if calls == 0:
+            note = 'leaf, no native calls'
+        elif calls * 1000 < weight:
+            note = 'mostly compute'
+        else:
+            note = 'chatty'
+        print('    0x%08x-0x%08x %6.2f%% %6u %12u %10u %7u  %s' % (
+            start, end - 1, 100.0 * weight / total, blocks, entry, calls,
+            targets, note))
+
+
+def write_drcov(path, images):
+    """
+    drcov v2, as understood by Lighthouse and friends. Each image
+    becomes a module, based at the first load address seen.
+    """
+    with open(path, 'wb') as f:
+        f.write(b'DRCOV VERSION: 2\nDRCOV FLAVOR: drcov\n')
+        f.write(b'Module Table: version 2, count %u\n' % len(images))
+        f.write(b'Columns: id, base, end, entry, checksum, timestamp, path\n')
+        for index, image in enumerate(images):
+            base = min(image.bases)
+            f.write(b'%3u, 0x%016x, 0x%016x, 0x%016x, 0x%08x, 0x%08x, %s\n' % (
+                index, base, base + image.size, 0, 0, 0, image.name.encode()))
+        count = sum(len(image.blocks) for image in images)
+        f.write(b'BB Table: %u bbs\n' % count)
+        for index, image in enumerate(images):
+            for offset in sorted(image.blocks):
+                f.write(struct.pack('<IHH', offset,
+                                    min(image.block_size[offset], 0xffff), index))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Analyze EmulatorDxe basic block traces.')
+    parser.add_argument('files', nargs='+', help='MauBb-*.bin trace files')
+    parser.add_argument('--top', type=int, default=20, help='number of entries in each list')
+    parser.add_argument('--calls', action='store_true', help='list hot native call sites')
+    parser.add_argument('--coverage', action='store_true', help='report coverage')
+    parser.add_argument('--ranges', action='store_true', help='list covered ranges with --coverage')
+    parser.add_argument('--functions', action='store_true',
+                        help='list candidate functions for native replacement')
+    parser.add_argument('--image', help='PE image the traces are for, for code sections and .pdata')
+    parser.add_argument('--gap', type=int, default=64,
+                        help='max gap between blocks of a guessed function without --image')
+    parser.add_argument('--drcov', help='write drcov coverage to this file')
+    args = parser.parse_args()
+
+    images = {}
+    for path in args.files:
+        try:
+            load(path, images)
+        except (ValueError, struct.error) as e:
+            print('%s: %s' % (path, e), file=sys.stderr)
+
+    if not images:
+        sys.exit('no traces loaded')
+
+    pe = PeImage(args.image) if args.image else None
+    if pe is not None and len(images) > 1:
+        sys.exit('--image only makes sense with traces of a single image')
+
+    for image in images.values():
+        print_summary(image)
+        print_hot(image, args.top)
+        if args.calls:
+            print_calls(image, args.top)
+        if args.coverage:
+            print_coverage(image, pe, args.ranges)
+        if args.functions:
+            funcs = pe.functions() if pe is not None else []
+            if not funcs:
+                funcs = guess_functions(image, args.gap)
+            print_functions(image, funcs, args.top)
+        print()
+
+    if args.drcov:
+        write_drcov(args.drcov, list(images.values()))
+
+
+if __name__ == '__main__':
+    main()
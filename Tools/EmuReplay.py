@@ -0,0 +1,542 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+#
+# SPDX-License-Identifier: BSD-2-Clause-Patent
+#
+# Replays EmulatorDxe call recordings (see
+# Include/Protocol/EmuCallRecordProtocol.h) on the host with the
+# stock Unicorn Python bindings, satisfying native calls from the
+# recording, to detect behavior changes without the original system.
+#
+# Times measured here are those of stock Unicorn. Use Tools/EmuReplay,
+# built against the unicorn-for-efi tree used by EmulatorDxe, to
+# measure emulation performance.
+#
+
+import argparse
+import collections
+import csv
+import ctypes
+import statistics
+import struct
+import sys
+import time
+
+try:
+    import unicorn
+    from unicorn import x86_const, arm64_const
+except ImportError:
+    sys.exit('the unicorn Python bindings are required (pip install unicorn)')
+
+SIGNATURE = b'MAUCALLS'
+VERSION = 1
+HEADER = struct.Struct('<8sIIQQQQQQH6s')
+RECORD = struct.Struct('<HHIQ')
+CPU = struct.Struct('<QQ')
+IMAGE = struct.Struct('<QQQ')
+EMU_CALL = struct.Struct('<QQQ16Q')
+EMU_RETURN = struct.Struct('<Q')
+NATIVE_CALL = struct.Struct('<QQQ16Q')
+NATIVE_RETURN = struct.Struct('<QQII')
+STACK_RUN = struct.Struct('<HH')
+PAGE = struct.Struct('<Q')
+
+FLAG_OVERFLOW = 1 << 1
+FLAG_INCOMPLETE = 1 << 2
+
+REC_CPU = 1
+REC_IMAGE = 2
+REC_EMU_CALL = 3
+REC_EMU_RETURN = 4
+REC_NATIVE_CALL = 5
+REC_NATIVE_RETURN = 6
+REC_PAGE = 7
+
+PAGE_SIZE = 4096
+PAGE_MASK = PAGE_SIZE - 1
+
+MACHINES = {
+    0x8664: 'X64',
+    0xAA64: 'AArch64',
+}
+
+
+class Record:
+    __slots__ = ('type', 'machine', 'timestamp', 'fields', 'data')
+
+    def __init__(self, rtype, machine, timestamp, fields, data=b''):
+        self.type = rtype
+        self.machine = machine
+        self.timestamp = timestamp
+        self.fields = fields
+        self.data = data
+
+
+class Recording:
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+
+        (sig, version, header_size, _, used, self.flags, self.frequency,
+         _, _, self.host_machine, _) = HEADER.unpack_from(data, 0)
+        if sig != SIGNATURE:
+            raise ValueError('not a call recording')
+        if version != VERSION:
+            raise ValueError('unsupported version %u' % version)
+
+        self.records = []
+        pos = header_size
+        end = min(header_size + used, len(data))
+        while pos + RECORD.size <= end:
+            rtype, machine, size, timestamp = RECORD.unpack_from(data, pos)
+            if size < RECORD.size or pos + size > end:
+                raise ValueError('bad record at 0x%x' % pos)
+            body = pos + RECORD.size
+            if rtype == REC_CPU:
+                fields = CPU.unpack_from(data, body)
+                extra = b''
+            elif rtype == REC_IMAGE:
+                fields = IMAGE.unpack_from(data, body)
+                extra = data[body + IMAGE.size:body + IMAGE.size + fields[1]]
+            elif rtype == REC_EMU_CALL:
+                fields = EMU_CALL.unpack_from(data, body)
+                extra = b''
+            elif rtype == REC_EMU_RETURN:
+                fields = EMU_RETURN.unpack_from(data, body)
+                extra = b''
+            elif rtype == REC_NATIVE_CALL:
+                fields = NATIVE_CALL.unpack_from(data, body)
+                extra = b''
+            elif rtype == REC_NATIVE_RETURN:
+                fields = NATIVE_RETURN.unpack_from(data, body)
+                runs = []
+                run = body + NATIVE_RETURN.size
+                for _ in range(fields[2]):
+                    offset, length = STACK_RUN.unpack_from(data, run)
+                    run += STACK_RUN.size
+                    runs.append((offset, data[run:run + length]))
+                    run += length
+                extra = runs
+            elif rtype == REC_PAGE:
+                fields = PAGE.unpack_from(data, body)
+                extra = data[body + PAGE.size:body + PAGE.size + PAGE_SIZE]
+            else:
+                raise ValueError('unknown record type %u at 0x%x' % (rtype, pos))
+            self.records.append(Record(rtype, machine, timestamp, fields, extra))
+            pos += size
+
+        if self.flags & FLAG_OVERFLOW:
+            print('WARNING: recording buffer overflowed, replaying up to the overflow',
+                  file=sys.stderr)
+        if self.flags & FLAG_INCOMPLETE:
+            print('WARNING: recording page table overflowed, replay may diverge',
+                  file=sys.stderr)
+
+
+class Memory:
+    """
+    Guest physical memory, shared by all engines by mapping
+    the same host buffers into each.
+    """
+
+    def __init__(self):
+        self.pages = {}
+        self.engines = []
+        self.zero_filled = 0
+
+    def add_engine(self, uc):
+        self.engines.append(uc)
+        for page, (buf, perms) in self.pages.items():
+            uc.mem_map_ptr(page, PAGE_SIZE, perms, ctypes.addressof(buf))
+
+    def ensure(self, page, perms=unicorn.UC_PROT_READ | unicorn.UC_PROT_WRITE):
+        entry = self.pages.get(page)
+        if entry is not None:
+            return entry[0]
+        buf = ctypes.create_string_buffer(PAGE_SIZE)
+        self.pages[page] = (buf, perms)
+        for uc in self.engines:
+            uc.mem_map_ptr(page, PAGE_SIZE, perms, ctypes.addressof(buf))
+        return buf
+
+    def write(self, address, data, perms=unicorn.UC_PROT_READ | unicorn.UC_PROT_WRITE):
+        pos = 0
+        while pos < len(data):
+            page = (address + pos) & ~PAGE_MASK
+            offset = (address + pos) & PAGE_MASK
+            length = min(PAGE_SIZE - offset, len(data) - pos)
+            buf = self.ensure(page, perms)
+            ctypes.memmove(ctypes.addressof(buf) + offset, data[pos:pos + length], length)
+            pos += length
+
+    def unmapped_cb(self, uc, access, address, size, value, user_data):
+        """
+        Memory that was never snapshotted, e.g. MMIO.
+        """
+        self.ensure(address & ~PAGE_MASK)
+        if (address + size - 1) & ~PAGE_MASK != address & ~PAGE_MASK:
+            self.ensure((address + size - 1) & ~PAGE_MASK)
+        self.zero_filled += 1
+        return True
+
+
+class X64:
+    arch = (unicorn.UC_ARCH_X86, unicorn.UC_MODE_64)
+    sp = x86_const.UC_X86_REG_RSP
+    pc = x86_const.UC_X86_REG_RIP
+    ret = x86_const.UC_X86_REG_RAX
+    regs = (x86_const.UC_X86_REG_RCX, x86_const.UC_X86_REG_RDX,
+            x86_const.UC_X86_REG_R8, x86_const.UC_X86_REG_R9)
+
+    @staticmethod
+    def push(uc, value):
+        sp = uc.reg_read(X64.sp) - 8
+        uc.mem_write(sp, struct.pack('<Q', value))
+        uc.reg_write(X64.sp, sp)
+
+    @staticmethod
+    def thunk_pre(uc, args, return_address):
+        for reg, arg in zip(X64.regs, args):
+            uc.reg_write(reg, arg)
+        for arg in reversed(args[4:]):
+            X64.push(uc, arg)
+        for _ in range(4):
+            X64.push(uc, 0)
+        X64.push(uc, return_address)
+
+    @staticmethod
+    def call_args(uc):
+        sp = uc.reg_read(X64.sp)
+        stack = struct.unpack('<17Q', uc.mem_read(sp, 17 * 8))
+        return [uc.reg_read(r) for r in X64.regs] + list(stack[5:17]), stack[0]
+
+    @staticmethod
+    def native_return(uc):
+        sp = uc.reg_read(X64.sp)
+        ret = struct.unpack('<Q', uc.mem_read(sp, 8))[0]
+        uc.reg_write(X64.sp, sp + 8)
+        return ret
+
+
+class AArch64:
+    arch = (unicorn.UC_ARCH_ARM64, unicorn.UC_MODE_ARM)
+    sp = arm64_const.UC_ARM64_REG_SP
+    pc = arm64_const.UC_ARM64_REG_PC
+    ret = arm64_const.UC_ARM64_REG_X0
+    lr = arm64_const.UC_ARM64_REG_LR
+    regs = tuple(getattr(arm64_const, 'UC_ARM64_REG_X%u' % i) for i in range(8))
+
+    @staticmethod
+    def thunk_pre(uc, args, return_address):
+        for reg, arg in zip(AArch64.regs, args):
+            uc.reg_write(reg, arg)
+        sp = uc.reg_read(AArch64.sp)
+        for arg in reversed(args[8:]):
+            sp -= 8
+            uc.mem_write(sp, struct.pack('<Q', arg))
+        uc.reg_write(AArch64.sp, sp)
+        uc.reg_write(AArch64.lr, return_address)
+
+    @staticmethod
+    def call_args(uc):
+        sp = uc.reg_read(AArch64.sp)
+        stack = struct.unpack('<8Q', uc.mem_read(sp, 8 * 8))
+        return [uc.reg_read(r) for r in AArch64.regs] + list(stack), uc.reg_read(AArch64.lr)
+
+    @staticmethod
+    def native_return(uc):
+        return uc.reg_read(AArch64.lr)
+
+
+ARCHS = {
+    0x8664: X64,
+    0xAA64: AArch64,
+}
+
+
+class Diverged(Exception):
+    pass
+
+
+class ExitUnwind(Exception):
+    pass
+
+
+class Stats:
+    def __init__(self):
+        self.calls = collections.Counter()
+        self.host = collections.Counter()
+        self.target = collections.Counter()
+
+
+class Replay:
+    def __init__(self, recording, verbose):
+        self.rec = recording
+        self.records = recording.records
+        self.pos = 0
+        self.depth = 0
+        self.verbose = verbose
+        self.memory = Memory()
+        self.engines = {}
+        self.images = []
+        self.stats = Stats()
+        self.divergences = []
+        self.current = []
+
+    def peek(self):
+        if self.pos < len(self.records):
+            return self.records[self.pos]
+        return None
+
+    def take(self):
+        r = self.records[self.pos]
+        self.pos += 1
+        if r.type == REC_EMU_CALL:
+            self.depth += 1
+        elif r.type == REC_EMU_RETURN:
+            self.depth -= 1
+        return r
+
+    def diverge(self, what):
+        self.divergences.append((self.pos, what))
+        if self.verbose:
+            print('divergence at record %u: %s' % (self.pos, what), file=sys.stderr)
+
+    def label(self, address):
+        for base, size, name in self.images:
+            if base <= address < base + size:
+                return '%s+0x%x' % (name, address - base)
+        return '0x%x' % address
+
+    def engine(self, machine):
+        uc = self.engines.get(machine)
+        if uc is None:
+            uc = unicorn.Uc(*ARCHS[machine].arch)
+            uc.hook_add(unicorn.UC_HOOK_MEM_READ_UNMAPPED | unicorn.UC_HOOK_MEM_WRITE_UNMAPPED,
+                        self.memory.unmapped_cb)
+            self.memory.add_engine(uc)
+            self.engines[machine] = uc
+        return uc
+
+    def apply(self, r):
+        if r.type == REC_CPU:
+            self.engine(r.machine)
+            start, top = r.fields
+            for page in range(start & ~PAGE_MASK, top, PAGE_SIZE):
+                self.memory.ensure(page)
+        elif r.type == REC_IMAGE:
+            base, size, entry = r.fields
+            self.images.append((base, size, '%s@0x%x' % (
+                MACHINES.get(r.machine, '0x%x' % r.machine), base)))
+            self.memory.write(base, r.data, unicorn.UC_PROT_ALL)
+        elif r.type == REC_PAGE:
+            self.memory.write(r.fields[0], r.data)
+
+    def resume(self):
+        """
+        Brings memory up to date before running emulated code,
+        and replays any emulated event callbacks that fired
+        while it was running.
+        """
+        while True:
+            r = self.peek()
+            if r is None:
+                return
+            if r.type == REC_PAGE:
+                self.apply(self.take())
+            elif r.type == REC_EMU_CALL:
+                self.nested_emu_call(self.take())
+            else:
+                return
+
+    def nested_emu_call(self, r):
+        """
+        Runs an emulated call without clobbering the state of
+        an engine that is in the middle of running another one.
+        """
+        if r.machine not in ARCHS:
+            self.emu_call(r)
+            return
+        uc = self.engine(r.machine)
+        context = uc.context_save()
+        self.emu_call(r)
+        uc.context_restore(context)
+
+    def native_call(self, uc, arch, pc, native_time):
+        r = self.peek()
+        if r is None or r.type != REC_NATIVE_CALL:
+            raise Diverged('unexpected native call to 0x%x from %s' % (
+                pc, self.label(arch.call_args(uc)[1])))
+        r = self.take()
+        rec_pc, rec_return, _ = r.fields[:3]
+        args, return_address = arch.call_args(uc)
+        if rec_pc != pc or rec_return != return_address:
+            raise Diverged('native call to 0x%x from %s, recorded 0x%x from %s' % (
+                pc, self.label(return_address), rec_pc, self.label(rec_return)))
+        if list(r.fields[3:3 + len(arch.regs)]) != args[:len(arch.regs)]:
+            self.diverge('native call to 0x%x from %s with different arguments' % (
+                pc, self.label(return_address)))
+
+        while True:
+            n = self.peek()
+            if n is None:
+                raise Diverged('recording ends inside native call to 0x%x' % pc)
+            if n.type == REC_EMU_CALL:
+                self.nested_emu_call(self.take())
+            elif n.type == REC_NATIVE_RETURN:
+                n = self.take()
+                ret, sp, _, _ = n.fields
+                for offset, data in n.data:
+                    self.memory.write(sp + offset, data)
+                uc.reg_write(arch.ret, ret)
+                native_time[0] += n.timestamp - r.timestamp
+                return arch.native_return(uc)
+            elif n.type == REC_EMU_RETURN:
+                raise ExitUnwind()
+            elif n.type in (REC_PAGE, REC_CPU, REC_IMAGE):
+                self.apply(self.take())
+            else:
+                raise Diverged('unexpected record type %u in native call to 0x%x' % (
+                    n.type, pc))
+
+    def emu_call(self, r):
+        pc, sp, return_address = r.fields[:3]
+        args = list(r.fields[3:])
+        depth = self.depth
+        if r.machine not in ARCHS:
+            self.diverge('unsupported machine type 0x%x' % r.machine)
+            while self.depth >= depth and self.pos < len(self.records):
+                self.take()
+            return
+
+        uc = self.engine(r.machine)
+        arch = ARCHS[r.machine]
+        key = self.label(pc)
+        native_time = [0]
+        host = 0.0
+
+        uc.reg_write(arch.sp, sp)
+        arch.thunk_pre(uc, args, return_address)
+
+        try:
+            while True:
+                self.resume()
+                start = time.perf_counter()
+                try:
+                    uc.emu_start(pc, return_address)
+                    host += time.perf_counter() - start
+                    pc = uc.reg_read(arch.pc)
+                except unicorn.UcError as e:
+                    host += time.perf_counter() - start
+                    pc = uc.reg_read(arch.pc)
+                    if e.errno not in (unicorn.UC_ERR_FETCH_UNMAPPED, unicorn.UC_ERR_FETCH_PROT):
+                        raise Diverged('%s at %s' % (e, self.label(pc)))
+
+                if pc == return_address:
+                    break
+
+                pc = self.native_call(uc, arch, pc, native_time)
+
+            n = self.peek()
+            if n is None or n.type != REC_EMU_RETURN:
+                raise Diverged('%s returned early' % key)
+            n = self.take()
+            ret = uc.reg_read(arch.ret)
+            if ret != n.fields[0]:
+                self.diverge('%s returned 0x%x, recorded 0x%x' % (key, ret, n.fields[0]))
+        except ExitUnwind:
+            n = self.take()
+        except Diverged as e:
+            self.diverge(str(e))
+            # Skip the rest of this call in the recording.
+            while self.depth >= depth and self.pos < len(self.records):
+                self.take()
+            n = None
+
+        self.stats.calls[key] += 1
+        self.stats.host[key] += host
+        if n is not None:
+            self.stats.target[key] += n.timestamp - r.timestamp - native_time[0]
+
+    def run(self):
+        while self.pos < len(self.records):
+            r = self.take()
+            if r.type == REC_EMU_CALL:
+                self.emu_call(r)
+            elif r.type in (REC_PAGE, REC_CPU, REC_IMAGE):
+                self.apply(r)
+            else:
+                self.diverge('unexpected record type %u at top level' % r.type)
+
+
+def load_baseline(path):
+    baseline = {}
+    with open(path, newline='') as f:
+        for row in csv.DictReader(f):
+            baseline[row['entry']] = float(row['host_us'])
+    return baseline
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay EmulatorDxe call recordings.')
+    parser.add_argument('file', help='recording saved with EmuTrace.efi -c')
+    parser.add_argument('--iterations', type=int, default=1,
+                        help='number of replays, host times are the median')
+    parser.add_argument('--top', type=int, default=20, help='number of entry points listed')
+    parser.add_argument('--csv', help='write per-entry point times to this file')
+    parser.add_argument('--baseline', help='compare host times with a CSV from an earlier run')
+    parser.add_argument('--verbose', action='store_true', help='print every divergence')
+    args = parser.parse_args()
+
+    try:
+        recording = Recording(args.file)
+    except (ValueError, struct.error) as e:
+        sys.exit('%s: %s' % (args.file, e))
+
+    host = collections.defaultdict(list)
+    for _ in range(max(args.iterations, 1)):
+        replay = Replay(recording, args.verbose)
+        replay.run()
+        for key, value in replay.stats.host.items():
+            host[key].append(value)
+
+    stats = replay.stats
+    frequency = recording.frequency or 1
+    print('%u records, %u emulated calls, %u divergences, %u zero-filled accesses' % (
+        len(recording.records), sum(stats.calls.values()), len(replay.divergences),
+        replay.memory.zero_filled))
+    for pos, what in replay.divergences[:10]:
+        print('  record %u: %s' % (pos, what))
+
+    rows = []
+    for key, calls in stats.calls.items():
+        rows.append((statistics.median(host[key]) * 1e6, key, calls,
+                     stats.target[key] * 1e6 / frequency))
+    rows.sort(reverse=True)
+
+    baseline = load_baseline(args.baseline) if args.baseline else {}
+    total_host = sum(row[0] for row in rows)
+    total_target = sum(row[3] for row in rows)
+    print('host %.0fus, target %.0fus (excluding native calls)' % (total_host, total_target))
+    print()
+    print('  %-32s %8s %12s %12s %8s' % ('entry', 'calls', 'host us', 'target us',
+                                          'vs base' if baseline else ''))
+    for host_us, key, calls, target_us in rows[:args.top]:
+        base = baseline.get(key)
+        print('  %-32s %8u %12.1f %12.1f %8s' % (
+            key, calls, host_us, target_us,
+            '%.2fx' % (host_us / base) if base else ''))
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(['entry', 'calls', 'host_us', 'target_us'])
+            for host_us, key, calls, target_us in rows:
+                writer.writerow([key, calls, '%.3f' % host_us, '%.3f' % target_us])
+
+    sys.exit(1 if replay.divergences else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1768 @@
+/** @file
+
+    Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+
+    SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+/*
+ * Replays EmulatorDxe call recordings (see
+ * Include/Protocol/EmuCallRecordProtocol.h) on the host, linked against
+ * the same unicorn-for-efi tree EmulatorDxe is built with, satisfying
+ * native calls from the recording.
+ *
+ * Engines are set up the way CpuInitEx does it: native code is detected
+ * with a UC_HOOK_TB_FIND_FAILURE hook (surfacing as UC_ERR_FIND_TB),
+ * uc_ctl_exits_enable is set, emulation is sliced with a UC_HOOK_BLOCK
+ * hook re-calibrated with the same constants, and the emulated<->native
+ * calling conventions match CpuX64EmuThunkPre/CpuAArch64EmuThunkPre and
+ * NativeThunkX64/NativeThunkAArch64. Measured times thus reflect the
+ * Unicorn build and engine configuration used by EmulatorDxe.
+ *
+ * See "Building With MAU_CALL_RECORD=YES" in Docs/Building.md.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unicorn/unicorn.h>
+
+typedef uint8_t    UINT8;
+typedef uint16_t   UINT16;
+typedef uint32_t   UINT32;
+typedef uint64_t   UINT64;
+typedef uintptr_t  UINTN;
+typedef char       CHAR8;
+typedef bool       BOOLEAN;
+#define VOID    void
+#define STATIC  static
+#define IN
+#define OUT
+#define EFIAPI
+#define TRUE   true
+#define FALSE  false
+#define BIT0   0x00000001
+#define BIT1   0x00000002
+#define BIT2   0x00000004
+#define SIGNATURE_16(A, B)        ((A) | (B << 8))
+#define SIGNATURE_32(A, B, C, D)  (SIGNATURE_16 (A, B) | (SIGNATURE_16 (C, D) << 16))
+#define SIGNATURE_64(A, B, C, D, E, F, G, H) \
+    (SIGNATURE_32 (A, B, C, D) | ((UINT64) (SIGNATURE_32 (E, F, G, H)) << 32))
+
+#include <Protocol/EmuCallRecordProtocol.h>
+
+#define EFI_IMAGE_MACHINE_X64          0x8664
+#define EFI_IMAGE_MACHINE_AARCH64      0xAA64
+#define EFI_IMAGE_MACHINE_RISCV64      0x5064
+#define EFI_PAGE_SIZE                  0x1000
+#define EFI_PAGE_MASK                  (EFI_PAGE_SIZE - 1)
+#define UC_EMU_EXIT_PERIOD_TB_MAX      0x100000
+#define UC_EMU_EXIT_PERIOD_TB_INITIAL  0x1000
+#define UC_EMU_EXIT_PERIOD_TB_MIN      0x100
+#define UC_EMU_EXIT_PERIOD_MS          10
+#define MAX_DIVERGENCES_LISTED         10
+#define MAX_CONTEXTS                   64
+
+typedef enum {
+  ReplayOk,
+  ReplayDiverged,
+  ReplayUnwind,
+} ReplayStatus;
+
+typedef struct {
+  UINT64    Address;
+  UINT8     *Data;
+  UINT32    Perms;
+} ReplayPage;
+
+typedef struct {
+  UINT64    Base;
+  UINT64    Size;
+  UINT16    MachineType;
+} ReplayImage;
+
+typedef struct {
+  UINT64    ProgramCounter;
+  UINT64    Calls;
+  UINT64    TargetTicks;
+  double    *Host;
+} ReplayEntry;
+
+typedef struct ReplayCpu {
+  uc_engine    *UE;
+  UINT16       MachineType;
+  int          StackReg;
+  int          ProgramCounterReg;
+  int          ReturnValueReg;
+  VOID         (*EmuThunkPre)(
+    struct ReplayCpu  *Cpu,
+    UINT64            *Args,
+    UINT64            ReturnAddress
+    );
+  VOID         (*GetCallArgs)(
+    struct ReplayCpu  *Cpu,
+    UINT64            *Args,
+    UINT64            *ReturnAddress
+    );
+  UINT64       (*NativeReturn)(
+    struct ReplayCpu  *Cpu
+    );
+  UINT64       ReturnAddress;
+  UINT64       TbCount;
+  UINT64       ExitPeriodTbs;
+  BOOLEAN      StoppedOnTimeout;
+  struct Replay *Replay;
+} ReplayCpu;
+
+typedef struct {
+  UINT8                     *Data;
+  UINTN                     Size;
+  EMU_CALL_RECORD_HEADER    *Header;
+  EMU_CALL_RECORD           **Records;
+  UINTN                     Count;
+} Recording;
+
+typedef struct Replay {
+  Recording      *Rec;
+  UINTN          Pos;
+  UINTN          Depth;
+  BOOLEAN        Verbose;
+  unsigned       Iteration;
+  unsigned       Iterations;
+  ReplayPage     *Pages;
+  UINTN          PageCount;
+  UINTN          PageSlots;
+  ReplayImage    *Images;
+  UINTN          ImageCount;
+  ReplayCpu      X64;
+  ReplayCpu      AArch64;
+  UINTN          ZeroFilled;
+  UINTN          Divergences;
+  CHAR8          *Listed[MAX_DIVERGENCES_LISTED];
+  ReplayEntry    *Entries;
+  UINTN          EntryCount;
+  UINTN          EntrySlots;
+} Replay;
+
+STATIC
+double
+Now (
+  VOID
+  )
+{
+  struct timespec  Ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &Ts);
+  return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+STATIC
+VOID *
+XAlloc (
+  IN  UINTN  Size
+  )
+{
+  VOID  *Buffer;
+
+  Buffer = calloc (1, Size);
+  if (Buffer == NULL) {
+    fprintf (stderr, "out of memory\n");
+    exit (2);
+  }
+
+  return Buffer;
+}
+
+STATIC
+VOID
+UcCheck (
+  IN  uc_err       UcErr,
+  IN  const CHAR8  *What
+  )
+{
+  if (UcErr != UC_ERR_OK) {
+    fprintf (stderr, "%s failed: %s\n", What, uc_strerror (UcErr));
+    exit (2);
+  }
+}
+
+STATIC
+UINT64
+RegRead (
+  IN  ReplayCpu  *Cpu,
+  IN  int        Reg
+  )
+{
+  UINT64  Value;
+
+  UcCheck (uc_reg_read (Cpu->UE, Reg, &Value), "uc_reg_read");
+  return Value;
+}
+
+STATIC
+VOID
+RegWrite (
+  IN  ReplayCpu  *Cpu,
+  IN  int        Reg,
+  IN  UINT64     Value
+  )
+{
+  UcCheck (uc_reg_write (Cpu->UE, Reg, &Value), "uc_reg_write");
+}
+
+STATIC
+const CHAR8 *
+MachineName (
+  IN  UINT16  MachineType
+  )
+{
+  switch (MachineType) {
+    case EFI_IMAGE_MACHINE_X64:
+      return "X64";
+    case EFI_IMAGE_MACHINE_AARCH64:
+      return "AArch64";
+    default:
+      return NULL;
+  }
+}
+
+STATIC
+int
+RecordingLoad (
+  IN  const CHAR8  *Path,
+  OUT Recording    *Rec
+  )
+{
+  FILE             *File;
+  long             Length;
+  UINT8            *Pos;
+  UINT8            *End;
+  EMU_CALL_RECORD  *Record;
+  UINTN            MinSize;
+  UINTN            Slots;
+
+  File = fopen (Path, "rb");
+  if (File == NULL) {
+    fprintf (stderr, "%s: cannot open\n", Path);
+    return -1;
+  }
+
+  fseek (File, 0, SEEK_END);
+  Length = ftell (File);
+  fseek (File, 0, SEEK_SET);
+  Rec->Data = XAlloc (Length + 1);
+  Rec->Size = fread (Rec->Data, 1, Length, File);
+  fclose (File);
+
+  Rec->Header = (EMU_CALL_RECORD_HEADER *)Rec->Data;
+  if ((Rec->Size < sizeof (EMU_CALL_RECORD_HEADER)) ||
+      (Rec->Header->Signature != EMU_CALL_RECORD_SIGNATURE))
+  {
+    fprintf (stderr, "%s: not a call recording\n", Path);
+    return -1;
+  }
+
+  if (Rec->Header->Version != EMU_CALL_RECORD_VERSION) {
+    fprintf (stderr, "%s: unsupported version %u\n", Path, Rec->Header->Version);
+    return -1;
+  }
+
+  Pos = Rec->Data + Rec->Header->HeaderSize;
+  End = Rec->Data + Rec->Size;
+  if (Rec->Header->Used < (UINT64)(End - Pos)) {
+    End = Pos + Rec->Header->Used;
+  }
+
+  Slots = 0;
+  while (Pos + sizeof (EMU_CALL_RECORD) <= End) {
+    Record = (EMU_CALL_RECORD *)Pos;
+    switch (Record->Type) {
+      case EmuRecordCpu:
+        MinSize = sizeof (EMU_CALL_RECORD_CPU);
+        break;
+      case EmuRecordImage:
+        MinSize = sizeof (EMU_CALL_RECORD_IMAGE);
+        if (Record->Size >= MinSize) {
+          MinSize += ((EMU_CALL_RECORD_IMAGE *)Record)->ImageSize;
+        }
+
+        break;
+      case EmuRecordEmuCall:
+        MinSize = sizeof (EMU_CALL_RECORD_EMU_CALL);
+        break;
+      case EmuRecordEmuReturn:
+        MinSize = sizeof (EMU_CALL_RECORD_EMU_RETURN);
+        break;
+      case EmuRecordNativeCall:
+        MinSize = sizeof (EMU_CALL_RECORD_NATIVE_CALL);
+        break;
+      case EmuRecordNativeReturn:
+        MinSize = sizeof (EMU_CALL_RECORD_NATIVE_RETURN);
+        break;
+      case EmuRecordPage:
+        MinSize = sizeof (EMU_CALL_RECORD_PAGE) + EFI_PAGE_SIZE;
+        break;
+      default:
+        fprintf (
+          stderr,
+          "%s: unknown record type %u at 0x%lx\n",
+          Path,
+          Record->Type,
+          (unsigned long)(Pos - Rec->Data)
+          );
+        return -1;
+    }
+
+    if ((Record->Size < MinSize) || (Pos + Record->Size > End)) {
+      fprintf (stderr, "%s: bad record at 0x%lx\n", Path, (unsigned long)(Pos - Rec->Data));
+      return -1;
+    }
+
+    if (Rec->Count == Slots) {
+      Slots        = Slots != 0 ? Slots * 2 : 4096;
+      Rec->Records = realloc (Rec->Records, Slots * sizeof (*Rec->Records));
+      if (Rec->Records == NULL) {
+        fprintf (stderr, "out of memory\n");
+        exit (2);
+      }
+    }
+
+    Rec->Records[Rec->Count++] = Record;
+    Pos                       += Record->Size;
+  }
+
+  if ((Rec->Header->Flags & EMU_CALL_RECORD_FLAG_OVERFLOW) != 0) {
+    fprintf (stderr, "WARNING: recording buffer overflowed, replaying up to the overflow\n");
+  }
+
+  if ((Rec->Header->Flags & EMU_CALL_RECORD_FLAG_INCOMPLETE) != 0) {
+    fprintf (stderr, "WARNING: recording page table overflowed, replay may diverge\n");
+  }
+
+  return 0;
+}
+
+STATIC
+VOID
+ReplayDiverge (
+  IN  Replay       *Rp,
+  IN  const CHAR8  *Format,
+  ...
+  )
+{
+  va_list  Marker;
+  CHAR8    Buffer[256];
+  int      Length;
+
+  Length = snprintf (Buffer, sizeof (Buffer), "record %lu: ", (unsigned long)Rp->Pos);
+  va_start (Marker, Format);
+  vsnprintf (Buffer + Length, sizeof (Buffer) - Length, Format, Marker);
+  va_end (Marker);
+
+  if (Rp->Divergences < MAX_DIVERGENCES_LISTED) {
+    Rp->Listed[Rp->Divergences] = strdup (Buffer);
+  }
+
+  Rp->Divergences++;
+  if (Rp->Verbose) {
+    fprintf (stderr, "divergence at %s\n", Buffer);
+  }
+}
+
+STATIC
+ReplayImage *
+ReplayFindImage (
+  IN  Replay  *Rp,
+  IN  UINT64  Address
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < Rp->ImageCount; Index++) {
+    if ((Address >= Rp->Images[Index].Base) &&
+        (Address - Rp->Images[Index].Base < Rp->Images[Index].Size))
+    {
+      return &Rp->Images[Index];
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+const CHAR8 *
+ReplayLabel (
+  IN  Replay  *Rp,
+  IN  UINT64  Address
+  )
+{
+  STATIC CHAR8  Buffer[4][64];
+  STATIC UINTN  Next;
+  CHAR8         *Label;
+  ReplayImage   *Image;
+  const CHAR8   *Name;
+
+  Label = Buffer[Next++ % 4];
+  Image = ReplayFindImage (Rp, Address);
+  if (Image == NULL) {
+    snprintf (Label, sizeof (Buffer[0]), "0x%lx", (unsigned long)Address);
+    return Label;
+  }
+
+  Name = MachineName (Image->MachineType);
+  if (Name != NULL) {
+    snprintf (
+      Label,
+      sizeof (Buffer[0]),
+      "%s@0x%lx+0x%lx",
+      Name,
+      (unsigned long)Image->Base,
+      (unsigned long)(Address - Image->Base)
+      );
+  } else {
+    snprintf (
+      Label,
+      sizeof (Buffer[0]),
+      "0x%x@0x%lx+0x%lx",
+      Image->MachineType,
+      (unsigned long)Image->Base,
+      (unsigned long)(Address - Image->Base)
+      );
+  }
+
+  return Label;
+}
+
+STATIC
+UINTN
+Hash64 (
+  IN  UINT64  Value
+  )
+{
+  Value ^= Value >> 33;
+  Value *= 0xFF51AFD7ED558CCDULL;
+  Value ^= Value >> 33;
+  return (UINTN)Value;
+}
+
+STATIC
+ReplayCpu *
+ReplayEngines (
+  IN  Replay  *Rp,
+  IN  UINTN   Index
+  )
+{
+  ReplayCpu  *Cpu;
+
+  Cpu = Index == 0 ? &Rp->X64 : &Rp->AArch64;
+  return Cpu->UE != NULL ? Cpu : NULL;
+}
+
+/*
+ * Guest memory, shared by all engines by mapping the same
+ * host buffers into each, just like EmulatorDxe maps all
+ * of RAM into every engine.
+ */
+STATIC
+ReplayPage *
+MemoryFind (
+  IN  Replay  *Rp,
+  IN  UINT64  Address
+  )
+{
+  UINTN  Slot;
+
+  if (Rp->PageSlots == 0) {
+    return NULL;
+  }
+
+  for (Slot = Hash64 (Address) & (Rp->PageSlots - 1); ;
+       Slot = (Slot + 1) & (Rp->PageSlots - 1))
+  {
+    if (Rp->Pages[Slot].Data == NULL) {
+      return NULL;
+    }
+
+    if (Rp->Pages[Slot].Address == Address) {
+      return &Rp->Pages[Slot];
+    }
+  }
+}
+
+STATIC
+VOID
+MemoryInsert (
+  IN  ReplayPage  *Pages,
+  IN  UINTN       Slots,
+  IN  ReplayPage  *Page
+  )
+{
+  UINTN  Slot;
+
+  for (Slot = Hash64 (Page->Address) & (Slots - 1);
+       Pages[Slot].Data != NULL;
+       Slot = (Slot + 1) & (Slots - 1))
+  {
+  }
+
+  Pages[Slot] = *Page;
+}
+
+STATIC
+VOID
+MemoryMapPage (
+  IN  ReplayCpu   *Cpu,
+  IN  ReplayPage  *Page
+  )
+{
+  UcCheck (
+    uc_mem_map_ptr (Cpu->UE, Page->Address, EFI_PAGE_SIZE, Page->Perms, Page->Data),
+    "uc_mem_map_ptr"
+    );
+}
+
+STATIC
+UINT8 *
+MemoryEnsure (
+  IN  Replay  *Rp,
+  IN  UINT64  Address,
+  IN  UINT32  Perms
+  )
+{
+  ReplayPage  *Page;
+  ReplayPage  *Old;
+  ReplayPage  New;
+  ReplayCpu   *Cpu;
+  UINTN       Index;
+  UINTN       OldSlots;
+
+  Address &= ~(UINT64)EFI_PAGE_MASK;
+  Page     = MemoryFind (Rp, Address);
+  if (Page != NULL) {
+    if ((Page->Perms | Perms) != Page->Perms) {
+      /*
+       * Page snapshotted before the image covering it was recorded.
+       */
+      Page->Perms |= Perms;
+      for (Index = 0; Index < 2; Index++) {
+        Cpu = ReplayEngines (Rp, Index);
+        if (Cpu != NULL) {
+          UcCheck (uc_mem_protect (Cpu->UE, Address, EFI_PAGE_SIZE, Page->Perms), "uc_mem_protect");
+        }
+      }
+    }
+
+    return Page->Data;
+  }
+
+  if ((Rp->PageCount + 1) * 2 > Rp->PageSlots) {
+    Old          = Rp->Pages;
+    OldSlots     = Rp->PageSlots;
+    Rp->PageSlots = OldSlots != 0 ? OldSlots * 2 : 1024;
+    Rp->Pages     = XAlloc (Rp->PageSlots * sizeof (ReplayPage));
+    for (Index = 0; Index < OldSlots; Index++) {
+      if (Old[Index].Data != NULL) {
+        MemoryInsert (Rp->Pages, Rp->PageSlots, &Old[Index]);
+      }
+    }
+
+    free (Old);
+  }
+
+  New.Address = Address;
+  New.Perms   = Perms;
+  New.Data    = aligned_alloc (EFI_PAGE_SIZE, EFI_PAGE_SIZE);
+  if (New.Data == NULL) {
+    fprintf (stderr, "out of memory\n");
+    exit (2);
+  }
+
+  memset (New.Data, 0, EFI_PAGE_SIZE);
+  MemoryInsert (Rp->Pages, Rp->PageSlots, &New);
+  Rp->PageCount++;
+
+  for (Index = 0; Index < 2; Index++) {
+    Cpu = ReplayEngines (Rp, Index);
+    if (Cpu != NULL) {
+      MemoryMapPage (Cpu, &New);
+    }
+  }
+
+  return New.Data;
+}
+
+STATIC
+VOID
+MemoryWrite (
+  IN  Replay       *Rp,
+  IN  UINT64       Address,
+  IN  const VOID   *Data,
+  IN  UINT64       Length,
+  IN  UINT32       Perms
+  )
+{
+  UINT64  Offset;
+  UINT64  Chunk;
+  UINT8   *Page;
+
+  while (Length != 0) {
+    Offset = Address & EFI_PAGE_MASK;
+    Chunk  = EFI_PAGE_SIZE - Offset;
+    if (Chunk > Length) {
+      Chunk = Length;
+    }
+
+    Page = MemoryEnsure (Rp, Address, Perms);
+    memcpy (Page + Offset, Data, Chunk);
+    Address += Chunk;
+    Data     = (const UINT8 *)Data + Chunk;
+    Length  -= Chunk;
+  }
+}
+
+/*
+ * Memory that was never snapshotted, e.g. MMIO.
+ */
+STATIC
+bool
+MemoryUnmappedCb (
+  IN  uc_engine    *UE,
+  IN  uc_mem_type  Type,
+  IN  UINT64       Address,
+  IN  int          Size,
+  IN  int64_t      Value,
+  IN  VOID         *UserData
+  )
+{
+  Replay  *Rp = UserData;
+
+  if (Address < EFI_PAGE_SIZE) {
+    return false;
+  }
+
+  MemoryEnsure (Rp, Address, UC_PROT_READ | UC_PROT_WRITE);
+  MemoryEnsure (Rp, Address + Size - 1, UC_PROT_READ | UC_PROT_WRITE);
+  Rp->ZeroFilled++;
+  return true;
+}
+
+/*
+ * Same policy as CpuNullReadCb: NULL pointer reads return a poison
+ * value. Unlike in EmulatorDxe, these are reported as divergences.
+ */
+STATIC
+UINT64
+MemoryNullReadCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Offset,
+  IN  unsigned   Size,
+  IN  VOID       *UserData
+  )
+{
+  ReplayDiverge (UserData, "UINT%u NULL-ptr read to 0x%lx", Size * 8, (unsigned long)Offset);
+  return 0xAFAFAFAFAFAFAFAFUL;
+}
+
+STATIC
+VOID
+MemoryNullWriteCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Offset,
+  IN  unsigned   Size,
+  IN  UINT64     Value,
+  IN  VOID       *UserData
+  )
+{
+  ReplayDiverge (UserData, "UINT%u NULL-ptr write to 0x%lx", Size * 8, (unsigned long)Offset);
+}
+
+/*
+ * Port I/O is not recorded. Reads return 0, like unrecorded memory.
+ */
+STATIC
+UINT32
+CpuIoReadCb (
+  IN  uc_engine  *UE,
+  IN  UINT32     Port,
+  IN  int        Size,
+  IN  VOID       *UserData
+  )
+{
+  Replay  *Rp = UserData;
+
+  Rp->ZeroFilled++;
+  return 0;
+}
+
+STATIC
+VOID
+CpuIoWriteCb (
+  IN  uc_engine  *UE,
+  IN  UINT32     Port,
+  IN  int        Size,
+  IN  UINT32     Value,
+  IN  VOID       *UserData
+  )
+{
+}
+
+STATIC
+VOID
+CpuStackPush64 (
+  IN  ReplayCpu  *Cpu,
+  IN  UINT64     Value
+  )
+{
+  UINT64  Sp;
+
+  Sp = RegRead (Cpu, Cpu->StackReg) - 8;
+  MemoryWrite (Cpu->Replay, Sp, &Value, sizeof (Value), UC_PROT_READ | UC_PROT_WRITE);
+  RegWrite (Cpu, Cpu->StackReg, Sp);
+}
+
+STATIC
+VOID
+CpuX64EmuThunkPre (
+  IN  ReplayCpu  *Cpu,
+  IN  UINT64     *Args,
+  IN  UINT64     ReturnAddress
+  )
+{
+  unsigned  Index;
+
+  RegWrite (Cpu, UC_X86_REG_RCX, Args[0]);
+  RegWrite (Cpu, UC_X86_REG_RDX, Args[1]);
+  RegWrite (Cpu, UC_X86_REG_R8, Args[2]);
+  RegWrite (Cpu, UC_X86_REG_R9, Args[3]);
+
+  for (Index = 0; Index < (EMU_CALL_RECORD_ARGS - 4); Index++) {
+    CpuStackPush64 (Cpu, Args[(EMU_CALL_RECORD_ARGS - 1) - Index]);
+  }
+
+  for (Index = 0; Index < 4; Index++) {
+    CpuStackPush64 (Cpu, 0);
+  }
+
+  CpuStackPush64 (Cpu, ReturnAddress);
+}
+
+STATIC
+VOID
+CpuX64GetCallArgs (
+  IN  ReplayCpu  *Cpu,
+  OUT UINT64     *Args,
+  OUT UINT64     *ReturnAddress
+  )
+{
+  UINT64  Stack[EMU_CALL_RECORD_ARGS + 1];
+
+  UcCheck (
+    uc_mem_read (Cpu->UE, RegRead (Cpu, Cpu->StackReg), Stack, sizeof (Stack)),
+    "uc_mem_read"
+    );
+  Args[0] = RegRead (Cpu, UC_X86_REG_RCX);
+  Args[1] = RegRead (Cpu, UC_X86_REG_RDX);
+  Args[2] = RegRead (Cpu, UC_X86_REG_R8);
+  Args[3] = RegRead (Cpu, UC_X86_REG_R9);
+  memcpy (&Args[4], &Stack[5], (EMU_CALL_RECORD_ARGS - 4) * sizeof (UINT64));
+  *ReturnAddress = Stack[0];
+}
+
+STATIC
+UINT64
+CpuX64NativeReturn (
+  IN  ReplayCpu  *Cpu
+  )
+{
+  UINT64  Sp;
+  UINT64  ReturnAddress;
+
+  Sp = RegRead (Cpu, Cpu->StackReg);
+  UcCheck (uc_mem_read (Cpu->UE, Sp, &ReturnAddress, sizeof (ReturnAddress)), "uc_mem_read");
+  RegWrite (Cpu, Cpu->StackReg, Sp + 8);
+  return ReturnAddress;
+}
+
+STATIC
+VOID
+CpuAArch64EmuThunkPre (
+  IN  ReplayCpu  *Cpu,
+  IN  UINT64     *Args,
+  IN  UINT64     ReturnAddress
+  )
+{
+  unsigned  Index;
+
+  for (Index = 0; Index < 8; Index++) {
+    RegWrite (Cpu, UC_ARM64_REG_X0 + Index, Args[Index]);
+  }
+
+  for (Index = 0; Index < (EMU_CALL_RECORD_ARGS - 8); Index++) {
+    CpuStackPush64 (Cpu, Args[(EMU_CALL_RECORD_ARGS - 1) - Index]);
+  }
+
+  RegWrite (Cpu, UC_ARM64_REG_LR, ReturnAddress);
+}
+
+STATIC
+VOID
+CpuAArch64GetCallArgs (
+  IN  ReplayCpu  *Cpu,
+  OUT UINT64     *Args,
+  OUT UINT64     *ReturnAddress
+  )
+{
+  unsigned  Index;
+
+  for (Index = 0; Index < 8; Index++) {
+    Args[Index] = RegRead (Cpu, UC_ARM64_REG_X0 + Index);
+  }
+
+  UcCheck (
+    uc_mem_read (
+      Cpu->UE,
+      RegRead (Cpu, Cpu->StackReg),
+      &Args[8],
+      (EMU_CALL_RECORD_ARGS - 8) * sizeof (UINT64)
+      ),
+    "uc_mem_read"
+    );
+  *ReturnAddress = RegRead (Cpu, UC_ARM64_REG_LR);
+}
+
+STATIC
+UINT64
+CpuAArch64NativeReturn (
+  IN  ReplayCpu  *Cpu
+  )
+{
+  return RegRead (Cpu, UC_ARM64_REG_LR);
+}
+
+/*
+ * Mirrors CpuIsNativeCb and EmulatorIsNativeCall.
+ */
+STATIC
+bool
+CpuIsNativeCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Address,
+  IN  VOID       *UserData
+  )
+{
+  ReplayCpu    *Cpu = UserData;
+  ReplayImage  *Image;
+  UINT64       Alignment;
+
+  if ((Address == Cpu->ReturnAddress) || (Address < EFI_PAGE_SIZE)) {
+    return true;
+  }
+
+  Image = ReplayFindImage (Cpu->Replay, Address);
+  if (Image != NULL) {
+    return Image->MachineType != Cpu->MachineType;
+  }
+
+  Alignment = Cpu->Replay->Rec->Header->HostMachineType == EFI_IMAGE_MACHINE_RISCV64 ? 2 : 4;
+  return (Address & (Alignment - 1)) == 0;
+}
+
+STATIC
+VOID
+CpuTimeoutCb (
+  IN  uc_engine  *UE,
+  IN  UINT64     Address,
+  IN  UINT32     Size,
+  IN  VOID       *UserData
+  )
+{
+  ReplayCpu  *Cpu = UserData;
+
+  if ((++(Cpu->TbCount) & (Cpu->ExitPeriodTbs - 1)) == 0) {
+    Cpu->StoppedOnTimeout = TRUE;
+    uc_emu_stop (UE);
+  }
+}
+
+STATIC
+ReplayCpu *
+ReplayEngine (
+  IN  Replay  *Rp,
+  IN  UINT16  MachineType
+  )
+{
+  ReplayCpu  *Cpu;
+  uc_arch    Arch;
+  uc_mode    Mode;
+  uc_hook    Hook;
+  UINTN      Index;
+
+  if (MachineType == EFI_IMAGE_MACHINE_X64) {
+    Cpu = &Rp->X64;
+  } else if (MachineType == EFI_IMAGE_MACHINE_AARCH64) {
+    Cpu = &Rp->AArch64;
+  } else {
+    return NULL;
+  }
+
+  if (Cpu->UE != NULL) {
+    return Cpu;
+  }
+
+  if (MachineType == EFI_IMAGE_MACHINE_X64) {
+    Arch                   = UC_ARCH_X86;
+    Mode                   = UC_MODE_64;
+    Cpu->StackReg          = UC_X86_REG_RSP;
+    Cpu->ProgramCounterReg = UC_X86_REG_RIP;
+    Cpu->ReturnValueReg    = UC_X86_REG_RAX;
+    Cpu->EmuThunkPre       = CpuX64EmuThunkPre;
+    Cpu->GetCallArgs       = CpuX64GetCallArgs;
+    Cpu->NativeReturn      = CpuX64NativeReturn;
+  } else {
+    Arch                   = UC_ARCH_ARM64;
+    Mode                   = UC_MODE_ARM;
+    Cpu->StackReg          = UC_ARM64_REG_SP;
+    Cpu->ProgramCounterReg = UC_ARM64_REG_PC;
+    Cpu->ReturnValueReg    = UC_ARM64_REG_X0;
+    Cpu->EmuThunkPre       = CpuAArch64EmuThunkPre;
+    Cpu->GetCallArgs       = CpuAArch64GetCallArgs;
+    Cpu->NativeReturn      = CpuAArch64NativeReturn;
+  }
+
+  Cpu->MachineType   = MachineType;
+  Cpu->Replay        = Rp;
+  Cpu->ExitPeriodTbs = UC_EMU_EXIT_PERIOD_TB_INITIAL;
+  UcCheck (uc_open (Arch, Mode, &Cpu->UE), "uc_open");
+  UcCheck (uc_hook_add (Cpu->UE, &Hook, UC_HOOK_BLOCK, CpuTimeoutCb, Cpu, 1, 0), "timeout hook");
+  UcCheck (
+    uc_hook_add (Cpu->UE, &Hook, UC_HOOK_TB_FIND_FAILURE, CpuIsNativeCb, Cpu, 1, 0),
+    "IsNative hook"
+    );
+  if (Arch == UC_ARCH_X86) {
+    UcCheck (
+      uc_hook_add (Cpu->UE, &Hook, UC_HOOK_INSN, CpuIoReadCb, Rp, 1, 0, UC_X86_INS_IN),
+      "PIO read hook"
+      );
+    UcCheck (
+      uc_hook_add (Cpu->UE, &Hook, UC_HOOK_INSN, CpuIoWriteCb, Rp, 1, 0, UC_X86_INS_OUT),
+      "PIO write hook"
+      );
+  }
+
+  UcCheck (
+    uc_hook_add (
+      Cpu->UE,
+      &Hook,
+      UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
+      MemoryUnmappedCb,
+      Rp,
+      1,
+      0
+      ),
+    "unmapped hook"
+    );
+  UcCheck (
+    uc_mmio_map (Cpu->UE, 0, EFI_PAGE_SIZE, MemoryNullReadCb, Rp, MemoryNullWriteCb, Rp),
+    "uc_mmio_map"
+    );
+
+  for (Index = 0; Index < Rp->PageSlots; Index++) {
+    if (Rp->Pages[Index].Data != NULL) {
+      MemoryMapPage (Cpu, &Rp->Pages[Index]);
+    }
+  }
+
+  UcCheck (uc_ctl_exits_enable (Cpu->UE), "uc_ctl_exits_enable");
+  return Cpu;
+}
+
+STATIC
+EMU_CALL_RECORD *
+ReplayPeek (
+  IN  Replay  *Rp
+  )
+{
+  if (Rp->Pos < Rp->Rec->Count) {
+    return Rp->Rec->Records[Rp->Pos];
+  }
+
+  return NULL;
+}
+
+STATIC
+EMU_CALL_RECORD *
+ReplayTake (
+  IN  Replay  *Rp
+  )
+{
+  EMU_CALL_RECORD  *Record;
+
+  Record = Rp->Rec->Records[Rp->Pos++];
+  if (Record->Type == EmuRecordEmuCall) {
+    Rp->Depth++;
+  } else if (Record->Type == EmuRecordEmuReturn) {
+    Rp->Depth--;
+  }
+
+  return Record;
+}
+
+STATIC
+VOID
+ReplayApply (
+  IN  Replay           *Rp,
+  IN  EMU_CALL_RECORD  *Record
+  )
+{
+  EMU_CALL_RECORD_CPU    *CpuRecord;
+  EMU_CALL_RECORD_IMAGE  *ImageRecord;
+  EMU_CALL_RECORD_PAGE   *PageRecord;
+  UINT64                 Address;
+
+  switch (Record->Type) {
+    case EmuRecordCpu:
+      CpuRecord = (VOID *)Record;
+      ReplayEngine (Rp, Record->MachineType);
+      for (Address = CpuRecord->StackStart & ~(UINT64)EFI_PAGE_MASK;
+           Address < CpuRecord->StackTop;
+           Address += EFI_PAGE_SIZE)
+      {
+        MemoryEnsure (Rp, Address, UC_PROT_READ | UC_PROT_WRITE);
+      }
+
+      break;
+    case EmuRecordImage:
+      ImageRecord                         = (VOID *)Record;
+      Rp->Images                          = realloc (Rp->Images, (Rp->ImageCount + 1) * sizeof (ReplayImage));
+      Rp->Images[Rp->ImageCount].Base        = ImageRecord->ImageBase;
+      Rp->Images[Rp->ImageCount].Size        = ImageRecord->ImageSize;
+      Rp->Images[Rp->ImageCount].MachineType = Record->MachineType;
+      Rp->ImageCount++;
+      MemoryWrite (Rp, ImageRecord->ImageBase, ImageRecord + 1, ImageRecord->ImageSize, UC_PROT_ALL);
+      break;
+    case EmuRecordPage:
+      PageRecord = (VOID *)Record;
+      MemoryWrite (Rp, PageRecord->Address, PageRecord + 1, EFI_PAGE_SIZE, UC_PROT_READ | UC_PROT_WRITE);
+      break;
+  }
+}
+
+STATIC
+ReplayEntry *
+ReplayGetEntry (
+  IN  Replay  *Rp,
+  IN  UINT64  ProgramCounter
+  )
+{
+  UINTN        Slot;
+  ReplayEntry  *Old;
+  UINTN        OldSlots;
+  UINTN        Index;
+
+  if ((Rp->EntryCount + 1) * 2 > Rp->EntrySlots) {
+    Old            = Rp->Entries;
+    OldSlots       = Rp->EntrySlots;
+    Rp->EntrySlots = OldSlots != 0 ? OldSlots * 2 : 256;
+    Rp->Entries    = XAlloc (Rp->EntrySlots * sizeof (ReplayEntry));
+    for (Index = 0; Index < OldSlots; Index++) {
+      if (Old[Index].Host == NULL) {
+        continue;
+      }
+
+      for (Slot = Hash64 (Old[Index].ProgramCounter) & (Rp->EntrySlots - 1);
+           Rp->Entries[Slot].Host != NULL;
+           Slot = (Slot + 1) & (Rp->EntrySlots - 1))
+      {
+      }
+
+      Rp->Entries[Slot] = Old[Index];
+    }
+
+    free (Old);
+  }
+
+  for (Slot = Hash64 (ProgramCounter) & (Rp->EntrySlots - 1); ;
+       Slot = (Slot + 1) & (Rp->EntrySlots - 1))
+  {
+    if (Rp->Entries[Slot].Host == NULL) {
+      Rp->Entries[Slot].ProgramCounter = ProgramCounter;
+      Rp->Entries[Slot].Host           = XAlloc (Rp->Iterations * sizeof (double));
+      Rp->EntryCount++;
+      return &Rp->Entries[Slot];
+    }
+
+    if (Rp->Entries[Slot].ProgramCounter == ProgramCounter) {
+      return &Rp->Entries[Slot];
+    }
+  }
+}
+
+STATIC
+VOID
+ReplayEmuCall (
+  IN  Replay                    *Rp,
+  IN  EMU_CALL_RECORD_EMU_CALL  *Call
+  );
+
+/*
+ * Runs an emulated call while preserving the state of the engine,
+ * for the same reason EmulatorDxe gives every nested CpuRunCtx its
+ * own uc_context.
+ */
+STATIC
+VOID
+ReplayNestedEmuCall (
+  IN  Replay           *Rp,
+  IN  EMU_CALL_RECORD  *Record
+  )
+{
+  ReplayCpu   *Cpu;
+  uc_context  *Context;
+  UINT64      ReturnAddress;
+
+  Cpu = ReplayEngine (Rp, Record->MachineType);
+  if ((Cpu == NULL) || (Rp->Depth > MAX_CONTEXTS)) {
+    ReplayEmuCall (Rp, (VOID *)Record);
+    return;
+  }
+
+  UcCheck (uc_context_alloc (Cpu->UE, &Context), "uc_context_alloc");
+  UcCheck (uc_context_save (Cpu->UE, Context), "uc_context_save");
+  ReturnAddress = Cpu->ReturnAddress;
+  ReplayEmuCall (Rp, (VOID *)Record);
+  Cpu->ReturnAddress = ReturnAddress;
+  UcCheck (uc_context_restore (Cpu->UE, Context), "uc_context_restore");
+  uc_context_free (Context);
+}
+
+/*
+ * Brings memory up to date before running emulated code,
+ * and replays any emulated event callbacks that fired
+ * while it was running.
+ */
+STATIC
+VOID
+ReplayResume (
+  IN  Replay  *Rp
+  )
+{
+  EMU_CALL_RECORD  *Record;
+
+  for ( ; ;) {
+    Record = ReplayPeek (Rp);
+    if (Record == NULL) {
+      return;
+    }
+
+    if (Record->Type == EmuRecordPage) {
+      ReplayApply (Rp, ReplayTake (Rp));
+    } else if (Record->Type == EmuRecordEmuCall) {
+      ReplayNestedEmuCall (Rp, ReplayTake (Rp));
+    } else {
+      return;
+    }
+  }
+}
+
+/*
+ * Satisfies a call to native code from the recording, returning
+ * the address to resume emulation at.
+ */
+STATIC
+ReplayStatus
+ReplayNativeCall (
+  IN  Replay     *Rp,
+  IN  ReplayCpu  *Cpu,
+  IN  UINT64     ProgramCounter,
+  OUT UINT64     *NativeTicks,
+  OUT UINT64     *ResumeAt
+  )
+{
+  EMU_CALL_RECORD                *Record;
+  EMU_CALL_RECORD_NATIVE_CALL    *Call;
+  EMU_CALL_RECORD_NATIVE_RETURN  *Return;
+  EMU_CALL_RECORD_STACK_RUN      *Run;
+  UINT64                         Args[EMU_CALL_RECORD_ARGS];
+  UINT64                         ReturnAddress;
+  UINT32                         Index;
+  unsigned                       RegArgs;
+
+  Cpu->GetCallArgs (Cpu, Args, &ReturnAddress);
+  Record = ReplayPeek (Rp);
+  if ((Record == NULL) || (Record->Type != EmuRecordNativeCall)) {
+    ReplayDiverge (
+      Rp,
+      "unexpected native call to 0x%lx from %s",
+      (unsigned long)ProgramCounter,
+      ReplayLabel (Rp, ReturnAddress)
+      );
+    return ReplayDiverged;
+  }
+
+  Call = (VOID *)ReplayTake (Rp);
+  if ((Call->ProgramCounter != ProgramCounter) || (Call->ReturnAddress != ReturnAddress)) {
+    ReplayDiverge (
+      Rp,
+      "native call to 0x%lx from %s, recorded 0x%lx from %s",
+      (unsigned long)ProgramCounter,
+      ReplayLabel (Rp, ReturnAddress),
+      (unsigned long)Call->ProgramCounter,
+      ReplayLabel (Rp, Call->ReturnAddress)
+      );
+    return ReplayDiverged;
+  }
+
+  RegArgs = Cpu->MachineType == EFI_IMAGE_MACHINE_X64 ? 4 : 8;
+  if (memcmp (Call->Args, Args, RegArgs * sizeof (UINT64)) != 0) {
+    ReplayDiverge (
+      Rp,
+      "native call to 0x%lx from %s with different arguments",
+      (unsigned long)ProgramCounter,
+      ReplayLabel (Rp, ReturnAddress)
+      );
+  }
+
+  for ( ; ;) {
+    Record = ReplayPeek (Rp);
+    if (Record == NULL) {
+      ReplayDiverge (Rp, "recording ends inside native call to 0x%lx", (unsigned long)ProgramCounter);
+      return ReplayDiverged;
+    }
+
+    switch (Record->Type) {
+      case EmuRecordEmuCall:
+        ReplayNestedEmuCall (Rp, ReplayTake (Rp));
+        break;
+      case EmuRecordNativeReturn:
+        Return = (VOID *)ReplayTake (Rp);
+        Run    = (VOID *)(Return + 1);
+        for (Index = 0; Index < Return->RunCount; Index++) {
+          if ((UINT8 *)(Run + 1) + Run->Length > (UINT8 *)Return + Return->Record.Size) {
+            ReplayDiverge (Rp, "bad stack run in native return");
+            return ReplayDiverged;
+          }
+
+          MemoryWrite (
+            Rp,
+            Return->StackPointer + Run->Offset,
+            Run + 1,
+            Run->Length,
+            UC_PROT_READ | UC_PROT_WRITE
+            );
+          Run = (VOID *)((UINT8 *)(Run + 1) + Run->Length);
+        }
+
+        RegWrite (Cpu, Cpu->ReturnValueReg, Return->Ret);
+        *NativeTicks += Return->Record.Timestamp - Call->Record.Timestamp;
+        *ResumeAt     = Cpu->NativeReturn (Cpu);
+        return ReplayOk;
+      case EmuRecordEmuReturn:
+        return ReplayUnwind;
+      case EmuRecordPage:
+      case EmuRecordCpu:
+      case EmuRecordImage:
+        ReplayApply (Rp, ReplayTake (Rp));
+        break;
+      default:
+        ReplayDiverge (
+          Rp,
+          "unexpected record type %u in native call to 0x%lx",
+          Record->Type,
+          (unsigned long)ProgramCounter
+          );
+        return ReplayDiverged;
+    }
+  }
+}
+
+/*
+ * Mirrors CpuRunCtxInternal.
+ */
+STATIC
+ReplayStatus
+ReplayRun (
+  IN  Replay                    *Rp,
+  IN  ReplayCpu                 *Cpu,
+  IN  EMU_CALL_RECORD_EMU_CALL  *Call,
+  OUT double                    *Host,
+  OUT UINT64                    *NativeTicks
+  )
+{
+  uc_err        UcErr;
+  UINT64        ProgramCounter;
+  ReplayStatus  Status;
+  double        Start;
+  double        End;
+  double        Deadline;
+
+  ProgramCounter     = Call->ProgramCounter;
+  Cpu->ReturnAddress = Call->ReturnAddress;
+  RegWrite (Cpu, Cpu->StackReg, Call->StackPointer);
+  Cpu->EmuThunkPre (Cpu, Call->Args, Call->ReturnAddress);
+
+  for ( ; ;) {
+    ReplayResume (Rp);
+
+    Start    = Now ();
+    Deadline = Start + UC_EMU_EXIT_PERIOD_MS / 1000.0;
+    UcErr    = uc_emu_start (Cpu->UE, ProgramCounter, 0, 0, 0);
+    End      = Now ();
+    *Host   += End - Start;
+
+    if (Cpu->StoppedOnTimeout) {
+      Cpu->StoppedOnTimeout = FALSE;
+      if (End > Deadline) {
+        if (Cpu->ExitPeriodTbs > UC_EMU_EXIT_PERIOD_TB_MIN) {
+          Cpu->ExitPeriodTbs = Cpu->ExitPeriodTbs >> 1;
+        }
+      } else if (End < Deadline) {
+        if (Cpu->ExitPeriodTbs < UC_EMU_EXIT_PERIOD_TB_MAX) {
+          Cpu->ExitPeriodTbs = Cpu->ExitPeriodTbs << 1;
+        }
+      }
+    }
+
+    ProgramCounter = RegRead (Cpu, Cpu->ProgramCounterReg);
+    if (UcErr == UC_ERR_FIND_TB) {
+      if (ProgramCounter == Call->ReturnAddress) {
+        return ReplayOk;
+      }
+
+      Status = ReplayNativeCall (Rp, Cpu, ProgramCounter, NativeTicks, &ProgramCounter);
+      if (Status != ReplayOk) {
+        return Status;
+      }
+    } else if (UcErr != UC_ERR_OK) {
+      ReplayDiverge (Rp, "%s at %s", uc_strerror (UcErr), ReplayLabel (Rp, ProgramCounter));
+      return ReplayDiverged;
+    }
+  }
+}
+
+STATIC
+VOID
+ReplayEmuCall (
+  IN  Replay                    *Rp,
+  IN  EMU_CALL_RECORD_EMU_CALL  *Call
+  )
+{
+  ReplayCpu                   *Cpu;
+  ReplayEntry                 *Entry;
+  EMU_CALL_RECORD             *Record;
+  EMU_CALL_RECORD_EMU_RETURN  *Return;
+  ReplayStatus                Status;
+  UINTN                       Depth;
+  double                      Host;
+  UINT64                      NativeTicks;
+  UINT64                      Ret;
+
+  Depth  = Rp->Depth;
+  Return = NULL;
+  Host   = 0;
+  NativeTicks = 0;
+
+  Cpu = ReplayEngine (Rp, Call->Record.MachineType);
+  if (Cpu == NULL) {
+    ReplayDiverge (Rp, "unsupported machine type 0x%x", Call->Record.MachineType);
+    Status = ReplayDiverged;
+  } else if (Rp->Depth > MAX_CONTEXTS) {
+    ReplayDiverge (Rp, "calls nested too deeply");
+    Status = ReplayDiverged;
+  } else {
+    Status = ReplayRun (Rp, Cpu, Call, &Host, &NativeTicks);
+  }
+
+  if (Status == ReplayOk) {
+    Record = ReplayPeek (Rp);
+    if ((Record == NULL) || (Record->Type != EmuRecordEmuReturn)) {
+      ReplayDiverge (Rp, "%s returned early", ReplayLabel (Rp, Call->ProgramCounter));
+      Status = ReplayDiverged;
+    } else {
+      Return = (VOID *)ReplayTake (Rp);
+      Ret    = RegRead (Cpu, Cpu->ReturnValueReg);
+      if (Ret != Return->Ret) {
+        ReplayDiverge (
+          Rp,
+          "%s returned 0x%lx, recorded 0x%lx",
+          ReplayLabel (Rp, Call->ProgramCounter),
+          (unsigned long)Ret,
+          (unsigned long)Return->Ret
+          );
+      }
+    }
+  } else if (Status == ReplayUnwind) {
+    Return = (VOID *)ReplayTake (Rp);
+  }
+
+  if (Status == ReplayDiverged) {
+    /*
+     * Skip the rest of this call in the recording.
+     */
+    while (Rp->Depth >= Depth && Rp->Pos < Rp->Rec->Count) {
+      ReplayTake (Rp);
+    }
+  }
+
+  Entry = ReplayGetEntry (Rp, Call->ProgramCounter);
+  Entry->Calls++;
+  Entry->Host[Rp->Iteration] += Host;
+  if (Return != NULL) {
+    Entry->TargetTicks += Return->Record.Timestamp - Call->Record.Timestamp - NativeTicks;
+  }
+}
+
+STATIC
+VOID
+ReplayAll (
+  IN  Replay  *Rp
+  )
+{
+  EMU_CALL_RECORD  *Record;
+
+  while (Rp->Pos < Rp->Rec->Count) {
+    Record = ReplayTake (Rp);
+    if (Record->Type == EmuRecordEmuCall) {
+      ReplayEmuCall (Rp, (VOID *)Record);
+    } else if ((Record->Type == EmuRecordPage) ||
+               (Record->Type == EmuRecordCpu) ||
+               (Record->Type == EmuRecordImage))
+    {
+      ReplayApply (Rp, Record);
+    } else {
+      ReplayDiverge (Rp, "unexpected record type %u at top level", Record->Type);
+    }
+  }
+}
+
+/*
+ * Everything but the per-entry point statistics, which
+ * accumulate across iterations.
+ */
+STATIC
+VOID
+ReplayReset (
+  IN  Replay  *Rp
+  )
+{
+  UINTN  Index;
+
+  if (Rp->X64.UE != NULL) {
+    uc_close (Rp->X64.UE);
+  }
+
+  if (Rp->AArch64.UE != NULL) {
+    uc_close (Rp->AArch64.UE);
+  }
+
+  memset (&Rp->X64, 0, sizeof (Rp->X64));
+  memset (&Rp->AArch64, 0, sizeof (Rp->AArch64));
+
+  for (Index = 0; Index < Rp->PageSlots; Index++) {
+    free (Rp->Pages[Index].Data);
+  }
+
+  for (Index = 0; Index < MAX_DIVERGENCES_LISTED; Index++) {
+    free (Rp->Listed[Index]);
+    Rp->Listed[Index] = NULL;
+  }
+
+  for (Index = 0; Index < Rp->EntrySlots; Index++) {
+    Rp->Entries[Index].Calls       = 0;
+    Rp->Entries[Index].TargetTicks = 0;
+  }
+
+  free (Rp->Pages);
+  free (Rp->Images);
+  Rp->Pages       = NULL;
+  Rp->PageCount   = 0;
+  Rp->PageSlots   = 0;
+  Rp->Images      = NULL;
+  Rp->ImageCount  = 0;
+  Rp->Pos         = 0;
+  Rp->Depth       = 0;
+  Rp->ZeroFilled  = 0;
+  Rp->Divergences = 0;
+}
+
+typedef struct {
+  double         HostUs;
+  double         TargetUs;
+  ReplayEntry    *Entry;
+  CHAR8          Label[64];
+} ReplayRow;
+
+STATIC
+int
+CompareDouble (
+  IN  const VOID  *A,
+  IN  const VOID  *B
+  )
+{
+  double  Left  = *(const double *)A;
+  double  Right = *(const double *)B;
+
+  return (Left > Right) - (Left < Right);
+}
+
+STATIC
+int
+CompareRows (
+  IN  const VOID  *A,
+  IN  const VOID  *B
+  )
+{
+  const ReplayRow  *Left  = A;
+  const ReplayRow  *Right = B;
+
+  if (Left->HostUs != Right->HostUs) {
+    return Left->HostUs < Right->HostUs ? 1 : -1;
+  }
+
+  return strcmp (Right->Label, Left->Label);
+}
+
+STATIC
+double
+Median (
+  IN  double    *Values,
+  IN  unsigned  Count
+  )
+{
+  double  *Sorted;
+  double  Result;
+
+  Sorted = XAlloc (Count * sizeof (double));
+  memcpy (Sorted, Values, Count * sizeof (double));
+  qsort (Sorted, Count, sizeof (double), CompareDouble);
+  if ((Count % 2) != 0) {
+    Result = Sorted[Count / 2];
+  } else {
+    Result = (Sorted[Count / 2 - 1] + Sorted[Count / 2]) / 2;
+  }
+
+  free (Sorted);
+  return Result;
+}
+
+/*
+ * Reads the host_us column of a CSV written by --csv.
+ */
+STATIC
+double
+BaselineFind (
+  IN  FILE         *Baseline,
+  IN  const CHAR8  *Label
+  )
+{
+  CHAR8   Line[256];
+  CHAR8   *Comma;
+  double  HostUs;
+
+  if (Baseline == NULL) {
+    return 0;
+  }
+
+  rewind (Baseline);
+  while (fgets (Line, sizeof (Line), Baseline) != NULL) {
+    Comma = strchr (Line, ',');
+    if (Comma == NULL) {
+      continue;
+    }
+
+    *Comma = '\0';
+    if ((strcmp (Line, Label) == 0) &&
+        (sscanf (Comma + 1, "%*[^,],%lf", &HostUs) == 1))
+    {
+      return HostUs;
+    }
+  }
+
+  return 0;
+}
+
+STATIC
+VOID
+Usage (
+  VOID
+  )
+{
+  fprintf (
+    stderr,
+    "usage: EmuReplay [--iterations N] [--top N] [--csv FILE] [--baseline FILE]\n"
+    "                 [--verbose] file\n"
+    "\n"
+    "Replay EmulatorDxe call recordings with the in-tree Unicorn.\n"
+    );
+  exit (2);
+}
+
+int
+main (
+  int    Argc,
+  CHAR8  **Argv
+  )
+{
+  Recording    Rec;
+  Replay       Rp;
+  ReplayRow    *Rows;
+  ReplayEntry  *Entry;
+  FILE         *Baseline;
+  FILE         *Csv;
+  const CHAR8  *Path;
+  const CHAR8  *CsvPath;
+  const CHAR8  *BaselinePath;
+  double       Frequency;
+  double       TotalHost;
+  double       TotalTarget;
+  double       Base;
+  CHAR8        VsBase[16];
+  UINTN        Calls;
+  UINTN        RowCount;
+  UINTN        Index;
+  unsigned     Top;
+  int          Arg;
+
+  memset (&Rec, 0, sizeof (Rec));
+  memset (&Rp, 0, sizeof (Rp));
+  Rp.Iterations = 1;
+  Top           = 20;
+  Path          = NULL;
+  CsvPath       = NULL;
+  BaselinePath  = NULL;
+
+  for (Arg = 1; Arg < Argc; Arg++) {
+    if ((strcmp (Argv[Arg], "--iterations") == 0) && (Arg + 1 < Argc)) {
+      Rp.Iterations = atoi (Argv[++Arg]) > 1 ? atoi (Argv[Arg]) : 1;
+    } else if ((strcmp (Argv[Arg], "--top") == 0) && (Arg + 1 < Argc)) {
+      Top = atoi (Argv[++Arg]);
+    } else if ((strcmp (Argv[Arg], "--csv") == 0) && (Arg + 1 < Argc)) {
+      CsvPath = Argv[++Arg];
+    } else if ((strcmp (Argv[Arg], "--baseline") == 0) && (Arg + 1 < Argc)) {
+      BaselinePath = Argv[++Arg];
+    } else if (strcmp (Argv[Arg], "--verbose") == 0) {
+      Rp.Verbose = TRUE;
+    } else if ((Argv[Arg][0] != '-') && (Path == NULL)) {
+      Path = Argv[Arg];
+    } else {
+      Usage ();
+    }
+  }
+
+  if (Path == NULL) {
+    Usage ();
+  }
+
+  if (RecordingLoad (Path, &Rec) != 0) {
+    return 2;
+  }
+
+  Rp.Rec = &Rec;
+  for (Rp.Iteration = 0; Rp.Iteration < Rp.Iterations; Rp.Iteration++) {
+    ReplayReset (&Rp);
+    ReplayAll (&Rp);
+  }
+
+  Calls    = 0;
+  RowCount = 0;
+  Rows     = XAlloc ((Rp.EntryCount + 1) * sizeof (ReplayRow));
+  Frequency = Rec.Header->Frequency != 0 ? (double)Rec.Header->Frequency : 1;
+  TotalHost   = 0;
+  TotalTarget = 0;
+  for (Index = 0; Index < Rp.EntrySlots; Index++) {
+    Entry = &Rp.Entries[Index];
+    if ((Entry->Host == NULL) || (Entry->Calls == 0)) {
+      continue;
+    }
+
+    Rows[RowCount].Entry    = Entry;
+    Rows[RowCount].HostUs   = Median (Entry->Host, Rp.Iterations) * 1e6;
+    Rows[RowCount].TargetUs = Entry->TargetTicks * 1e6 / Frequency;
+    snprintf (
+      Rows[RowCount].Label,
+      sizeof (Rows[RowCount].Label),
+      "%s",
+      ReplayLabel (&Rp, Entry->ProgramCounter)
+      );
+    Calls       += Entry->Calls;
+    TotalHost   += Rows[RowCount].HostUs;
+    TotalTarget += Rows[RowCount].TargetUs;
+    RowCount++;
+  }
+
+  qsort (Rows, RowCount, sizeof (ReplayRow), CompareRows);
+
+  printf (
+    "%lu records, %lu emulated calls, %lu divergences, %lu zero-filled accesses\n",
+    (unsigned long)Rec.Count,
+    (unsigned long)Calls,
+    (unsigned long)Rp.Divergences,
+    (unsigned long)Rp.ZeroFilled
+    );
+  for (Index = 0; Index < MAX_DIVERGENCES_LISTED && Rp.Listed[Index] != NULL; Index++) {
+    printf ("  %s\n", Rp.Listed[Index]);
+  }
+
+  Baseline = NULL;
+  if (BaselinePath != NULL) {
+    Baseline = fopen (BaselinePath, "r");
+    if (Baseline == NULL) {
+      fprintf (stderr, "%s: cannot open\n", BaselinePath);
+      return 2;
+    }
+  }
+
+  printf ("host %.0fus, target %.0fus (excluding native calls)\n\n", TotalHost, TotalTarget);
+  printf (
+    "  %-32s %8s %12s %12s %8s\n",
+    "entry",
+    "calls",
+    "host us",
+    "target us",
+    Baseline != NULL ? "vs base" : ""
+    );
+  for (Index = 0; Index < RowCount && Index < Top; Index++) {
+    Base      = BaselineFind (Baseline, Rows[Index].Label);
+    VsBase[0] = '\0';
+    if (Base != 0) {
+      snprintf (VsBase, sizeof (VsBase), "%.2fx", Rows[Index].HostUs / Base);
+    }
+
+    printf (
+      "  %-32s %8lu %12.1f %12.1f %8s\n",
+      Rows[Index].Label,
+      (unsigned long)Rows[Index].Entry->Calls,
+      Rows[Index].HostUs,
+      Rows[Index].TargetUs,
+      VsBase
+      );
+  }
+
+  if (CsvPath != NULL) {
+    Csv = fopen (CsvPath, "w");
+    if (Csv == NULL) {
+      fprintf (stderr, "%s: cannot open\n", CsvPath);
+      return 2;
+    }
+
+    fprintf (Csv, "entry,calls,host_us,target_us\r\n");
+    for (Index = 0; Index < RowCount; Index++) {
+      fprintf (
+        Csv,
+        "%s,%lu,%.3f,%.3f\r\n",
+        Rows[Index].Label,
+        (unsigned long)Rows[Index].Entry->Calls,
+        Rows[Index].HostUs,
+        Rows[Index].TargetUs
+        );
+    }
+
+    fclose (Csv);
+  }
+
+  return Rp.Divergences != 0 ? 1 : 0;
+}
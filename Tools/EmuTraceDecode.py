@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+#
+# SPDX-License-Identifier: BSD-2-Clause-Patent
+#
+# Decodes an EmulatorDxe trace buffer (see Include/Protocol/EmuTraceProtocol.h),
+# as saved by EmuTrace.efi -o, or found inside a raw memory dump with --scan.
+#
+
+import argparse
+import collections
+import struct
+import sys
+
+SIGNATURE = b'MAUTRACE'
+VERSION = 1
+HEADER = struct.Struct('<8sIIIIQQQQQH6x')
+ENTRY = struct.Struct('<QHHI4Q')
+
+EVENTS = [
+    'none',
+    'enter',
+    'exit',
+    'native',
+    'wrapper',
+    'ret',
+    'ctx-alloc',
+    'ctx-free',
+    'slice',
+    'img-reg',
+    'img-unreg',
+]
+
+MACHINES = {
+    0x8664: 'X64',
+    0xAA64: 'AArch64',
+    0x5064: 'RISCV64',
+    0x6264: 'LoongArch64',
+}
+
+
+class Trace:
+    def __init__(self, data, offset=0):
+        (sig, version, header_size, entry_size, entry_count, head, flags,
+         freq, counter_start, counter_end,
+         host) = HEADER.unpack_from(data, offset)
+        if sig != SIGNATURE:
+            raise ValueError('no trace signature at 0x%x' % offset)
+        if version != VERSION:
+            raise ValueError('unsupported trace version %u' % version)
+        if entry_size != ENTRY.size:
+            raise ValueError('unexpected entry size %u' % entry_size)
+
+        self.head = head
+        self.flags = flags
+        self.entry_count = entry_count
+        self.freq = freq
+        self.countdown = counter_start > counter_end
+        self.host = host
+        self.entries = []
+
+        base = offset + header_size
+        count = min(head, entry_count)
+        for index in range(head - count, head):
+            pos = base + (index % entry_count) * entry_size
+            if pos + entry_size > len(data):
+                raise ValueError('truncated trace buffer')
+            ts, event, machine, _, a0, a1, a2, a3 = ENTRY.unpack_from(data, pos)
+            self.entries.append((index, ts, event, machine, (a0, a1, a2, a3)))
+
+    def ns(self, begin, end):
+        ticks = (begin - end if self.countdown else end - begin) & 0xffffffffffffffff
+        if self.freq == 0:
+            return 0
+        return ticks * 1000000000 // self.freq
+
+
+def find_traces(data):
+    offsets = []
+    pos = data.find(SIGNATURE)
+    while pos != -1:
+        offsets.append(pos)
+        pos = data.find(SIGNATURE, pos + 1)
+    return offsets
+
+
+def event_name(event):
+    return EVENTS[event] if event < len(EVENTS) else '%u?' % event
+
+
+def machine_name(machine):
+    return MACHINES.get(machine, '0x%x' % machine)
+
+
+def dump(trace, csv):
+    if not trace.entries:
+        return
+
+    first = trace.entries[0][1]
+    if csv:
+        print('index,ns,machine,event,arg0,arg1,arg2,arg3')
+    for index, ts, event, machine, args in trace.entries:
+        if csv:
+            print('%u,%u,%s,%s,%s' % (index, trace.ns(first, ts),
+                                      machine_name(machine), event_name(event),
+                                      ','.join('0x%x' % a for a in args)))
+        else:
+            print('%8u %12u ns %-8s %-9s %s' % (index, trace.ns(first, ts),
+                                                machine_name(machine),
+                                                event_name(event),
+                                                ' '.join('%016x' % a for a in args)))
+
+
+def summary(trace, top):
+    counts = collections.Counter()
+    targets = collections.Counter()
+    target_ns = collections.Counter()
+    emu_ns = 0
+    pending_calls = []
+    pending_enters = []
+
+    for index, ts, event, machine, args in trace.entries:
+        name = event_name(event)
+        counts[name] += 1
+        if name in ('native', 'wrapper'):
+            targets[args[1]] += 1
+            pending_calls.append((ts, args[1]))
+        elif name == 'ret' and pending_calls:
+            begin, target = pending_calls.pop()
+            target_ns[target] += trace.ns(begin, ts)
+        elif name == 'enter':
+            pending_enters.append(ts)
+        elif name == 'exit' and pending_enters:
+            begin = pending_enters.pop()
+            # Nested entries are already part of the outer one.
+            if not pending_enters:
+                emu_ns += trace.ns(begin, ts)
+
+    entries = trace.entries
+    span = trace.ns(entries[0][1], entries[-1][1]) if entries else 0
+    print('%u events logged, %u decoded, %u ns span' % (trace.head, len(entries), span))
+    print('host %s, tracing %s' % (machine_name(trace.host),
+                                   'enabled' if trace.flags & 1 else 'disabled'))
+    print()
+    for name in EVENTS:
+        if counts[name]:
+            print('%-10s %10u' % (name, counts[name]))
+    print()
+    print('outermost emulation time: %u ns' % emu_ns)
+    print()
+    print('top native call targets:')
+    for target, count in targets.most_common(top):
+        print('  0x%016x %8u calls %12u ns' % (target, count, target_ns[target]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an EmulatorDxe trace buffer.')
+    parser.add_argument('file', help='EmuTrace.efi -o output or raw memory dump')
+    parser.add_argument('--scan', action='store_true',
+                        help='search the file for trace buffers instead of expecting one at offset 0')
+    parser.add_argument('--csv', action='store_true', help='dump entries as CSV')
+    parser.add_argument('--summary', action='store_true', help='print statistics instead of entries')
+    parser.add_argument('--top', type=int, default=10, help='number of call targets in the summary')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    offsets = find_traces(data) if args.scan else [0]
+    if not offsets:
+        sys.exit('no trace buffers found')
+
+    for offset in offsets:
+        try:
+            trace = Trace(data, offset)
+        except (ValueError, struct.error) as e:
+            print('0x%x: %s' % (offset, e), file=sys.stderr)
+            continue
+
+        if args.scan:
+            print('trace buffer at file offset 0x%x' % offset)
+        if args.summary:
+            summary(trace, args.top)
+        else:
+            dump(trace, args.csv)
+
+
+if __name__ == '__main__':
+    main()
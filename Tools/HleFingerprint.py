@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, Intel Corporation. All rights reserved.<BR>
+#
+# SPDX-License-Identifier: BSD-2-Clause-Patent
+#
+# Generates EmulatorDxe HLE signatures (mHleSignatures in
+# Drivers/Emulator/Hle.c) for library routines in a PE image:
+# the .pdata function size and the CRC32 of the function bytes.
+#
+# Routines are given as NAME=RVA, with RVAs taken from the build
+# map file or a disassembly, or with --map, looked up in the build
+# map file (VS or lld-link /MAP) for every routine EmulatorDxe has a
+# native implementation of. Functions containing base relocations
+# are skipped, as their bytes differ once loaded.
+#
+# With --header, the signatures are merged into the built-in table
+# (Drivers/Emulator/HleSignatures.h). With --setvar, prints a Shell
+# command setting the HleSignatures variable instead, so the
+# signatures are used without rebuilding EmulatorDxe.
+#
+
+import argparse
+import bisect
+import os
+import re
+import sys
+import zlib
+
+from EmuBbAnalyze import MACHINES, PeImage
+
+EMULATOR_GUID = 'E6727A5E-CBCD-44C8-B37F-78BC3A0C16C8'
+HLE_SOURCE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          '..', 'Drivers', 'Emulator', 'Hle.c')
+ENTRY = re.compile(r'^\s*\{ "(\w+)", (\w+), 0x([0-9a-f]+), 0x([0-9a-f]+) \},$')
+
+MACHINE_DEFINES = {
+    0x8664: 'EFI_IMAGE_MACHINE_X64',
+    0xAA64: 'EFI_IMAGE_MACHINE_AARCH64',
+}
+
+
+def hle_natives():
+    """Names of the routines in mHleNatives."""
+    with open(HLE_SOURCE) as f:
+        return re.findall(r'\{ "(\w+)",\s+\(VOID \*\)', f.read())
+
+
+def map_symbols(path, names, image_base):
+    """NAME=RVA for the names found in a VS or lld-link map file."""
+    base = image_base
+    values = {}
+    with open(path, errors='replace') as f:
+        for line in f:
+            match = re.search(r'Preferred load address is ([0-9a-fA-F]+)', line)
+            if match:
+                base = int(match.group(1), 16)
+                continue
+            tokens = line.split()
+            # VS: 0001:00000f40 CopyMem 0000000000001f40 f Lib:Obj.obj
+            if (len(tokens) > 2 and tokens[1] in names and
+                    re.fullmatch(r'[0-9a-fA-F]+', tokens[2])):
+                values.setdefault(tokens[1], int(tokens[2], 16))
+            # lld-link: 0000000000001f40 00000000 0 CopyMem
+            elif (len(tokens) > 1 and tokens[-1] in names and
+                  re.fullmatch(r'[0-9a-fA-F]+', tokens[0])):
+                values.setdefault(tokens[-1], int(tokens[0], 16))
+    for name in names:
+        if name not in values:
+            print('%s: not in %s' % (name, path), file=sys.stderr)
+    return ['%s=%x' % (name, value - base) for name, value in values.items()]
+
+
+def merge_header(path, entries):
+    """Merges C table entries into a header, keeping them sorted."""
+    with open(path, newline='') as f:
+        lines = f.read().splitlines()
+    # Everything before the first entry is kept as is.
+    prefix = []
+    merged = set(entries)
+    in_table = False
+    for line in lines:
+        if ENTRY.match(line):
+            merged.add(line)
+            in_table = True
+        elif not in_table:
+            prefix.append(line)
+    with open(path, 'w', newline='') as f:
+        for line in prefix + sorted(merged, key=lambda entry: ENTRY.match(entry).groups()):
+            f.write(line + '\r\n')
+    print('%s: %u signatures' % (path, len(merged)))
+
+
+def has_relocs(relocs, begin, end):
+    index = bisect.bisect_left(relocs, (begin, 0))
+    if index > 0 and relocs[index - 1][0] + relocs[index - 1][1] > begin:
+        return True
+    return index < len(relocs) and relocs[index][0] < end
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate EmulatorDxe HLE signatures.')
+    parser.add_argument('image', help='PE image')
+    parser.add_argument('symbols', nargs='*', help='NAME=RVA of routines to fingerprint')
+    parser.add_argument('--list', action='store_true',
+                        help='list all .pdata functions with their signatures')
+    parser.add_argument('--map',
+                        help='build map file to look up all routines with a native implementation in')
+    parser.add_argument('--header',
+                        help='merge the signatures into this header (Drivers/Emulator/HleSignatures.h)')
+    parser.add_argument('--setvar', action='store_true',
+                        help='print a Shell setvar command for the HleSignatures variable')
+    args = parser.parse_args()
+
+    pe = PeImage(args.image)
+    if pe.machine not in MACHINE_DEFINES:
+        sys.exit('%s: unsupported machine 0x%x' % (args.image, pe.machine))
+
+    funcs = {begin: end for begin, end in pe.functions()}
+    relocs = pe.relocs()
+    if args.map:
+        args.symbols += map_symbols(args.map, hle_natives(), pe.image_base)
+
+    if args.list:
+        print('%s (%s), %u functions' % (args.image, MACHINES[pe.machine], len(funcs)))
+        for begin in sorted(funcs):
+            end = funcs[begin]
+            print('  0x%08x-0x%08x size 0x%x crc32 0x%08x%s' % (
+                begin, end, end - begin,
+                zlib.crc32(pe.read(begin, end - begin)),
+                ' (relocs)' if has_relocs(relocs, begin, end) else ''))
+
+    items = []
+    entries = []
+    for symbol in args.symbols:
+        name, _, rva = symbol.partition('=')
+        begin = int(rva, 16)
+        end = funcs.get(begin)
+        if end is None:
+            print('%s: no .pdata function at 0x%x' % (name, begin), file=sys.stderr)
+            continue
+        if has_relocs(relocs, begin, end):
+            print('%s: has base relocations, skipped' % name, file=sys.stderr)
+            continue
+        crc32 = zlib.crc32(pe.read(begin, end - begin))
+        if args.setvar:
+            items.append('%s:%x:%x:%08x' % (name, pe.machine, end - begin, crc32))
+        else:
+            entries.append('  { "%s", %s, 0x%x, 0x%08x },' % (
+                name, MACHINE_DEFINES[pe.machine], end - begin, crc32))
+
+    if args.header:
+        merge_header(args.header, entries)
+    else:
+        for entry in entries:
+            print(entry)
+
+    if items:
+        print('setvar HleSignatures -guid %s -bs -nv ="%s"' % (EMULATOR_GUID, ' '.join(items)))
+
+
+if __name__ == '__main__':
+    main()